@@ -67,6 +67,10 @@ THE SOFTWARE.
 #endif
 #endif
 
+#if !defined(APE_NO_THREADS) && (defined(APE_POSIX) || defined(APE_WINDOWS))
+    #define APE_THREADS
+#endif
+
 #if defined(APE_POSIX)
 #include <sys/time.h>
 #elif defined(APE_WINDOWS)
@@ -76,6 +80,15 @@ THE SOFTWARE.
 #include <emscripten/emscripten.h>
 #endif
 
+#if defined(APE_THREADS) && defined(APE_POSIX)
+#include <pthread.h>
+#endif
+
+// APE_JIT enables compilation of hot functions to machine code, only x86-64 linux is supported
+#if defined(APE_JIT) && !(defined(APE_LINUX) && defined(__x86_64__))
+    #undef APE_JIT
+#endif
+
 #ifndef APE_AMALGAMATED
 #include "ape.h"
 #endif
@@ -85,6 +98,15 @@ THE SOFTWARE.
 #define APE_ARRAY_LEN(array) ((int)(sizeof(array) / sizeof(array[0])))
 #define APE_DBLEQ(a, b) (fabs((a) - (b)) < DBL_EPSILON)
 
+// for bytes that are modified while other threads might read them
+#if defined(__GNUC__) || defined(__clang__)
+    #define APE_RELAXED_LOAD_U8(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+    #define APE_RELAXED_STORE_U8(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+#else
+    #define APE_RELAXED_LOAD_U8(ptr) (*(volatile uint8_t*)(ptr))
+    #define APE_RELAXED_STORE_U8(ptr, val) (*(volatile uint8_t*)(ptr) = (val))
+#endif
+
 #ifdef APE_DEBUG
     #define APE_ASSERT(x) assert((x))
     #define APE_FILENAME (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
@@ -116,6 +138,7 @@ typedef struct ape_config {
             ape_stdout_write_fn write;
             void *context;
         } write;
+        int buffer_size; // print output is written once it's at least this long (or on flush)
     } stdio;
 
     struct {
@@ -145,6 +168,42 @@ typedef struct ape_timer {
     double start_time_ms;
 } ape_timer_t;
 
+typedef struct ape_random {
+    uint64_t state[4];
+} ape_random_t;
+
+typedef void (*ape_thread_fn)(void *arg);
+
+typedef struct ape_thread {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_t handle;
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    HANDLE handle;
+#endif
+    ape_thread_fn fn;
+    void *arg;
+} ape_thread_t;
+
+typedef struct ape_mutex {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_mutex_t handle;
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    SRWLOCK handle;
+#else
+    int unused;
+#endif
+} ape_mutex_t;
+
+typedef struct ape_cond {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_cond_t handle;
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    CONDITION_VARIABLE handle;
+#else
+    int unused;
+#endif
+} ape_cond_t;
+
 #ifndef APE_AMALGAMATED
 extern const src_pos_t src_pos_invalid;
 extern const src_pos_t src_pos_zero;
@@ -163,6 +222,25 @@ APE_INTERNAL bool ape_timer_platform_supported(void);
 APE_INTERNAL ape_timer_t ape_timer_start(void);
 APE_INTERNAL double ape_timer_get_elapsed_ms(const ape_timer_t *timer);
 
+// xoshiro256**
+APE_INTERNAL void ape_random_seed(ape_random_t *random, uint64_t seed);
+APE_INTERNAL uint64_t ape_random_next(ape_random_t *random);
+APE_INTERNAL double ape_random_next_double(ape_random_t *random); // [0, 1)
+
+APE_INTERNAL bool ape_threads_platform_supported(void);
+APE_INTERNAL bool ape_thread_start(ape_thread_t *thread, ape_thread_fn fn, void *arg); // thread has to stay valid until it's joined
+APE_INTERNAL void ape_thread_join(ape_thread_t *thread);
+
+// without thread support these do nothing (and ape_cond_wait must not be called)
+APE_INTERNAL bool ape_mutex_init(ape_mutex_t *mutex);
+APE_INTERNAL void ape_mutex_deinit(ape_mutex_t *mutex);
+APE_INTERNAL void ape_mutex_lock(ape_mutex_t *mutex);
+APE_INTERNAL void ape_mutex_unlock(ape_mutex_t *mutex);
+APE_INTERNAL bool ape_cond_init(ape_cond_t *cond);
+APE_INTERNAL void ape_cond_deinit(ape_cond_t *cond);
+APE_INTERNAL void ape_cond_wait(ape_cond_t *cond, ape_mutex_t *mutex);
+APE_INTERNAL void ape_cond_broadcast(ape_cond_t *cond);
+
 #endif /* common_h */
 //FILE_END
 //FILE_START:collections.h
@@ -202,6 +280,17 @@ COLLECTIONS_API allocator_t allocator_make(allocator_malloc_fn malloc_fn, alloca
 COLLECTIONS_API void* allocator_malloc(allocator_t *allocator, size_t size);
 COLLECTIONS_API void  allocator_free(allocator_t *allocator, void *ptr);
 
+//-----------------------------------------------------------------------------
+// Arena
+//-----------------------------------------------------------------------------
+
+// Bump allocator, freeing memory allocated from it does nothing, everything is released by arena_destroy
+typedef struct arena arena_t;
+
+COLLECTIONS_API arena_t*     arena_make(allocator_t *alloc);
+COLLECTIONS_API void         arena_destroy(arena_t *arena);
+COLLECTIONS_API allocator_t* arena_get_allocator(arena_t *arena);
+
 //-----------------------------------------------------------------------------
 // Dictionary
 //-----------------------------------------------------------------------------
@@ -225,6 +314,7 @@ COLLECTIONS_API void *       dict_get_value_at(const dict_t_ *dict, unsigned int
 COLLECTIONS_API const char * dict_get_key_at(const dict_t_ *dict, unsigned int ix);
 COLLECTIONS_API int          dict_count(const dict_t_ *dict);
 COLLECTIONS_API bool         dict_remove(dict_t_ *dict, const char *key);
+COLLECTIONS_API void         dict_clear(dict_t_ *dict);
 
 //-----------------------------------------------------------------------------
 // Value dictionary
@@ -517,6 +607,7 @@ typedef enum {
     TOKEN_NULL,
     TOKEN_IMPORT,
     TOKEN_RECOVER,
+    TOKEN_YIELD,
 
     // Identifiers and literals
     TOKEN_IDENT,
@@ -555,10 +646,12 @@ typedef struct compiled_file {
     allocator_t *alloc;
     char *dir_path;
     char *path;
-    ptrarray(char*) *lines;
+    ptrarray(char*) *sources; // copies of compiled code with newlines replaced by '\0'
+    ptrarray(char*) *lines;   // point into sources
 } compiled_file_t;
 
 APE_INTERNAL compiled_file_t* compiled_file_make(allocator_t *alloc, const char *path);
+APE_INTERNAL bool compiled_file_add_source(compiled_file_t *file, const char *source); // appends lines of source
 APE_INTERNAL void compiled_file_destroy(compiled_file_t *file);
 
 #endif /* compiled_file_h */
@@ -732,6 +825,7 @@ typedef enum expression_type {
     EXPRESSION_ASSIGN,
     EXPRESSION_LOGICAL,
     EXPRESSION_TERNARY,
+    EXPRESSION_YIELD,
 } expression_type_t;
 
 typedef struct ident {
@@ -758,6 +852,7 @@ typedef struct expression {
         assign_expression_t assign;
         logical_expression_t logical;
         ternary_expression_t ternary;
+        expression_t *yield_value; // can be NULL
     };
     src_pos_t pos;
 } expression_t;
@@ -872,6 +967,7 @@ APE_INTERNAL expression_t* expression_make_index(allocator_t *alloc, expression_
 APE_INTERNAL expression_t* expression_make_assign(allocator_t *alloc, expression_t *dest, expression_t *source, bool is_postfix);
 APE_INTERNAL expression_t* expression_make_logical(allocator_t *alloc, operator_t op, expression_t *left, expression_t *right);
 APE_INTERNAL expression_t* expression_make_ternary(allocator_t *alloc, expression_t *test, expression_t *if_true, expression_t *if_false);
+APE_INTERNAL expression_t* expression_make_yield(allocator_t *alloc, expression_t *value);
 
 APE_INTERNAL void expression_destroy(expression_t *expr);
 
@@ -925,8 +1021,8 @@ typedef struct parser {
     int depth;
 } parser_t;
 
+// parser and ast nodes are allocated from alloc and never freed (not even on errors), it's meant to be an arena
 APE_INTERNAL parser_t* parser_make(allocator_t *alloc, const ape_config_t *config, errors_t *errors);
-APE_INTERNAL void parser_destroy(parser_t *parser);
 
 APE_INTERNAL ptrarray(statement_t)* parser_parse_all(parser_t *parser,  const char *input, compiled_file_t *file);
 
@@ -947,7 +1043,10 @@ APE_INTERNAL ptrarray(statement_t)* parser_parse_all(parser_t *parser,  const ch
 typedef struct compilation_result compilation_result_t;
 typedef struct traceback traceback_t;
 typedef struct vm vm_t;
+typedef struct errors errors_t;
 typedef struct gcmem gcmem_t;
+typedef struct gcmem_page gcmem_page_t;
+typedef struct jit_code jit_code_t;
 
 #define OBJECT_STRING_BUF_SIZE 24
 
@@ -964,6 +1063,7 @@ typedef enum {
     OBJECT_FUNCTION  = 1 << 8,
     OBJECT_EXTERNAL  = 1 << 9,
     OBJECT_FREED     = 1 << 10,
+    OBJECT_COROUTINE = 1 << 11,
     OBJECT_ANY       = 0xffff,
 } object_type_t;
 
@@ -974,20 +1074,28 @@ typedef struct object {
     };
 } object_t;
 
+#define FUNCTION_INLINE_FREE_VALS 2
+
 typedef struct function {
     union {
-        object_t *free_vals_allocated;
-        object_t free_vals_buf[2];
+        object_t *free_vals_allocated; // points right past function_t, in the same allocation
+        object_t free_vals_buf[FUNCTION_INLINE_FREE_VALS];
     };
     union {
         char *name;
         const char *const_name;
     };
     compilation_result_t *comp_result;
+    object_t constants; // array of constants of the compilation function comes from
     int num_locals;
     int num_args;
     int free_vals_count;
     bool owns_data;
+#ifdef APE_JIT
+    jit_code_t *jit_code;
+    int jit_counter; // counts calls, returns and backward jumps until function is compiled
+    bool jit_failed;
+#endif
 } function_t;
 
 #define NATIVE_FN_MAX_DATA_LEN 24
@@ -1014,19 +1122,47 @@ typedef struct object_error {
     traceback_t *traceback;
 } object_error_t;
 
+typedef enum coroutine_state {
+    COROUTINE_CREATED = 0,
+    COROUTINE_SUSPENDED,
+    COROUTINE_RUNNING,
+    COROUTINE_DONE,
+} coroutine_state_t;
+
+// coroutine owns its frames and stack, the vm switches to them while it's running
+typedef struct coroutine {
+    object_t function;
+    struct frame *frames;
+    object_t *stack;
+    int frames_count; // frames and stack slots in use while suspended, 0 otherwise
+    int frames_capacity;
+    int stack_count;
+    int stack_capacity;
+    coroutine_state_t state;
+} coroutine_t;
+
 typedef struct object_string {
     union {
         char *value_allocated;
         char value_buf[OBJECT_STRING_BUF_SIZE];
+        struct {
+            object_t view_parent; // string that owns the buffer (never a view)
+            char *view_value;
+        };
     };
     unsigned long hash;
     bool is_allocated;
+    bool is_view; // tail of another string, strings are immutable so it stays null terminated
     int capacity;
     int length;
 } object_string_t;
 
+// object data is allocated only as large as its type's union member (see gc.c),
+// so the union has to stay the last member
 typedef struct object_data {
-    gcmem_t *mem;
+    gcmem_page_t *page;
+    object_type_t type;
+    uint16_t page_slot;
     union {
         object_string_t string;
         object_error_t error;
@@ -1035,9 +1171,9 @@ typedef struct object_data {
         function_t function;
         native_function_t native_function;
         external_data_t external;
+        coroutine_t coroutine;
+        struct object_data *next_free; // used by gcmem while the slot is unused
     };
-    bool gcmark;
-    object_type_t type;
 } object_data_t;
 
 APE_INTERNAL object_t object_make_from_data(object_type_t type, object_data_t *data);
@@ -1046,6 +1182,7 @@ APE_INTERNAL object_t object_make_bool(bool val);
 APE_INTERNAL object_t object_make_null(void);
 APE_INTERNAL object_t object_make_string(gcmem_t *mem, const char *string);
 APE_INTERNAL object_t object_make_string_with_capacity(gcmem_t *mem, int capacity);
+APE_INTERNAL object_t object_make_string_view(gcmem_t *mem, object_t string, int offset); // shares string's buffer from offset to the end
 APE_INTERNAL object_t object_make_native_function(gcmem_t *mem, const char *name, native_fn fn, void *data, int data_len);
 APE_INTERNAL object_t object_make_array(gcmem_t *mem);
 APE_INTERNAL object_t object_make_array_with_capacity(gcmem_t *mem, unsigned capacity);
@@ -1055,9 +1192,10 @@ APE_INTERNAL object_t object_make_error(gcmem_t *mem, const char *message);
 APE_INTERNAL object_t object_make_error_no_copy(gcmem_t *mem, char *message);
 APE_INTERNAL object_t object_make_errorf(gcmem_t *mem, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 APE_INTERNAL object_t object_make_function(gcmem_t *mem, const char *name, compilation_result_t *comp_res,
-                                           bool owns_data, int num_locals, int num_args,
+                                           object_t constants, bool owns_data, int num_locals, int num_args,
                                            int free_vals_count);
 APE_INTERNAL object_t object_make_external(gcmem_t *mem, void *data);
+APE_INTERNAL object_t object_make_coroutine(gcmem_t *mem, object_t function);
 
 APE_INTERNAL void object_deinit(object_t obj);
 APE_INTERNAL void object_data_deinit(object_data_t *obj);
@@ -1070,6 +1208,7 @@ APE_INTERNAL const char* object_get_type_name(const object_type_t type);
 APE_INTERNAL char*       object_get_type_union_name(allocator_t *alloc, const object_type_t type);
 APE_INTERNAL char*       object_serialize(allocator_t *alloc, object_t object);
 APE_INTERNAL object_t    object_deep_copy(gcmem_t *mem, object_t object);
+APE_INTERNAL object_t    object_copy_to_heap(gcmem_t *mem, object_t object, valdict(object_t, object_t) *copies, bool share_code, errors_t *errors);
 APE_INTERNAL object_t    object_copy(gcmem_t *mem, object_t obj);
 APE_INTERNAL double      object_compare(object_t a, object_t b, bool *out_ok);
 APE_INTERNAL bool        object_equals(object_t a, object_t b);
@@ -1102,6 +1241,8 @@ APE_INTERNAL const char*  object_get_error_message(object_t obj);
 APE_INTERNAL void         object_set_error_traceback(object_t obj, traceback_t *traceback);
 APE_INTERNAL traceback_t* object_get_error_traceback(object_t obj);
 
+APE_INTERNAL coroutine_t* object_get_coroutine(object_t obj);
+
 APE_INTERNAL external_data_t* object_get_external_data(object_t object);
 APE_INTERNAL bool object_set_external_destroy_function(object_t object, external_data_destroy_fn destroy_fn);
 APE_INTERNAL bool object_set_external_data(object_t object, void *data);
@@ -1140,6 +1281,7 @@ typedef struct global_store global_store_t;
 
 APE_INTERNAL global_store_t *global_store_make(allocator_t *alloc, gcmem_t *mem);
 APE_INTERNAL void global_store_destroy(global_store_t *store);
+APE_INTERNAL global_store_t *global_store_copy(global_store_t *src, allocator_t *alloc); // objects aren't copied, only references to them
 APE_INTERNAL const symbol_t* global_store_get_symbol(global_store_t *store, const char *name);
 APE_INTERNAL object_t global_store_get_object(global_store_t *store, const char *name);
 APE_INTERNAL bool global_store_set(global_store_t *store, const char *name, object_t object);
@@ -1178,6 +1320,7 @@ typedef struct symbol {
     char *name;
     int index;
     bool assignable;
+    bool shadowable; // ape global that script definitions take precedence over
 } symbol_t;
 
 typedef struct block_scope {
@@ -1194,10 +1337,20 @@ typedef struct symbol_table {
     ptrarray(block_scope_t) *block_scopes;
     ptrarray(symbol_t) *free_symbols;
     ptrarray(symbol_t) *module_global_symbols;
+    ptrarray(symbol_t) *replaced_symbols; // top scope symbols redefined since last checkpoint
+    bool has_checkpoint;
     int max_num_definitions;
     int module_global_offset;
 } symbol_table_t;
 
+typedef struct symbol_table_checkpoint {
+    int symbols_count;
+    int num_definitions;
+    int free_symbols_count;
+    int module_global_symbols_count;
+    int max_num_definitions;
+} symbol_table_checkpoint_t;
+
 APE_INTERNAL symbol_t *symbol_make(allocator_t *alloc, const char *name, symbol_type_t type, int index, bool assignable);
 APE_INTERNAL void symbol_destroy(symbol_t *symbol);
 APE_INTERNAL symbol_t* symbol_copy(symbol_t *symbol);
@@ -1225,6 +1378,11 @@ APE_INTERNAL bool symbol_table_is_top_global_scope(symbol_table_t *table);
 APE_INTERNAL int symbol_table_get_module_global_symbol_count(const symbol_table_t *table);
 APE_INTERNAL const symbol_t * symbol_table_get_module_global_symbol_at(const symbol_table_t *table, int ix);
 
+// Checkpoints record top block scope's state, rollback undoes everything defined after it
+APE_INTERNAL symbol_table_checkpoint_t symbol_table_make_checkpoint(symbol_table_t *table);
+APE_INTERNAL void symbol_table_rollback(symbol_table_t *table, const symbol_table_checkpoint_t *checkpoint);
+APE_INTERNAL void symbol_table_commit(symbol_table_t *table);
+
 
 #endif /* symbol_table_h */
 //FILE_END
@@ -1294,6 +1452,19 @@ typedef enum opcode_val {
     OPCODE_AND,
     OPCODE_LSHIFT,
     OPCODE_RSHIFT,
+    OPCODE_YIELD,
+    OPCODE_FOREACH_NEXT,
+    OPCODE_FOREACH_RANGE_INIT,
+    OPCODE_FOREACH_RANGE_NEXT,
+    // quickened opcodes, vm rewrites generic opcodes to them after they operate on numbers
+    // and back once their operands aren't numbers anymore
+    OPCODE_ADD_NUMBER,
+    OPCODE_SUB_NUMBER,
+    OPCODE_MUL_NUMBER,
+    OPCODE_DIV_NUMBER,
+    OPCODE_MOD_NUMBER,
+    OPCODE_COMPARE_NUMBER,
+    OPCODE_COMPARE_EQ_NUMBER,
     OPCODE_MAX,
 } opcode_val_t;
 
@@ -1305,10 +1476,31 @@ typedef struct opcode_definition {
 
 APE_INTERNAL opcode_definition_t* opcode_lookup(opcode_t op);
 APE_INTERNAL const char *opcode_get_name(opcode_t op);
+APE_INTERNAL opcode_t opcode_get_quickened(opcode_t op); // OPCODE_NONE if op can't be quickened
+APE_INTERNAL opcode_t opcode_get_generic(opcode_t op);
 APE_INTERNAL int code_make(opcode_t op, int operands_count, uint64_t *operands, array(uint8_t) *res);
-APE_INTERNAL void code_to_string(uint8_t *code, src_pos_t *source_positions, size_t code_size, strbuf_t *res);
+APE_INTERNAL void code_to_string(uint8_t *code, const uint8_t *src_positions, int src_positions_size, size_t code_size, strbuf_t *res);
 APE_INTERNAL bool code_read_operands(opcode_definition_t *def, uint8_t *instr, uint64_t out_operands[2]);
 
+// Call of an inlined function that instructions were compiled from, so tracebacks can show its frame.
+typedef struct inline_frame {
+    const char *function_name; // NULL if instructions aren't part of an inlined call
+    src_pos_t call_pos;
+} inline_frame_t;
+
+APE_INTERNAL bool inline_frame_equals(const inline_frame_t *a, const inline_frame_t *b);
+
+// Source positions are stored only for instructions at which they change, each entry is
+// delta encoded relative to the previous one (starting at ip 0 and src_pos_invalid).
+// Inline frames are stored in entries at which they change (NULL is the same as no inline frame).
+APE_INTERNAL bool code_add_src_pos(array(uint8_t) *src_positions, int ip_delta, src_pos_t pos, src_pos_t prev_pos,
+                                   const inline_frame_t *inline_frame, const inline_frame_t *prev_inline_frame);
+APE_INTERNAL src_pos_t code_find_src_pos(const uint8_t *src_positions, int src_positions_size, int ip);
+APE_INTERNAL inline_frame_t code_find_inline_frame(const uint8_t *src_positions, int src_positions_size, int ip); // function_name points into src_positions
+// Reads entry at *offset and advances it, *ip, *pos and *inline_frame (can be NULL) have to hold values of the previous entry.
+APE_INTERNAL bool code_read_src_pos(const uint8_t *src_positions, int src_positions_size, int *offset, int *ip, src_pos_t *pos,
+                                    inline_frame_t *inline_frame);
+
 #endif /* code_h */
 //FILE_END
 //FILE_START:compilation_scope.h
@@ -1324,15 +1516,20 @@ APE_INTERNAL bool code_read_operands(opcode_definition_t *def, uint8_t *instr, u
 typedef struct compilation_result {
     allocator_t *alloc;
     uint8_t *bytecode;
-    src_pos_t *src_positions;
+    uint8_t *src_positions; // encoded with code_add_src_pos
+    int src_positions_size;
     int count;
+    uint8_t *dequickened; // bitmap of instructions whose quickened form failed its guard, they aren't quickened again
 } compilation_result_t;
 
 typedef struct compilation_scope {
     allocator_t *alloc;
     struct compilation_scope *outer;
     array(uint8_t) *bytecode;
-    array(src_pos_t) *src_positions;
+    array(uint8_t) *src_positions;
+    int last_src_ip;
+    src_pos_t last_src_pos;
+    inline_frame_t last_inline_frame;
     array(int) *break_ip_stack;
     array(int) *continue_ip_stack;
     opcode_t last_opcode;
@@ -1340,9 +1537,12 @@ typedef struct compilation_scope {
 
 APE_INTERNAL compilation_scope_t* compilation_scope_make(allocator_t *alloc, compilation_scope_t *outer);
 APE_INTERNAL void compilation_scope_destroy(compilation_scope_t *scope);
+APE_INTERNAL bool compilation_scope_add_src_pos(compilation_scope_t *scope, int ip, src_pos_t pos, const inline_frame_t *inline_frame);
+APE_INTERNAL void compilation_scope_clear(compilation_scope_t *scope);
 APE_INTERNAL compilation_result_t *compilation_scope_orphan_result(compilation_scope_t *scope);
 
-APE_INTERNAL compilation_result_t* compilation_result_make(allocator_t *alloc, uint8_t *bytecode, src_pos_t *src_positions, int count);
+APE_INTERNAL compilation_result_t* compilation_result_make(allocator_t *alloc, uint8_t *bytecode, uint8_t *src_positions, int src_positions_size, int count);
+APE_INTERNAL compilation_result_t* compilation_result_copy(allocator_t *alloc, const compilation_result_t *res);
 APE_INTERNAL void compilation_result_destroy(compilation_result_t* res);
 
 #endif /* compilation_scope_h */
@@ -1355,9 +1555,16 @@ APE_INTERNAL void compilation_result_destroy(compilation_result_t* res);
 #ifndef APE_AMALGAMATED
 #include "common.h"
 #include "parser.h"
+#include "code.h"
+#include "compilation_scope.h"
 #endif
 
+// replaced ast nodes aren't freed, they're allocated from the same arena as the rest of ast
 APE_INTERNAL expression_t* optimise_expression(expression_t* expr);
+APE_INTERNAL bool optimise_statements(allocator_t *alloc, ptrarray(statement_t) *statements);
+// Peephole pass over finished bytecode, value popped last is the result of executed programs
+// so pushes followed by pops are removed only if preserve_last_popped is false.
+APE_INTERNAL bool optimise_bytecode(compilation_result_t *res, bool preserve_last_popped);
 
 #endif /* optimisation_h */
 //FILE_END
@@ -1390,11 +1597,17 @@ APE_INTERNAL compiler_t *compiler_make(allocator_t *alloc,
                                        ptrarray(compiled_file_t) *files,
                                        global_store_t *global_store);
 APE_INTERNAL void compiler_destroy(compiler_t *comp);
+APE_INTERNAL compiler_t *compiler_make_copy(compiler_t *src,
+                                            allocator_t *alloc,
+                                            const ape_config_t *config,
+                                            gcmem_t *mem, errors_t *errors,
+                                            ptrarray(compiled_file_t) *files,
+                                            global_store_t *global_store); // constants reference objects in src's heap
 APE_INTERNAL compilation_result_t* compiler_compile(compiler_t *comp, const char *code);
 APE_INTERNAL compilation_result_t* compiler_compile_file(compiler_t *comp, const char *path);
 APE_INTERNAL symbol_table_t* compiler_get_symbol_table(compiler_t *comp);
 APE_INTERNAL void compiler_set_symbol_table(compiler_t *comp, symbol_table_t *table);
-APE_INTERNAL array(object_t)* compiler_get_constants(const compiler_t *comp);
+APE_INTERNAL object_t compiler_get_constants(const compiler_t *comp); // of last compilation
 
 #endif /* compiler_h */
 //FILE_END
@@ -1414,22 +1627,59 @@ typedef struct env env_t;
 #define GCMEM_POOL_SIZE 2048
 #define GCMEM_POOLS_NUM 3
 #define GCMEM_SWEEP_INTERVAL 128
+#define GCMEM_PAGE_SIZE 8192
+#define GCMEM_SIZE_CLASSES_NUM 8
+#define GCMEM_LARGE_OBJECT_SIZE_CLASS -1
+#define GCMEM_EMPTY_PAGES_RESERVE 2 // empty pages kept for every size class after a sweep, the rest is freed
 
 typedef struct object_data_pool {
     object_data_t *data[GCMEM_POOL_SIZE];
     int count;
 } object_data_pool_t;
 
+// live and marks bitmaps (sized by slots count) and slots are laid out right after the page header,
+// objects bigger than the largest size class get a page of their own with a single slot
+typedef struct gcmem_page {
+    gcmem_t *mem;
+    struct gcmem_page *next;
+    struct gcmem_page *prev;
+    int size_class;
+    int slot_size;
+    int slots_count;
+    int slots_used;
+    int live_count;
+    int bitmap_words;
+    bool arena;
+    uint64_t *live;
+    uint64_t *marks;
+    uint8_t *slots;
+} gcmem_page_t;
+
+typedef struct gcmem_size_class {
+    int slot_size;
+    int slots_per_page;
+    object_data_t *free_slots;
+} gcmem_size_class_t;
+
+typedef struct gcmem_heap {
+    gcmem_page_t *pages[GCMEM_SIZE_CLASSES_NUM];
+    gcmem_page_t *large_pages;
+} gcmem_heap_t;
+
 typedef struct gcmem {
     allocator_t *alloc;
     int allocations_since_sweep;
 
-    ptrarray(object_data_t) *objects;
-    ptrarray(object_data_t) *objects_back;
-
     array(object_t) *objects_not_gced;
 
-    object_data_pool_t data_only_pool;
+    gcmem_size_class_t size_classes[GCMEM_SIZE_CLASSES_NUM];
+    gcmem_heap_t heap;
+
+    // while the arena is enabled objects are bump allocated from arena pages, which are never swept
+    // and get released all at once by gcmem_arena_reset
+    gcmem_heap_t arena;
+    bool arena_enabled;
+
     object_data_pool_t pools[GCMEM_POOLS_NUM];
 } gcmem_t;
 
@@ -1437,8 +1687,15 @@ APE_INTERNAL gcmem_t *gcmem_make(allocator_t *alloc);
 APE_INTERNAL void gcmem_destroy(gcmem_t *mem);
 
 APE_INTERNAL object_data_t* gcmem_alloc_object_data(gcmem_t *mem, object_type_t type);
+APE_INTERNAL object_data_t* gcmem_alloc_object_data_with_tail(gcmem_t *mem, object_type_t type, int tail_size);
 APE_INTERNAL object_data_t* gcmem_get_object_data_from_pool(gcmem_t *mem, object_type_t type);
 
+APE_INTERNAL void gcmem_set_arena_enabled(gcmem_t *mem, bool enabled);
+APE_INTERNAL bool gcmem_is_arena_enabled(gcmem_t *mem);
+APE_INTERNAL void gcmem_arena_reset(gcmem_t *mem);
+APE_INTERNAL bool gc_object_is_in_arena(object_t obj);
+APE_INTERNAL void gc_clear_arena_references(object_t *objects, int count);
+
 APE_INTERNAL void gc_unmark_all(gcmem_t *mem);
 APE_INTERNAL void gc_mark_objects(object_t *objects, int count);
 APE_INTERNAL void gc_mark_object(object_t object);
@@ -1451,6 +1708,33 @@ APE_INTERNAL int gc_should_sweep(gcmem_t *mem);
 
 #endif /* gc_h */
 //FILE_END
+//FILE_START:channel.h
+#ifndef channel_h
+#define channel_h
+
+#ifndef APE_AMALGAMATED
+#include "common.h"
+#include "collections.h"
+#include "errors.h"
+#include "object.h"
+#endif
+
+typedef struct gcmem gcmem_t;
+typedef struct channel channel_t;
+
+// bounded queue of objects copied out of their heaps, can be shared by instances running on different threads
+APE_INTERNAL channel_t* channel_make(allocator_t *alloc, int capacity); // alloc has to be thread safe
+APE_INTERNAL channel_t* channel_retain(channel_t *channel);
+APE_INTERNAL void channel_release(channel_t *channel); // destroys channel once it's not referenced
+APE_INTERNAL void channel_close(channel_t *channel);
+APE_INTERNAL bool channel_send(channel_t *channel, object_t obj, errors_t *errors); // blocks while channel is full
+APE_INTERNAL object_t channel_recv(channel_t *channel, gcmem_t *mem, errors_t *errors); // blocks while channel is empty, null if closed
+
+APE_INTERNAL object_t object_make_channel(gcmem_t *mem, channel_t *channel);
+APE_INTERNAL channel_t* object_get_channel(object_t obj); // NULL if obj isn't a channel
+
+#endif /* channel_h */
+//FILE_END
 //FILE_START:builtins.h
 #ifndef builtins_h
 #define builtins_h
@@ -1467,6 +1751,8 @@ typedef struct vm vm_t;
 APE_INTERNAL int builtins_count(void);
 APE_INTERNAL native_fn builtins_get_fn(int ix);
 APE_INTERNAL const char* builtins_get_name(int ix);
+APE_INTERNAL bool builtins_is_shadowable(int ix);
+APE_INTERNAL bool builtins_is_range(object_t obj); // true if obj is the range builtin (iterated lazily by foreach)
 
 #endif /* builtins_h */
 //FILE_END
@@ -1514,12 +1800,15 @@ APE_INTERNAL const char* traceback_item_get_filepath(traceback_item_t *item);
 #include "code.h"
 #endif
 
-typedef struct {
+typedef struct frame {
     object_t function;
+    object_t constants;
     int ip;
     int base_pointer;
-    const src_pos_t *src_positions;
+    const uint8_t *src_positions;
+    int src_positions_size;
     uint8_t *bytecode;
+    uint8_t *dequickened;
     int src_ip;
     int bytecode_size;
     int recover_ip;
@@ -1529,6 +1818,8 @@ typedef struct {
 APE_INTERNAL bool frame_init(frame_t* frame, object_t function, int base_pointer);
 
 APE_INTERNAL opcode_val_t frame_read_opcode(frame_t* frame);
+APE_INTERNAL void frame_quicken_opcode(frame_t* frame, opcode_t op); // replaces opcode of the instruction being executed
+APE_INTERNAL void frame_dequicken_opcode(frame_t* frame, opcode_t op); // same, but the instruction won't be quickened again
 APE_INTERNAL uint64_t frame_read_uint64(frame_t* frame);
 APE_INTERNAL uint16_t frame_read_uint16(frame_t* frame);
 APE_INTERNAL uint8_t frame_read_uint8(frame_t* frame);
@@ -1536,6 +1827,46 @@ APE_INTERNAL src_pos_t frame_src_position(const frame_t *frame);
 
 #endif /* frame_h */
 //FILE_END
+//FILE_START:jit.h
+#ifndef jit_h
+#define jit_h
+
+#ifndef APE_AMALGAMATED
+#include "common.h"
+#include "collections.h"
+#include "object.h"
+#endif
+
+#ifdef APE_JIT
+
+// Baseline compiler translating bytecode of hot functions to x86-64 machine code. Generated
+// code operates directly on vm stack and returns to the interpreter (state->ip) at every
+// instruction it doesn't handle or when a type guard fails, so errors, calls, allocations
+// and tracebacks are always handled by the interpreter.
+
+#ifndef APE_JIT_THRESHOLD
+#define APE_JIT_THRESHOLD 1000 // calls, returns and backward jumps before a function is compiled
+#endif
+
+#define JIT_BACKWARD_JUMPS_BUDGET 10000 // jitted code returns to the interpreter after that many backward jumps
+
+typedef struct jit_state {
+    object_t *bp;
+    object_t *sp;
+    object_t *globals;
+    object_t last_popped;
+    int ip;
+    int budget;
+} jit_state_t;
+
+APE_INTERNAL jit_code_t* jit_compile(allocator_t *alloc, object_t function); // NULL if function can't be compiled
+APE_INTERNAL void jit_code_destroy(allocator_t *alloc, jit_code_t *code);
+APE_INTERNAL void jit_run(const jit_code_t *code, jit_state_t *state); // starts at state->ip
+
+#endif /* APE_JIT */
+
+#endif /* jit_h */
+//FILE_END
 //FILE_START:vm.h
 #ifndef vm_h
 #define vm_h
@@ -1554,10 +1885,25 @@ APE_INTERNAL src_pos_t frame_src_position(const frame_t *frame);
 #define VM_MAX_GLOBALS 2048
 #define VM_MAX_FRAMES 2048
 #define VM_THIS_STACK_SIZE 2048
+#define VM_MAX_RESUMED_COROUTINES 256
+#define VM_STDOUT_BUF_MAX_SLACK (64 * 1024) // print buffers grown this much past the buffer size are freed once written
 
 typedef struct ape_config ape_config_t;
 typedef struct compilation_result compilation_result_t;
 
+// coroutine running on its own stacks, stacks of its caller are restored when it yields or returns
+typedef struct resumed_coroutine {
+    object_t coroutine;
+    object_t *caller_stack;
+    int caller_stack_capacity;
+    int caller_sp; // slot of the callee, replaced by the value passed to caller
+    frame_t *caller_frames;
+    int caller_frames_capacity;
+    int caller_frames_count;
+    int this_sp;
+    int done_ip;     // if >= 0 caller jumps there instead of receiving return value (used by foreach)
+} resumed_coroutine_t;
+
 typedef struct vm {
     allocator_t *alloc;
     const ape_config_t *config;
@@ -1566,16 +1912,29 @@ typedef struct vm {
     global_store_t *global_store;
     object_t globals[VM_MAX_GLOBALS];
     int globals_count;
-    object_t stack[VM_STACK_SIZE];
+    object_t *stack; // main_stack or stack of the running coroutine
+    int stack_capacity;
     int sp;
     object_t this_stack[VM_THIS_STACK_SIZE];
     int this_sp;
-    frame_t frames[VM_MAX_FRAMES];
+    frame_t *frames; // main_frames or frames of the running coroutine
+    int frames_capacity;
     int frames_count;
     object_t last_popped;
     frame_t *current_frame;
     bool running;
     object_t operator_oveload_keys[OPCODE_MAX];
+    ape_random_t random;
+    resumed_coroutine_t resumed_coroutines[VM_MAX_RESUMED_COROUTINES];
+    int resumed_coroutines_count;
+    bool suspend_requested; // set by native function, execution is suspended after the call returns
+    bool suspended;
+    int suspended_frames_count; // restored when suspended execution finishes
+    int suspended_this_sp;
+    object_t char_strings[256]; // single character strings, created on first use
+    strbuf_t *stdout_buf; // print output waiting to be written, created on first use
+    object_t main_stack[VM_STACK_SIZE];
+    frame_t main_frames[VM_MAX_FRAMES];
 } vm_t;
 
 APE_INTERNAL vm_t* vm_make(allocator_t *alloc, const ape_config_t *config, gcmem_t *mem, errors_t *errors, global_store_t *global_store); // config can be null (for internal testing purposes)
@@ -1583,9 +1942,12 @@ APE_INTERNAL void  vm_destroy(vm_t *vm);
 
 APE_INTERNAL void vm_reset(vm_t *vm);
 
-APE_INTERNAL bool vm_run(vm_t *vm, compilation_result_t *comp_res, array(object_t) *constants);
-APE_INTERNAL object_t vm_call(vm_t *vm, array(object_t) *constants, object_t callee, int argc, object_t *args);
-APE_INTERNAL bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants);
+APE_INTERNAL bool vm_run(vm_t *vm, compilation_result_t *comp_res, object_t constants);
+APE_INTERNAL object_t vm_call(vm_t *vm, object_t callee, int argc, object_t *args);
+APE_INTERNAL bool vm_execute_function(vm_t *vm, object_t function);
+APE_INTERNAL bool vm_resume(vm_t *vm, object_t result);
+APE_INTERNAL bool vm_is_suspended(vm_t *vm);
+APE_INTERNAL bool vm_is_running_code_of(vm_t *vm, const compilation_result_t *comp_res); // checks frames of all resumed coroutines too
 
 APE_INTERNAL object_t vm_get_last_popped(vm_t *vm);
 APE_INTERNAL bool vm_has_errors(vm_t *vm);
@@ -1593,6 +1955,11 @@ APE_INTERNAL bool vm_has_errors(vm_t *vm);
 APE_INTERNAL bool vm_set_global(vm_t *vm, int ix, object_t val);
 APE_INTERNAL object_t vm_get_global(vm_t *vm, int ix);
 
+APE_INTERNAL object_t vm_get_char_string(vm_t *vm, char c);
+
+APE_INTERNAL strbuf_t* vm_get_stdout_buf(vm_t *vm);
+APE_INTERNAL void vm_flush_stdout(vm_t *vm, bool force); // if !force only writes when buffer is full
+
 #endif /* vm_h */
 //FILE_END
 
@@ -1737,6 +2104,164 @@ double ape_timer_get_elapsed_ms(const ape_timer_t *timer) {
     return 0;
 #endif
 }
+
+void ape_random_seed(ape_random_t *random, uint64_t seed) {
+    // splitmix64 spreads the seed over the whole state, which can't be all zeros
+    for (int i = 0; i < 4; i++) {
+        seed += 0x9e3779b97f4a7c15;
+        uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        random->state[i] = z ^ (z >> 31);
+    }
+}
+
+uint64_t ape_random_next(ape_random_t *random) {
+    uint64_t *s = random->state;
+    uint64_t x = s[1] * 5;
+    uint64_t res = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return res;
+}
+
+double ape_random_next_double(ape_random_t *random) {
+    return (ape_random_next(random) >> 11) * (1.0 / 9007199254740992.0); // 53 bits of mantissa
+}
+
+#if defined(APE_THREADS) && defined(APE_POSIX)
+static void* thread_main(void *arg) {
+    ape_thread_t *thread = arg;
+    thread->fn(thread->arg);
+    return NULL;
+}
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+static DWORD WINAPI thread_main(LPVOID arg) {
+    ape_thread_t *thread = arg;
+    thread->fn(thread->arg);
+    return 0;
+}
+#endif
+
+bool ape_threads_platform_supported() {
+#if defined(APE_THREADS)
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool ape_thread_start(ape_thread_t *thread, ape_thread_fn fn, void *arg) {
+    memset(thread, 0, sizeof(ape_thread_t));
+    thread->fn = fn;
+    thread->arg = arg;
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    return pthread_create(&thread->handle, NULL, thread_main, thread) == 0;
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    thread->handle = CreateThread(NULL, 0, thread_main, thread, 0, NULL);
+    return thread->handle != NULL;
+#else
+    return false;
+#endif
+}
+
+void ape_thread_join(ape_thread_t *thread) {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_join(thread->handle, NULL);
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#else
+    (void)thread;
+#endif
+}
+
+bool ape_mutex_init(ape_mutex_t *mutex) {
+    memset(mutex, 0, sizeof(ape_mutex_t));
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    return pthread_mutex_init(&mutex->handle, NULL) == 0;
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    InitializeSRWLock(&mutex->handle);
+    return true;
+#else
+    return true;
+#endif
+}
+
+void ape_mutex_deinit(ape_mutex_t *mutex) {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_mutex_destroy(&mutex->handle);
+#else
+    (void)mutex;
+#endif
+}
+
+void ape_mutex_lock(ape_mutex_t *mutex) {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_mutex_lock(&mutex->handle);
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    AcquireSRWLockExclusive(&mutex->handle);
+#else
+    (void)mutex;
+#endif
+}
+
+void ape_mutex_unlock(ape_mutex_t *mutex) {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_mutex_unlock(&mutex->handle);
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    ReleaseSRWLockExclusive(&mutex->handle);
+#else
+    (void)mutex;
+#endif
+}
+
+bool ape_cond_init(ape_cond_t *cond) {
+    memset(cond, 0, sizeof(ape_cond_t));
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    return pthread_cond_init(&cond->handle, NULL) == 0;
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    InitializeConditionVariable(&cond->handle);
+    return true;
+#else
+    return true;
+#endif
+}
+
+void ape_cond_deinit(ape_cond_t *cond) {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_cond_destroy(&cond->handle);
+#else
+    (void)cond;
+#endif
+}
+
+void ape_cond_wait(ape_cond_t *cond, ape_mutex_t *mutex) {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_cond_wait(&cond->handle, &mutex->handle);
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    SleepConditionVariableSRW(&cond->handle, &mutex->handle, INFINITE, 0);
+#else
+    (void)cond;
+    (void)mutex;
+    APE_ASSERT(false);
+#endif
+}
+
+void ape_cond_broadcast(ape_cond_t *cond) {
+#if defined(APE_THREADS) && defined(APE_POSIX)
+    pthread_cond_broadcast(&cond->handle);
+#elif defined(APE_THREADS) && defined(APE_WINDOWS)
+    WakeAllConditionVariable(&cond->handle);
+#else
+    (void)cond;
+#endif
+}
 //FILE_END
 //FILE_START:collections.c
 #ifndef COLLECTIONS_AMALGAMATED
@@ -1830,6 +2355,97 @@ void allocator_free(allocator_t *allocator, void *ptr) {
     allocator->free(allocator->ctx, ptr);
 }
 
+//-----------------------------------------------------------------------------
+// Arena
+//-----------------------------------------------------------------------------
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+#define ARENA_ALIGN(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~(size_t)(ARENA_ALIGNMENT - 1))
+
+typedef struct arena_chunk {
+    struct arena_chunk *next;
+} arena_chunk_t;
+
+typedef struct arena {
+    allocator_t *alloc;
+    allocator_t allocator;
+    arena_chunk_t *chunks;
+    char *cursor;
+    char *end;
+} arena_t;
+
+static void* arena_malloc(void *ctx, size_t size);
+static void arena_free(void *ctx, void *ptr);
+static arena_chunk_t* arena_add_chunk(arena_t *arena, size_t size);
+
+arena_t* arena_make(allocator_t *alloc) {
+    arena_t *arena = allocator_malloc(alloc, sizeof(arena_t));
+    if (!arena) {
+        return NULL;
+    }
+    memset(arena, 0, sizeof(arena_t));
+    arena->alloc = alloc;
+    arena->allocator = allocator_make(arena_malloc, arena_free, arena);
+    return arena;
+}
+
+void arena_destroy(arena_t *arena) {
+    if (!arena) {
+        return;
+    }
+    arena_chunk_t *chunk = arena->chunks;
+    while (chunk) {
+        arena_chunk_t *next = chunk->next;
+        allocator_free(arena->alloc, chunk);
+        chunk = next;
+    }
+    allocator_free(arena->alloc, arena);
+}
+
+allocator_t* arena_get_allocator(arena_t *arena) {
+    return &arena->allocator;
+}
+
+static void* arena_malloc(void *ctx, size_t size) {
+    arena_t *arena = ctx;
+    if (size > ARENA_CHUNK_SIZE) {
+        // gets its own chunk so the current one isn't wasted
+        arena_chunk_t *chunk = arena_add_chunk(arena, size);
+        if (!chunk) {
+            return NULL;
+        }
+        return (char*)chunk + ARENA_ALIGN(sizeof(arena_chunk_t));
+    }
+    size = ARENA_ALIGN(size);
+    if (size > (size_t)(arena->end - arena->cursor)) {
+        arena_chunk_t *chunk = arena_add_chunk(arena, ARENA_CHUNK_SIZE);
+        if (!chunk) {
+            return NULL;
+        }
+        arena->cursor = (char*)chunk + ARENA_ALIGN(sizeof(arena_chunk_t));
+        arena->end = arena->cursor + ARENA_CHUNK_SIZE;
+    }
+    void *res = arena->cursor;
+    arena->cursor += size;
+    return res;
+}
+
+static void arena_free(void *ctx, void *ptr) {
+    (void)ctx;
+    (void)ptr;
+}
+
+static arena_chunk_t* arena_add_chunk(arena_t *arena, size_t size) {
+    arena_chunk_t *chunk = allocator_malloc(arena->alloc, ARENA_ALIGN(sizeof(arena_chunk_t)) + size);
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    return chunk;
+}
+
 //-----------------------------------------------------------------------------
 // Dictionary
 //-----------------------------------------------------------------------------
@@ -2001,6 +2617,16 @@ bool dict_remove(dict_t_ *dict, const char *key) {
     return true;
 }
 
+void dict_clear(dict_t_ *dict) {
+    for (unsigned int i = 0; i < dict->count; i++) {
+        allocator_free(dict->alloc, dict->keys[i]);
+    }
+    dict->count = 0;
+    for (unsigned int i = 0; i < dict->cell_capacity; i++) {
+        dict->cells[i] = DICT_INVALID_IX;
+    }
+}
+
 // Private definitions
 static bool dict_init(dict_t_ *dict, allocator_t *alloc, unsigned int initial_capacity, dict_item_copy_fn copy_fn, dict_item_destroy_fn destroy_fn) {
     dict->alloc = alloc;
@@ -2307,7 +2933,7 @@ bool valdict_remove(valdict_t_ *dict, void *key) {
     if (item_ix < last_item_ix) {
         void *last_key = valdict_get_key_at(dict, last_item_ix);
         valdict_set_key_at(dict, item_ix, last_key);
-        void *last_value = valdict_get_key_at(dict, last_item_ix);
+        void *last_value = valdict_get_value_at(dict, last_item_ix);
         valdict_set_value_at(dict, item_ix, last_value);
         dict->cell_ixs[item_ix] = dict->cell_ixs[last_item_ix];
         dict->hashes[item_ix] = dict->hashes[last_item_ix];
@@ -3520,6 +4146,7 @@ static const char *g_type_names[] = {
     "NULL",
     "IMPORT",
     "RECOVER",
+    "YIELD",
     "IDENT",
     "NUMBER",
     "STRING",
@@ -3566,6 +4193,10 @@ compiled_file_t* compiled_file_make(allocator_t *alloc, const char *path) {
     if (!file->path) {
         goto error;
     }
+    file->sources = ptrarray_make(alloc);
+    if (!file->sources) {
+        goto error;
+    }
     file->lines = ptrarray_make(alloc);
     if (!file->lines) {
         goto error;
@@ -3576,14 +4207,42 @@ error:
     return NULL;
 }
 
+bool compiled_file_add_source(compiled_file_t *file, const char *source) {
+    // one copy of the whole source instead of a copy of every line
+    char *copy = ape_strdup(file->alloc, source);
+    if (!copy) {
+        return false;
+    }
+    bool ok = ptrarray_add(file->sources, copy);
+    if (!ok) {
+        allocator_free(file->alloc, copy);
+        return false;
+    }
+    char *line = copy;
+    while (true) {
+        ok = ptrarray_add(file->lines, line);
+        if (!ok) {
+            return false;
+        }
+        char *new_line = strchr(line, '\n');
+        if (!new_line) {
+            break;
+        }
+        *new_line = '\0';
+        line = new_line + 1;
+    }
+    return true;
+}
+
 void compiled_file_destroy(compiled_file_t *file) {
     if (!file) {
         return;
     }
-    for (int i = 0; i < ptrarray_count(file->lines); i++) {
-        void *item = ptrarray_get(file->lines, i);
+    for (int i = 0; i < ptrarray_count(file->sources); i++) {
+        void *item = ptrarray_get(file->sources, i);
         allocator_free(file->alloc, item);
     }
+    ptrarray_destroy(file->sources);
     ptrarray_destroy(file->lines);
     allocator_free(file->alloc, file->dir_path);
     allocator_free(file->alloc, file->path);
@@ -3600,17 +4259,31 @@ void compiled_file_destroy(compiled_file_t *file) {
 #include "compiler.h"
 #endif
 
+#define CHAR_LETTER     0x1 // a-z, A-Z and _
+#define CHAR_DIGIT      0x2
+#define CHAR_NUMBER     0x4 // digits and . x X a-f A-F, can be a part of number literal
+#define CHAR_WHITESPACE 0x8
+
+static const uint8_t g_char_classes[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 8, 8, 0, 0, 8, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 0,
+    6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 0, 0, 0, 0, 0, 0,
+    0, 5, 5, 5, 5, 5, 5, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 5, 1, 1, 0, 0, 0, 0, 1,
+    0, 5, 5, 5, 5, 5, 5, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 5, 1, 1, 0, 0, 0, 0, 0,
+};
+
 static bool read_char(lexer_t *lex);
+static void read_chars_until(lexer_t *lex, int position);
 static char peek_char(lexer_t *lex);
-static bool is_letter(char ch);
-static bool is_digit(char ch);
-static bool is_one_of(char ch, const char* allowed, int allowed_len);
+static bool char_is(char ch, uint8_t char_class);
 static const char* read_identifier(lexer_t *lex, int *out_len);
 static const char* read_number(lexer_t *lex, int *out_len);
 static const char* read_string(lexer_t *lex, char delimiter, bool is_template, bool *out_template_found, int *out_len);
 static token_type_t lookup_identifier(const char *ident, int len);
 static void skip_whitespace(lexer_t *lex);
-static bool add_line(lexer_t *lex, int offset);
 
 bool lexer_init(lexer_t *lex, allocator_t *alloc, errors_t *errs, const char *input, compiled_file_t *file) {
     lex->alloc = alloc;
@@ -3622,16 +4295,16 @@ bool lexer_init(lexer_t *lex, allocator_t *alloc, errors_t *errs, const char *in
     lex->ch = '\0';
     if (file) {
         lex->line = ptrarray_count(file->lines);
+        bool ok = compiled_file_add_source(file, input);
+        if (!ok) {
+            return false;
+        }
     } else {
         lex->line = 0;
     }
     lex->column = -1;
     lex->file = file;
-    bool ok = add_line(lex, 0);
-    if (!ok) {
-        return false;
-    }
-    ok = read_char(lex);
+    bool ok = read_char(lex);
     if (!ok) {
         return false;
     }
@@ -3795,10 +4468,9 @@ token_t lexer_next_token_internal(lexer_t *lex) {
             }
             case '/': {
                 if (peek_char(lex) == '/') {
-                    read_char(lex);
-                    while (lex->ch != '\n' && lex->ch != '\0') {
-                        read_char(lex);
-                    }
+                    const char *comment = lex->input + lex->next_position;
+                    const char *new_line = memchr(comment, '\n', lex->input_len - lex->next_position);
+                    read_chars_until(lex, new_line ? (int)(new_line - lex->input) : lex->input_len);
                     continue;
                 } else if (peek_char(lex) == '=') {
                     token_init(&out_tok, TOKEN_SLASH_ASSIGN, "/=", 2);
@@ -3903,13 +4575,13 @@ token_t lexer_next_token_internal(lexer_t *lex) {
                 break;
             }
             default: {
-                if (is_letter(lex->ch)) {
+                if (char_is(lex->ch, CHAR_LETTER)) {
                     int ident_len = 0;
                     const char *ident = read_identifier(lex, &ident_len);
                     token_type_t type = lookup_identifier(ident, ident_len);
                     token_init(&out_tok, type, ident, ident_len);
                     return out_tok;
-                } else if (is_digit(lex->ch)) {
+                } else if (char_is(lex->ch, CHAR_DIGIT)) {
                     int number_len = 0;
                     const char *number = read_number(lex, &number_len);
                     token_init(&out_tok, TOKEN_NUMBER, number, number_len);
@@ -3957,17 +4629,20 @@ static bool read_char(lexer_t *lex) {
     if (lex->ch == '\n') {
         lex->line++;
         lex->column = -1;
-        bool ok = add_line(lex, lex->next_position);
-        if (!ok) {
-            lex->failed = true;
-            return false;
-        }
     } else {
         lex->column++;
     }
     return true;
 }
 
+static void read_chars_until(lexer_t *lex, int position) {
+    // skips characters up to position on the current line and reads the one at position (can be a newline)
+    APE_ASSERT(position > lex->position);
+    lex->column += position - lex->position - 1;
+    lex->next_position = position;
+    read_char(lex);
+}
+
 static char peek_char(lexer_t *lex) {
     if (lex->next_position >= lex->input_len) {
         return '\0';
@@ -3976,50 +4651,40 @@ static char peek_char(lexer_t *lex) {
     }
 }
 
-static bool is_letter(char ch) {
-    return ('a' <= ch && ch <= 'z') || ('A' <= ch && ch <= 'Z') || ch == '_';
-}
-
-static bool is_digit(char ch) {
-    return ch >= '0' && ch <= '9';
-}
-
-static bool is_one_of(char ch, const char* allowed, int allowed_len) {
-    for (int i = 0; i < allowed_len; i++) {
-        if (ch == allowed[i]) {
-            return true;
-        }
-    }
-    return false;
+static bool char_is(char ch, uint8_t char_class) {
+    return g_char_classes[(uint8_t)ch] & char_class;
 }
 
+// input is null terminated and identifiers and numbers can't span lines, so both are scanned
+// without going through read_char
 static const char* read_identifier(lexer_t *lex, int *out_len) {
+    const char *input = lex->input;
     int position = lex->position;
-    int len = 0;
-    while (is_digit(lex->ch) || is_letter(lex->ch) || lex->ch == ':') {
-        if (lex->ch == ':') {
-            if (peek_char(lex) != ':') {
-                goto end;
-            }
-            read_char(lex);
+    int end = position;
+    while (true) {
+        if (char_is(input[end], CHAR_LETTER | CHAR_DIGIT)) {
+            end++;
+        } else if (input[end] == ':' && input[end + 1] == ':') {
+            end += 2;
+        } else {
+            break;
         }
-        read_char(lex);
     }
-end:
-    len = lex->position - position;
-    *out_len = len;
-    return lex->input + position;
+    read_chars_until(lex, end);
+    *out_len = end - position;
+    return input + position;
 }
 
 static const char* read_number(lexer_t *lex, int *out_len) {
-    char allowed[] = ".xXaAbBcCdDeEfF";
+    const char *input = lex->input;
     int position = lex->position;
-    while (is_digit(lex->ch) || is_one_of(lex->ch, allowed, APE_ARRAY_LEN(allowed) - 1)) {
-        read_char(lex);
+    int end = position;
+    while (char_is(input[end], CHAR_NUMBER)) {
+        end++;
     }
-    int len = lex->position - position;
-    *out_len = len;
-    return lex->input + position;
+    read_chars_until(lex, end);
+    *out_len = end - position;
+    return input + position;
 }
 
 static const char* read_string(lexer_t *lex, char delimiter, bool is_template, bool *out_template_found, int *out_len) {
@@ -4051,75 +4716,74 @@ static const char* read_string(lexer_t *lex, char delimiter, bool is_template, b
 }
 
 static token_type_t lookup_identifier(const char *ident, int len) {
-    struct {
-        const char *value;
-        int len;
-        token_type_t type;
-    } keywords[] = {
-        {"fn", 2, TOKEN_FUNCTION},
-        {"const", 5, TOKEN_CONST},
-        {"var", 3, TOKEN_VAR},
-        {"true", 4, TOKEN_TRUE},
-        {"false", 5, TOKEN_FALSE},
-        {"if", 2, TOKEN_IF},
-        {"else", 4, TOKEN_ELSE},
-        {"return", 6, TOKEN_RETURN},
-        {"while", 5, TOKEN_WHILE},
-        {"break", 5, TOKEN_BREAK},
-        {"for", 3, TOKEN_FOR},
-        {"in", 2, TOKEN_IN},
-        {"continue", 8, TOKEN_CONTINUE},
-        {"null", 4, TOKEN_NULL},
-        {"import", 6, TOKEN_IMPORT},
-        {"recover", 7, TOKEN_RECOVER},
-    };
-
-    for (int i = 0; i < APE_ARRAY_LEN(keywords); i++) {
-        if (keywords[i].len == len && APE_STRNEQ(ident, keywords[i].value, len)) {
-            return keywords[i].type;
+    // keywords differ in first character and length, so at most one of them has to be compared
+    const char *keyword = NULL;
+    token_type_t type = TOKEN_IDENT;
+    switch (ident[0]) {
+        case 'b': keyword = "break";    type = TOKEN_BREAK;    break;
+        case 'c': {
+            if (len == 5) {
+                keyword = "const";      type = TOKEN_CONST;
+            } else {
+                keyword = "continue";   type = TOKEN_CONTINUE;
+            }
+            break;
         }
+        case 'e': keyword = "else";     type = TOKEN_ELSE;     break;
+        case 'f': {
+            if (len == 2) {
+                keyword = "fn";         type = TOKEN_FUNCTION;
+            } else if (len == 3) {
+                keyword = "for";        type = TOKEN_FOR;
+            } else {
+                keyword = "false";      type = TOKEN_FALSE;
+            }
+            break;
+        }
+        case 'i': {
+            if (len == 6) {
+                keyword = "import";     type = TOKEN_IMPORT;
+            } else if (len == 2 && ident[1] == 'f') {
+                keyword = "if";         type = TOKEN_IF;
+            } else {
+                keyword = "in";         type = TOKEN_IN;
+            }
+            break;
+        }
+        case 'n': keyword = "null";     type = TOKEN_NULL;     break;
+        case 'r': {
+            if (len == 6) {
+                keyword = "return";     type = TOKEN_RETURN;
+            } else {
+                keyword = "recover";    type = TOKEN_RECOVER;
+            }
+            break;
+        }
+        case 't': keyword = "true";     type = TOKEN_TRUE;     break;
+        case 'v': keyword = "var";      type = TOKEN_VAR;      break;
+        case 'w': keyword = "while";    type = TOKEN_WHILE;    break;
+        case 'y': keyword = "yield";    type = TOKEN_YIELD;    break;
+        default: break;
     }
-    
-    return TOKEN_IDENT;
-}
-
-static void skip_whitespace(lexer_t *lex) {
-    char ch = lex->ch;
-    while (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r') {
-        read_char(lex);
-        ch = lex->ch;
-    }
-}
-
-static bool add_line(lexer_t *lex, int offset) {
-    if (!lex->file) {
-        return true;
-    }
-
-    if (lex->line < ptrarray_count(lex->file->lines)) {
-        return true;
+    if (keyword && (int)strlen(keyword) == len && APE_STRNEQ(ident, keyword, len)) {
+        return type;
     }
+    return TOKEN_IDENT;
+}
 
-    const char *line_start = lex->input + offset;
-    const char *new_line_ptr = strchr(line_start, '\n');
-    char *line = NULL;
-    if (!new_line_ptr) {
-        line = ape_strdup(lex->alloc, line_start);
-    } else {
-        size_t line_len = new_line_ptr - line_start;
-        line = ape_strndup(lex->alloc, line_start, line_len);
-    }
-    if (!line) {
-        lex->failed = true;
-        return false;
-    }
-    bool ok = ptrarray_add(lex->file->lines, line);
-    if (!ok) {
-        lex->failed = true;
-        allocator_free(lex->alloc, line);
-        return false;
+static void skip_whitespace(lexer_t *lex) {
+    const char *input = lex->input;
+    while (char_is(lex->ch, CHAR_WHITESPACE)) {
+        if (lex->ch == '\n') {
+            read_char(lex);
+            continue;
+        }
+        int end = lex->position + 1;
+        while (char_is(input[end], CHAR_WHITESPACE) && input[end] != '\n') {
+            end++;
+        }
+        read_chars_until(lex, end);
     }
-    return true;
 }
 //FILE_END
 //FILE_START:ast.c
@@ -4282,6 +4946,15 @@ expression_t* expression_make_ternary(allocator_t *alloc, expression_t *test, ex
     return res;
 }
 
+expression_t* expression_make_yield(allocator_t *alloc, expression_t *value) {
+    expression_t *res = expression_make(alloc, EXPRESSION_YIELD);
+    if (!res) {
+        return NULL;
+    }
+    res->yield_value = value;
+    return res;
+}
+
 void expression_destroy(expression_t *expr) {
     if (!expr) {
         return;
@@ -4358,6 +5031,10 @@ void expression_destroy(expression_t *expr) {
             expression_destroy(expr->ternary.if_false);
             break;
         }
+        case EXPRESSION_YIELD: {
+            expression_destroy(expr->yield_value);
+            break;
+        }
     }
     allocator_free(expr->alloc, expr);
 
@@ -4568,6 +5245,21 @@ expression_t* expression_copy(expression_t *expr) {
             }
             break;
         }
+        case EXPRESSION_YIELD: {
+            expression_t *value_copy = NULL;
+            if (expr->yield_value) {
+                value_copy = expression_copy(expr->yield_value);
+                if (!value_copy) {
+                    return NULL;
+                }
+            }
+            res = expression_make_yield(expr->alloc, value_copy);
+            if (!res) {
+                expression_destroy(value_copy);
+                return NULL;
+            }
+            break;
+        }
     }
     if (!res) {
         return NULL;
@@ -5233,6 +5925,14 @@ void expression_to_string(expression_t *expr, strbuf_t *buf) {
             expression_to_string(expr->ternary.if_false, buf);
             break;
         }
+        case EXPRESSION_YIELD: {
+            strbuf_append(buf, "yield");
+            if (expr->yield_value) {
+                strbuf_append(buf, " ");
+                expression_to_string(expr->yield_value, buf);
+            }
+            break;
+        }
         case EXPRESSION_NONE: {
             strbuf_append(buf, "EXPRESSION_NONE");
             break;
@@ -5292,6 +5992,7 @@ const char *expression_type_to_string(expression_type_t type) {
         case EXPRESSION_ASSIGN:           return "ASSIGN";
         case EXPRESSION_LOGICAL:          return "LOGICAL";
         case EXPRESSION_TERNARY:          return "TERNARY";
+        case EXPRESSION_YIELD:            return "YIELD";
         default:                          return "UNKNOWN";
     }
 }
@@ -5480,6 +6181,7 @@ static expression_t* parse_logical_expression(parser_t *p, expression_t *left);
 static expression_t* parse_ternary_expression(parser_t *p, expression_t *left);
 static expression_t* parse_incdec_prefix_expression(parser_t *p);
 static expression_t* parse_incdec_postfix_expression(parser_t *p, expression_t *left);
+static expression_t* parse_yield_expression(parser_t *p);
 
 static precedence_t get_precedence(token_type_t tk);
 static operator_t token_to_operator(token_type_t tk);
@@ -5514,6 +6216,7 @@ parser_t* parser_make(allocator_t *alloc, const ape_config_t *config, errors_t *
     parser->right_assoc_parse_fns[TOKEN_LBRACE] = parse_map_literal;
     parser->right_assoc_parse_fns[TOKEN_PLUS_PLUS] = parse_incdec_prefix_expression;
     parser->right_assoc_parse_fns[TOKEN_MINUS_MINUS] = parse_incdec_prefix_expression;
+    parser->right_assoc_parse_fns[TOKEN_YIELD] = parse_yield_expression;
 
     parser->left_assoc_parse_fns[TOKEN_PLUS] = parse_infix_expression;
     parser->left_assoc_parse_fns[TOKEN_MINUS] = parse_infix_expression;
@@ -5556,13 +6259,6 @@ parser_t* parser_make(allocator_t *alloc, const ape_config_t *config, errors_t *
     return parser;
 }
 
-void parser_destroy(parser_t *parser) {
-    if (!parser) {
-        return;
-    }
-    allocator_free(parser->alloc, parser);
-}
-
 ptrarray(statement_t)* parser_parse_all(parser_t *parser, const char *input, compiled_file_t *file) {
     parser->depth = 0;
 
@@ -5590,7 +6286,6 @@ ptrarray(statement_t)* parser_parse_all(parser_t *parser, const char *input, com
         }
         bool ok = ptrarray_add(statements, stmt);
         if (!ok) {
-            statement_destroy(stmt);
             goto err;
         }
     }
@@ -5601,7 +6296,6 @@ ptrarray(statement_t)* parser_parse_all(parser_t *parser, const char *input, com
 
     return statements;
 err:
-    ptrarray_destroy_with_items(statements, statement_destroy);
     return NULL;
 }
 
@@ -5718,8 +6412,6 @@ static statement_t* parse_define_statement(parser_t *p) {
     }
     return res;
 err:
-    expression_destroy(value);
-    ident_destroy(name_ident);
     return NULL;
 }
 
@@ -5747,7 +6439,6 @@ static statement_t* parse_if_statement(parser_t *p) {
 
     bool ok = ptrarray_add(cases, cond);
     if (!ok) {
-        if_case_destroy(cond);
         goto err;
     }
 
@@ -5786,7 +6477,6 @@ static statement_t* parse_if_statement(parser_t *p) {
 
             ok = ptrarray_add(cases, elif);
             if (!ok) {
-                if_case_destroy(elif);
                 goto err;
             }
 
@@ -5819,8 +6509,6 @@ static statement_t* parse_if_statement(parser_t *p) {
     }
     return res;
 err:
-    ptrarray_destroy_with_items(cases, if_case_destroy);
-    code_block_destroy(alternative);
     return NULL;
 }
 
@@ -5838,7 +6526,6 @@ static statement_t* parse_return_statement(parser_t *p) {
 
     statement_t *res = statement_make_return(p->alloc, expr);
     if (!res) {
-        expression_destroy(expr);
         return NULL;
     }
     return res;
@@ -5851,17 +6538,15 @@ static statement_t* parse_expression_statement(parser_t *p) {
     }
 
     if (expr && (!p->config->repl_mode || p->depth > 0)) {
-        if (expr->type != EXPRESSION_ASSIGN && expr->type != EXPRESSION_CALL) {
+        if (expr->type != EXPRESSION_ASSIGN && expr->type != EXPRESSION_CALL && expr->type != EXPRESSION_YIELD) {
             errors_add_errorf(p->errors, ERROR_PARSING, expr->pos,
-                              "Only assignments and function calls can be expression statements");
-            expression_destroy(expr);
+                              "Only assignments, function calls and yields can be expression statements");
             return NULL;
         }
     }
 
     statement_t *res = statement_make_expression(p->alloc, expr);
     if (!res) {
-        expression_destroy(expr);
         return NULL;
     }
     return res;
@@ -5901,8 +6586,6 @@ static statement_t* parse_while_loop_statement(parser_t *p) {
     }
     return res;
 err:
-    code_block_destroy(body);
-    expression_destroy(test);
     return NULL;
 }
 
@@ -5923,7 +6606,6 @@ static statement_t* parse_block_statement(parser_t *p) {
     }
     statement_t *res = statement_make_block(p->alloc, block);
     if (!res) {
-        code_block_destroy(block);
         return NULL;
     }
     return res;
@@ -5989,8 +6671,6 @@ static statement_t* parse_recover_statement(parser_t *p) {
     }
     return res;
 err:
-    code_block_destroy(body);
-    ident_destroy(error_ident);
     return NULL;
 
 }
@@ -6051,9 +6731,6 @@ static statement_t* parse_foreach(parser_t *p) {
     }
     return res;
 err:
-    code_block_destroy(body);
-    ident_destroy(iterator_ident);
-    expression_destroy(source);
     return NULL;
 }
 
@@ -6116,10 +6793,6 @@ static statement_t* parse_classic_for_loop(parser_t *p) {
 
     return res;
 err:
-    statement_destroy(init);
-    expression_destroy(test);
-    expression_destroy(update);
-    code_block_destroy(body);
     return NULL;
 }
 
@@ -6161,8 +6834,6 @@ static statement_t* parse_function_statement(parser_t *p) {
     return res;
 
 err:
-    expression_destroy(value);
-    ident_destroy(name_ident);
     return NULL;
 }
 
@@ -6194,7 +6865,6 @@ static code_block_t* parse_code_block(parser_t *p) {
         }
         bool ok = ptrarray_add(statements, stmt);
         if (!ok) {
-            statement_destroy(stmt);
             goto err;
         }
     }
@@ -6211,7 +6881,6 @@ static code_block_t* parse_code_block(parser_t *p) {
 
 err:
     p->depth--;
-    ptrarray_destroy_with_items(statements, statement_destroy);
     return NULL;
 }
 
@@ -6246,7 +6915,6 @@ static expression_t* parse_expression(parser_t *p, precedence_t prec) {
         pos = p->lexer.cur_token.pos;
         expression_t *new_left_expr = parse_left_assoc(p, left_expr);
         if (!new_left_expr) {
-            expression_destroy(left_expr);
             return NULL;
         }
         new_left_expr->pos = pos;
@@ -6263,7 +6931,6 @@ static expression_t* parse_identifier(parser_t *p) {
     }
     expression_t *res = expression_make_ident(p->alloc, ident);
     if (!res) {
-        ident_destroy(ident);
         return NULL;
     }
     lexer_next_token(&p->lexer);
@@ -6349,15 +7016,12 @@ static expression_t* parse_template_string_literal(parser_t *p) {
         goto err;
     }
     to_str_call_expr->pos = pos;
-    template_expr = NULL;
 
     left_add_expr = expression_make_infix(p->alloc, OPERATOR_PLUS, left_string_expr, to_str_call_expr);
     if (!left_add_expr) {
         goto err;
     }
     left_add_expr->pos = pos;
-    left_string_expr = NULL;
-    to_str_call_expr = NULL;
 
     if (!lexer_expect_current(&p->lexer, TOKEN_RBRACE)) {
         goto err;
@@ -6379,17 +7043,9 @@ static expression_t* parse_template_string_literal(parser_t *p) {
         goto err;
     }
     right_add_expr->pos = pos;
-    left_add_expr = NULL;
-    right_expr = NULL;
 
     return right_add_expr;
 err:
-    expression_destroy(right_add_expr);
-    expression_destroy(right_expr);
-    expression_destroy(left_add_expr);
-    expression_destroy(to_str_call_expr);
-    expression_destroy(template_expr);
-    expression_destroy(left_string_expr);
     allocator_free(p->alloc, processed_literal);
     return NULL;
 }
@@ -6406,7 +7062,6 @@ static expression_t* parse_array_literal(parser_t *p) {
     }
     expression_t *res = expression_make_array_literal(p->alloc, array);
     if (!res) {
-        ptrarray_destroy_with_items(array, expression_destroy);
         return NULL;
     }
     return res;
@@ -6446,7 +7101,6 @@ static expression_t* parse_map_literal(parser_t *p) {
                 }
                 default: {
                     errors_add_errorf(p->errors, ERROR_PARSING, key->pos, "Invalid map literal key type");
-                    expression_destroy(key);
                     goto err;
                 }
             }
@@ -6454,7 +7108,6 @@ static expression_t* parse_map_literal(parser_t *p) {
 
         bool ok = ptrarray_add(keys, key);
         if (!ok) {
-            expression_destroy(key);
             goto err;
         }
 
@@ -6470,7 +7123,6 @@ static expression_t* parse_map_literal(parser_t *p) {
         }
         ok = ptrarray_add(values, value);
         if (!ok) {
-            expression_destroy(value);
             goto err;
         }
 
@@ -6493,8 +7145,6 @@ static expression_t* parse_map_literal(parser_t *p) {
     }
     return res;
 err:
-    ptrarray_destroy_with_items(keys, expression_destroy);
-    ptrarray_destroy_with_items(values, expression_destroy);
     return NULL;
 }
 
@@ -6507,7 +7157,6 @@ static expression_t* parse_prefix_expression(parser_t *p) {
     }
     expression_t *res = expression_make_prefix(p->alloc, op, right);
     if (!res) {
-        expression_destroy(right);
         return NULL;
     }
     return res;
@@ -6523,7 +7172,6 @@ static expression_t* parse_infix_expression(parser_t *p, expression_t *left) {
     }
     expression_t *res = expression_make_infix(p->alloc, op, left, right);
     if (!res) {
-        expression_destroy(right);
         return NULL;
     }
     return res;
@@ -6533,7 +7181,6 @@ static expression_t* parse_grouped_expression(parser_t *p) {
     lexer_next_token(&p->lexer);
     expression_t *expr = parse_expression(p, PRECEDENCE_LOWEST);
     if (!expr || !lexer_expect_current(&p->lexer, TOKEN_RPAREN)) {
-        expression_destroy(expr);
         return NULL;
     }
     lexer_next_token(&p->lexer);
@@ -6571,8 +7218,6 @@ static expression_t* parse_function_literal(parser_t *p) {
 
     return res;
 err:
-    code_block_destroy(body);
-    ptrarray_destroy_with_items(params, ident_destroy);
     p->depth -= 1;
     return NULL;
 }
@@ -6600,7 +7245,6 @@ static bool parse_function_parameters(parser_t *p, ptrarray(ident_t) *out_params
     
     bool ok = ptrarray_add(out_params, ident);
     if (!ok) {
-        ident_destroy(ident);
         return false;
     }
 
@@ -6619,7 +7263,6 @@ static bool parse_function_parameters(parser_t *p, ptrarray(ident_t) *out_params
         }
         bool ok = ptrarray_add(out_params, ident);
         if (!ok) {
-            ident_destroy(ident);
             return false;
         }
 
@@ -6643,7 +7286,6 @@ static expression_t* parse_call_expression(parser_t *p, expression_t *left) {
     }
     expression_t *res = expression_make_call(p->alloc, function, args);
     if (!res) {
-        ptrarray_destroy_with_items(args, expression_destroy);
         return NULL;
     }
     return res;
@@ -6669,7 +7311,6 @@ static ptrarray(expression_t)* parse_expression_list(parser_t *p, token_type_t s
     }
     bool ok = ptrarray_add(res, arg_expr);
     if (!ok) {
-        expression_destroy(arg_expr);
         goto err;
     }
 
@@ -6687,7 +7328,6 @@ static ptrarray(expression_t)* parse_expression_list(parser_t *p, token_type_t s
 
         bool ok = ptrarray_add(res, arg_expr);
         if (!ok) {
-            expression_destroy(arg_expr);
             goto err;
         }
     }
@@ -6700,7 +7340,6 @@ static ptrarray(expression_t)* parse_expression_list(parser_t *p, token_type_t s
 
     return res;
 err:
-    ptrarray_destroy_with_items(res, expression_destroy);
     return NULL;
 }
 
@@ -6713,7 +7352,6 @@ static expression_t* parse_index_expression(parser_t *p, expression_t *left) {
     }
 
     if (!lexer_expect_current(&p->lexer, TOKEN_RBRACKET)) {
-        expression_destroy(index);
         return NULL;
     }
 
@@ -6721,7 +7359,6 @@ static expression_t* parse_index_expression(parser_t *p, expression_t *left) {
 
     expression_t *res = expression_make_index(p->alloc, left, index);
     if (!res) {
-        expression_destroy(index);
         return NULL;
     }
 
@@ -6759,7 +7396,6 @@ static expression_t* parse_assign_expression(parser_t *p, expression_t *left) {
             src_pos_t pos = source->pos;
             expression_t *new_source = expression_make_infix(p->alloc, op, left_copy, source);
             if (!new_source) {
-                expression_destroy(left_copy);
                 goto err;
             }
             new_source->pos = pos;
@@ -6776,7 +7412,6 @@ static expression_t* parse_assign_expression(parser_t *p, expression_t *left) {
     }
     return res;
 err:
-    expression_destroy(source);
     return NULL;
 }
 
@@ -6790,7 +7425,6 @@ static expression_t* parse_logical_expression(parser_t *p, expression_t *left) {
     }
     expression_t *res = expression_make_logical(p->alloc, op, left, right);
     if (!res) {
-        expression_destroy(right);
         return NULL;
     }
     return res;
@@ -6805,21 +7439,17 @@ static expression_t* parse_ternary_expression(parser_t *p, expression_t *left) {
     }
 
     if (!lexer_expect_current(&p->lexer, TOKEN_COLON)) {
-        expression_destroy(if_true);
         return NULL;
     }
     lexer_next_token(&p->lexer);
 
     expression_t *if_false = parse_expression(p, PRECEDENCE_LOWEST);
     if (!if_false) {
-        expression_destroy(if_true);
         return NULL;
     }
 
     expression_t *res = expression_make_ternary(p->alloc, left, if_true, if_false);
     if (!res) {
-        expression_destroy(if_true);
-        expression_destroy(if_false);
         return NULL;
     }
 
@@ -6827,7 +7457,6 @@ static expression_t* parse_ternary_expression(parser_t *p, expression_t *left) {
 }
 
 static expression_t* parse_incdec_prefix_expression(parser_t *p) {
-    expression_t *source = NULL;
     token_type_t operation_type = p->lexer.cur_token.type;
     src_pos_t pos = p->lexer.cur_token.pos;
 
@@ -6842,41 +7471,31 @@ static expression_t* parse_incdec_prefix_expression(parser_t *p) {
 
     expression_t *one_literal = expression_make_number_literal(p->alloc, 1);
     if (!one_literal) {
-        expression_destroy(dest);
         goto err;
     }
     one_literal->pos = pos;
 
     expression_t *dest_copy = expression_copy(dest);
     if (!dest_copy) {
-        expression_destroy(one_literal);
-        expression_destroy(dest);
         goto err;
     }
 
     expression_t *operation = expression_make_infix(p->alloc, op, dest_copy, one_literal);
     if (!operation) {
-        expression_destroy(dest_copy);
-        expression_destroy(dest);
-        expression_destroy(one_literal);
         goto err;
     }
     operation->pos = pos;
 
     expression_t *res = expression_make_assign(p->alloc, dest, operation, false);
     if (!res) {
-        expression_destroy(dest);
-        expression_destroy(operation);
         goto err;
     }
     return res;
 err:
-    expression_destroy(source);
     return NULL;
 }
 
 static expression_t* parse_incdec_postfix_expression(parser_t *p, expression_t *left) {
-    expression_t *source = NULL;
     token_type_t operation_type = p->lexer.cur_token.type;
     src_pos_t pos = p->lexer.cur_token.pos;
 
@@ -6890,31 +7509,49 @@ static expression_t* parse_incdec_postfix_expression(parser_t *p, expression_t *
 
     expression_t *one_literal = expression_make_number_literal(p->alloc, 1);
     if (!one_literal) {
-        expression_destroy(left_copy);
         goto err;
     }
     one_literal->pos = pos;
 
     expression_t *operation = expression_make_infix(p->alloc, op, left_copy, one_literal);
     if (!operation) {
-        expression_destroy(one_literal);
-        expression_destroy(left_copy);
         goto err;
     }
     operation->pos = pos;
 
     expression_t *res = expression_make_assign(p->alloc, left, operation, true);
     if (!res) {
-        expression_destroy(operation);
         goto err;
     }
 
     return res;
 err:
-    expression_destroy(source);
     return NULL;
 }
 
+static expression_t* parse_yield_expression(parser_t *p) {
+    lexer_next_token(&p->lexer);
+
+    expression_t *value = NULL;
+    if (!lexer_cur_token_is(&p->lexer, TOKEN_SEMICOLON)
+        && !lexer_cur_token_is(&p->lexer, TOKEN_RBRACE)
+        && !lexer_cur_token_is(&p->lexer, TOKEN_RPAREN)
+        && !lexer_cur_token_is(&p->lexer, TOKEN_RBRACKET)
+        && !lexer_cur_token_is(&p->lexer, TOKEN_COMMA)
+        && !lexer_cur_token_is(&p->lexer, TOKEN_EOF)) {
+        value = parse_expression(p, PRECEDENCE_LOWEST);
+        if (!value) {
+            return NULL;
+        }
+    }
+
+    expression_t *res = expression_make_yield(p->alloc, value);
+    if (!res) {
+        return NULL;
+    }
+    return res;
+}
+
 
 static expression_t* parse_dot_expression(parser_t *p, expression_t *left) {
     lexer_next_token(&p->lexer);
@@ -6935,7 +7572,6 @@ static expression_t* parse_dot_expression(parser_t *p, expression_t *left) {
 
     expression_t *res = expression_make_index(p->alloc, left, index);
     if (!res) {
-        expression_destroy(index);
         return NULL;
     }
     return res;
@@ -7080,29 +7716,22 @@ static expression_t* wrap_expression_in_function_call(allocator_t *alloc, expres
 
     expression_t *function_ident_expr = expression_make_ident(alloc, ident);;
     if (!function_ident_expr) {
-        ident_destroy(ident);
         return NULL;
     }
     function_ident_expr->pos = expr->pos;
-    ident = NULL;
 
     ptrarray(expression_t) *args = ptrarray_make(alloc);
     if (!args) {
-        expression_destroy(function_ident_expr);
         return NULL;
     }
 
     bool ok = ptrarray_add(args, expr);
     if (!ok) {
-        ptrarray_destroy(args);
-        expression_destroy(function_ident_expr);
         return NULL;
     }
 
     expression_t *call_expr = expression_make_call(alloc, function_ident_expr, args);
     if (!call_expr) {
-        ptrarray_destroy(args);
-        expression_destroy(function_ident_expr);
         return NULL;
     }
     call_expr->pos = expr->pos;
@@ -7151,6 +7780,8 @@ global_store_t *global_store_make(allocator_t *alloc, gcmem_t *mem) {
             if (!ok) {
                 goto err;
             }
+            symbol_t *symbol = dict_get(store->symbols, name);
+            symbol->shadowable = builtins_is_shadowable(i);
         }
     }
 
@@ -7169,6 +7800,28 @@ void global_store_destroy(global_store_t *store) {
     allocator_free(store->alloc, store);
 }
 
+global_store_t *global_store_copy(global_store_t *src, allocator_t *alloc) {
+    global_store_t *copy = global_store_make(alloc, NULL);
+    if (!copy) {
+        return NULL;
+    }
+    for (int i = 0; i < dict_count(src->symbols); i++) {
+        const symbol_t *symbol = dict_get_value_at(src->symbols, i);
+        object_t *object = array_get(src->objects, symbol->index);
+        bool ok = global_store_set(copy, symbol->name, *object);
+        if (!ok) {
+            goto err;
+        }
+        symbol_t *symbol_copy = dict_get(copy->symbols, symbol->name);
+        APE_ASSERT(symbol_copy->index == symbol->index);
+        symbol_copy->shadowable = symbol->shadowable;
+    }
+    return copy;
+err:
+    global_store_destroy(copy);
+    return NULL;
+}
+
 const symbol_t* global_store_get_symbol(global_store_t *store, const char *name) {
     return dict_get(store->symbols, name);
 }
@@ -7276,7 +7929,12 @@ void symbol_destroy(symbol_t *symbol) {
 }
 
 symbol_t* symbol_copy(symbol_t *symbol) {
-    return symbol_make(symbol->alloc, symbol->name, symbol->type, symbol->index, symbol->assignable);
+    symbol_t *copy = symbol_make(symbol->alloc, symbol->name, symbol->type, symbol->index, symbol->assignable);
+    if (!copy) {
+        return NULL;
+    }
+    copy->shadowable = symbol->shadowable;
+    return copy;
 }
 
 symbol_table_t *symbol_table_make(allocator_t *alloc, symbol_table_t *outer, global_store_t *global_store, int module_global_offset) {
@@ -7306,6 +7964,11 @@ symbol_table_t *symbol_table_make(allocator_t *alloc, symbol_table_t *outer, glo
         goto err;
     }
 
+    table->replaced_symbols = ptrarray_make(alloc);
+    if (!table->replaced_symbols) {
+        goto err;
+    }
+
     bool ok = symbol_table_push_block_scope(table);
     if (!ok) {
         goto err;
@@ -7328,6 +7991,7 @@ void symbol_table_destroy(symbol_table_t *table) {
     ptrarray_destroy(table->block_scopes);
     ptrarray_destroy_with_items(table->module_global_symbols, symbol_destroy);
     ptrarray_destroy_with_items(table->free_symbols, symbol_destroy);
+    ptrarray_destroy_with_items(table->replaced_symbols, symbol_destroy);
     allocator_t *alloc = table->alloc;
     memset(table, 0, sizeof(symbol_table_t));
     allocator_free(alloc, table);
@@ -7354,6 +8018,10 @@ symbol_table_t* symbol_table_copy(symbol_table_t *table) {
     if (!copy->module_global_symbols) {
         goto err;
     }
+    copy->replaced_symbols = ptrarray_make(table->alloc);
+    if (!copy->replaced_symbols) {
+        goto err;
+    }
     copy->max_num_definitions = table->max_num_definitions;
     copy->module_global_offset = table->module_global_offset;
     return copy;
@@ -7384,7 +8052,7 @@ bool symbol_table_add_module_symbol(symbol_table_t *st, symbol_t *symbol) {
 
 const symbol_t *symbol_table_define(symbol_table_t *table, const char *name, bool assignable) {
     const symbol_t *global_symbol = global_store_get_symbol(table->global_store, name);
-    if (global_symbol) {
+    if (global_symbol && !global_symbol->shadowable) {
         return NULL;
     }
 
@@ -7501,9 +8169,9 @@ const symbol_t *symbol_table_resolve(symbol_table_t *table, const char *name) {
     const symbol_t *symbol = NULL;
     block_scope_t *scope = NULL;
 
-    symbol = global_store_get_symbol(table->global_store, name);
-    if (symbol) {
-        return symbol;
+    const symbol_t *global_symbol = global_store_get_symbol(table->global_store, name);
+    if (global_symbol && !global_symbol->shadowable) {
+        return global_symbol;
     }
 
     for (int i = ptrarray_count(table->block_scopes) - 1; i >= 0; i--) {
@@ -7528,12 +8196,15 @@ const symbol_t *symbol_table_resolve(symbol_table_t *table, const char *name) {
         }
         symbol = symbol_table_define_free(table, symbol);
     }
+    if (!symbol) {
+        return global_symbol;
+    }
     return symbol;
 }
 
 bool symbol_table_symbol_is_defined(symbol_table_t *table, const char *name) { // todo: rename to something more obvious
     const symbol_t *symbol = global_store_get_symbol(table->global_store, name);
-    if (symbol) {
+    if (symbol && !symbol->shadowable) {
         return true;
     }
 
@@ -7598,6 +8269,60 @@ const symbol_t * symbol_table_get_module_global_symbol_at(const symbol_table_t *
     return ptrarray_get(table->module_global_symbols, ix);
 }
 
+symbol_table_checkpoint_t symbol_table_make_checkpoint(symbol_table_t *table) {
+    APE_ASSERT(symbol_table_is_top_block_scope(table));
+    symbol_table_commit(table);
+    block_scope_t *top_scope = ptrarray_top(table->block_scopes);
+    symbol_table_checkpoint_t checkpoint;
+    checkpoint.symbols_count = dict_count(top_scope->store);
+    checkpoint.num_definitions = top_scope->num_definitions;
+    checkpoint.free_symbols_count = ptrarray_count(table->free_symbols);
+    checkpoint.module_global_symbols_count = ptrarray_count(table->module_global_symbols);
+    checkpoint.max_num_definitions = table->max_num_definitions;
+    table->has_checkpoint = true;
+    return checkpoint;
+}
+
+void symbol_table_rollback(symbol_table_t *table, const symbol_table_checkpoint_t *checkpoint) {
+    APE_ASSERT(table->has_checkpoint);
+    while (ptrarray_count(table->block_scopes) > 1) {
+        symbol_table_pop_block_scope(table);
+    }
+    block_scope_t *top_scope = ptrarray_top(table->block_scopes);
+
+    // restoring in reverse order leaves symbols defined before checkpoint in their original state
+    while (ptrarray_count(table->replaced_symbols) > 0) {
+        symbol_t *replaced = ptrarray_pop(table->replaced_symbols);
+        symbol_t *current = dict_get(top_scope->store, replaced->name);
+        symbol_destroy(current);
+        dict_set(top_scope->store, replaced->name, replaced); // key exists so it can't fail
+    }
+
+    // dict_remove doesn't reorder items when last one is removed
+    while (dict_count(top_scope->store) > checkpoint->symbols_count) {
+        int last_ix = dict_count(top_scope->store) - 1;
+        symbol_t *symbol = dict_get_value_at(top_scope->store, last_ix);
+        dict_remove(top_scope->store, symbol->name);
+        symbol_destroy(symbol);
+    }
+
+    while (ptrarray_count(table->free_symbols) > checkpoint->free_symbols_count) {
+        symbol_destroy(ptrarray_pop(table->free_symbols));
+    }
+    while (ptrarray_count(table->module_global_symbols) > checkpoint->module_global_symbols_count) {
+        symbol_destroy(ptrarray_pop(table->module_global_symbols));
+    }
+
+    top_scope->num_definitions = checkpoint->num_definitions;
+    table->max_num_definitions = checkpoint->max_num_definitions;
+    table->has_checkpoint = false;
+}
+
+void symbol_table_commit(symbol_table_t *table) {
+    ptrarray_clear_and_destroy_items(table->replaced_symbols, symbol_destroy);
+    table->has_checkpoint = false;
+}
+
 // INTERNAL
 static block_scope_t* block_scope_make(allocator_t *alloc, int offset) {
     block_scope_t *new_scope = allocator_malloc(alloc, sizeof(block_scope_t));
@@ -7641,7 +8366,12 @@ static block_scope_t* block_scope_copy(block_scope_t *scope) {
 static bool set_symbol(symbol_table_t *table, symbol_t *symbol) {
     block_scope_t *top_scope = ptrarray_top(table->block_scopes);
     symbol_t *existing = dict_get(top_scope->store, symbol->name);
-    if (existing) {
+    if (existing && table->has_checkpoint && symbol_table_is_top_block_scope(table)) {
+        bool ok = ptrarray_add(table->replaced_symbols, existing);
+        if (!ok) {
+            return false;
+        }
+    } else if (existing) {
         symbol_destroy(existing);
     }
     return dict_set(top_scope->store, symbol->name, symbol);
@@ -7664,6 +8394,7 @@ static int count_num_definitions(symbol_table_t *table) {
 //FILE_END
 //FILE_START:code.c
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef APE_AMALGAMATED
 #include "code.h"
@@ -7725,6 +8456,17 @@ static opcode_definition_t g_definitions[OPCODE_MAX + 1] = {
     {"AND", 0, {0}},
     {"LSHIFT", 0, {0}},
     {"RSHIFT", 0, {0}},
+    {"YIELD", 0, {0}},
+    {"FOREACH_NEXT", 1, {2}},
+    {"FOREACH_RANGE_INIT", 1, {1}},
+    {"FOREACH_RANGE_NEXT", 1, {2}},
+    {"ADD_NUMBER", 0, {0}},
+    {"SUB_NUMBER", 0, {0}},
+    {"MUL_NUMBER", 0, {0}},
+    {"DIV_NUMBER", 0, {0}},
+    {"MOD_NUMBER", 0, {0}},
+    {"COMPARE_NUMBER", 0, {0}},
+    {"COMPARE_EQ_NUMBER", 0, {0}},
     {"INVALID_MAX", 0, {0}},
 };
 
@@ -7742,6 +8484,32 @@ const char *opcode_get_name(opcode_t op) {
     return g_definitions[op].name;
 }
 
+opcode_t opcode_get_quickened(opcode_t op) {
+    switch (op) {
+        case OPCODE_ADD:        return OPCODE_ADD_NUMBER;
+        case OPCODE_SUB:        return OPCODE_SUB_NUMBER;
+        case OPCODE_MUL:        return OPCODE_MUL_NUMBER;
+        case OPCODE_DIV:        return OPCODE_DIV_NUMBER;
+        case OPCODE_MOD:        return OPCODE_MOD_NUMBER;
+        case OPCODE_COMPARE:    return OPCODE_COMPARE_NUMBER;
+        case OPCODE_COMPARE_EQ: return OPCODE_COMPARE_EQ_NUMBER;
+        default:                return OPCODE_NONE;
+    }
+}
+
+opcode_t opcode_get_generic(opcode_t op) {
+    switch (op) {
+        case OPCODE_ADD_NUMBER:        return OPCODE_ADD;
+        case OPCODE_SUB_NUMBER:        return OPCODE_SUB;
+        case OPCODE_MUL_NUMBER:        return OPCODE_MUL;
+        case OPCODE_DIV_NUMBER:        return OPCODE_DIV;
+        case OPCODE_MOD_NUMBER:        return OPCODE_MOD;
+        case OPCODE_COMPARE_NUMBER:    return OPCODE_COMPARE;
+        case OPCODE_COMPARE_EQ_NUMBER: return OPCODE_COMPARE_EQ;
+        default:                       return op;
+    }
+}
+
 int code_make(opcode_t op, int operands_count, uint64_t *operands, array(uint8_t) *res) {
     opcode_definition_t *def = opcode_lookup(op);
     if (!def) {
@@ -7809,14 +8577,14 @@ int code_make(opcode_t op, int operands_count, uint64_t *operands, array(uint8_t
     return instr_len;
 }
 
-void code_to_string(uint8_t *code, src_pos_t *source_positions, size_t code_size, strbuf_t *res) {
+void code_to_string(uint8_t *code, const uint8_t *src_positions, int src_positions_size, size_t code_size, strbuf_t *res) {
     unsigned pos = 0;
     while (pos < code_size) {
         uint8_t op = code[pos];
         opcode_definition_t *def = opcode_lookup(op);
         APE_ASSERT(def);
-        if (source_positions) {
-            src_pos_t src_pos = source_positions[pos];
+        if (src_positions) {
+            src_pos_t src_pos = code_find_src_pos(src_positions, src_positions_size, pos);
             strbuf_appendf(res, "%d:%-4d\t%04d\t%s", src_pos.line, src_pos.column, pos, def->name);
         } else {
             strbuf_appendf(res, "%04d %s", pos, def->name);
@@ -7843,6 +8611,179 @@ void code_to_string(uint8_t *code, src_pos_t *source_positions, size_t code_size
     return;
 }
 
+static bool append_varint(array(uint8_t) *buf, uint64_t val) {
+    do {
+        uint8_t byte = val & 0x7f;
+        val >>= 7;
+        if (val) {
+            byte |= 0x80;
+        }
+        bool ok = array_add(buf, &byte);
+        if (!ok) {
+            return false;
+        }
+    } while (val);
+    return true;
+}
+
+static uint64_t read_varint(const uint8_t *data, int *offset) {
+    uint64_t res = 0;
+    int shift = 0;
+    uint8_t byte = 0;
+    do {
+        byte = data[*offset];
+        (*offset)++;
+        res |= (uint64_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return res;
+}
+
+#define ZIGZAG_ENCODE(x) (((uint64_t)(x) << 1) ^ (uint64_t)((int64_t)(x) >> 63))
+#define ZIGZAG_DECODE(x) ((int64_t)((x) >> 1) ^ -(int64_t)((x) & 1))
+
+static const inline_frame_t g_no_inline_frame = { NULL, { NULL, -1, -1 } };
+
+static bool append_file(array(uint8_t) *src_positions, const compiled_file_t *file) {
+    const uint8_t *file_bytes = (const uint8_t*)&file;
+    for (size_t i = 0; i < sizeof(file); i++) {
+        bool ok = array_add(src_positions, &file_bytes[i]);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool inline_frame_equals(const inline_frame_t *a, const inline_frame_t *b) {
+    a = a ? a : &g_no_inline_frame;
+    b = b ? b : &g_no_inline_frame;
+    if (!a->function_name || !b->function_name) {
+        return a->function_name == b->function_name;
+    }
+    return APE_STREQ(a->function_name, b->function_name)
+        && a->call_pos.file == b->call_pos.file
+        && a->call_pos.line == b->call_pos.line
+        && a->call_pos.column == b->call_pos.column;
+}
+
+bool code_add_src_pos(array(uint8_t) *src_positions, int ip_delta, src_pos_t pos, src_pos_t prev_pos,
+                      const inline_frame_t *inline_frame, const inline_frame_t *prev_inline_frame) {
+    // lowest bit of ip delta marks that file pointer follows, second one that inline frame follows
+    bool file_changed = pos.file != prev_pos.file;
+    bool inline_frame_changed = !inline_frame_equals(inline_frame, prev_inline_frame);
+    bool ok = append_varint(src_positions, ((uint64_t)ip_delta << 2) | (inline_frame_changed << 1) | file_changed);
+    if (!ok) {
+        return false;
+    }
+    if (file_changed) {
+        ok = append_file(src_positions, pos.file);
+        if (!ok) {
+            return false;
+        }
+    }
+    ok = append_varint(src_positions, ZIGZAG_ENCODE((int64_t)pos.line - prev_pos.line));
+    if (!ok) {
+        return false;
+    }
+    ok = append_varint(src_positions, ZIGZAG_ENCODE((int64_t)pos.column - prev_pos.column));
+    if (!ok) {
+        return false;
+    }
+    if (inline_frame_changed) {
+        // null terminated function name (empty if there's no inline frame), followed by call position
+        const char *name = inline_frame && inline_frame->function_name ? inline_frame->function_name : "";
+        for (size_t i = 0; i <= strlen(name); i++) {
+            ok = array_add(src_positions, &name[i]);
+            if (!ok) {
+                return false;
+            }
+        }
+        if (name[0] != '\0') {
+            ok = append_file(src_positions, inline_frame->call_pos.file);
+            if (!ok) {
+                return false;
+            }
+            ok = append_varint(src_positions, ZIGZAG_ENCODE((int64_t)inline_frame->call_pos.line));
+            if (!ok) {
+                return false;
+            }
+            ok = append_varint(src_positions, ZIGZAG_ENCODE((int64_t)inline_frame->call_pos.column));
+            if (!ok) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+src_pos_t code_find_src_pos(const uint8_t *src_positions, int src_positions_size, int ip) {
+    src_pos_t res = src_pos_invalid;
+    src_pos_t pos = src_pos_invalid;
+    int entry_ip = 0;
+    int offset = 0;
+    while (code_read_src_pos(src_positions, src_positions_size, &offset, &entry_ip, &pos, NULL)) {
+        if (entry_ip > ip) {
+            break;
+        }
+        res = pos;
+    }
+    return res;
+}
+
+inline_frame_t code_find_inline_frame(const uint8_t *src_positions, int src_positions_size, int ip) {
+    inline_frame_t res = g_no_inline_frame;
+    inline_frame_t inline_frame = g_no_inline_frame;
+    src_pos_t pos = src_pos_invalid;
+    int entry_ip = 0;
+    int offset = 0;
+    while (code_read_src_pos(src_positions, src_positions_size, &offset, &entry_ip, &pos, &inline_frame)) {
+        if (entry_ip > ip) {
+            break;
+        }
+        res = inline_frame;
+    }
+    return res;
+}
+
+bool code_read_src_pos(const uint8_t *src_positions, int src_positions_size, int *offset, int *ip, src_pos_t *pos,
+                       inline_frame_t *inline_frame) {
+    if (*offset >= src_positions_size) {
+        return false;
+    }
+    uint64_t ip_delta = read_varint(src_positions, offset);
+    *ip += (int)(ip_delta >> 2);
+    if (ip_delta & 1) {
+        memcpy(&pos->file, src_positions + *offset, sizeof(pos->file));
+        *offset += sizeof(pos->file);
+    }
+    uint64_t line_delta = read_varint(src_positions, offset);
+    uint64_t column_delta = read_varint(src_positions, offset);
+    pos->line += (int)ZIGZAG_DECODE(line_delta);
+    pos->column += (int)ZIGZAG_DECODE(column_delta);
+    if (ip_delta & 2) {
+        const char *name = (const char*)src_positions + *offset;
+        *offset += (int)strlen(name) + 1;
+        inline_frame_t frame = g_no_inline_frame;
+        if (name[0] != '\0') {
+            frame.function_name = name;
+            memcpy(&frame.call_pos.file, src_positions + *offset, sizeof(frame.call_pos.file));
+            *offset += sizeof(frame.call_pos.file);
+            uint64_t call_line = read_varint(src_positions, offset);
+            uint64_t call_column = read_varint(src_positions, offset);
+            frame.call_pos.line = (int)ZIGZAG_DECODE(call_line);
+            frame.call_pos.column = (int)ZIGZAG_DECODE(call_column);
+        }
+        if (inline_frame) {
+            *inline_frame = frame;
+        }
+    }
+    return true;
+}
+
+#undef ZIGZAG_ENCODE
+#undef ZIGZAG_DECODE
+
 bool code_read_operands(opcode_definition_t *def, uint8_t *instr, uint64_t out_operands[2]) {
     int offset = 0;
     for (int i = 0; i < def->num_operands; i++) {
@@ -7908,10 +8849,13 @@ compilation_scope_t *compilation_scope_make(allocator_t *alloc, compilation_scop
     if (!scope->bytecode) {
         goto err;
     }
-    scope->src_positions = array_make(alloc, src_pos_t);
+    scope->src_positions = array_make(alloc, uint8_t);
     if (!scope->src_positions) {
         goto err;
     }
+    scope->last_src_ip = 0;
+    scope->last_src_pos = src_pos_invalid;
+    memset(&scope->last_inline_frame, 0, sizeof(inline_frame_t));
     scope->break_ip_stack = array_make(alloc, int);
     if (!scope->break_ip_stack) {
         goto err;
@@ -7934,20 +8878,50 @@ void compilation_scope_destroy(compilation_scope_t *scope) {
     allocator_free(scope->alloc, scope);
 }
 
+bool compilation_scope_add_src_pos(compilation_scope_t *scope, int ip, src_pos_t pos, const inline_frame_t *inline_frame) {
+    const src_pos_t *last = &scope->last_src_pos;
+    if (pos.file == last->file && pos.line == last->line && pos.column == last->column
+        && inline_frame_equals(inline_frame, &scope->last_inline_frame)) {
+        return true;
+    }
+    bool ok = code_add_src_pos(scope->src_positions, ip - scope->last_src_ip, pos, *last, inline_frame, &scope->last_inline_frame);
+    if (!ok) {
+        return false;
+    }
+    scope->last_src_ip = ip;
+    scope->last_src_pos = pos;
+    scope->last_inline_frame = *inline_frame;
+    return true;
+}
+
+void compilation_scope_clear(compilation_scope_t *scope) {
+    array_clear(scope->bytecode);
+    array_clear(scope->src_positions);
+    array_clear(scope->break_ip_stack);
+    array_clear(scope->continue_ip_stack);
+    scope->last_src_ip = 0;
+    scope->last_src_pos = src_pos_invalid;
+    memset(&scope->last_inline_frame, 0, sizeof(inline_frame_t));
+}
+
 compilation_result_t* compilation_scope_orphan_result(compilation_scope_t *scope) {
     compilation_result_t *res = compilation_result_make(scope->alloc,
                                                         array_data(scope->bytecode),
                                                         array_data(scope->src_positions),
+                                                        array_count(scope->src_positions),
                                                         array_count(scope->bytecode));
     if (!res) {
         return NULL;
     }
     array_orphan_data(scope->bytecode);
     array_orphan_data(scope->src_positions);
+    scope->last_src_ip = 0;
+    scope->last_src_pos = src_pos_invalid;
+    memset(&scope->last_inline_frame, 0, sizeof(inline_frame_t));
     return res;
 }
 
-compilation_result_t* compilation_result_make(allocator_t *alloc, uint8_t *bytecode, src_pos_t *src_positions, int count) {
+compilation_result_t* compilation_result_make(allocator_t *alloc, uint8_t *bytecode, uint8_t *src_positions, int src_positions_size, int count) {
     compilation_result_t *res = allocator_malloc(alloc, sizeof(compilation_result_t));
     if (!res) {
         return NULL;
@@ -7956,16 +8930,54 @@ compilation_result_t* compilation_result_make(allocator_t *alloc, uint8_t *bytec
     res->alloc = alloc;
     res->bytecode = bytecode;
     res->src_positions = src_positions;
+    res->src_positions_size = src_positions_size;
     res->count = count;
+    res->dequickened = allocator_malloc(alloc, count / 8 + 1);
+    if (!res->dequickened) {
+        allocator_free(alloc, res);
+        return NULL;
+    }
+    memset(res->dequickened, 0, count / 8 + 1);
     return res;
 }
 
+compilation_result_t* compilation_result_copy(allocator_t *alloc, const compilation_result_t *res) {
+    uint8_t *bytecode_copy = NULL;
+    uint8_t *src_positions_copy = NULL;
+    compilation_result_t *copy = NULL;
+
+    bytecode_copy = allocator_malloc(alloc, sizeof(uint8_t) * res->count);
+    if (!bytecode_copy) {
+        goto err;
+    }
+    memcpy(bytecode_copy, res->bytecode, sizeof(uint8_t) * res->count);
+
+    if (res->src_positions) {
+        src_positions_copy = allocator_malloc(alloc, res->src_positions_size);
+        if (!src_positions_copy) {
+            goto err;
+        }
+        memcpy(src_positions_copy, res->src_positions, res->src_positions_size);
+    }
+
+    copy = compilation_result_make(alloc, bytecode_copy, src_positions_copy, res->src_positions_size, res->count);
+    if (!copy) {
+        goto err;
+    }
+    return copy;
+err:
+    allocator_free(alloc, src_positions_copy);
+    allocator_free(alloc, bytecode_copy);
+    return NULL;
+}
+
 void compilation_result_destroy(compilation_result_t *res) {
     if (!res) {
         return;
     }
     allocator_free(res->alloc, res->bytecode);
     allocator_free(res->alloc, res->src_positions);
+    allocator_free(res->alloc, res->dequickened);
     allocator_free(res->alloc, res);
 }
 //FILE_END
@@ -7974,9 +8986,62 @@ void compilation_result_destroy(compilation_result_t *res) {
 #include "optimisation.h"
 #endif
 
+// scopes map names of symbols to values of constants they're bound to,
+// symbols that aren't constant are mapped to NOT_CONSTANT so they can shadow outer constants
+typedef struct optimiser {
+    allocator_t *alloc;
+    ptrarray(dict(expression_t)) *scopes;
+} optimiser_t;
+
+static char g_not_constant;
+#define NOT_CONSTANT ((void*)&g_not_constant)
+
 static expression_t* optimise_infix_expression(expression_t* expr);
 static expression_t* optimise_prefix_expression(expression_t* expr);
 
+static bool optimise_statements_in_scope(optimiser_t *opt, ptrarray(statement_t) *statements);
+static bool optimise_statements_list(optimiser_t *opt, ptrarray(statement_t) *statements);
+static bool optimise_statement(optimiser_t *opt, statement_t *stmt);
+static bool optimise_expression_in_place(optimiser_t *opt, expression_t **expr_ptr);
+static bool optimise_expressions_in_place(optimiser_t *opt, ptrarray(expression_t) *exprs);
+
+static bool optimiser_push_scope(optimiser_t *opt);
+static void optimiser_pop_scope(optimiser_t *opt);
+static bool optimiser_define_symbol(optimiser_t *opt, const char *name, expression_t *value);
+static expression_t* optimiser_resolve_constant(optimiser_t *opt, const char *name);
+static bool optimiser_is_constant_literal(const expression_t *expr);
+
+// bytecode is decoded into a list of instructions that are rewritten in place (or marked as removed)
+// and then encoded again with remapped ip operands and source positions
+typedef struct peephole_instr {
+    int ip; // in original bytecode
+    int new_ip;
+    opcode_t op;
+    uint64_t operands[2];
+    src_pos_t pos;
+    inline_frame_t inline_frame; // name points into src positions of compilation result
+    bool removed;
+} peephole_instr_t;
+
+typedef struct peephole {
+    allocator_t *alloc;
+    int code_size;
+    peephole_instr_t *instrs;
+    int count;
+    int *ip_to_instr; // -1 for ips that aren't at instruction start
+    bool *is_target;
+} peephole_t;
+
+static bool peephole_decode(peephole_t *ph, const compilation_result_t *res);
+static bool peephole_mark_targets(peephole_t *ph);
+static void peephole_thread_jumps(peephole_t *ph);
+static bool peephole_combine(peephole_t *ph, bool preserve_last_popped);
+static bool peephole_encode(peephole_t *ph, compilation_result_t *res);
+static int peephole_next(const peephole_t *ph, int ix);
+static bool peephole_has_ip_operand(opcode_t op);
+static bool peephole_is_pure_push(opcode_t op);
+static opcode_t peephole_load_for_store(opcode_t op);
+
 expression_t* optimise_expression(expression_t* expr) {
     switch (expr->type) {
         case EXPRESSION_INFIX: return optimise_infix_expression(expr);
@@ -7985,17 +9050,62 @@ expression_t* optimise_expression(expression_t* expr) {
     }
 }
 
-// INTERNAL
-static expression_t* optimise_infix_expression(expression_t* expr) {
-    expression_t *left = expr->infix.left;
-    expression_t *left_optimised = optimise_expression(left);
-    if (left_optimised) {
-        left = left_optimised;
+bool optimise_statements(allocator_t *alloc, ptrarray(statement_t) *statements) {
+    optimiser_t opt;
+    opt.alloc = alloc;
+    opt.scopes = ptrarray_make(alloc);
+    if (!opt.scopes) {
+        return false;
     }
+    bool ok = optimise_statements_in_scope(&opt, statements);
+    ptrarray_destroy(opt.scopes);
+    return ok;
+}
 
-    expression_t *right = expr->infix.right;
-    expression_t *right_optimised = optimise_expression(right);
-    if (right_optimised) {
+bool optimise_bytecode(compilation_result_t *res, bool preserve_last_popped) {
+    if (res->count == 0) {
+        return true;
+    }
+
+    peephole_t ph;
+    memset(&ph, 0, sizeof(peephole_t));
+    ph.alloc = res->alloc;
+    ph.code_size = res->count;
+
+    bool ok = peephole_decode(&ph, res);
+    if (!ok) {
+        goto end;
+    }
+
+    if (!peephole_mark_targets(&ph)) {
+        // ip operand not pointing at an instruction, leave bytecode as it is
+        goto end;
+    }
+    peephole_thread_jumps(&ph);
+    peephole_mark_targets(&ph);
+
+    while (peephole_combine(&ph, preserve_last_popped)) {
+    }
+
+    ok = peephole_encode(&ph, res);
+end:
+    allocator_free(ph.alloc, ph.instrs);
+    allocator_free(ph.alloc, ph.ip_to_instr);
+    allocator_free(ph.alloc, ph.is_target);
+    return ok;
+}
+
+// INTERNAL
+static expression_t* optimise_infix_expression(expression_t* expr) {
+    expression_t *left = expr->infix.left;
+    expression_t *left_optimised = optimise_expression(left);
+    if (left_optimised) {
+        left = left_optimised;
+    }
+
+    expression_t *right = expr->infix.right;
+    expression_t *right_optimised = optimise_expression(right);
+    if (right_optimised) {
         right = right_optimised;
     }
 
@@ -8046,9 +9156,6 @@ static expression_t* optimise_infix_expression(expression_t* expr) {
         }
     }
 
-    expression_destroy(left_optimised);
-    expression_destroy(right_optimised);
-
     if (res) {
         res->pos = expr->pos;
     }
@@ -8068,979 +9175,1807 @@ expression_t* optimise_prefix_expression(expression_t* expr) {
     } else if (expr->prefix.op == OPERATOR_BANG && right->type == EXPRESSION_BOOL_LITERAL) {
         res = expression_make_bool_literal(expr->alloc, !right->bool_literal);
     }
-    expression_destroy(right_optimised);
     if (res) {
         res->pos = expr->pos;
     }
     return res;
 }
-//FILE_END
-//FILE_START:compiler.c
-#include <stdlib.h>
-#include <math.h>
-
-#ifndef APE_AMALGAMATED
-#include "compiler.h"
-
-#include "ape.h"
-#include "ast.h"
-#include "object.h"
-#include "gc.h"
-#include "code.h"
-#include "symbol_table.h"
-#include "errors.h"
-#include "optimisation.h"
-#endif
-
-typedef struct module {
-    allocator_t *alloc;
-    char *name;
-    ptrarray(symbol_t) *symbols;
-} module_t;
-
-typedef struct file_scope {
-    allocator_t *alloc;
-    parser_t *parser;
-    symbol_table_t *symbol_table;
-    compiled_file_t *file;
-    ptrarray(char) *loaded_module_names;
-} file_scope_t;
-
-typedef struct compiler {
-    allocator_t *alloc;
-    const ape_config_t *config;
-    gcmem_t *mem;
-    errors_t *errors;
-    ptrarray(compiled_file_t) *files;
-    global_store_t *global_store;
-    array(object_t) *constants;
-    compilation_scope_t *compilation_scope;
-    ptrarray(file_scope_t) *file_scopes;
-    array(src_pos_t) *src_positions_stack;
-    dict(module_t) *modules;
-    dict(int) *string_constants_positions;
-} compiler_t;
-
-static bool compiler_init(compiler_t *comp,
-                          allocator_t *alloc,
-                          const ape_config_t *config,
-                          gcmem_t *mem, errors_t *errors,
-                          ptrarray(compiled_file_t) *files,
-                          global_store_t *global_store);
-static void compiler_deinit(compiler_t *comp);
-
-static bool compiler_init_shallow_copy(compiler_t *copy, compiler_t *src); // used to restore compiler's state if something fails
-
-static int emit(compiler_t *comp, opcode_t op, int operands_count, uint64_t *operands);
-static compilation_scope_t* get_compilation_scope(compiler_t *comp);
-static bool push_compilation_scope(compiler_t *comp);
-static void pop_compilation_scope(compiler_t *comp);
-static bool push_symbol_table(compiler_t *comp, int global_offset);
-static void pop_symbol_table(compiler_t *comp);
-static opcode_t get_last_opcode(compiler_t *comp);
-static bool compile_code(compiler_t *comp, const char *code);
-static bool compile_statements(compiler_t *comp, ptrarray(statement_t) *statements);
-static bool import_module(compiler_t *comp, const statement_t *import_stmt);
-static bool compile_statement(compiler_t *comp, const statement_t *stmt);
-static bool compile_expression(compiler_t *comp, expression_t *expr);
-static bool compile_code_block(compiler_t *comp, const code_block_t *block);
-static int  add_constant(compiler_t *comp, object_t obj);
-static void change_uint16_operand(compiler_t *comp, int ip, uint16_t operand);
-static bool last_opcode_is(compiler_t *comp, opcode_t op);
-static bool read_symbol(compiler_t *comp, const symbol_t *symbol);
-static bool write_symbol(compiler_t *comp, const symbol_t *symbol, bool define);
-
-static bool push_break_ip(compiler_t *comp, int ip);
-static void pop_break_ip(compiler_t *comp);
-static int  get_break_ip(compiler_t *comp);
-
-static bool push_continue_ip(compiler_t *comp, int ip);
-static void pop_continue_ip(compiler_t *comp);
-static int  get_continue_ip(compiler_t *comp);
-
-static int  get_ip(compiler_t *comp);
-
-static array(src_pos_t)* get_src_positions(compiler_t *comp);
-static array(uint8_t)*   get_bytecode(compiler_t *comp);
-
-static file_scope_t* file_scope_make(compiler_t *comp, compiled_file_t *file);
-static void file_scope_destroy(file_scope_t *file_scope);
-static bool push_file_scope(compiler_t *comp, const char *filepath);
-static void pop_file_scope(compiler_t *comp);
-
-static void set_compilation_scope(compiler_t *comp, compilation_scope_t *scope);
-
-static module_t* module_make(allocator_t *alloc, const char *name);
-static void module_destroy(module_t *module);
-static module_t* module_copy(module_t *module);
-static bool module_add_symbol(module_t *module, const symbol_t *symbol);
-
-static const char* get_module_name(const char *path);
-static const symbol_t* define_symbol(compiler_t *comp, src_pos_t pos, const char *name, bool assignable, bool can_shadow);
 
-compiler_t *compiler_make(allocator_t *alloc, const ape_config_t *config, gcmem_t *mem, errors_t *errors, ptrarray(compiled_file_t) *files, global_store_t *global_store) {
-    compiler_t *comp = allocator_malloc(alloc, sizeof(compiler_t));
-    if (!comp) {
-        return NULL;
-    }
-    bool ok = compiler_init(comp, alloc, config, mem, errors, files, global_store);
+static bool optimise_statements_in_scope(optimiser_t *opt, ptrarray(statement_t) *statements) {
+    bool ok = optimiser_push_scope(opt);
     if (!ok) {
-        allocator_free(alloc, comp);
-        return NULL;
+        return false;
     }
-    return comp;
+    ok = optimise_statements_list(opt, statements);
+    optimiser_pop_scope(opt);
+    return ok;
 }
 
-void compiler_destroy(compiler_t *comp) {
-    if (!comp) {
-        return;
+static bool optimise_statements_list(optimiser_t *opt, ptrarray(statement_t) *statements) {
+    for (int i = 0; i < ptrarray_count(statements); i++) {
+        statement_t *stmt = ptrarray_get(statements, i);
+        bool ok = optimise_statement(opt, stmt);
+        if (!ok) {
+            return false;
+        }
     }
-    allocator_t *alloc = comp->alloc;
-    compiler_deinit(comp);
-    allocator_free(alloc, comp);
+    return true;
 }
 
-compilation_result_t* compiler_compile(compiler_t *comp, const char *code) {
-    compilation_scope_t *compilation_scope = get_compilation_scope(comp);
-
-    APE_ASSERT(array_count(comp->src_positions_stack) == 0);
-    APE_ASSERT(array_count(compilation_scope->bytecode) == 0);
-    APE_ASSERT(array_count(compilation_scope->break_ip_stack) == 0);
-    APE_ASSERT(array_count(compilation_scope->continue_ip_stack) == 0);
-
-    array_clear(comp->src_positions_stack);
-    array_clear(compilation_scope->bytecode);
-    array_clear(compilation_scope->src_positions);
-    array_clear(compilation_scope->break_ip_stack);
-    array_clear(compilation_scope->continue_ip_stack);
-
-    compiler_t comp_shallow_copy;
-    bool ok = compiler_init_shallow_copy(&comp_shallow_copy, comp);
-    if (!ok) {
-        return NULL;
-    }
-
-    ok = compile_code(comp, code);
-    if (!ok) {
-        goto err;
-    }
-
-    compilation_scope = get_compilation_scope(comp); // might've changed
-    APE_ASSERT(compilation_scope->outer == NULL);
-
-    compilation_scope = get_compilation_scope(comp);
-    compilation_result_t *res = compilation_scope_orphan_result(compilation_scope);
-    if (!res) {
-        goto err;
+static bool optimise_statement(optimiser_t *opt, statement_t *stmt) {
+    bool ok = false;
+    switch (stmt->type) {
+        case STATEMENT_DEFINE: {
+            ok = optimise_expression_in_place(opt, &stmt->define.value);
+            if (!ok) {
+                return false;
+            }
+            expression_t *value = NOT_CONSTANT;
+            if (!stmt->define.assignable && optimiser_is_constant_literal(stmt->define.value)) {
+                value = stmt->define.value;
+            }
+            return optimiser_define_symbol(opt, stmt->define.name->value, value);
+        }
+        case STATEMENT_IF: {
+            if_statement_t *if_stmt = &stmt->if_statement;
+            for (int i = 0; i < ptrarray_count(if_stmt->cases); i++) {
+                if_case_t *if_case = ptrarray_get(if_stmt->cases, i);
+                ok = optimise_expression_in_place(opt, &if_case->test);
+                if (!ok) {
+                    return false;
+                }
+                ok = optimise_statements_in_scope(opt, if_case->consequence->statements);
+                if (!ok) {
+                    return false;
+                }
+            }
+            if (if_stmt->alternative) {
+                return optimise_statements_in_scope(opt, if_stmt->alternative->statements);
+            }
+            return true;
+        }
+        case STATEMENT_RETURN_VALUE: {
+            return optimise_expression_in_place(opt, &stmt->return_value);
+        }
+        case STATEMENT_EXPRESSION: {
+            return optimise_expression_in_place(opt, &stmt->expression);
+        }
+        case STATEMENT_WHILE_LOOP: {
+            ok = optimise_expression_in_place(opt, &stmt->while_loop.test);
+            if (!ok) {
+                return false;
+            }
+            return optimise_statements_in_scope(opt, stmt->while_loop.body->statements);
+        }
+        case STATEMENT_FOREACH: {
+            ok = optimise_expression_in_place(opt, &stmt->foreach.source);
+            if (!ok) {
+                return false;
+            }
+            ok = optimiser_push_scope(opt);
+            if (!ok) {
+                return false;
+            }
+            ok = optimiser_define_symbol(opt, stmt->foreach.iterator->value, NOT_CONSTANT);
+            if (ok) {
+                ok = optimise_statements_list(opt, stmt->foreach.body->statements);
+            }
+            optimiser_pop_scope(opt);
+            return ok;
+        }
+        case STATEMENT_FOR_LOOP: {
+            ok = optimiser_push_scope(opt);
+            if (!ok) {
+                return false;
+            }
+            if (stmt->for_loop.init) {
+                ok = optimise_statement(opt, stmt->for_loop.init);
+            }
+            if (ok) {
+                ok = optimise_expression_in_place(opt, &stmt->for_loop.test);
+            }
+            if (ok) {
+                ok = optimise_expression_in_place(opt, &stmt->for_loop.update);
+            }
+            if (ok) {
+                ok = optimise_statements_in_scope(opt, stmt->for_loop.body->statements);
+            }
+            optimiser_pop_scope(opt);
+            return ok;
+        }
+        case STATEMENT_BLOCK: {
+            return optimise_statements_in_scope(opt, stmt->block->statements);
+        }
+        case STATEMENT_RECOVER: {
+            ok = optimiser_push_scope(opt);
+            if (!ok) {
+                return false;
+            }
+            ok = optimiser_define_symbol(opt, stmt->recover.error_ident->value, NOT_CONSTANT);
+            if (ok) {
+                ok = optimise_statements_list(opt, stmt->recover.body->statements);
+            }
+            optimiser_pop_scope(opt);
+            return ok;
+        }
+        default: {
+            return true;
+        }
     }
-    compiler_deinit(&comp_shallow_copy);
-    return res;
-err:
-    compiler_deinit(comp);
-    *comp = comp_shallow_copy;
-    return NULL;
 }
 
-compilation_result_t* compiler_compile_file(compiler_t *comp, const char *path) {
-    char *code = NULL;
-    compiled_file_t *file = NULL;
-    compilation_result_t *res = NULL;
-
-    if (!comp->config->fileio.read_file.read_file) { // todo: read code function
-        errors_add_error(comp->errors, ERROR_COMPILATION, src_pos_invalid, "File read function not configured");
-        goto err;
-    }
-
-    code = comp->config->fileio.read_file.read_file(comp->config->fileio.read_file.context, path);
-    if (!code) {
-        errors_add_errorf(comp->errors, ERROR_COMPILATION, src_pos_invalid, "Reading file \"%s\" failed", path);
-        goto err;
+static bool optimise_expression_in_place(optimiser_t *opt, expression_t **expr_ptr) {
+    expression_t *expr = *expr_ptr;
+    if (!expr) {
+        return true;
     }
+    bool ok = false;
+    switch (expr->type) {
+        case EXPRESSION_IDENT: {
+            expression_t *value = optimiser_resolve_constant(opt, expr->ident->value);
+            if (!value) {
+                return true;
+            }
+            expression_t *value_copy = expression_copy(value);
+            if (!value_copy) {
+                return false;
+            }
+            value_copy->pos = expr->pos;
+            *expr_ptr = value_copy;
+            return true;
+        }
+        case EXPRESSION_ARRAY_LITERAL: {
+            return optimise_expressions_in_place(opt, expr->array);
+        }
+        case EXPRESSION_MAP_LITERAL: {
+            ok = optimise_expressions_in_place(opt, expr->map.keys);
+            if (!ok) {
+                return false;
+            }
+            return optimise_expressions_in_place(opt, expr->map.values);
+        }
+        case EXPRESSION_PREFIX:
+        case EXPRESSION_INFIX: {
+            if (expr->type == EXPRESSION_PREFIX) {
+                ok = optimise_expression_in_place(opt, &expr->prefix.right);
+            } else {
+                ok = optimise_expression_in_place(opt, &expr->infix.left);
+                if (ok) {
+                    ok = optimise_expression_in_place(opt, &expr->infix.right);
+                }
+            }
+            if (!ok) {
+                return false;
+            }
+            expression_t *folded = optimise_expression(expr);
+            if (folded) {
+                *expr_ptr = folded;
+            }
+            return true;
+        }
+        case EXPRESSION_FUNCTION_LITERAL: {
+            fn_literal_t *fn = &expr->fn_literal;
+            ok = optimiser_push_scope(opt);
+            if (!ok) {
+                return false;
+            }
+            if (fn->name) {
+                ok = optimiser_define_symbol(opt, fn->name, NOT_CONSTANT);
+            }
+            for (int i = 0; ok && i < ptrarray_count(fn->params); i++) {
+                ident_t *param = ptrarray_get(fn->params, i);
+                ok = optimiser_define_symbol(opt, param->value, NOT_CONSTANT);
+            }
+            if (ok) {
+                ok = optimise_statements_in_scope(opt, fn->body->statements);
+            }
+            optimiser_pop_scope(opt);
+            return ok;
+        }
+        case EXPRESSION_CALL: {
+            ok = optimise_expression_in_place(opt, &expr->call_expr.function);
+            if (!ok) {
+                return false;
+            }
+            return optimise_expressions_in_place(opt, expr->call_expr.args);
+        }
+        case EXPRESSION_INDEX: {
+            ok = optimise_expression_in_place(opt, &expr->index_expr.left);
+            if (!ok) {
+                return false;
+            }
+            return optimise_expression_in_place(opt, &expr->index_expr.index);
+        }
+        case EXPRESSION_ASSIGN: {
+            // assigned identifiers are left alone so assigning to a constant is still an error
+            if (expr->assign.dest->type != EXPRESSION_IDENT) {
+                ok = optimise_expression_in_place(opt, &expr->assign.dest);
+                if (!ok) {
+                    return false;
+                }
+            }
+            return optimise_expression_in_place(opt, &expr->assign.source);
+        }
+        case EXPRESSION_LOGICAL: {
+            logical_expression_t *logi = &expr->logical;
+            ok = optimise_expression_in_place(opt, &logi->left);
+            if (ok) {
+                ok = optimise_expression_in_place(opt, &logi->right);
+            }
+            return ok;
+        }
+        case EXPRESSION_TERNARY: {
+            ternary_expression_t *ternary = &expr->ternary;
+            ok = optimise_expression_in_place(opt, &ternary->test);
+            if (ok) {
+                ok = optimise_expression_in_place(opt, &ternary->if_true);
+            }
+            if (ok) {
+                ok = optimise_expression_in_place(opt, &ternary->if_false);
+            }
+            return ok;
+        }
+        case EXPRESSION_YIELD: {
+            return optimise_expression_in_place(opt, &expr->yield_value);
+        }
+        default: {
+            return true;
+        }
+    }
+}
 
-    file = compiled_file_make(comp->alloc, path);
-    if (!file) {
-        goto err;
+static bool optimise_expressions_in_place(optimiser_t *opt, ptrarray(expression_t) *exprs) {
+    for (int i = 0; i < ptrarray_count(exprs); i++) {
+        expression_t **expr_ptr = ptrarray_get_addr(exprs, i);
+        bool ok = optimise_expression_in_place(opt, expr_ptr);
+        if (!ok) {
+            return false;
+        }
     }
+    return true;
+}
 
-    bool ok = ptrarray_add(comp->files, file);
+static bool optimiser_push_scope(optimiser_t *opt) {
+    dict(expression_t) *scope = dict_make(opt->alloc, NULL, NULL);
+    if (!scope) {
+        return false;
+    }
+    bool ok = ptrarray_push(opt->scopes, scope);
     if (!ok) {
-        compiled_file_destroy(file);
-        goto err;
+        dict_destroy(scope);
+        return false;
     }
+    return true;
+}
 
-    APE_ASSERT(ptrarray_count(comp->file_scopes) == 1);
-    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
-    if (!file_scope) {
-        goto err;
-    }
-    
-    compiled_file_t *prev_file = file_scope->file; // todo: push file scope instead?
-    file_scope->file = file;
+static void optimiser_pop_scope(optimiser_t *opt) {
+    dict(expression_t) *scope = ptrarray_pop(opt->scopes);
+    dict_destroy(scope);
+}
 
-    res = compiler_compile(comp, code);
-    if (!res) {
-        file_scope->file = prev_file;
-        goto err;
-    }
-    file_scope->file = prev_file;
+static bool optimiser_define_symbol(optimiser_t *opt, const char *name, expression_t *value) {
+    dict(expression_t) *scope = ptrarray_top(opt->scopes);
+    return dict_set(scope, name, value);
+}
 
-    allocator_free(comp->alloc, code);
-    return res;
-err:
-    allocator_free(comp->alloc, code);
+static expression_t* optimiser_resolve_constant(optimiser_t *opt, const char *name) {
+    for (int i = ptrarray_count(opt->scopes) - 1; i >= 0; i--) {
+        dict(expression_t) *scope = ptrarray_get(opt->scopes, i);
+        expression_t *value = dict_get(scope, name);
+        if (value) {
+            return value == NOT_CONSTANT ? NULL : value;
+        }
+    }
     return NULL;
 }
 
-symbol_table_t* compiler_get_symbol_table(compiler_t *comp) {
-    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
-    if (!file_scope) {
-        APE_ASSERT(false);
-        return NULL;
+static bool optimiser_is_constant_literal(const expression_t *expr) {
+    return expr->type == EXPRESSION_NUMBER_LITERAL
+        || expr->type == EXPRESSION_STRING_LITERAL
+        || expr->type == EXPRESSION_BOOL_LITERAL;
+}
+
+static bool peephole_decode(peephole_t *ph, const compilation_result_t *res) {
+    ph->instrs = allocator_malloc(ph->alloc, sizeof(peephole_instr_t) * ph->code_size);
+    ph->ip_to_instr = allocator_malloc(ph->alloc, sizeof(int) * (ph->code_size + 1));
+    ph->is_target = allocator_malloc(ph->alloc, sizeof(bool) * (ph->code_size + 1));
+    if (!ph->instrs || !ph->ip_to_instr || !ph->is_target) {
+        return false;
     }
-    return file_scope->symbol_table;
+    for (int i = 0; i <= ph->code_size; i++) {
+        ph->ip_to_instr[i] = -1;
+    }
+
+    src_pos_t pos = src_pos_invalid;
+    src_pos_t entry_pos = src_pos_invalid;
+    inline_frame_t inline_frame = {0};
+    inline_frame_t entry_inline_frame = {0};
+    int entry_ip = 0;
+    int src_offset = 0;
+    bool has_entry = code_read_src_pos(res->src_positions, res->src_positions_size, &src_offset, &entry_ip, &entry_pos, &entry_inline_frame);
+
+    int ip = 0;
+    while (ip < ph->code_size) {
+        opcode_t op = res->bytecode[ip];
+        opcode_definition_t *def = opcode_lookup(op);
+        if (!def) {
+            APE_ASSERT(false);
+            return false;
+        }
+        while (has_entry && entry_ip <= ip) {
+            pos = entry_pos;
+            inline_frame = entry_inline_frame;
+            has_entry = code_read_src_pos(res->src_positions, res->src_positions_size, &src_offset, &entry_ip, &entry_pos, &entry_inline_frame);
+        }
+        peephole_instr_t *instr = &ph->instrs[ph->count];
+        memset(instr, 0, sizeof(peephole_instr_t));
+        instr->ip = ip;
+        instr->op = op;
+        instr->pos = pos;
+        instr->inline_frame = inline_frame;
+        bool ok = code_read_operands(def, res->bytecode + ip + 1, instr->operands);
+        if (!ok) {
+            return false;
+        }
+        ph->ip_to_instr[ip] = ph->count;
+        ph->count++;
+
+        ip++;
+        for (int i = 0; i < def->num_operands; i++) {
+            ip += def->operand_widths[i];
+        }
+    }
+    return true;
 }
 
-void compiler_set_symbol_table(compiler_t *comp, symbol_table_t *table) {
-    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
-    if (!file_scope) {
-        APE_ASSERT(false);
-        return;
+static bool peephole_mark_targets(peephole_t *ph) {
+    memset(ph->is_target, 0, sizeof(bool) * (ph->code_size + 1));
+    for (int i = 0; i < ph->count; i++) {
+        const peephole_instr_t *instr = &ph->instrs[i];
+        if (instr->removed || !peephole_has_ip_operand(instr->op)) {
+            continue;
+        }
+        uint64_t target = instr->operands[0];
+        if (target > (uint64_t)ph->code_size) {
+            return false;
+        }
+        if (target < (uint64_t)ph->code_size && ph->ip_to_instr[target] < 0) {
+            return false;
+        }
+        ph->is_target[target] = true;
     }
-    file_scope->symbol_table = table;
+    return true;
 }
 
-array(object_t)* compiler_get_constants(const compiler_t *comp) {
-    return comp->constants;
+static void peephole_thread_jumps(peephole_t *ph) {
+    for (int i = 0; i < ph->count; i++) {
+        peephole_instr_t *instr = &ph->instrs[i];
+        if (instr->op != OPCODE_JUMP && instr->op != OPCODE_JUMP_IF_FALSE && instr->op != OPCODE_JUMP_IF_TRUE) {
+            continue;
+        }
+        uint64_t target = instr->operands[0];
+        // number of hops is limited so jumps forming a cycle (e.g. in "while (true) {}") terminate
+        for (int hops = 0; hops < ph->count && target < (uint64_t)ph->code_size; hops++) {
+            const peephole_instr_t *target_instr = &ph->instrs[ph->ip_to_instr[target]];
+            if (target_instr->op != OPCODE_JUMP) {
+                break;
+            }
+            target = target_instr->operands[0];
+        }
+        instr->operands[0] = target;
+    }
 }
 
-// INTERNAL
-static bool compiler_init(compiler_t *comp,
-                          allocator_t *alloc,
-                          const ape_config_t *config,
-                          gcmem_t *mem, errors_t *errors,
-                          ptrarray(compiled_file_t) *files,
-                          global_store_t *global_store) {
+// instructions can only be merged with following instructions that aren't jumped to
+static bool peephole_combine(peephole_t *ph, bool preserve_last_popped) {
+    bool changed = false;
+    for (int i = 0; i < ph->count; i++) {
+        peephole_instr_t *a = &ph->instrs[i];
+        if (a->removed) {
+            continue;
+        }
+        int b_ix = peephole_next(ph, i);
+        peephole_instr_t *b = b_ix >= 0 ? &ph->instrs[b_ix] : NULL;
+        int next_ip = b ? b->ip : ph->code_size;
 
-    memset(comp, 0, sizeof(compiler_t));
-    comp->alloc = alloc;
-    comp->config = config;
-    comp->mem = mem;
-    comp->errors = errors;
-    comp->files = files;
-    comp->global_store = global_store;
+        // jump to next instruction
+        if (a->op == OPCODE_JUMP || a->op == OPCODE_JUMP_IF_FALSE || a->op == OPCODE_JUMP_IF_TRUE) {
+            uint64_t target = a->operands[0];
+            if (target > (uint64_t)a->ip && target <= (uint64_t)next_ip) {
+                if (a->op == OPCODE_JUMP) {
+                    a->removed = true;
+                } else {
+                    a->op = OPCODE_POP; // test value still has to be popped
+                }
+                changed = true;
+                continue;
+            }
+        }
 
-    comp->file_scopes = ptrarray_make(alloc);
-    if (!comp->file_scopes) {
-        goto err;
-    }
-    comp->constants = array_make(alloc, object_t);
-    if (!comp->constants) {
-        goto err;
+        if (!b || ph->is_target[b->ip]) {
+            continue;
+        }
+
+        // PUSH, POP
+        if (!preserve_last_popped && peephole_is_pure_push(a->op) && b->op == OPCODE_POP) {
+            a->removed = true;
+            b->removed = true;
+            changed = true;
+            continue;
+        }
+
+        // DUP, STORE, POP -> STORE
+        if (a->op == OPCODE_DUP && peephole_load_for_store(b->op) != OPCODE_NONE) {
+            int c_ix = peephole_next(ph, b_ix);
+            peephole_instr_t *c = c_ix >= 0 ? &ph->instrs[c_ix] : NULL;
+            if (c && c->op == OPCODE_POP && !ph->is_target[c->ip]) {
+                a->removed = true;
+                c->removed = true;
+                changed = true;
+                continue;
+            }
+        }
+
+        // STORE x, LOAD x -> DUP, STORE x
+        opcode_t load_op = peephole_load_for_store(a->op);
+        if (load_op != OPCODE_NONE && b->op == load_op && a->operands[0] == b->operands[0]) {
+            b->op = a->op;
+            b->pos = a->pos;
+            a->op = OPCODE_DUP;
+            changed = true;
+            continue;
+        }
     }
-    comp->src_positions_stack = array_make(alloc, src_pos_t);
-    if (!comp->src_positions_stack) {
-        goto err;
+    return changed;
+}
+
+static bool peephole_encode(peephole_t *ph, compilation_result_t *res) {
+    int new_ip = 0;
+    for (int i = 0; i < ph->count; i++) {
+        peephole_instr_t *instr = &ph->instrs[i];
+        if (instr->removed) {
+            continue;
+        }
+        instr->new_ip = new_ip;
+        opcode_definition_t *def = opcode_lookup(instr->op);
+        new_ip++;
+        for (int j = 0; j < def->num_operands; j++) {
+            new_ip += def->operand_widths[j];
+        }
     }
-    comp->modules = dict_make(alloc, module_copy, module_destroy);
-    if (!comp->modules) {
-        goto err;
+
+    // ips of removed instructions map to the next remaining one
+    int *new_ips = ph->ip_to_instr;
+    new_ips[ph->code_size] = new_ip;
+    for (int i = ph->count - 1; i >= 0; i--) {
+        const peephole_instr_t *instr = &ph->instrs[i];
+        new_ips[instr->ip] = instr->removed ? new_ips[i + 1 < ph->count ? ph->instrs[i + 1].ip : ph->code_size] : instr->new_ip;
     }
-    bool ok = push_compilation_scope(comp);
-    if (!ok) {
+
+    array(uint8_t) *bytecode = array_make_with_capacity(ph->alloc, new_ip, sizeof(uint8_t));
+    array(uint8_t) *src_positions = array_make(ph->alloc, uint8_t);
+    if (!bytecode || !src_positions) {
         goto err;
     }
-    ok = push_file_scope(comp, "none");
-    if (!ok) {
-        goto err;
+
+    int last_src_ip = 0;
+    src_pos_t last_src_pos = src_pos_invalid;
+    inline_frame_t last_inline_frame = {0};
+    for (int i = 0; i < ph->count; i++) {
+        peephole_instr_t *instr = &ph->instrs[i];
+        if (instr->removed) {
+            continue;
+        }
+        if (peephole_has_ip_operand(instr->op)) {
+            instr->operands[0] = new_ips[instr->operands[0]];
+        }
+        src_pos_t pos = instr->pos;
+        if (pos.file != last_src_pos.file || pos.line != last_src_pos.line || pos.column != last_src_pos.column
+            || !inline_frame_equals(&instr->inline_frame, &last_inline_frame)) {
+            bool ok = code_add_src_pos(src_positions, instr->new_ip - last_src_ip, pos, last_src_pos, &instr->inline_frame, &last_inline_frame);
+            if (!ok) {
+                goto err;
+            }
+            last_src_ip = instr->new_ip;
+            last_src_pos = pos;
+            last_inline_frame = instr->inline_frame;
+        }
+        opcode_definition_t *def = opcode_lookup(instr->op);
+        int len = code_make(instr->op, def->num_operands, instr->operands, bytecode);
+        if (len == 0) {
+            goto err;
+        }
     }
-    comp->string_constants_positions = dict_make(comp->alloc, NULL, NULL);
-    if (!comp->string_constants_positions) {
+
+    uint8_t *dequickened = allocator_malloc(res->alloc, array_count(bytecode) / 8 + 1);
+    if (!dequickened) {
         goto err;
     }
+    memset(dequickened, 0, array_count(bytecode) / 8 + 1);
 
+    allocator_free(res->alloc, res->bytecode);
+    allocator_free(res->alloc, res->src_positions);
+    allocator_free(res->alloc, res->dequickened);
+    res->dequickened = dequickened;
+    res->bytecode = array_data(bytecode);
+    res->count = array_count(bytecode);
+    res->src_positions = array_data(src_positions);
+    res->src_positions_size = array_count(src_positions);
+    array_orphan_data(bytecode);
+    array_orphan_data(src_positions);
+    array_destroy(bytecode);
+    array_destroy(src_positions);
     return true;
 err:
-    compiler_deinit(comp);
+    array_destroy(bytecode);
+    array_destroy(src_positions);
     return false;
 }
 
-static void compiler_deinit(compiler_t *comp) {
-    if (!comp) {
-        return;
-    }
-    for (int i = 0; i < dict_count(comp->string_constants_positions); i++) {
-        int *val = dict_get_value_at(comp->string_constants_positions, i);
-        allocator_free(comp->alloc, val);
-    }
-    dict_destroy(comp->string_constants_positions);
-    
-    while (ptrarray_count(comp->file_scopes) > 0) {
-        pop_file_scope(comp);
-    }
-    while (get_compilation_scope(comp)) {
-        pop_compilation_scope(comp);
+static int peephole_next(const peephole_t *ph, int ix) {
+    for (int i = ix + 1; i < ph->count; i++) {
+        if (!ph->instrs[i].removed) {
+            return i;
+        }
     }
-    dict_destroy_with_items(comp->modules);
-    array_destroy(comp->src_positions_stack);
+    return -1;
+}
 
-    array_destroy(comp->constants);
-    ptrarray_destroy(comp->file_scopes);
-    memset(comp, 0, sizeof(compiler_t));
+static bool peephole_has_ip_operand(opcode_t op) {
+    switch (op) {
+        case OPCODE_JUMP:
+        case OPCODE_JUMP_IF_FALSE:
+        case OPCODE_JUMP_IF_TRUE:
+        case OPCODE_SET_RECOVER:
+        case OPCODE_FOREACH_NEXT:
+        case OPCODE_FOREACH_RANGE_NEXT:
+            return true;
+        default:
+            return false;
+    }
 }
 
-static bool compiler_init_shallow_copy(compiler_t *copy, compiler_t *src) {
-    bool ok = compiler_init(copy, src->alloc, src->config, src->mem, src->errors, src->files, src->global_store);
-    if (!ok) {
-        return false;
+static bool peephole_is_pure_push(opcode_t op) {
+    switch (op) {
+        case OPCODE_DUP:
+        case OPCODE_NULL:
+        case OPCODE_TRUE:
+        case OPCODE_FALSE:
+        case OPCODE_CONSTANT:
+        case OPCODE_NUMBER:
+        case OPCODE_GET_LOCAL:
+        case OPCODE_GET_FREE:
+        case OPCODE_CURRENT_FUNCTION:
+            return true;
+        default:
+            return false;
     }
+}
 
-    symbol_table_t *src_st = compiler_get_symbol_table(src);
-    APE_ASSERT(ptrarray_count(src->file_scopes) == 1);
-    APE_ASSERT(src_st->outer == NULL);
-    symbol_table_t *src_st_copy = symbol_table_copy(src_st);
-    if (!src_st_copy) {
-        goto err;
+static opcode_t peephole_load_for_store(opcode_t op) {
+    switch (op) {
+        case OPCODE_SET_LOCAL:
+        case OPCODE_DEFINE_LOCAL:
+            return OPCODE_GET_LOCAL;
+        case OPCODE_SET_MODULE_GLOBAL:
+        case OPCODE_DEFINE_MODULE_GLOBAL:
+            return OPCODE_GET_MODULE_GLOBAL;
+        case OPCODE_SET_FREE:
+            return OPCODE_GET_FREE;
+        default:
+            return OPCODE_NONE;
     }
-    symbol_table_t *copy_st = compiler_get_symbol_table(copy);
-    symbol_table_destroy(copy_st);
-    copy_st = NULL;
-    compiler_set_symbol_table(copy, src_st_copy);
+}
+//FILE_END
+//FILE_START:compiler.c
+#include <stdlib.h>
+#include <math.h>
 
-    dict(module_t) *modules_copy = dict_copy_with_items(src->modules);
-    if (!modules_copy) {
-        goto err;
-    }
-    dict_destroy_with_items(copy->modules);
-    copy->modules = modules_copy;
+#ifndef APE_AMALGAMATED
+#include "compiler.h"
 
-    array(object_t) *constants_copy = array_copy(src->constants);
-    if (!constants_copy) {
-        goto err;
-    }
-    array_destroy(copy->constants);
-    copy->constants = constants_copy;
+#include "ape.h"
+#include "ast.h"
+#include "object.h"
+#include "gc.h"
+#include "code.h"
+#include "symbol_table.h"
+#include "errors.h"
+#include "optimisation.h"
+#include "builtins.h"
+#include "global_store.h"
+#include "vm.h"
+#endif
 
-    for (int i = 0; i < dict_count(src->string_constants_positions); i++) {
-        const char *key = dict_get_key_at(src->string_constants_positions, i);
-        int *val = dict_get_value_at(src->string_constants_positions, i);
-        int *val_copy = allocator_malloc(src->alloc, sizeof(int));
-        if (!val_copy) {
-            goto err;
-        }
-        *val_copy = *val;
-        ok = dict_set(copy->string_constants_positions, key, val_copy);
-        if (!ok) {
-            allocator_free(src->alloc, val_copy);
-            goto err;
-        }
-    }
+typedef struct module {
+    allocator_t *alloc;
+    char *name;
+    ptrarray(symbol_t) *symbols;
+} module_t;
 
-    file_scope_t *src_file_scope = ptrarray_top(src->file_scopes);
-    file_scope_t *copy_file_scope = ptrarray_top(copy->file_scopes);
+#define COMPILER_MAX_INLINED_EXPRESSIONS 32
 
-    ptrarray(char) *src_loaded_module_names = src_file_scope->loaded_module_names;
-    ptrarray(char) *copy_loaded_module_names = copy_file_scope->loaded_module_names;
+// const function defined at module scope with body consisting only of a return statement,
+// calls to it are compiled as its return expression with parameters defined in caller's scope
+typedef struct inline_function {
+    int symbol_index;
+    const fn_literal_t *fn;
+} inline_function_t;
 
-    for (int i = 0; i < ptrarray_count(src_loaded_module_names); i++) {
-        const char *loaded_name = ptrarray_get(src_loaded_module_names, i);
-        char *loaded_name_copy = ape_strdup(copy->alloc, loaded_name);
-        if (!loaded_name_copy) {
-            goto err;
-        }
-        ok = ptrarray_add(copy_loaded_module_names, loaded_name_copy);
-        if (!ok) {
-            allocator_free(copy->alloc, loaded_name_copy);
-            goto err;
-        }
-    }
+typedef struct file_scope {
+    allocator_t *alloc;
+    symbol_table_t *symbol_table;
+    compiled_file_t *file;
+    ptrarray(char) *loaded_module_names;
+} file_scope_t;
 
-    return true;
-err:
-    compiler_deinit(copy);
-    return false;
-}
+typedef struct compiler {
+    allocator_t *alloc;
+    const ape_config_t *config;
+    gcmem_t *mem;
+    errors_t *errors;
+    ptrarray(compiled_file_t) *files;
+    global_store_t *global_store;
+    object_t constants; // array of constants of current compilation, functions compiled from it reference it
+    compilation_scope_t *compilation_scope;
+    ptrarray(file_scope_t) *file_scopes;
+    array(src_pos_t) *src_positions_stack;
+    dict(module_t) *modules;
+    dict(int) *string_constants_positions;
+    int unreachable_depth; // code compiled while it's > 0 is checked for errors, but nothing is emitted
+    array(inline_function_t) *inline_functions; // point into ast, valid only while it's compiled
+    inline_frame_t inline_frame; // of inlined call being compiled
+} compiler_t;
 
-static int emit(compiler_t *comp, opcode_t op, int operands_count, uint64_t *operands) {
-    int ip = get_ip(comp);
-    int len = code_make(op, operands_count, operands, get_bytecode(comp));
-    if (len == 0) {
-        return -1;
-    }
-    for (int i = 0; i < len; i++) {
-        src_pos_t *src_pos = array_top(comp->src_positions_stack);
-        APE_ASSERT(src_pos->line >= 0);
-        APE_ASSERT(src_pos->column >= 0);
-        bool ok = array_add(get_src_positions(comp), src_pos);
-        if (!ok) {
-            return -1;
-        }
-    }
-    compilation_scope_t *compilation_scope = get_compilation_scope(comp);
-    compilation_scope->last_opcode = op;
-    return ip;
-}
+// everything compiler_compile can change, so a failed compilation can be undone
+typedef struct compiler_checkpoint {
+    int modules_count;
+    int loaded_module_names_count;
+    symbol_table_checkpoint_t symbol_table;
+} compiler_checkpoint_t;
 
-static compilation_scope_t* get_compilation_scope(compiler_t *comp) {
-    return comp->compilation_scope;
-}
+static bool compiler_init(compiler_t *comp,
+                          allocator_t *alloc,
+                          const ape_config_t *config,
+                          gcmem_t *mem, errors_t *errors,
+                          ptrarray(compiled_file_t) *files,
+                          global_store_t *global_store);
+static void compiler_deinit(compiler_t *comp);
 
-static bool push_compilation_scope(compiler_t *comp) {
-    compilation_scope_t *current_scope = get_compilation_scope(comp);
-    compilation_scope_t *new_scope = compilation_scope_make(comp->alloc, current_scope);
-    if (!new_scope) {
-        return false;
-    }
-    set_compilation_scope(comp, new_scope);
-    return true;
-}
+static compiler_checkpoint_t make_checkpoint(compiler_t *comp);
+static void rollback_to_checkpoint(compiler_t *comp, const compiler_checkpoint_t *checkpoint);
+static void clear_string_constants_positions(compiler_t *comp);
+static bool compiler_init_copy(compiler_t *copy, compiler_t *src,
+                               allocator_t *alloc,
+                               const ape_config_t *config,
+                               gcmem_t *mem, errors_t *errors,
+                               ptrarray(compiled_file_t) *files,
+                               global_store_t *global_store);
 
-static void pop_compilation_scope(compiler_t *comp) {
-    compilation_scope_t *current_scope = get_compilation_scope(comp);
-    APE_ASSERT(current_scope);
-    set_compilation_scope(comp, current_scope->outer);
-    compilation_scope_destroy(current_scope);
-}
+static int emit(compiler_t *comp, opcode_t op, int operands_count, uint64_t *operands);
+static compilation_scope_t* get_compilation_scope(compiler_t *comp);
+static bool push_compilation_scope(compiler_t *comp);
+static void pop_compilation_scope(compiler_t *comp);
+static bool push_symbol_table(compiler_t *comp, int global_offset);
+static void pop_symbol_table(compiler_t *comp);
+static opcode_t get_last_opcode(compiler_t *comp);
+static bool compile_code(compiler_t *comp, const char *code);
+static bool compile_statements(compiler_t *comp, ptrarray(statement_t) *statements);
+static bool import_module(compiler_t *comp, const statement_t *import_stmt);
+static bool compile_statement(compiler_t *comp, const statement_t *stmt);
+static bool compile_expression(compiler_t *comp, expression_t *expr);
+static bool compile_code_block(compiler_t *comp, const code_block_t *block);
+static int  add_constant(compiler_t *comp, object_t obj);
+static void change_uint16_operand(compiler_t *comp, int ip, uint16_t operand);
+static bool last_opcode_is(compiler_t *comp, opcode_t op);
+static bool read_symbol(compiler_t *comp, const symbol_t *symbol);
+static bool write_symbol(compiler_t *comp, const symbol_t *symbol, bool define);
 
-static bool push_symbol_table(compiler_t *comp, int global_offset) {
-    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
-    if (!file_scope) {
-        APE_ASSERT(false);
-        return false;
+static bool push_break_ip(compiler_t *comp, int ip);
+static void pop_break_ip(compiler_t *comp);
+static int  get_break_ip(compiler_t *comp);
+
+static bool push_continue_ip(compiler_t *comp, int ip);
+static void pop_continue_ip(compiler_t *comp);
+static int  get_continue_ip(compiler_t *comp);
+
+static int  get_ip(compiler_t *comp);
+
+static array(uint8_t)*   get_bytecode(compiler_t *comp);
+
+static file_scope_t* file_scope_make(compiler_t *comp, compiled_file_t *file);
+static void file_scope_destroy(file_scope_t *file_scope);
+static bool push_file_scope(compiler_t *comp, const char *filepath);
+static void pop_file_scope(compiler_t *comp);
+
+static void set_compilation_scope(compiler_t *comp, compilation_scope_t *scope);
+
+static module_t* module_make(allocator_t *alloc, const char *name);
+static void module_destroy(module_t *module);
+static module_t* module_copy(module_t *module);
+static bool module_add_symbol(module_t *module, const symbol_t *symbol);
+
+static const char* get_module_name(const char *path);
+static const symbol_t* define_symbol(compiler_t *comp, src_pos_t pos, const char *name, bool assignable, bool can_shadow);
+static bool is_builtin_range_call(compiler_t *comp, const expression_t *expr);
+static bool is_jump_statement(const statement_t *stmt);
+static bool is_bool_literal(const expression_t *expr, bool value);
+
+static bool can_inline_function(compiler_t *comp, const fn_literal_t *fn);
+static bool can_inline_expression(compiler_t *comp, const fn_literal_t *fn, const expression_t *expr, int *budget);
+static const fn_literal_t* get_inline_function(compiler_t *comp, const expression_t *call);
+static bool compile_inlined_call(compiler_t *comp, const fn_literal_t *fn, ptrarray(expression_t) *args, src_pos_t call_pos);
+
+compiler_t *compiler_make(allocator_t *alloc, const ape_config_t *config, gcmem_t *mem, errors_t *errors, ptrarray(compiled_file_t) *files, global_store_t *global_store) {
+    compiler_t *comp = allocator_malloc(alloc, sizeof(compiler_t));
+    if (!comp) {
+        return NULL;
     }
-    symbol_table_t *current_table = file_scope->symbol_table;
-    file_scope->symbol_table = symbol_table_make(comp->alloc, current_table, comp->global_store, global_offset);
-    if (!file_scope->symbol_table) {
-        file_scope->symbol_table = current_table;
-        return false;
+    bool ok = compiler_init(comp, alloc, config, mem, errors, files, global_store);
+    if (!ok) {
+        allocator_free(alloc, comp);
+        return NULL;
     }
-    return true;
+    return comp;
 }
 
-static void pop_symbol_table(compiler_t *comp) {
-    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
-    if (!file_scope) {
-        APE_ASSERT(false);
-        return;
-    }
-    symbol_table_t *current_table = file_scope->symbol_table;
-    if (!current_table) {
-        APE_ASSERT(false);
+void compiler_destroy(compiler_t *comp) {
+    if (!comp) {
         return;
     }
-    file_scope->symbol_table = current_table->outer;
-    symbol_table_destroy(current_table);
+    allocator_t *alloc = comp->alloc;
+    compiler_deinit(comp);
+    allocator_free(alloc, comp);
 }
 
-static opcode_t get_last_opcode(compiler_t *comp) {
-    compilation_scope_t *current_scope = get_compilation_scope(comp);
-    return current_scope->last_opcode;
+compiler_t *compiler_make_copy(compiler_t *src, allocator_t *alloc, const ape_config_t *config, gcmem_t *mem, errors_t *errors, ptrarray(compiled_file_t) *files, global_store_t *global_store) {
+    compiler_t *comp = allocator_malloc(alloc, sizeof(compiler_t));
+    if (!comp) {
+        return NULL;
+    }
+    bool ok = compiler_init_copy(comp, src, alloc, config, mem, errors, files, global_store);
+    if (!ok) {
+        allocator_free(alloc, comp);
+        return NULL;
+    }
+    return comp;
 }
 
-static bool compile_code(compiler_t *comp, const char *code) {
-    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
-    APE_ASSERT(file_scope);
+compilation_result_t* compiler_compile(compiler_t *comp, const char *code) {
+    compilation_scope_t *compilation_scope = get_compilation_scope(comp);
 
-    ptrarray(statement_t) *statements = parser_parse_all(file_scope->parser, code, file_scope->file);
-    if (!statements) {
-        // errors are added by parser
-        return false;
-    }
+    APE_ASSERT(array_count(comp->src_positions_stack) == 0);
+    APE_ASSERT(array_count(compilation_scope->bytecode) == 0);
+    APE_ASSERT(array_count(compilation_scope->break_ip_stack) == 0);
+    APE_ASSERT(array_count(compilation_scope->continue_ip_stack) == 0);
 
-    bool ok = compile_statements(comp, statements);
+    array_clear(comp->src_positions_stack);
+    compilation_scope_clear(compilation_scope);
 
-    ptrarray_destroy_with_items(statements, statement_destroy);
+    // constants have to outlive the arena
+    bool arena_enabled = gcmem_is_arena_enabled(comp->mem);
+    gcmem_set_arena_enabled(comp->mem, false);
 
-    // Left for debugging purposes
-//    if (ok) {
-//        strbuf_t *buf = strbuf_make(NULL);
-//        code_to_string(array_data(comp->compilation_scope->bytecode),
-//                       array_data(comp->compilation_scope->src_positions),
-//                       array_count(comp->compilation_scope->bytecode), buf);
-//        puts(strbuf_get_string(buf));
-//        strbuf_destroy(buf);
-//    }
+    // every compilation gets its own constants so they can be collected once it's not used anymore
+    clear_string_constants_positions(comp);
+    comp->constants = object_make_array(comp->mem);
+    if (object_is_null(comp->constants)) {
+        gcmem_set_arena_enabled(comp->mem, arena_enabled);
+        return NULL;
+    }
 
-    return ok;
-}
+    compiler_checkpoint_t checkpoint = make_checkpoint(comp);
 
-static bool compile_statements(compiler_t *comp, ptrarray(statement_t) *statements) {
-    bool ok = true;
-    for (int i = 0; i < ptrarray_count(statements); i++) {
-        const statement_t *stmt = ptrarray_get(statements, i);
-        ok = compile_statement(comp, stmt);
-        if (!ok) {
-            break;
-        }
+    bool ok = compile_code(comp, code);
+    if (!ok) {
+        goto err;
     }
-    return ok;
-}
 
-static bool import_module(compiler_t *comp, const statement_t *import_stmt) { // todo: split into smaller functions
-    bool result = false;
-    char *filepath = NULL;
-    char *code = NULL;
+    compilation_scope = get_compilation_scope(comp); // might've changed
+    APE_ASSERT(compilation_scope->outer == NULL);
 
-    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    compilation_scope = get_compilation_scope(comp);
+    compilation_result_t *res = compilation_scope_orphan_result(compilation_scope);
+    if (!res) {
+        goto err;
+    }
+    ok = optimise_bytecode(res, true);
+    if (!ok) {
+        compilation_result_destroy(res);
+        goto err;
+    }
+    symbol_table_commit(compiler_get_symbol_table(comp));
+    gcmem_set_arena_enabled(comp->mem, arena_enabled);
+    return res;
+err:
+    rollback_to_checkpoint(comp, &checkpoint);
+    gcmem_set_arena_enabled(comp->mem, arena_enabled);
+    return NULL;
+}
 
-    const char *module_path = import_stmt->import.path;
-    const char *module_name = get_module_name(module_path);
+compilation_result_t* compiler_compile_file(compiler_t *comp, const char *path) {
+    char *code = NULL;
+    compiled_file_t *file = NULL;
+    compilation_result_t *res = NULL;
 
-    for (int i = 0; i < ptrarray_count(file_scope->loaded_module_names); i++) {
-        const char *loaded_name = ptrarray_get(file_scope->loaded_module_names, i);
-        if (kg_streq(loaded_name, module_name)) {
-            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Module \"%s\" was already imported", module_name);
-            result = false;
-            goto end;
-        }
+    if (!comp->config->fileio.read_file.read_file) { // todo: read code function
+        errors_add_error(comp->errors, ERROR_COMPILATION, src_pos_invalid, "File read function not configured");
+        goto err;
     }
 
-    strbuf_t *filepath_buf = strbuf_make(comp->alloc);
-    if (!filepath_buf) {
-        result = false;
-        goto end;
+    code = comp->config->fileio.read_file.read_file(comp->config->fileio.read_file.context, path);
+    if (!code) {
+        errors_add_errorf(comp->errors, ERROR_COMPILATION, src_pos_invalid, "Reading file \"%s\" failed", path);
+        goto err;
     }
-    if (kg_is_path_absolute(module_path)) {
-        strbuf_appendf(filepath_buf, "%s.ape", module_path);
-    } else {
-        strbuf_appendf(filepath_buf, "%s%s.ape", file_scope->file->dir_path, module_path);
+
+    file = compiled_file_make(comp->alloc, path);
+    if (!file) {
+        goto err;
     }
 
-    if (strbuf_failed(filepath_buf)) {
-        strbuf_destroy(filepath_buf);
-        result = false;
-        goto end;
+    bool ok = ptrarray_add(comp->files, file);
+    if (!ok) {
+        compiled_file_destroy(file);
+        goto err;
     }
 
-    const char *filepath_non_canonicalised = strbuf_get_string(filepath_buf);
-    filepath = kg_canonicalise_path(comp->alloc, filepath_non_canonicalised);
-    strbuf_destroy(filepath_buf);
-    if (!filepath) {
-        result = false;
-        goto end;
+    APE_ASSERT(ptrarray_count(comp->file_scopes) == 1);
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    if (!file_scope) {
+        goto err;
     }
+    
+    compiled_file_t *prev_file = file_scope->file; // todo: push file scope instead?
+    file_scope->file = file;
 
-    symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
-    if (symbol_table->outer != NULL || ptrarray_count(symbol_table->block_scopes) > 1) {
-        errors_add_error(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Modules can only be imported in global scope");
-        result = false;
-        goto end;
+    res = compiler_compile(comp, code);
+    file_scope = ptrarray_top(comp->file_scopes); // failed compilations pop the file scopes they pushed, the top one is fetched again to be safe
+    if (!res) {
+        file_scope->file = prev_file;
+        goto err;
     }
+    file_scope->file = prev_file;
 
-    for (int i = 0; i < ptrarray_count(comp->file_scopes); i++) {
-        file_scope_t *fs = ptrarray_get(comp->file_scopes, i);
-        if (APE_STREQ(fs->file->path, filepath)) {
-            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Cyclic reference of file \"%s\"", filepath);
-            result = false;
-            goto end;
-        }
+    allocator_free(comp->alloc, code);
+    return res;
+err:
+    allocator_free(comp->alloc, code);
+    return NULL;
+}
+
+symbol_table_t* compiler_get_symbol_table(compiler_t *comp) {
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    if (!file_scope) {
+        APE_ASSERT(false);
+        return NULL;
     }
+    return file_scope->symbol_table;
+}
 
-    module_t *module = dict_get(comp->modules, filepath);
-    if (!module) { // todo: create new module function
-        if (!comp->config->fileio.read_file.read_file) {
-            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Cannot import module \"%s\", file read function not configured", filepath);
-            result = false;
-            goto end;
-        }
+void compiler_set_symbol_table(compiler_t *comp, symbol_table_t *table) {
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    if (!file_scope) {
+        APE_ASSERT(false);
+        return;
+    }
+    file_scope->symbol_table = table;
+}
 
-        code = comp->config->fileio.read_file.read_file(comp->config->fileio.read_file.context, filepath);
-        if (!code) {
-            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Reading module file \"%s\" failed", filepath);
-            result = false;
-            goto end;
-        }
+object_t compiler_get_constants(const compiler_t *comp) {
+    return comp->constants;
+}
 
-        module = module_make(comp->alloc, module_name);
-        if (!module) {
-            result = false;
-            goto end;
-        }
+// INTERNAL
+static bool compiler_init(compiler_t *comp,
+                          allocator_t *alloc,
+                          const ape_config_t *config,
+                          gcmem_t *mem, errors_t *errors,
+                          ptrarray(compiled_file_t) *files,
+                          global_store_t *global_store) {
 
-        bool ok = push_file_scope(comp, filepath);
-        if (!ok) {
-            module_destroy(module);
-            result = false;
-            goto end;
-        }
+    memset(comp, 0, sizeof(compiler_t));
+    comp->alloc = alloc;
+    comp->config = config;
+    comp->mem = mem;
+    comp->errors = errors;
+    comp->files = files;
+    comp->global_store = global_store;
 
-        ok = compile_code(comp, code);
-        if (!ok) {
-            module_destroy(module);
-            result = false;
-            goto end;
-        }
+    comp->file_scopes = ptrarray_make(alloc);
+    if (!comp->file_scopes) {
+        goto err;
+    }
+    comp->constants = object_make_null();
+    comp->src_positions_stack = array_make(alloc, src_pos_t);
+    if (!comp->src_positions_stack) {
+        goto err;
+    }
+    comp->modules = dict_make(alloc, module_copy, module_destroy);
+    if (!comp->modules) {
+        goto err;
+    }
+    bool ok = push_compilation_scope(comp);
+    if (!ok) {
+        goto err;
+    }
+    ok = push_file_scope(comp, "none");
+    if (!ok) {
+        goto err;
+    }
+    comp->string_constants_positions = dict_make(comp->alloc, NULL, NULL);
+    if (!comp->string_constants_positions) {
+        goto err;
+    }
+    comp->inline_functions = array_make(alloc, inline_function_t);
+    if (!comp->inline_functions) {
+        goto err;
+    }
 
-        symbol_table_t *st = compiler_get_symbol_table(comp);
-        for (int i = 0; i < symbol_table_get_module_global_symbol_count(st); i++) {
-            const symbol_t *symbol = symbol_table_get_module_global_symbol_at(st, i);
-            module_add_symbol(module, symbol);
-        }
+    return true;
+err:
+    compiler_deinit(comp);
+    return false;
+}
 
+static void compiler_deinit(compiler_t *comp) {
+    if (!comp) {
+        return;
+    }
+    clear_string_constants_positions(comp);
+    dict_destroy(comp->string_constants_positions);
+    array_destroy(comp->inline_functions);
+    
+    while (ptrarray_count(comp->file_scopes) > 0) {
         pop_file_scope(comp);
-
-        ok = dict_set(comp->modules, filepath, module);
-        if (!ok) {
-            module_destroy(module);
-            result = false;
-            goto end;
-        }
     }
+    while (get_compilation_scope(comp)) {
+        pop_compilation_scope(comp);
+    }
+    dict_destroy_with_items(comp->modules);
+    array_destroy(comp->src_positions_stack);
 
-    for (int i = 0; i < ptrarray_count(module->symbols); i++) {
-        symbol_t *symbol = ptrarray_get(module->symbols, i);
-        bool ok = symbol_table_add_module_symbol(symbol_table, symbol);
-        if (!ok) {
-            result = false;
-            goto end;
-        }
+    ptrarray_destroy(comp->file_scopes);
+    memset(comp, 0, sizeof(compiler_t));
+}
+
+static compiler_checkpoint_t make_checkpoint(compiler_t *comp) {
+    APE_ASSERT(ptrarray_count(comp->file_scopes) == 1);
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    compiler_checkpoint_t checkpoint;
+    checkpoint.modules_count = dict_count(comp->modules);
+    checkpoint.loaded_module_names_count = ptrarray_count(file_scope->loaded_module_names);
+    checkpoint.symbol_table = symbol_table_make_checkpoint(file_scope->symbol_table);
+    return checkpoint;
+}
+
+static void rollback_to_checkpoint(compiler_t *comp, const compiler_checkpoint_t *checkpoint) {
+    comp->unreachable_depth = 0;
+    // compilation might've stopped anywhere so scopes it entered are still there
+    while (ptrarray_count(comp->file_scopes) > 1) {
+        pop_file_scope(comp);
+    }
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    while (file_scope->symbol_table->outer) {
+        pop_symbol_table(comp);
     }
+    while (get_compilation_scope(comp)->outer) {
+        pop_compilation_scope(comp);
+    }
+    compilation_scope_clear(get_compilation_scope(comp));
+    array_clear(comp->src_positions_stack);
 
-    char *name_copy = ape_strdup(comp->alloc, module_name);
-    if (!name_copy) {
-        result = false;
-        goto end;
+    symbol_table_rollback(file_scope->symbol_table, &checkpoint->symbol_table);
+
+    while (ptrarray_count(file_scope->loaded_module_names) > checkpoint->loaded_module_names_count) {
+        allocator_free(comp->alloc, ptrarray_pop(file_scope->loaded_module_names));
     }
 
-    bool ok = ptrarray_add(file_scope->loaded_module_names, name_copy);
-    if (!ok) {
-        allocator_free(comp->alloc, name_copy);
-        result = false;
-        goto end;
+    // items are only appended so removing last ones restores previous state
+    while (dict_count(comp->modules) > checkpoint->modules_count) {
+        int last_ix = dict_count(comp->modules) - 1;
+        const char *key = dict_get_key_at(comp->modules, last_ix);
+        module_t *module = dict_get_value_at(comp->modules, last_ix);
+        dict_remove(comp->modules, key);
+        module_destroy(module);
     }
-    
-    result = true;
 
-end:
-    allocator_free(comp->alloc, filepath);
-    allocator_free(comp->alloc, code);
-    return result;
+    // constants of failed compilation are collected by gc
+    clear_string_constants_positions(comp);
+    comp->constants = object_make_null();
 }
 
-static bool compile_statement(compiler_t *comp, const statement_t *stmt) {
-    bool ok = false;
-    int ip = -1;
+static void clear_string_constants_positions(compiler_t *comp) {
+    if (!comp->string_constants_positions) {
+        return;
+    }
+    for (int i = 0; i < dict_count(comp->string_constants_positions); i++) {
+        int *val = dict_get_value_at(comp->string_constants_positions, i);
+        allocator_free(comp->alloc, val);
+    }
+    dict_clear(comp->string_constants_positions);
+}
 
-    ok = array_push(comp->src_positions_stack, &stmt->pos);
+static bool compiler_init_copy(compiler_t *copy, compiler_t *src,
+                               allocator_t *alloc,
+                               const ape_config_t *config,
+                               gcmem_t *mem, errors_t *errors,
+                               ptrarray(compiled_file_t) *files,
+                               global_store_t *global_store) {
+    bool ok = compiler_init(copy, alloc, config, mem, errors, files, global_store);
     if (!ok) {
         return false;
     }
 
-    compilation_scope_t *compilation_scope = get_compilation_scope(comp);
-    symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
-    switch (stmt->type) {
-        case STATEMENT_EXPRESSION: {
-            ok = compile_expression(comp, stmt->expression);
-            if (!ok) {
-                return false;
-            }
-            ip = emit(comp, OPCODE_POP, 0, NULL);
-            if (ip < 0) {
-                return false;
-            }
-            break;
-        }
-        case STATEMENT_DEFINE: {
-            ok = compile_expression(comp, stmt->define.value);
-            if (!ok) {
-                return false;
-            }
-            
-            const symbol_t *symbol = define_symbol(comp, stmt->define.name->pos, stmt->define.name->value, stmt->define.assignable, false);
-            if (!symbol) {
-                return false;
-            }
-
-            ok = write_symbol(comp, symbol, true);
-            if (!ok) {
-                return false;
-            }
+    symbol_table_t *src_st = compiler_get_symbol_table(src);
+    APE_ASSERT(ptrarray_count(src->file_scopes) == 1);
+    APE_ASSERT(src_st->outer == NULL);
+    symbol_table_t *src_st_copy = symbol_table_copy(src_st);
+    if (!src_st_copy) {
+        goto err;
+    }
+    src_st_copy->global_store = global_store;
+    symbol_table_t *copy_st = compiler_get_symbol_table(copy);
+    symbol_table_destroy(copy_st);
+    copy_st = NULL;
+    compiler_set_symbol_table(copy, src_st_copy);
 
-            break;
-        }
-        case STATEMENT_IF: {
-            const if_statement_t *if_stmt = &stmt->if_statement;
+    dict(module_t) *modules_copy = dict_copy_with_items(src->modules);
+    if (!modules_copy) {
+        goto err;
+    }
+    dict_destroy_with_items(copy->modules);
+    copy->modules = modules_copy;
 
-            array(int) *jump_to_end_ips = array_make(comp->alloc, int);
-            if (!jump_to_end_ips) {
-                goto statement_if_error;
-            }
+    file_scope_t *src_file_scope = ptrarray_top(src->file_scopes);
+    file_scope_t *copy_file_scope = ptrarray_top(copy->file_scopes);
 
-            for (int i = 0; i < ptrarray_count(if_stmt->cases); i++) {
-                if_case_t *if_case = ptrarray_get(if_stmt->cases, i);
+    ptrarray(char) *src_loaded_module_names = src_file_scope->loaded_module_names;
+    ptrarray(char) *copy_loaded_module_names = copy_file_scope->loaded_module_names;
 
-                ok = compile_expression(comp, if_case->test);
-                if (!ok) {
-                    goto statement_if_error;
-                }
+    for (int i = 0; i < ptrarray_count(src_loaded_module_names); i++) {
+        const char *loaded_name = ptrarray_get(src_loaded_module_names, i);
+        char *loaded_name_copy = ape_strdup(copy->alloc, loaded_name);
+        if (!loaded_name_copy) {
+            goto err;
+        }
+        ok = ptrarray_add(copy_loaded_module_names, loaded_name_copy);
+        if (!ok) {
+            allocator_free(copy->alloc, loaded_name_copy);
+            goto err;
+        }
+    }
 
-                int next_case_jump_ip = emit(comp, OPCODE_JUMP_IF_FALSE, 1, (uint64_t[]){0xbeef});
+    return true;
+err:
+    compiler_deinit(copy);
+    return false;
+}
 
-                ok = compile_code_block(comp, if_case->consequence);
-                if (!ok) {
-                    goto statement_if_error;
-                }
+static int emit(compiler_t *comp, opcode_t op, int operands_count, uint64_t *operands) {
+    int ip = get_ip(comp);
+    if (comp->unreachable_depth > 0) {
+        return ip;
+    }
+    int len = code_make(op, operands_count, operands, get_bytecode(comp));
+    if (len == 0) {
+        return -1;
+    }
+    src_pos_t *src_pos = array_top(comp->src_positions_stack);
+    APE_ASSERT(src_pos->line >= 0);
+    APE_ASSERT(src_pos->column >= 0);
+    compilation_scope_t *compilation_scope = get_compilation_scope(comp);
+    bool ok = compilation_scope_add_src_pos(compilation_scope, ip, *src_pos, &comp->inline_frame);
+    if (!ok) {
+        return -1;
+    }
+    compilation_scope->last_opcode = op;
+    return ip;
+}
 
-                // don't emit jump for the last statement
-                if (i < (ptrarray_count(if_stmt->cases) - 1) || if_stmt->alternative) {
-                    int jump_to_end_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xbeef});
-                    bool ok = array_add(jump_to_end_ips, &jump_to_end_ip);
-                    if (!ok) {
-                        goto statement_if_error;
-                    }
-                }
+static compilation_scope_t* get_compilation_scope(compiler_t *comp) {
+    return comp->compilation_scope;
+}
 
-                int after_elif_ip = get_ip(comp);
-                change_uint16_operand(comp, next_case_jump_ip + 1, after_elif_ip);
-            }
+static bool push_compilation_scope(compiler_t *comp) {
+    compilation_scope_t *current_scope = get_compilation_scope(comp);
+    compilation_scope_t *new_scope = compilation_scope_make(comp->alloc, current_scope);
+    if (!new_scope) {
+        return false;
+    }
+    set_compilation_scope(comp, new_scope);
+    return true;
+}
 
-            if (if_stmt->alternative) {
-                ok = compile_code_block(comp, if_stmt->alternative);
-                if (!ok) {
-                    goto statement_if_error;
-                }
-            }
+static void pop_compilation_scope(compiler_t *comp) {
+    compilation_scope_t *current_scope = get_compilation_scope(comp);
+    APE_ASSERT(current_scope);
+    set_compilation_scope(comp, current_scope->outer);
+    compilation_scope_destroy(current_scope);
+}
 
-            int after_alt_ip = get_ip(comp);
+static bool push_symbol_table(compiler_t *comp, int global_offset) {
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    if (!file_scope) {
+        APE_ASSERT(false);
+        return false;
+    }
+    symbol_table_t *current_table = file_scope->symbol_table;
+    file_scope->symbol_table = symbol_table_make(comp->alloc, current_table, comp->global_store, global_offset);
+    if (!file_scope->symbol_table) {
+        file_scope->symbol_table = current_table;
+        return false;
+    }
+    return true;
+}
 
-            for (int i = 0; i < array_count(jump_to_end_ips); i++) {
-                int *pos = array_get(jump_to_end_ips, i);
-                change_uint16_operand(comp, *pos + 1, after_alt_ip);
-            }
+static void pop_symbol_table(compiler_t *comp) {
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    if (!file_scope) {
+        APE_ASSERT(false);
+        return;
+    }
+    symbol_table_t *current_table = file_scope->symbol_table;
+    if (!current_table) {
+        APE_ASSERT(false);
+        return;
+    }
+    file_scope->symbol_table = current_table->outer;
+    symbol_table_destroy(current_table);
+}
 
-            array_destroy(jump_to_end_ips);
+static opcode_t get_last_opcode(compiler_t *comp) {
+    compilation_scope_t *current_scope = get_compilation_scope(comp);
+    return current_scope->last_opcode;
+}
 
-            break;
-        statement_if_error:
-            array_destroy(jump_to_end_ips);
-            return false;
-        }
-        case STATEMENT_RETURN_VALUE: {
-            if (compilation_scope->outer == NULL) {
-                errors_add_errorf(comp->errors, ERROR_COMPILATION, stmt->pos, "Nothing to return from");
-                return false;
-            }
-            ip = -1;
-            if (stmt->return_value) {
-                ok = compile_expression(comp, stmt->return_value);
-                if (!ok) {
-                    return false;
-                }
-                ip = emit(comp, OPCODE_RETURN_VALUE, 0, NULL);
-            } else {
-                ip = emit(comp, OPCODE_RETURN, 0, NULL);
-            }
-            if (ip < 0) {
-                return false;
-            }
-            break;
-        }
-        case STATEMENT_WHILE_LOOP: {
-            const while_loop_statement_t *loop = &stmt->while_loop;
+static bool compile_code(compiler_t *comp, const char *code) {
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+    APE_ASSERT(file_scope);
 
-            int before_test_ip = get_ip(comp);
+    // parser and ast are allocated from an arena that's released all at once after compilation,
+    // so nothing referenced by compiled code can point into it
+    arena_t *ast_arena = arena_make(comp->alloc);
+    if (!ast_arena) {
+        return false;
+    }
+    allocator_t *ast_alloc = arena_get_allocator(ast_arena);
 
-            ok = compile_expression(comp, loop->test);
-            if (!ok) {
-                return false;
-            }
+    parser_t *parser = parser_make(ast_alloc, comp->config, comp->errors);
+    if (!parser) {
+        arena_destroy(ast_arena);
+        return false;
+    }
 
-            int after_test_ip = get_ip(comp);
-            ip = emit(comp, OPCODE_JUMP_IF_TRUE, 1, (uint64_t[]){after_test_ip + 6});
-            if (ip < 0) {
-                return false;
-            }
+    ptrarray(statement_t) *statements = parser_parse_all(parser, code, file_scope->file);
+    if (!statements) {
+        // errors are added by parser
+        arena_destroy(ast_arena);
+        return false;
+    }
 
-            int jump_to_after_body_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xdead});
-            if (jump_to_after_body_ip < 0) {
-                return false;
-            }
+    bool ok = optimise_statements(ast_alloc, statements);
+    if (!ok) {
+        arena_destroy(ast_arena);
+        return false;
+    }
 
-            ok = push_continue_ip(comp, before_test_ip);
-            if (!ok) {
-                return false;
-            }
+    int inline_functions_count = array_count(comp->inline_functions);
 
-            ok = push_break_ip(comp, jump_to_after_body_ip);
-            if (!ok) {
-                return false;
-            }
+    ok = compile_statements(comp, statements);
 
-            ok = compile_code_block(comp, loop->body);
-            if (!ok) {
-                return false;
-            }
+    while (array_count(comp->inline_functions) > inline_functions_count) {
+        array_pop(comp->inline_functions, NULL);
+    }
 
-            pop_break_ip(comp);
-            pop_continue_ip(comp);
+    arena_destroy(ast_arena);
 
-            ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){before_test_ip});
-            if (ip < 0) {
-                return false;
-            }
+    // Left for debugging purposes
+//    if (ok) {
+//        strbuf_t *buf = strbuf_make(NULL);
+//        code_to_string(array_data(comp->compilation_scope->bytecode),
+//                       array_data(comp->compilation_scope->src_positions),
+//                       array_count(comp->compilation_scope->src_positions),
+//                       array_count(comp->compilation_scope->bytecode), buf);
+//        puts(strbuf_get_string(buf));
+//        strbuf_destroy(buf);
+//    }
 
-            int after_body_ip = get_ip(comp);
-            change_uint16_operand(comp, jump_to_after_body_ip + 1, after_body_ip);
+    return ok;
+}
 
+static bool compile_statements(compiler_t *comp, ptrarray(statement_t) *statements) {
+    int unreachable_depth = comp->unreachable_depth;
+    bool ok = true;
+    for (int i = 0; i < ptrarray_count(statements); i++) {
+        const statement_t *stmt = ptrarray_get(statements, i);
+        ok = compile_statement(comp, stmt);
+        if (!ok) {
             break;
         }
-        case STATEMENT_BREAK: {
-            int break_ip = get_break_ip(comp);
-            if (break_ip < 0) {
-                errors_add_errorf(comp->errors, ERROR_COMPILATION, stmt->pos, "Nothing to break from.");
-                return false;
-            }
-            ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){break_ip});
-            if (ip < 0) {
-                return false;
-            }
-            break;
+        if (is_jump_statement(stmt) && comp->unreachable_depth == unreachable_depth) {
+            comp->unreachable_depth++; // rest of statements can't be reached
         }
-        case STATEMENT_CONTINUE: {
-            int continue_ip = get_continue_ip(comp);
-            if (continue_ip < 0) {
-                errors_add_errorf(comp->errors, ERROR_COMPILATION, stmt->pos, "Nothing to continue from.");
+    }
+    comp->unreachable_depth = unreachable_depth;
+    return ok;
+}
+
+static bool import_module(compiler_t *comp, const statement_t *import_stmt) { // todo: split into smaller functions
+    bool result = false;
+    char *filepath = NULL;
+    char *code = NULL;
+
+    file_scope_t *file_scope = ptrarray_top(comp->file_scopes);
+
+    const char *module_path = import_stmt->import.path;
+    const char *module_name = get_module_name(module_path);
+
+    for (int i = 0; i < ptrarray_count(file_scope->loaded_module_names); i++) {
+        const char *loaded_name = ptrarray_get(file_scope->loaded_module_names, i);
+        if (kg_streq(loaded_name, module_name)) {
+            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Module \"%s\" was already imported", module_name);
+            result = false;
+            goto end;
+        }
+    }
+
+    strbuf_t *filepath_buf = strbuf_make(comp->alloc);
+    if (!filepath_buf) {
+        result = false;
+        goto end;
+    }
+    if (kg_is_path_absolute(module_path)) {
+        strbuf_appendf(filepath_buf, "%s.ape", module_path);
+    } else {
+        strbuf_appendf(filepath_buf, "%s%s.ape", file_scope->file->dir_path, module_path);
+    }
+
+    if (strbuf_failed(filepath_buf)) {
+        strbuf_destroy(filepath_buf);
+        result = false;
+        goto end;
+    }
+
+    const char *filepath_non_canonicalised = strbuf_get_string(filepath_buf);
+    filepath = kg_canonicalise_path(comp->alloc, filepath_non_canonicalised);
+    strbuf_destroy(filepath_buf);
+    if (!filepath) {
+        result = false;
+        goto end;
+    }
+
+    symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
+    if (symbol_table->outer != NULL || ptrarray_count(symbol_table->block_scopes) > 1) {
+        errors_add_error(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Modules can only be imported in global scope");
+        result = false;
+        goto end;
+    }
+
+    for (int i = 0; i < ptrarray_count(comp->file_scopes); i++) {
+        file_scope_t *fs = ptrarray_get(comp->file_scopes, i);
+        if (APE_STREQ(fs->file->path, filepath)) {
+            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Cyclic reference of file \"%s\"", filepath);
+            result = false;
+            goto end;
+        }
+    }
+
+    module_t *module = dict_get(comp->modules, filepath);
+    if (!module) { // todo: create new module function
+        if (!comp->config->fileio.read_file.read_file) {
+            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Cannot import module \"%s\", file read function not configured", filepath);
+            result = false;
+            goto end;
+        }
+
+        code = comp->config->fileio.read_file.read_file(comp->config->fileio.read_file.context, filepath);
+        if (!code) {
+            errors_add_errorf(comp->errors, ERROR_COMPILATION, import_stmt->pos, "Reading module file \"%s\" failed", filepath);
+            result = false;
+            goto end;
+        }
+
+        module = module_make(comp->alloc, module_name);
+        if (!module) {
+            result = false;
+            goto end;
+        }
+
+        bool ok = push_file_scope(comp, filepath);
+        if (!ok) {
+            module_destroy(module);
+            result = false;
+            goto end;
+        }
+
+        ok = compile_code(comp, code);
+        if (!ok) {
+            module_destroy(module);
+            result = false;
+            goto end;
+        }
+
+        symbol_table_t *st = compiler_get_symbol_table(comp);
+        for (int i = 0; i < symbol_table_get_module_global_symbol_count(st); i++) {
+            const symbol_t *symbol = symbol_table_get_module_global_symbol_at(st, i);
+            module_add_symbol(module, symbol);
+        }
+
+        pop_file_scope(comp);
+
+        ok = dict_set(comp->modules, filepath, module);
+        if (!ok) {
+            module_destroy(module);
+            result = false;
+            goto end;
+        }
+    }
+
+    for (int i = 0; i < ptrarray_count(module->symbols); i++) {
+        symbol_t *symbol = ptrarray_get(module->symbols, i);
+        bool ok = symbol_table_add_module_symbol(symbol_table, symbol);
+        if (!ok) {
+            result = false;
+            goto end;
+        }
+    }
+
+    char *name_copy = ape_strdup(comp->alloc, module_name);
+    if (!name_copy) {
+        result = false;
+        goto end;
+    }
+
+    bool ok = ptrarray_add(file_scope->loaded_module_names, name_copy);
+    if (!ok) {
+        allocator_free(comp->alloc, name_copy);
+        result = false;
+        goto end;
+    }
+    
+    result = true;
+
+end:
+    allocator_free(comp->alloc, filepath);
+    allocator_free(comp->alloc, code);
+    return result;
+}
+
+static bool compile_statement(compiler_t *comp, const statement_t *stmt) {
+    bool ok = false;
+    int ip = -1;
+
+    ok = array_push(comp->src_positions_stack, &stmt->pos);
+    if (!ok) {
+        return false;
+    }
+
+    compilation_scope_t *compilation_scope = get_compilation_scope(comp);
+    symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
+    switch (stmt->type) {
+        case STATEMENT_EXPRESSION: {
+            ok = compile_expression(comp, stmt->expression);
+            if (!ok) {
                 return false;
             }
-            ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){continue_ip});
+            ip = emit(comp, OPCODE_POP, 0, NULL);
             if (ip < 0) {
                 return false;
             }
             break;
         }
-        case STATEMENT_FOREACH: {
-            const foreach_statement_t *foreach = &stmt->foreach;
-            ok = symbol_table_push_block_scope(symbol_table);
+        case STATEMENT_DEFINE: {
+            ok = compile_expression(comp, stmt->define.value);
             if (!ok) {
                 return false;
             }
-
-            // Init
-            const symbol_t *index_symbol = define_symbol(comp, stmt->pos, "@i", false, true);
-            if (!index_symbol) {
-                return false;
-            }
-
-            ip = emit(comp, OPCODE_NUMBER, 1, (uint64_t[]){0});
-            if (ip < 0) {
+            
+            const symbol_t *symbol = define_symbol(comp, stmt->define.name->pos, stmt->define.name->value, stmt->define.assignable, false);
+            if (!symbol) {
                 return false;
             }
 
-            ok = write_symbol(comp, index_symbol, true);
+            ok = write_symbol(comp, symbol, true);
             if (!ok) {
                 return false;
             }
 
-            const symbol_t *source_symbol = NULL;
-            if (foreach->source->type == EXPRESSION_IDENT) {
-                source_symbol = symbol_table_resolve(symbol_table, foreach->source->ident->value);
-                if (!source_symbol) {
-                    errors_add_errorf(comp->errors, ERROR_COMPILATION, foreach->source->pos,
-                                      "Symbol \"%s\" could not be resolved", foreach->source->ident->value);
-                    return false;
-                }
-            } else {
-                ok = compile_expression(comp, foreach->source);
-                if (!ok) {
-                    return false;
-                }
-                source_symbol = define_symbol(comp, foreach->source->pos, "@source", false, true);
-                if (!source_symbol) {
-                    return false;
-                }
-                ok = write_symbol(comp, source_symbol, true);
+            const expression_t *value = stmt->define.value;
+            if (!stmt->define.assignable && symbol_table_is_top_global_scope(symbol_table)
+                && value->type == EXPRESSION_FUNCTION_LITERAL && can_inline_function(comp, &value->fn_literal)) {
+                inline_function_t inline_fn = {symbol->index, &value->fn_literal};
+                ok = array_add(comp->inline_functions, &inline_fn);
                 if (!ok) {
                     return false;
                 }
             }
 
-            // Update
-            int jump_to_after_update_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xbeef});
-            if (jump_to_after_update_ip < 0) {
-                return false;
-            }
+            break;
+        }
+        case STATEMENT_IF: {
+            const if_statement_t *if_stmt = &stmt->if_statement;
 
-            int update_ip = get_ip(comp);
-            ok = read_symbol(comp, index_symbol);
-            if (!ok) {
-                return false;
+            array(int) *jump_to_end_ips = array_make(comp->alloc, int);
+            if (!jump_to_end_ips) {
+                goto statement_if_error;
             }
 
-            ip = emit(comp, OPCODE_NUMBER, 1, (uint64_t[]){ape_double_to_uint64(1)});
-            if (ip < 0) {
-                return false;
-            }
+            int unreachable_depth = comp->unreachable_depth;
+            for (int i = 0; i < ptrarray_count(if_stmt->cases); i++) {
+                if_case_t *if_case = ptrarray_get(if_stmt->cases, i);
 
-            ip = emit(comp, OPCODE_ADD, 0, NULL);
-            if (ip < 0) {
-                return false;
-            }
+                if (is_bool_literal(if_case->test, false)) {
+                    // case is never taken, it's only checked for errors
+                    comp->unreachable_depth++;
+                    ok = compile_code_block(comp, if_case->consequence);
+                    comp->unreachable_depth--;
+                    if (!ok) {
+                        goto statement_if_error;
+                    }
+                    continue;
+                }
 
-            ok = write_symbol(comp, index_symbol, false);
-            if (!ok) {
-                return false;
+                if (is_bool_literal(if_case->test, true)) {
+                    // case is always taken, following cases and alternative are never reached
+                    ok = compile_code_block(comp, if_case->consequence);
+                    if (!ok) {
+                        goto statement_if_error;
+                    }
+                    comp->unreachable_depth++;
+                    continue;
+                }
+
+                ok = compile_expression(comp, if_case->test);
+                if (!ok) {
+                    goto statement_if_error;
+                }
+
+                int next_case_jump_ip = emit(comp, OPCODE_JUMP_IF_FALSE, 1, (uint64_t[]){0xbeef});
+
+                ok = compile_code_block(comp, if_case->consequence);
+                if (!ok) {
+                    goto statement_if_error;
+                }
+
+                // don't emit jump for the last statement
+                // cases after an always taken one emit nothing, so there's no jump to patch
+                if ((i < (ptrarray_count(if_stmt->cases) - 1) || if_stmt->alternative) && comp->unreachable_depth == 0) {
+                    int jump_to_end_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xbeef});
+                    bool ok = array_add(jump_to_end_ips, &jump_to_end_ip);
+                    if (!ok) {
+                        goto statement_if_error;
+                    }
+                }
+
+                int after_elif_ip = get_ip(comp);
+                change_uint16_operand(comp, next_case_jump_ip + 1, after_elif_ip);
             }
 
-            int after_update_ip = get_ip(comp);
-            change_uint16_operand(comp, jump_to_after_update_ip + 1, after_update_ip);
+            if (if_stmt->alternative) {
+                ok = compile_code_block(comp, if_stmt->alternative);
+                if (!ok) {
+                    goto statement_if_error;
+                }
+            }
+            comp->unreachable_depth = unreachable_depth;
 
-            // Test
-            ok = array_push(comp->src_positions_stack, &foreach->source->pos);
-            if (!ok) {
+            int after_alt_ip = get_ip(comp);
+
+            for (int i = 0; i < array_count(jump_to_end_ips); i++) {
+                int *pos = array_get(jump_to_end_ips, i);
+                change_uint16_operand(comp, *pos + 1, after_alt_ip);
+            }
+
+            array_destroy(jump_to_end_ips);
+
+            break;
+        statement_if_error:
+            array_destroy(jump_to_end_ips);
+            return false;
+        }
+        case STATEMENT_RETURN_VALUE: {
+            if (compilation_scope->outer == NULL) {
+                errors_add_errorf(comp->errors, ERROR_COMPILATION, stmt->pos, "Nothing to return from");
+                return false;
+            }
+            ip = -1;
+            if (stmt->return_value) {
+                ok = compile_expression(comp, stmt->return_value);
+                if (!ok) {
+                    return false;
+                }
+                ip = emit(comp, OPCODE_RETURN_VALUE, 0, NULL);
+            } else {
+                ip = emit(comp, OPCODE_RETURN, 0, NULL);
+            }
+            if (ip < 0) {
                 return false;
             }
+            break;
+        }
+        case STATEMENT_WHILE_LOOP: {
+            const while_loop_statement_t *loop = &stmt->while_loop;
+
+            // loop that never runs is only checked for errors
+            bool never_runs = is_bool_literal(loop->test, false);
+            if (never_runs) {
+                comp->unreachable_depth++;
+            }
+
+            int before_test_ip = get_ip(comp);
 
-            ok = read_symbol(comp, source_symbol);
+            ok = compile_expression(comp, loop->test);
             if (!ok) {
                 return false;
             }
 
-            ip = emit(comp, OPCODE_LEN, 0, NULL);
+            int after_test_ip = get_ip(comp);
+            ip = emit(comp, OPCODE_JUMP_IF_TRUE, 1, (uint64_t[]){after_test_ip + 6});
             if (ip < 0) {
                 return false;
             }
 
-            array_pop(comp->src_positions_stack, NULL);
-            ok = read_symbol(comp, index_symbol);
+            int jump_to_after_body_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xdead});
+            if (jump_to_after_body_ip < 0) {
+                return false;
+            }
+
+            ok = push_continue_ip(comp, before_test_ip);
             if (!ok) {
                 return false;
             }
 
-            ip = emit(comp, OPCODE_COMPARE, 0, NULL);
-            if (ip < 0) {
+            ok = push_break_ip(comp, jump_to_after_body_ip);
+            if (!ok) {
+                return false;
+            }
+
+            ok = compile_code_block(comp, loop->body);
+            if (!ok) {
                 return false;
             }
 
-            ip = emit(comp, OPCODE_EQUAL, 0, NULL);
+            pop_break_ip(comp);
+            pop_continue_ip(comp);
+
+            ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){before_test_ip});
             if (ip < 0) {
                 return false;
             }
 
-            int after_test_ip = get_ip(comp);
-            ip = emit(comp, OPCODE_JUMP_IF_FALSE, 1, (uint64_t[]){after_test_ip + 6});
+            int after_body_ip = get_ip(comp);
+            change_uint16_operand(comp, jump_to_after_body_ip + 1, after_body_ip);
+
+            if (never_runs) {
+                comp->unreachable_depth--;
+            }
+            break;
+        }
+        case STATEMENT_BREAK: {
+            int break_ip = get_break_ip(comp);
+            if (break_ip < 0) {
+                errors_add_errorf(comp->errors, ERROR_COMPILATION, stmt->pos, "Nothing to break from.");
+                return false;
+            }
+            ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){break_ip});
+            if (ip < 0) {
+                return false;
+            }
+            break;
+        }
+        case STATEMENT_CONTINUE: {
+            int continue_ip = get_continue_ip(comp);
+            if (continue_ip < 0) {
+                errors_add_errorf(comp->errors, ERROR_COMPILATION, stmt->pos, "Nothing to continue from.");
+                return false;
+            }
+            ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){continue_ip});
             if (ip < 0) {
                 return false;
             }
+            break;
+        }
+        case STATEMENT_FOREACH: {
+            const foreach_statement_t *foreach = &stmt->foreach;
+            ok = symbol_table_push_block_scope(symbol_table);
+            if (!ok) {
+                return false;
+            }
 
-            int jump_to_after_body_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xdead});
-            if (jump_to_after_body_ip < 0) {
+            // Init
+            const symbol_t *index_symbol = NULL;
+            const symbol_t *source_symbol = NULL;
+            const symbol_t *range_end_symbol = NULL;
+            const symbol_t *range_step_symbol = NULL;
+            bool is_range = is_builtin_range_call(comp, foreach->source);
+            if (is_range) {
+                // range isn't materialised, @i counts from start to end by step
+                // range is pushed too, FOREACH_RANGE_INIT calls it if it's been replaced since compiling
+                const call_expression_t *range_call = &foreach->source->call_expr;
+                ok = compile_expression(comp, range_call->function);
+                if (!ok) {
+                    return false;
+                }
+
+                for (int i = 0; i < ptrarray_count(range_call->args); i++) {
+                    ok = compile_expression(comp, ptrarray_get(range_call->args, i));
+                    if (!ok) {
+                        return false;
+                    }
+                }
+
+                ok = array_push(comp->src_positions_stack, &foreach->source->pos);
+                if (!ok) {
+                    return false;
+                }
+
+                ip = emit(comp, OPCODE_FOREACH_RANGE_INIT, 1, (uint64_t[]){ptrarray_count(range_call->args)});
+                if (ip < 0) {
+                    return false;
+                }
+
+                array_pop(comp->src_positions_stack, NULL);
+
+                range_end_symbol = define_symbol(comp, foreach->source->pos, "@end", false, true);
+                if (!range_end_symbol) {
+                    return false;
+                }
+                ok = write_symbol(comp, range_end_symbol, true);
+                if (!ok) {
+                    return false;
+                }
+
+                index_symbol = define_symbol(comp, stmt->pos, "@i", false, true);
+                if (!index_symbol) {
+                    return false;
+                }
+                ok = write_symbol(comp, index_symbol, true);
+                if (!ok) {
+                    return false;
+                }
+
+                range_step_symbol = define_symbol(comp, foreach->source->pos, "@step", false, true);
+                if (!range_step_symbol) {
+                    return false;
+                }
+                ok = write_symbol(comp, range_step_symbol, true);
+                if (!ok) {
+                    return false;
+                }
+            } else {
+                index_symbol = define_symbol(comp, stmt->pos, "@i", false, true);
+                if (!index_symbol) {
+                    return false;
+                }
+
+                ip = emit(comp, OPCODE_NUMBER, 1, (uint64_t[]){0});
+                if (ip < 0) {
+                    return false;
+                }
+
+                ok = write_symbol(comp, index_symbol, true);
+                if (!ok) {
+                    return false;
+                }
+
+                if (foreach->source->type == EXPRESSION_IDENT) {
+                    source_symbol = symbol_table_resolve(symbol_table, foreach->source->ident->value);
+                    if (!source_symbol) {
+                        errors_add_errorf(comp->errors, ERROR_COMPILATION, foreach->source->pos,
+                                          "Symbol \"%s\" could not be resolved", foreach->source->ident->value);
+                        return false;
+                    }
+                } else {
+                    ok = compile_expression(comp, foreach->source);
+                    if (!ok) {
+                        return false;
+                    }
+                    source_symbol = define_symbol(comp, foreach->source->pos, "@source", false, true);
+                    if (!source_symbol) {
+                        return false;
+                    }
+                    ok = write_symbol(comp, source_symbol, true);
+                    if (!ok) {
+                        return false;
+                    }
+                }
+            }
+
+            // Update
+            int jump_to_after_update_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xbeef});
+            if (jump_to_after_update_ip < 0) {
                 return false;
             }
 
-            ok = read_symbol(comp, source_symbol);
-            if (!ok) {
+            // break jumps here, FOREACH_NEXT's operand can't be used as a jump target
+            int jump_to_after_body_ip = emit(comp, OPCODE_JUMP, 1, (uint64_t[]){0xdead});
+            if (jump_to_after_body_ip < 0) {
                 return false;
             }
 
+            int update_ip = get_ip(comp);
             ok = read_symbol(comp, index_symbol);
             if (!ok) {
                 return false;
             }
 
-            ip = emit(comp, OPCODE_GET_VALUE_AT, 0, NULL);
+            if (is_range) {
+                ok = read_symbol(comp, range_step_symbol);
+                if (!ok) {
+                    return false;
+                }
+            } else {
+                ip = emit(comp, OPCODE_NUMBER, 1, (uint64_t[]){ape_double_to_uint64(1)});
+                if (ip < 0) {
+                    return false;
+                }
+            }
+
+            ip = emit(comp, OPCODE_ADD, 0, NULL);
             if (ip < 0) {
                 return false;
             }
 
+            ok = write_symbol(comp, index_symbol, false);
+            if (!ok) {
+                return false;
+            }
+
+            int after_update_ip = get_ip(comp);
+            change_uint16_operand(comp, jump_to_after_update_ip + 1, after_update_ip);
+
+            // Test (pushes next item or jumps past the body when source is exhausted)
+            int next_ip = -1;
+            if (is_range) {
+                ok = read_symbol(comp, index_symbol);
+                if (!ok) {
+                    return false;
+                }
+
+                ok = read_symbol(comp, range_end_symbol);
+                if (!ok) {
+                    return false;
+                }
+
+                ok = read_symbol(comp, range_step_symbol);
+                if (!ok) {
+                    return false;
+                }
+
+                ok = array_push(comp->src_positions_stack, &foreach->source->pos);
+                if (!ok) {
+                    return false;
+                }
+
+                next_ip = emit(comp, OPCODE_FOREACH_RANGE_NEXT, 1, (uint64_t[]){0xdead});
+                if (next_ip < 0) {
+                    return false;
+                }
+            } else {
+                ok = read_symbol(comp, source_symbol);
+                if (!ok) {
+                    return false;
+                }
+
+                ok = read_symbol(comp, index_symbol);
+                if (!ok) {
+                    return false;
+                }
+
+                ok = array_push(comp->src_positions_stack, &foreach->source->pos);
+                if (!ok) {
+                    return false;
+                }
+
+                next_ip = emit(comp, OPCODE_FOREACH_NEXT, 1, (uint64_t[]){0xdead});
+                if (next_ip < 0) {
+                    return false;
+                }
+            }
+
+            array_pop(comp->src_positions_stack, NULL);
+
             const symbol_t *iter_symbol  = define_symbol(comp, foreach->iterator->pos, foreach->iterator->value, false, false);
             if (!iter_symbol) {
                 return false;
@@ -9077,6 +11012,7 @@ static bool compile_statement(compiler_t *comp, const statement_t *stmt) {
 
             int after_body_ip = get_ip(comp);
             change_uint16_operand(comp, jump_to_after_body_ip + 1, after_body_ip);
+            change_uint16_operand(comp, next_ip + 1, after_body_ip);
 
             symbol_table_pop_block_scope(symbol_table);
             break;
@@ -9566,12 +11502,18 @@ static bool compile_expression(compiler_t *comp, expression_t *expr) {
                 ptrarray_destroy_with_items(free_symbols, symbol_destroy);
                 goto error;
             }
-            pop_symbol_table(comp);
+            ok = optimise_bytecode(comp_res, false);
+            if (!ok) {
+                ptrarray_destroy_with_items(free_symbols, symbol_destroy);
+                compilation_result_destroy(comp_res);
+                goto error;
+            }
+            pop_symbol_table(comp);
             pop_compilation_scope(comp);
             compilation_scope = get_compilation_scope(comp);
             symbol_table = compiler_get_symbol_table(comp);
             
-            object_t obj = object_make_function(comp->mem, fn->name, comp_res, true,
+            object_t obj = object_make_function(comp->mem, fn->name, comp_res, comp->constants, true,
                                                 num_locals, ptrarray_count(fn->params), 0);
 
             if (object_is_null(obj)) {
@@ -9606,6 +11548,15 @@ static bool compile_expression(compiler_t *comp, expression_t *expr) {
             break;
         }
         case EXPRESSION_CALL: {
+            const fn_literal_t *inline_fn = get_inline_function(comp, expr);
+            if (inline_fn) {
+                ok = compile_inlined_call(comp, inline_fn, expr->call_expr.args, expr->pos);
+                if (!ok) {
+                    goto error;
+                }
+                break;
+            }
+
             ok = compile_expression(comp, expr->call_expr.function);
             if (!ok) {
                 goto error;
@@ -9702,6 +11653,25 @@ static bool compile_expression(compiler_t *comp, expression_t *expr) {
         case EXPRESSION_LOGICAL: {
             const logical_expression_t* logi = &expr->logical;
 
+            // with constant left side only one of the sides is evaluated
+            if (logi->left->type == EXPRESSION_BOOL_LITERAL) {
+                bool short_circuits = logi->op == OPERATOR_LOGICAL_AND ? !logi->left->bool_literal : logi->left->bool_literal;
+                if (short_circuits) {
+                    ok = compile_expression(comp, logi->left);
+                    if (ok) {
+                        comp->unreachable_depth++;
+                        ok = compile_expression(comp, logi->right);
+                        comp->unreachable_depth--;
+                    }
+                } else {
+                    ok = compile_expression(comp, logi->right);
+                }
+                if (!ok) {
+                    goto error;
+                }
+                break;
+            }
+
             ok = compile_expression(comp, logi->left);
             if (!ok) {
                 goto error;
@@ -9741,6 +11711,21 @@ static bool compile_expression(compiler_t *comp, expression_t *expr) {
         case EXPRESSION_TERNARY: {
             const ternary_expression_t* ternary = &expr->ternary;
 
+            if (ternary->test->type == EXPRESSION_BOOL_LITERAL) {
+                expression_t *taken = ternary->test->bool_literal ? ternary->if_true : ternary->if_false;
+                expression_t *not_taken = ternary->test->bool_literal ? ternary->if_false : ternary->if_true;
+                ok = compile_expression(comp, taken);
+                if (ok) {
+                    comp->unreachable_depth++;
+                    ok = compile_expression(comp, not_taken);
+                    comp->unreachable_depth--;
+                }
+                if (!ok) {
+                    goto error;
+                }
+                break;
+            }
+
             ok = compile_expression(comp, ternary->test);
             if (!ok) {
                 goto error;
@@ -9768,6 +11753,28 @@ static bool compile_expression(compiler_t *comp, expression_t *expr) {
 
             break;
         }
+        case EXPRESSION_YIELD: {
+            if (compilation_scope->outer == NULL) {
+                errors_add_errorf(comp->errors, ERROR_COMPILATION, expr->pos, "Nothing to yield from");
+                goto error;
+            }
+            if (expr->yield_value) {
+                ok = compile_expression(comp, expr->yield_value);
+                if (!ok) {
+                    goto error;
+                }
+            } else {
+                ip = emit(comp, OPCODE_NULL, 0, NULL);
+                if (ip < 0) {
+                    goto error;
+                }
+            }
+            ip = emit(comp, OPCODE_YIELD, 0, NULL);
+            if (ip < 0) {
+                goto error;
+            }
+            break;
+        }
         default: {
             APE_ASSERT(false);
             break;
@@ -9779,7 +11786,6 @@ error:
     res = false;
 end:
     array_pop(comp->src_positions_stack, NULL);
-    expression_destroy(expr_optimised);
     return res;
 }
 
@@ -9805,27 +11811,35 @@ static bool compile_code_block(compiler_t *comp, const code_block_t *block) {
         }
     }
 
+    int unreachable_depth = comp->unreachable_depth;
     for (int i = 0; i < ptrarray_count(block->statements); i++) {
         const statement_t *stmt = ptrarray_get(block->statements, i);
         bool ok = compile_statement(comp, stmt);
         if (!ok) {
             return false;
         }
+        if (is_jump_statement(stmt) && comp->unreachable_depth == unreachable_depth) {
+            comp->unreachable_depth++; // rest of the block can't be reached
+        }
     }
+    comp->unreachable_depth = unreachable_depth;
     symbol_table_pop_block_scope(symbol_table);
     return true;
 }
 
 static int add_constant(compiler_t *comp, object_t obj) {
-    bool ok = array_add(comp->constants, &obj);
+    bool ok = object_add_array_value(comp->constants, obj);
     if (!ok) {
         return -1;
     }
-    int pos = array_count(comp->constants) - 1;
+    int pos = object_get_array_length(comp->constants) - 1;
     return pos;
 }
 
 static void change_uint16_operand(compiler_t *comp, int ip, uint16_t operand) {
+    if (comp->unreachable_depth > 0) {
+        return;
+    }
     array(uint8_t) *bytecode = get_bytecode(comp);
     if ((ip + 1) >= array_count(bytecode)) {
         APE_ASSERT(false);
@@ -9932,10 +11946,6 @@ static int get_ip(compiler_t *comp) {
     return array_count(compilation_scope->bytecode);
 }
 
-static array(src_pos_t)* get_src_positions(compiler_t *comp) {
-    compilation_scope_t *compilation_scope = get_compilation_scope(comp);
-    return compilation_scope->src_positions;
-}
 
 static array(uint8_t)* get_bytecode(compiler_t *comp) {
     compilation_scope_t *compilation_scope = get_compilation_scope(comp);
@@ -9949,10 +11959,6 @@ static file_scope_t* file_scope_make(compiler_t *comp, compiled_file_t *file) {
     }
     memset(file_scope, 0, sizeof(file_scope_t));
     file_scope->alloc = comp->alloc;
-    file_scope->parser = parser_make(comp->alloc, comp->config, comp->errors);
-    if (!file_scope->parser) {
-        goto err;
-    }
     file_scope->symbol_table = NULL;
     file_scope->file = file;
     file_scope->loaded_module_names = ptrarray_make(comp->alloc);
@@ -9971,7 +11977,6 @@ static void file_scope_destroy(file_scope_t *scope) {
         allocator_free(scope->alloc, name);
     }
     ptrarray_destroy(scope->loaded_module_names);
-    parser_destroy(scope->parser);
     allocator_free(scope->alloc, scope);
 }
 
@@ -10131,7 +12136,7 @@ static const symbol_t* define_symbol(compiler_t *comp, src_pos_t pos, const char
     symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
     if (!can_shadow && !symbol_table_is_top_global_scope(symbol_table)) {
         const symbol_t *current_symbol = symbol_table_resolve(symbol_table, name);
-        if (current_symbol) {
+        if (current_symbol && !current_symbol->shadowable) {
             errors_add_errorf(comp->errors, ERROR_COMPILATION, pos, "Symbol \"%s\" is already defined", name);
             return NULL;
         }
@@ -10143,8 +12148,198 @@ static const symbol_t* define_symbol(compiler_t *comp, src_pos_t pos, const char
         return false;
     }
 
+    if (symbol->type == SYMBOL_MODULE_GLOBAL && symbol->index >= VM_MAX_GLOBALS) {
+        errors_add_errorf(comp->errors, ERROR_COMPILATION, pos, "Too many globals, at most %d can be defined", VM_MAX_GLOBALS);
+        return NULL;
+    }
+
     return symbol;
 }
+
+static bool is_jump_statement(const statement_t *stmt) {
+    return stmt->type == STATEMENT_RETURN_VALUE || stmt->type == STATEMENT_BREAK || stmt->type == STATEMENT_CONTINUE;
+}
+
+// true for tests that were folded to a constant by optimise_statements
+static bool is_bool_literal(const expression_t *expr, bool value) {
+    return expr->type == EXPRESSION_BOOL_LITERAL && expr->bool_literal == value;
+}
+
+static bool can_inline_function(compiler_t *comp, const fn_literal_t *fn) {
+    if (ptrarray_count(fn->body->statements) != 1) {
+        return false;
+    }
+    const statement_t *stmt = ptrarray_get(fn->body->statements, 0);
+    if (stmt->type != STATEMENT_RETURN_VALUE || !stmt->return_value) {
+        return false;
+    }
+    for (int i = 0; i < ptrarray_count(fn->params); i++) {
+        const ident_t *param = ptrarray_get(fn->params, i);
+        if (global_store_get_symbol(comp->global_store, param->value)) {
+            return false;
+        }
+    }
+    int budget = COMPILER_MAX_INLINED_EXPRESSIONS;
+    return can_inline_expression(comp, fn, stmt->return_value, &budget);
+}
+
+// only parameters and ape globals can be referenced, so the expression means the same in every scope
+static bool can_inline_expression(compiler_t *comp, const fn_literal_t *fn, const expression_t *expr, int *budget) {
+    (*budget)--;
+    if (*budget < 0) {
+        return false;
+    }
+    switch (expr->type) {
+        case EXPRESSION_NUMBER_LITERAL:
+        case EXPRESSION_BOOL_LITERAL:
+        case EXPRESSION_STRING_LITERAL:
+        case EXPRESSION_NULL_LITERAL: {
+            return true;
+        }
+        case EXPRESSION_IDENT: {
+            for (int i = 0; i < ptrarray_count(fn->params); i++) {
+                const ident_t *param = ptrarray_get(fn->params, i);
+                if (APE_STREQ(param->value, expr->ident->value)) {
+                    return true;
+                }
+            }
+            const symbol_t *symbol = global_store_get_symbol(comp->global_store, expr->ident->value);
+            return symbol && !symbol->shadowable;
+        }
+        case EXPRESSION_ARRAY_LITERAL: {
+            for (int i = 0; i < ptrarray_count(expr->array); i++) {
+                if (!can_inline_expression(comp, fn, ptrarray_get(expr->array, i), budget)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case EXPRESSION_MAP_LITERAL: {
+            for (int i = 0; i < ptrarray_count(expr->map.keys); i++) {
+                if (!can_inline_expression(comp, fn, ptrarray_get(expr->map.keys, i), budget)
+                    || !can_inline_expression(comp, fn, ptrarray_get(expr->map.values, i), budget)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case EXPRESSION_PREFIX: {
+            return can_inline_expression(comp, fn, expr->prefix.right, budget);
+        }
+        case EXPRESSION_INFIX: {
+            return can_inline_expression(comp, fn, expr->infix.left, budget)
+                && can_inline_expression(comp, fn, expr->infix.right, budget);
+        }
+        case EXPRESSION_CALL: {
+            if (!can_inline_expression(comp, fn, expr->call_expr.function, budget)) {
+                return false;
+            }
+            for (int i = 0; i < ptrarray_count(expr->call_expr.args); i++) {
+                if (!can_inline_expression(comp, fn, ptrarray_get(expr->call_expr.args, i), budget)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        case EXPRESSION_INDEX: {
+            return can_inline_expression(comp, fn, expr->index_expr.left, budget)
+                && can_inline_expression(comp, fn, expr->index_expr.index, budget);
+        }
+        case EXPRESSION_LOGICAL: {
+            return can_inline_expression(comp, fn, expr->logical.left, budget)
+                && can_inline_expression(comp, fn, expr->logical.right, budget);
+        }
+        case EXPRESSION_TERNARY: {
+            return can_inline_expression(comp, fn, expr->ternary.test, budget)
+                && can_inline_expression(comp, fn, expr->ternary.if_true, budget)
+                && can_inline_expression(comp, fn, expr->ternary.if_false, budget);
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+static const fn_literal_t* get_inline_function(compiler_t *comp, const expression_t *call) {
+    const expression_t *function = call->call_expr.function;
+    if (function->type != EXPRESSION_IDENT) {
+        return NULL;
+    }
+    symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
+    const symbol_t *symbol = symbol_table_resolve(symbol_table, function->ident->value);
+    if (!symbol || symbol->type != SYMBOL_MODULE_GLOBAL) {
+        return NULL;
+    }
+    for (int i = 0; i < array_count(comp->inline_functions); i++) {
+        const inline_function_t *inline_fn = array_get(comp->inline_functions, i);
+        if (inline_fn->symbol_index == symbol->index) {
+            if (ptrarray_count(inline_fn->fn->params) != ptrarray_count(call->call_expr.args)) {
+                return NULL; // fails at runtime like a regular call
+            }
+            return inline_fn->fn;
+        }
+    }
+    return NULL;
+}
+
+static bool compile_inlined_call(compiler_t *comp, const fn_literal_t *fn, ptrarray(expression_t) *args, src_pos_t call_pos) {
+    // all arguments are evaluated before parameters are defined so they can't refer to them
+    for (int i = 0; i < ptrarray_count(args); i++) {
+        bool ok = compile_expression(comp, ptrarray_get(args, i));
+        if (!ok) {
+            return false;
+        }
+    }
+
+    symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
+    bool ok = symbol_table_push_block_scope(symbol_table);
+    if (!ok) {
+        return false;
+    }
+
+    for (int i = ptrarray_count(fn->params) - 1; i >= 0; i--) {
+        const ident_t *param = ptrarray_get(fn->params, i);
+        const symbol_t *symbol = symbol_table_define(symbol_table, param->value, false);
+        if (!symbol) {
+            ok = false;
+            goto end;
+        }
+        ok = write_symbol(comp, symbol, true);
+        if (!ok) {
+            goto end;
+        }
+    }
+
+    // body is marked with the call so tracebacks show the inlined function's frame
+    const statement_t *stmt = ptrarray_get(fn->body->statements, 0);
+    inline_frame_t prev_inline_frame = comp->inline_frame;
+    comp->inline_frame.function_name = fn->name ? fn->name : "anonymous";
+    comp->inline_frame.call_pos = call_pos;
+    ok = compile_expression(comp, stmt->return_value);
+    comp->inline_frame = prev_inline_frame;
+end:
+    symbol_table_pop_block_scope(symbol_table);
+    return ok;
+}
+
+static bool is_builtin_range_call(compiler_t *comp, const expression_t *expr) {
+    if (expr->type != EXPRESSION_CALL) {
+        return false;
+    }
+    const call_expression_t *call_expr = &expr->call_expr;
+    int argc = ptrarray_count(call_expr->args);
+    if (call_expr->function->type != EXPRESSION_IDENT || argc < 1 || argc > 3) {
+        return false;
+    }
+    symbol_table_t *symbol_table = compiler_get_symbol_table(comp);
+    const symbol_t *symbol = symbol_table_resolve(symbol_table, call_expr->function->ident->value);
+    if (!symbol || symbol->type != SYMBOL_APE_GLOBAL) {
+        return false;
+    }
+    bool ok = false;
+    object_t obj = global_store_get_object_at(comp->global_store, symbol->index, &ok);
+    return ok && builtins_is_range(obj);
+}
 //FILE_END
 //FILE_START:object.c
 #include <stdlib.h>
@@ -10160,6 +12355,8 @@ static const symbol_t* define_symbol(compiler_t *comp, src_pos_t pos, const char
 #include "compiler.h"
 #include "traceback.h"
 #include "gc.h"
+#include "jit.h"
+#include "errors.h"
 #endif
 
 #define OBJECT_PATTERN          0xfff8000000000000
@@ -10168,7 +12365,7 @@ static const symbol_t* define_symbol(compiler_t *comp, src_pos_t pos, const char
 #define OBJECT_BOOL_HEADER      0xfff9000000000000
 #define OBJECT_NULL_PATTERN     0xfffa000000000000
 
-static object_t object_deep_copy_internal(gcmem_t *mem, object_t obj, valdict(object_t, object_t) *copies);
+static object_t object_deep_copy_internal(gcmem_t *mem, object_t obj, valdict(object_t, object_t) *copies, bool to_other_heap, bool share_code, errors_t *errors);
 static bool object_equals_wrapped(const object_t *a, const object_t *b);
 static unsigned long object_hash(object_t *obj_ptr);
 static unsigned long object_hash_string(const char *str);
@@ -10242,6 +12439,28 @@ object_t object_make_string_with_capacity(gcmem_t *mem, int capacity) {
     return object_make_from_data(OBJECT_STRING, data);
 }
 
+object_t object_make_string_view(gcmem_t *mem, object_t string, int offset) {
+    APE_ASSERT(object_get_type(string) == OBJECT_STRING);
+    object_data_t *string_data = object_get_allocated_data(string);
+    APE_ASSERT(offset >= 0 && offset <= string_data->string.length);
+    object_data_t *data = gcmem_alloc_object_data(mem, OBJECT_STRING);
+    if (!data) {
+        return object_make_null();
+    }
+    if (string_data->string.is_view) {
+        data->string.view_parent = string_data->string.view_parent;
+    } else {
+        data->string.view_parent = string;
+    }
+    data->string.view_value = object_data_get_string(string_data) + offset;
+    data->string.is_view = true;
+    data->string.is_allocated = false;
+    data->string.length = string_data->string.length - offset;
+    data->string.capacity = data->string.length;
+    data->string.hash = 0;
+    return object_make_from_data(OBJECT_STRING, data);
+}
+
 object_t object_make_stringf(gcmem_t *mem, const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -10370,11 +12589,16 @@ object_t object_make_errorf(gcmem_t *mem, const char *fmt, ...) {
     return res_obj;
 }
 
-object_t object_make_function(gcmem_t *mem, const char *name, compilation_result_t *comp_res, bool owns_data,
-                              int num_locals, int num_args,
+object_t object_make_function(gcmem_t *mem, const char *name, compilation_result_t *comp_res,
+                              object_t constants, bool owns_data, int num_locals, int num_args,
                               int free_vals_count) {
 
-    object_data_t *data = gcmem_alloc_object_data(mem, OBJECT_FUNCTION);
+    // free values that don't fit inline are stored right after object data, in the same allocation
+    int tail_size = 0;
+    if (free_vals_count > FUNCTION_INLINE_FREE_VALS) {
+        tail_size = sizeof(object_t) * free_vals_count;
+    }
+    object_data_t *data = gcmem_alloc_object_data_with_tail(mem, OBJECT_FUNCTION, tail_size);
     if (!data) {
         return object_make_null();
     }
@@ -10387,16 +12611,19 @@ object_t object_make_function(gcmem_t *mem, const char *name, compilation_result
         data->function.const_name = name ? name : "anonymous";
     }
     data->function.comp_result = comp_res;
+    data->function.constants = constants;
     data->function.owns_data = owns_data;
     data->function.num_locals = num_locals;
     data->function.num_args = num_args;
-    if (free_vals_count >= APE_ARRAY_LEN(data->function.free_vals_buf)) {
-        data->function.free_vals_allocated = allocator_malloc(mem->alloc, sizeof(object_t) * free_vals_count);
-        if (!data->function.free_vals_allocated) {
-            return object_make_null();
-        }
+    if (tail_size > 0) {
+        data->function.free_vals_allocated = (object_t*)((uint8_t*)&data->function + sizeof(function_t));
     }
     data->function.free_vals_count = free_vals_count;
+#ifdef APE_JIT
+    data->function.jit_code = NULL;
+    data->function.jit_counter = 0;
+    data->function.jit_failed = false;
+#endif
     return object_make_from_data(OBJECT_FUNCTION, data);
 }
 
@@ -10411,6 +12638,17 @@ object_t object_make_external(gcmem_t *mem, void *data) {
     return object_make_from_data(OBJECT_EXTERNAL, obj);
 }
 
+object_t object_make_coroutine(gcmem_t *mem, object_t function) {
+    object_data_t *obj = gcmem_alloc_object_data(mem, OBJECT_COROUTINE);
+    if (!obj) {
+        return object_make_null();
+    }
+    memset(&obj->coroutine, 0, sizeof(coroutine_t));
+    obj->coroutine.function = function;
+    obj->coroutine.state = COROUTINE_CREATED;
+    return object_make_from_data(OBJECT_COROUTINE, obj);
+}
+
 void object_deinit(object_t obj) {
     if (object_is_allocated(obj)) {
         object_data_t *data = object_get_allocated_data(obj);
@@ -10426,18 +12664,18 @@ void object_data_deinit(object_data_t *data) {
         }
         case OBJECT_STRING: {
             if (data->string.is_allocated) {
-                allocator_free(data->mem->alloc, data->string.value_allocated);
+                allocator_free(data->page->mem->alloc, data->string.value_allocated);
             }
             break;
         }
         case OBJECT_FUNCTION: {
+#ifdef APE_JIT
+            jit_code_destroy(data->page->mem->alloc, data->function.jit_code);
+#endif
             if (data->function.owns_data) {
-                allocator_free(data->mem->alloc, data->function.name);
+                allocator_free(data->page->mem->alloc, data->function.name);
                 compilation_result_destroy(data->function.comp_result);
             }
-            if (freevals_are_allocated(&data->function)) {
-                allocator_free(data->mem->alloc, data->function.free_vals_allocated);
-            }
             break;
         }
         case OBJECT_ARRAY: {
@@ -10449,7 +12687,7 @@ void object_data_deinit(object_data_t *data) {
             break;
         }
         case OBJECT_NATIVE_FUNCTION: {
-            allocator_free(data->mem->alloc, data->native_function.name);
+            allocator_free(data->page->mem->alloc, data->native_function.name);
             break;
         }
         case OBJECT_EXTERNAL: {
@@ -10458,8 +12696,13 @@ void object_data_deinit(object_data_t *data) {
             }
             break;
         }
+        case OBJECT_COROUTINE: {
+            allocator_free(data->page->mem->alloc, data->coroutine.frames);
+            allocator_free(data->page->mem->alloc, data->coroutine.stack);
+            break;
+        }
         case OBJECT_ERROR: {
-            allocator_free(data->mem->alloc, data->error.message);
+            allocator_free(data->page->mem->alloc, data->error.message);
             traceback_destroy(data->error.traceback);
             break;
         }
@@ -10476,7 +12719,7 @@ bool object_is_allocated(object_t object) {
 
 gcmem_t* object_get_mem(object_t obj) {
     object_data_t *data = object_get_allocated_data(obj);
-    return data->mem;
+    return data->page->mem;
 }
 
 bool object_is_hashable(object_t obj) {
@@ -10525,7 +12768,8 @@ void object_to_string(object_t obj, strbuf_t *buf, bool quote_str) {
         case OBJECT_FUNCTION: {
             const function_t *function = object_get_function(obj);
             strbuf_appendf(buf, "CompiledFunction: %s\n", object_get_function_name(obj));
-            code_to_string(function->comp_result->bytecode, function->comp_result->src_positions, function->comp_result->count, buf);
+            code_to_string(function->comp_result->bytecode, function->comp_result->src_positions,
+                           function->comp_result->src_positions_size, function->comp_result->count, buf);
             break;
         }
         case OBJECT_ARRAY: {
@@ -10563,6 +12807,10 @@ void object_to_string(object_t obj, strbuf_t *buf, bool quote_str) {
             strbuf_append(buf, "EXTERNAL");
             break;
         }
+        case OBJECT_COROUTINE: {
+            strbuf_append(buf, "COROUTINE");
+            break;
+        }
         case OBJECT_ERROR: {
             strbuf_appendf(buf, "ERROR: %s\n", object_get_error_message(obj));
             traceback_t *traceback = object_get_error_traceback(obj);
@@ -10592,6 +12840,7 @@ const char *object_get_type_name(const object_type_t type) {
         case OBJECT_MAP:             return "MAP";
         case OBJECT_FUNCTION:        return "FUNCTION";
         case OBJECT_EXTERNAL:        return "EXTERNAL";
+        case OBJECT_COROUTINE:       return "COROUTINE";
         case OBJECT_ERROR:           return "ERROR";
         case OBJECT_ANY:             return "ANY";
     }
@@ -10627,6 +12876,7 @@ char* object_get_type_union_name(allocator_t *alloc, const object_type_t type) {
     CHECK_TYPE(OBJECT_MAP);
     CHECK_TYPE(OBJECT_FUNCTION);
     CHECK_TYPE(OBJECT_EXTERNAL);
+    CHECK_TYPE(OBJECT_COROUTINE);
     CHECK_TYPE(OBJECT_ERROR);
 
     return strbuf_get_string_and_destroy(res);
@@ -10647,17 +12897,534 @@ object_t object_deep_copy(gcmem_t *mem, object_t obj) {
     if (!copies) {
         return object_make_null();
     }
-    object_t res = object_deep_copy_internal(mem, obj, copies);
-    valdict_destroy(copies);
-    return res;
-}
+    object_t res = object_deep_copy_internal(mem, obj, copies, false, false, NULL);
+    valdict_destroy(copies);
+    return res;
+}
+
+// copies object graph into a different heap, if share_code is set functions share bytecode with the originals
+object_t object_copy_to_heap(gcmem_t *mem, object_t obj, valdict(object_t, object_t) *copies, bool share_code, errors_t *errors) {
+    return object_deep_copy_internal(mem, obj, copies, true, share_code, errors);
+}
+
+object_t object_copy(gcmem_t *mem, object_t obj) {
+    object_t copy = object_make_null();
+    object_type_t type = object_get_type(obj);
+    switch (type) {
+        case OBJECT_ANY:
+        case OBJECT_FREED:
+        case OBJECT_NONE: {
+            APE_ASSERT(false);
+            copy = object_make_null();
+            break;
+        }
+        case OBJECT_NUMBER:
+        case OBJECT_BOOL:
+        case OBJECT_NULL:
+        case OBJECT_FUNCTION:
+        case OBJECT_NATIVE_FUNCTION:
+        case OBJECT_COROUTINE:
+        case OBJECT_ERROR: {
+            copy = obj;
+            break;
+        }
+        case OBJECT_STRING: {
+            const char *str = object_get_string(obj);
+            copy = object_make_string(mem, str);
+            break;
+        }
+        case OBJECT_ARRAY: {
+            int len = object_get_array_length(obj);
+            copy = object_make_array_with_capacity(mem, len);
+            if (object_is_null(copy)) {
+                return object_make_null();
+            }
+            for (int i = 0; i < len; i++) {
+                object_t item = object_get_array_value_at(obj, i);
+                bool ok = object_add_array_value(copy, item);
+                if (!ok) {
+                    return object_make_null();
+                }
+            }
+            break;
+        }
+        case OBJECT_MAP: {
+            copy = object_make_map(mem);
+            for (int i = 0; i < object_get_map_length(obj); i++) {
+                object_t key = object_get_map_key_at(obj, i);
+                object_t val = object_get_map_value_at(obj, i);
+                bool ok = object_set_map_value(copy, key, val);
+                if (!ok) {
+                    return object_make_null();
+                }
+            }
+            break;
+        }
+        case OBJECT_EXTERNAL: {
+            copy = object_make_external(mem, NULL);
+            if (object_is_null(copy)) {
+                return object_make_null();
+            }
+            external_data_t *external = object_get_external_data(obj);
+            void *data_copy = NULL;
+            if (external->data_copy_fn) {
+                data_copy = external->data_copy_fn(external->data);
+            } else {
+                data_copy = external->data;
+            }
+            object_set_external_data(copy, data_copy);
+            object_set_external_destroy_function(copy, external->data_destroy_fn);
+            object_set_external_copy_function(copy, external->data_copy_fn);
+            break;
+        }
+    }
+    return copy;
+}
+
+double object_compare(object_t a, object_t b, bool *out_ok) {
+    if (a.handle == b.handle) {
+        return 0;
+    }
+
+    *out_ok = true;
+
+    object_type_t a_type = object_get_type(a);
+    object_type_t b_type = object_get_type(b);
+
+    if ((a_type == OBJECT_NUMBER || a_type == OBJECT_BOOL || a_type == OBJECT_NULL)
+        && (b_type == OBJECT_NUMBER || b_type == OBJECT_BOOL || b_type == OBJECT_NULL)) {
+        double left_val = object_get_number(a);
+        double right_val = object_get_number(b);
+        return left_val - right_val;
+    } else if (a_type == b_type && a_type == OBJECT_STRING) {
+        int a_len = object_get_string_length(a);
+        int b_len = object_get_string_length(b);
+        if (a_len != b_len) {
+            return a_len - b_len;
+        }
+        unsigned long a_hash = object_get_string_hash(a);
+        unsigned long b_hash = object_get_string_hash(b);
+        if (a_hash != b_hash) {
+            return a_hash - b_hash;
+        }
+        const char *a_string = object_get_string(a);
+        const char *b_string = object_get_string(b);
+        return strcmp(a_string, b_string);
+    } else if ((object_is_allocated(a) || object_is_null(a))
+            && (object_is_allocated(b) || object_is_null(b))) {
+        intptr_t a_data_val = (intptr_t)object_get_allocated_data(a);
+        intptr_t b_data_val = (intptr_t)object_get_allocated_data(b);
+        return (double)(a_data_val - b_data_val);
+    } else {
+        *out_ok = false;
+    }
+    return 1;
+}
+
+bool object_equals(object_t a, object_t b) {
+    object_type_t a_type = object_get_type(a);
+    object_type_t b_type = object_get_type(b);
+
+    if (a_type != b_type) {
+        return false;
+    }
+    bool ok = false;
+    double res = object_compare(a, b, &ok);
+    return APE_DBLEQ(res, 0);
+}
+
+coroutine_t* object_get_coroutine(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_COROUTINE);
+    object_data_t *data = object_get_allocated_data(object);
+    return &data->coroutine;
+}
+
+external_data_t* object_get_external_data(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
+    object_data_t *data = object_get_allocated_data(object);
+    return &data->external;
+}
+
+bool object_set_external_destroy_function(object_t object, external_data_destroy_fn destroy_fn) {
+    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
+    external_data_t* data = object_get_external_data(object);
+    if (!data) {
+        return false;
+    }
+    data->data_destroy_fn = destroy_fn;
+    return true;
+}
+
+object_data_t* object_get_allocated_data(object_t object) {
+    APE_ASSERT(object_is_allocated(object) || object_get_type(object) == OBJECT_NULL);
+    return (object_data_t*)(object.handle & ~OBJECT_HEADER_MASK);
+}
+
+bool object_get_bool(object_t obj) {
+    if (object_is_number(obj)) {
+        return obj.handle;
+    }
+    return obj.handle & (~OBJECT_HEADER_MASK);
+}
+
+double object_get_number(object_t obj) {
+    if (object_is_number(obj)) { // todo: optimise? always return number?
+        return obj.number;
+    }
+    return (double)(obj.handle & (~OBJECT_HEADER_MASK));
+}
+
+const char * object_get_string(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
+    object_data_t *data = object_get_allocated_data(object);
+    return object_data_get_string(data);
+}
+
+int object_get_string_length(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
+    object_data_t *data = object_get_allocated_data(object);
+    return data->string.length;
+}
+
+void object_set_string_length(object_t object, int len) {
+    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
+    object_data_t *data = object_get_allocated_data(object);
+    data->string.length = len;
+}
+
+
+int object_get_string_capacity(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
+    object_data_t *data = object_get_allocated_data(object);
+    return data->string.capacity;
+}
+
+char* object_get_mutable_string(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
+    object_data_t *data = object_get_allocated_data(object);
+    APE_ASSERT(!data->string.is_view);
+    return object_data_get_string(data);
+}
+
+bool object_string_append(object_t obj, const char *src, int len) {
+    APE_ASSERT(object_get_type(obj) == OBJECT_STRING);
+    object_data_t *data = object_get_allocated_data(obj);
+    object_string_t *string = &data->string;
+    char *str_buf = object_get_mutable_string(obj);
+    int current_len = string->length;
+    int capacity = string->capacity;
+    if ((len + current_len) > capacity) {
+        APE_ASSERT(false);
+        return false;
+    }
+    memcpy(str_buf + current_len, src, len);
+    string->length += len;
+    str_buf[string->length] = '\0';
+    return true;
+}
+
+unsigned long object_get_string_hash(object_t obj) {
+    APE_ASSERT(object_get_type(obj) == OBJECT_STRING);
+    object_data_t *data = object_get_allocated_data(obj);
+    if (data->string.hash == 0) {
+        data->string.hash = object_hash_string(object_get_string(obj));
+        if (data->string.hash == 0) {
+            data->string.hash = 1;
+        }
+    }
+    return data->string.hash;
+}
+
+function_t* object_get_function(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_FUNCTION);
+    object_data_t *data = object_get_allocated_data(object);
+    return &data->function;
+}
+
+native_function_t* object_get_native_function(object_t obj) {
+    object_data_t *data = object_get_allocated_data(obj);
+    return &data->native_function;
+}
+
+object_type_t object_get_type(object_t obj) {
+    if (object_is_number(obj)) {
+        return OBJECT_NUMBER;
+    }
+    uint64_t tag = (obj.handle >> 48) & 0x7;
+    switch (tag) {
+        case 0: return OBJECT_NONE;
+        case 1: return OBJECT_BOOL;
+        case 2: return OBJECT_NULL;
+        case 4: {
+            object_data_t *data = object_get_allocated_data(obj);
+            return data->type;
+        }
+        default: return OBJECT_NONE;
+    }
+}
+
+bool object_is_numeric(object_t obj) {
+    object_type_t type = object_get_type(obj);
+    return type == OBJECT_NUMBER || type == OBJECT_BOOL;
+}
+
+bool object_is_null(object_t obj) {
+    return object_get_type(obj) == OBJECT_NULL;
+}
+
+bool object_is_callable(object_t obj) {
+    object_type_t type = object_get_type(obj);
+    return type == OBJECT_NATIVE_FUNCTION || type == OBJECT_FUNCTION;
+}
+
+const char* object_get_function_name(object_t obj) {
+    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
+    object_data_t *data = object_get_allocated_data(obj);
+    APE_ASSERT(data);
+    if (!data) {
+        return NULL;
+    }
+
+    if (data->function.owns_data) {
+        return data->function.name;
+    } else {
+        return data->function.const_name;
+    }
+}
+
+object_t object_get_function_free_val(object_t obj, int ix) {
+    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
+    object_data_t *data = object_get_allocated_data(obj);
+    APE_ASSERT(data);
+    if (!data) {
+        return object_make_null();
+    }
+    function_t *fun = &data->function;
+    APE_ASSERT(ix >= 0 && ix < fun->free_vals_count);
+    if (ix < 0 || ix >= fun->free_vals_count) {
+        return object_make_null();
+    }
+    if (freevals_are_allocated(fun)) {
+        return fun->free_vals_allocated[ix];
+    } else {
+        return fun->free_vals_buf[ix];
+    }
+}
+
+void object_set_function_free_val(object_t obj, int ix, object_t val) {
+    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
+    object_data_t *data = object_get_allocated_data(obj);
+    APE_ASSERT(data);
+    if (!data) {
+        return;
+    }
+    function_t *fun = &data->function;
+    APE_ASSERT(ix >= 0 && ix < fun->free_vals_count);
+    if (ix < 0 || ix >= fun->free_vals_count) {
+        return;
+    }
+    if (freevals_are_allocated(fun)) {
+        fun->free_vals_allocated[ix] = val;
+    } else {
+        fun->free_vals_buf[ix] = val;
+    }
+}
+
+object_t* object_get_function_free_vals(object_t obj) {
+    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
+    object_data_t *data = object_get_allocated_data(obj);
+    APE_ASSERT(data);
+    if (!data) {
+        return NULL;
+    }
+    function_t *fun = &data->function;
+    if (freevals_are_allocated(fun)) {
+        return fun->free_vals_allocated;
+    } else {
+        return fun->free_vals_buf;
+    }
+}
+
+const char* object_get_error_message(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ERROR);
+    object_data_t *data = object_get_allocated_data(object);
+    return data->error.message;
+}
+
+void object_set_error_traceback(object_t object, traceback_t *traceback) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ERROR);
+    if (object_get_type(object) != OBJECT_ERROR) {
+        return;
+    }
+    object_data_t *data = object_get_allocated_data(object);
+    APE_ASSERT(data->error.traceback == NULL);
+    data->error.traceback = traceback;
+}
+
+traceback_t* object_get_error_traceback(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ERROR);
+    object_data_t *data = object_get_allocated_data(object);
+    return data->error.traceback;
+}
+
+bool object_set_external_data(object_t object, void *ext_data) {
+    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
+    external_data_t* data = object_get_external_data(object);
+    if (!data) {
+        return false;
+    }
+    data->data = ext_data;
+    return true;
+}
+
+bool object_set_external_copy_function(object_t object, external_data_copy_fn copy_fn) {
+    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
+    external_data_t* data = object_get_external_data(object);
+    if (!data) {
+        return false;
+    }
+    data->data_copy_fn = copy_fn;
+    return true;
+}
+
+object_t object_get_array_value_at(object_t object, int ix) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
+    array(object_t)* array = object_get_allocated_array(object);
+    if (ix < 0 || ix >= array_count(array)) {
+        return object_make_null();
+    }
+    object_t *res = array_get(array, ix);
+    if (!res) {
+        return object_make_null();
+    }
+    return *res;
+}
+
+bool object_set_array_value_at(object_t object, int ix, object_t val) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
+    array(object_t)* array = object_get_allocated_array(object);
+    if (ix < 0 || ix >= array_count(array)) {
+        return false;
+    }
+    return array_set(array, ix, &val);
+}
+
+bool object_add_array_value(object_t object, object_t val) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
+    array(object_t)* array = object_get_allocated_array(object);
+    return array_add(array, &val);
+}
+
+int object_get_array_length(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
+    array(object_t)* array = object_get_allocated_array(object);
+    return array_count(array);
+}
+
+APE_INTERNAL bool object_remove_array_value_at(object_t object, int ix) {
+    array(object_t)* array = object_get_allocated_array(object);
+    return array_remove_at(array, ix);
+}
+
+int object_get_map_length(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    object_data_t *data = object_get_allocated_data(object);
+    return valdict_count(data->map);
+}
+
+object_t object_get_map_key_at(object_t object, int ix) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    object_data_t *data = object_get_allocated_data(object);
+    object_t *res = valdict_get_key_at(data->map, ix);
+    if (!res) {
+        return object_make_null();
+    }
+    return *res;
+}
+
+object_t object_get_map_value_at(object_t object, int ix) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    object_data_t *data = object_get_allocated_data(object);
+    object_t *res = valdict_get_value_at(data->map, ix);
+    if (!res) {
+        return object_make_null();
+    }
+    return *res;
+}
+
+bool object_set_map_value_at(object_t object, int ix, object_t val) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    if (ix >= object_get_map_length(object)) {
+        return false;
+    }
+    object_data_t *data = object_get_allocated_data(object);
+    return valdict_set_value_at(data->map, ix, &val);
+}
+
+object_t object_get_kv_pair_at(gcmem_t *mem, object_t object, int ix) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    object_data_t *data = object_get_allocated_data(object);
+    if (ix >= valdict_count(data->map)) {
+        return object_make_null();
+    }
+    object_t key = object_get_map_key_at(object, ix);
+    object_t val = object_get_map_value_at(object, ix);
+    object_t res = object_make_map(mem);
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+
+    object_t key_obj = object_make_string(mem, "key");
+    if (object_is_null(key_obj)) {
+        return object_make_null();
+    }
+    object_set_map_value(res, key_obj, key);
+
+    object_t val_obj = object_make_string(mem, "value");
+    if (object_is_null(val_obj)) {
+        return object_make_null();
+    }
+    object_set_map_value(res, val_obj, val);
+
+    return res;
+}
+
+bool object_set_map_value(object_t object, object_t key, object_t val) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    object_data_t *data = object_get_allocated_data(object);
+    return valdict_set(data->map, &key, &val);
+}
+
+object_t object_get_map_value(object_t object, object_t key) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    object_data_t *data = object_get_allocated_data(object);
+    object_t *res = valdict_get(data->map, &key);
+    if (!res) {
+        return object_make_null();
+    }
+    return *res;
+}
+
+bool object_map_has_key(object_t object, object_t key) {
+    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
+    object_data_t *data = object_get_allocated_data(object);
+    object_t *res = valdict_get(data->map, &key);
+    return res != NULL;
+}
+
+// INTERNAL
+static object_t object_deep_copy_internal(gcmem_t *mem, object_t obj, valdict(object_t, object_t) *copies, bool to_other_heap, bool share_code, errors_t *errors) {
+    object_t *copy_ptr = valdict_get(copies, &obj);
+    if (copy_ptr) {
+        return *copy_ptr;
+    }
+
+    object_t copy = object_make_null()  ;
 
-object_t object_copy(gcmem_t *mem, object_t obj) {
-    object_t copy = object_make_null();
     object_type_t type = object_get_type(obj);
     switch (type) {
-        case OBJECT_ANY:
         case OBJECT_FREED:
+        case OBJECT_ANY:
         case OBJECT_NONE: {
             APE_ASSERT(false);
             copy = object_make_null();
@@ -10665,27 +13432,99 @@ object_t object_copy(gcmem_t *mem, object_t obj) {
         }
         case OBJECT_NUMBER:
         case OBJECT_BOOL:
-        case OBJECT_NULL:
-        case OBJECT_FUNCTION:
-        case OBJECT_NATIVE_FUNCTION:
-        case OBJECT_ERROR: {
+        case OBJECT_NULL: {
             copy = obj;
             break;
         }
+        case OBJECT_NATIVE_FUNCTION: {
+            if (to_other_heap) {
+                native_function_t *native_function = object_get_native_function(obj);
+                copy = object_make_native_function(mem, native_function->name, native_function->fn,
+                                                   native_function->data, native_function->data_len);
+                if (object_is_null(copy)) {
+                    return object_make_null();
+                }
+                bool ok = valdict_set(copies, &obj, &copy);
+                if (!ok) {
+                    return object_make_null();
+                }
+            } else {
+                copy = obj;
+            }
+            break;
+        }
         case OBJECT_STRING: {
             const char *str = object_get_string(obj);
             copy = object_make_string(mem, str);
             break;
         }
+        case OBJECT_FUNCTION: {
+            function_t *function = object_get_function(obj);
+            if (share_code) {
+                // bytecode is shared with the original function. quickening rewrites it in place, but only swaps
+                // an opcode for its number or generic form (both are correct for any operands) with relaxed atomic
+                // byte stores, so functions running on other threads at worst see the other form of an instruction
+                copy = object_make_function(mem, object_get_function_name(obj), function->comp_result, object_make_null(), false,
+                                            function->num_locals, function->num_args, function->free_vals_count);
+                if (object_is_null(copy)) {
+                    return object_make_null();
+                }
+            } else {
+                compilation_result_t *comp_res_copy = compilation_result_copy(mem->alloc, function->comp_result);
+                if (!comp_res_copy) {
+                    return object_make_null();
+                }
+
+                copy = object_make_function(mem, object_get_function_name(obj), comp_res_copy, object_make_null(), true,
+                                            function->num_locals, function->num_args, function->free_vals_count);
+                if (object_is_null(copy)) {
+                    compilation_result_destroy(comp_res_copy);
+                    return object_make_null();
+                }
+            }
+
+            bool ok = valdict_set(copies, &obj, &copy);
+            if (!ok) {
+                return object_make_null();
+            }
+
+            if (to_other_heap) {
+                object_t constants_copy = object_deep_copy_internal(mem, function->constants, copies, to_other_heap, share_code, errors);
+                if (!object_is_null(function->constants) && object_is_null(constants_copy)) {
+                    return object_make_null();
+                }
+                object_get_function(copy)->constants = constants_copy;
+            } else {
+                object_get_function(copy)->constants = function->constants;
+            }
+
+            for (int i = 0; i < function->free_vals_count; i++) {
+                object_t free_val = object_get_function_free_val(obj, i);
+                object_t free_val_copy = object_deep_copy_internal(mem, free_val, copies, to_other_heap, share_code, errors);
+                if (!object_is_null(free_val) && object_is_null(free_val_copy)) {
+                    return object_make_null();
+                }
+                object_set_function_free_val(copy, i, free_val_copy);
+            }
+            break;
+        }
         case OBJECT_ARRAY: {
             int len = object_get_array_length(obj);
             copy = object_make_array_with_capacity(mem, len);
             if (object_is_null(copy)) {
                 return object_make_null();
             }
+            bool ok = valdict_set(copies, &obj, &copy);
+            if (!ok) {
+                return object_make_null();
+            }
             for (int i = 0; i < len; i++) {
                 object_t item = object_get_array_value_at(obj, i);
-                bool ok = object_add_array_value(copy, item);
+                object_t item_copy = object_deep_copy_internal(mem, item, copies, to_other_heap, share_code, errors);
+                if (!object_is_null(item) && object_is_null(item_copy)) {
+                    return object_make_null();
+                }
+                bool ok = object_add_array_value(copy, item_copy);
                 if (!ok) {
                     return object_make_null();
                 }
@@ -10694,10 +13533,28 @@ object_t object_copy(gcmem_t *mem, object_t obj) {
         }
         case OBJECT_MAP: {
             copy = object_make_map(mem);
+            if (object_is_null(copy)) {
+                return object_make_null();
+            }
+            bool ok = valdict_set(copies, &obj, &copy);
+            if (!ok) {
+                return object_make_null();
+            }
             for (int i = 0; i < object_get_map_length(obj); i++) {
                 object_t key = object_get_map_key_at(obj, i);
                 object_t val = object_get_map_value_at(obj, i);
-                bool ok = object_set_map_value(copy, key, val);
+
+                object_t key_copy = object_deep_copy_internal(mem, key, copies, to_other_heap, share_code, errors);
+                if (!object_is_null(key) && object_is_null(key_copy)) {
+                    return object_make_null();
+                }
+
+                object_t val_copy = object_deep_copy_internal(mem, val, copies, to_other_heap, share_code, errors);
+                if (!object_is_null(val) && object_is_null(val_copy)) {
+                    return object_make_null();
+                }
+
+                bool ok = object_set_map_value(copy, key_copy, val_copy);
                 if (!ok) {
                     return object_make_null();
                 }
@@ -10705,1041 +13562,1222 @@ object_t object_copy(gcmem_t *mem, object_t obj) {
             break;
         }
         case OBJECT_EXTERNAL: {
-            copy = object_make_external(mem, NULL);
-            if (object_is_null(copy)) {
-                return object_make_null();
-            }
-            external_data_t *external = object_get_external_data(obj);
-            void *data_copy = NULL;
-            if (external->data_copy_fn) {
-                data_copy = external->data_copy_fn(external->data);
+            copy = object_copy(mem, obj);
+            break;
+        }
+        case OBJECT_ERROR: {
+            if (to_other_heap) {
+                copy = object_make_error(mem, object_get_error_message(obj)); // traceback isn't copied
             } else {
-                data_copy = external->data;
+                copy = obj;
             }
-            object_set_external_data(copy, data_copy);
-            object_set_external_destroy_function(copy, external->data_destroy_fn);
-            object_set_external_copy_function(copy, external->data_copy_fn);
             break;
         }
-    }
-    return copy;
-}
-
-double object_compare(object_t a, object_t b, bool *out_ok) {
-    if (a.handle == b.handle) {
-        return 0;
-    }
-
-    *out_ok = true;
-
-    object_type_t a_type = object_get_type(a);
-    object_type_t b_type = object_get_type(b);
-
-    if ((a_type == OBJECT_NUMBER || a_type == OBJECT_BOOL || a_type == OBJECT_NULL)
-        && (b_type == OBJECT_NUMBER || b_type == OBJECT_BOOL || b_type == OBJECT_NULL)) {
-        double left_val = object_get_number(a);
-        double right_val = object_get_number(b);
-        return left_val - right_val;
-    } else if (a_type == b_type && a_type == OBJECT_STRING) {
-        int a_len = object_get_string_length(a);
-        int b_len = object_get_string_length(b);
-        if (a_len != b_len) {
-            return a_len - b_len;
-        }
-        unsigned long a_hash = object_get_string_hash(a);
-        unsigned long b_hash = object_get_string_hash(b);
-        if (a_hash != b_hash) {
-            return a_hash - b_hash;
-        }
-        const char *a_string = object_get_string(a);
-        const char *b_string = object_get_string(b);
-        return strcmp(a_string, b_string);
-    } else if ((object_is_allocated(a) || object_is_null(a))
-            && (object_is_allocated(b) || object_is_null(b))) {
-        intptr_t a_data_val = (intptr_t)object_get_allocated_data(a);
-        intptr_t b_data_val = (intptr_t)object_get_allocated_data(b);
-        return (double)(a_data_val - b_data_val);
-    } else {
-        *out_ok = false;
-    }
-    return 1;
-}
-
-bool object_equals(object_t a, object_t b) {
-    object_type_t a_type = object_get_type(a);
-    object_type_t b_type = object_get_type(b);
-
-    if (a_type != b_type) {
-        return false;
-    }
-    bool ok = false;
-    double res = object_compare(a, b, &ok);
-    return APE_DBLEQ(res, 0);
-}
-
-external_data_t* object_get_external_data(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
-    object_data_t *data = object_get_allocated_data(object);
-    return &data->external;
-}
-
-bool object_set_external_destroy_function(object_t object, external_data_destroy_fn destroy_fn) {
-    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
-    external_data_t* data = object_get_external_data(object);
-    if (!data) {
-        return false;
-    }
-    data->data_destroy_fn = destroy_fn;
-    return true;
-}
-
-object_data_t* object_get_allocated_data(object_t object) {
-    APE_ASSERT(object_is_allocated(object) || object_get_type(object) == OBJECT_NULL);
-    return (object_data_t*)(object.handle & ~OBJECT_HEADER_MASK);
-}
-
-bool object_get_bool(object_t obj) {
-    if (object_is_number(obj)) {
-        return obj.handle;
-    }
-    return obj.handle & (~OBJECT_HEADER_MASK);
-}
-
-double object_get_number(object_t obj) {
-    if (object_is_number(obj)) { // todo: optimise? always return number?
-        return obj.number;
-    }
-    return (double)(obj.handle & (~OBJECT_HEADER_MASK));
-}
-
-const char * object_get_string(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
-    object_data_t *data = object_get_allocated_data(object);
-    return object_data_get_string(data);
-}
-
-int object_get_string_length(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
-    object_data_t *data = object_get_allocated_data(object);
-    return data->string.length;
-}
-
-void object_set_string_length(object_t object, int len) {
-    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
-    object_data_t *data = object_get_allocated_data(object);
-    data->string.length = len;
-}
-
-
-int object_get_string_capacity(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
-    object_data_t *data = object_get_allocated_data(object);
-    return data->string.capacity;
-}
-
-char* object_get_mutable_string(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_STRING);
-    object_data_t *data = object_get_allocated_data(object);
-    return object_data_get_string(data);
-}
-
-bool object_string_append(object_t obj, const char *src, int len) {
-    APE_ASSERT(object_get_type(obj) == OBJECT_STRING);
-    object_data_t *data = object_get_allocated_data(obj);
-    object_string_t *string = &data->string;
-    char *str_buf = object_get_mutable_string(obj);
-    int current_len = string->length;
-    int capacity = string->capacity;
-    if ((len + current_len) > capacity) {
-        APE_ASSERT(false);
-        return false;
-    }
-    memcpy(str_buf + current_len, src, len);
-    string->length += len;
-    str_buf[string->length] = '\0';
-    return true;
-}
-
-unsigned long object_get_string_hash(object_t obj) {
-    APE_ASSERT(object_get_type(obj) == OBJECT_STRING);
-    object_data_t *data = object_get_allocated_data(obj);
-    if (data->string.hash == 0) {
-        data->string.hash = object_hash_string(object_get_string(obj));
-        if (data->string.hash == 0) {
-            data->string.hash = 1;
+        case OBJECT_COROUTINE: {
+            // execution state can't be duplicated
+            if (to_other_heap) {
+                errors_add_error(errors, ERROR_RUNTIME, src_pos_invalid, "Coroutines can't be copied to another heap");
+                return object_make_null();
+            }
+            copy = obj;
+            break;
         }
     }
-    return data->string.hash;
-}
-
-function_t* object_get_function(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_FUNCTION);
-    object_data_t *data = object_get_allocated_data(object);
-    return &data->function;
+    return copy;
 }
 
-native_function_t* object_get_native_function(object_t obj) {
-    object_data_t *data = object_get_allocated_data(obj);
-    return &data->native_function;
+
+static bool object_equals_wrapped(const object_t *a_ptr, const object_t *b_ptr) {
+    object_t a = *a_ptr;
+    object_t b = *b_ptr;
+    return object_equals(a, b);
 }
 
-object_type_t object_get_type(object_t obj) {
-    if (object_is_number(obj)) {
-        return OBJECT_NUMBER;
-    }
-    uint64_t tag = (obj.handle >> 48) & 0x7;
-    switch (tag) {
-        case 0: return OBJECT_NONE;
-        case 1: return OBJECT_BOOL;
-        case 2: return OBJECT_NULL;
-        case 4: {
-            object_data_t *data = object_get_allocated_data(obj);
-            return data->type;
+static unsigned long object_hash(object_t *obj_ptr) {
+    object_t obj = *obj_ptr;
+    object_type_t type = object_get_type(obj);
+
+    switch (type) {
+        case OBJECT_NUMBER: {
+            double val = object_get_number(obj);
+            return object_hash_double(val);
+        }
+        case OBJECT_BOOL: {
+            bool val = object_get_bool(obj);
+            return val;
+        }
+        case OBJECT_STRING: {
+            return object_get_string_hash(obj);
+        }
+        default: {
+            return 0;
         }
-        default: return OBJECT_NONE;
     }
 }
 
-bool object_is_numeric(object_t obj) {
-    object_type_t type = object_get_type(obj);
-    return type == OBJECT_NUMBER || type == OBJECT_BOOL;
+static unsigned long object_hash_string(const char *str) { /* djb2 */
+    unsigned long hash = 5381;
+    int c;
+    while ((c = *str++)) {
+        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    }
+    return hash;
 }
 
-bool object_is_null(object_t obj) {
-    return object_get_type(obj) == OBJECT_NULL;
+static unsigned long object_hash_double(double val) { /* djb2 */
+    uint32_t *val_ptr = (uint32_t*)&val;
+    unsigned long hash = 5381;
+    hash = ((hash << 5) + hash) + val_ptr[0];
+    hash = ((hash << 5) + hash) + val_ptr[1];
+    return hash;
 }
 
-bool object_is_callable(object_t obj) {
-    object_type_t type = object_get_type(obj);
-    return type == OBJECT_NATIVE_FUNCTION || type == OBJECT_FUNCTION;
+array(object_t)* object_get_allocated_array(object_t object) {
+    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
+    object_data_t *data = object_get_allocated_data(object);
+    return data->array;
 }
 
-const char* object_get_function_name(object_t obj) {
-    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
-    object_data_t *data = object_get_allocated_data(obj);
-    APE_ASSERT(data);
-    if (!data) {
-        return NULL;
-    }
-
-    if (data->function.owns_data) {
-        return data->function.name;
-    } else {
-        return data->function.const_name;
-    }
+static bool object_is_number(object_t o) {
+    return (o.handle & OBJECT_PATTERN) != OBJECT_PATTERN;
 }
 
-object_t object_get_function_free_val(object_t obj, int ix) {
-    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
-    object_data_t *data = object_get_allocated_data(obj);
-    APE_ASSERT(data);
-    if (!data) {
-        return object_make_null();
-    }
-    function_t *fun = &data->function;
-    APE_ASSERT(ix >= 0 && ix < fun->free_vals_count);
-    if (ix < 0 || ix >= fun->free_vals_count) {
-        return object_make_null();
-    }
-    if (freevals_are_allocated(fun)) {
-        return fun->free_vals_allocated[ix];
-    } else {
-        return fun->free_vals_buf[ix];
+static uint64_t get_type_tag(object_type_t type) {
+    switch (type) {
+        case OBJECT_NONE: return 0;
+        case OBJECT_BOOL: return 1;
+        case OBJECT_NULL: return 2;
+        default:          return 4;
     }
 }
 
-void object_set_function_free_val(object_t obj, int ix, object_t val) {
-    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
-    object_data_t *data = object_get_allocated_data(obj);
-    APE_ASSERT(data);
-    if (!data) {
-        return;
-    }
-    function_t *fun = &data->function;
-    APE_ASSERT(ix >= 0 && ix < fun->free_vals_count);
-    if (ix < 0 || ix >= fun->free_vals_count) {
-        return;
-    }
-    if (freevals_are_allocated(fun)) {
-        fun->free_vals_allocated[ix] = val;
-    } else {
-        fun->free_vals_buf[ix] = val;
-    }
+static bool freevals_are_allocated(function_t *fun) {
+    return fun->free_vals_count > FUNCTION_INLINE_FREE_VALS;
 }
 
-object_t* object_get_function_free_vals(object_t obj) {
-    APE_ASSERT(object_get_type(obj) == OBJECT_FUNCTION);
-    object_data_t *data = object_get_allocated_data(obj);
-    APE_ASSERT(data);
-    if (!data) {
-        return NULL;
-    }
-    function_t *fun = &data->function;
-    if (freevals_are_allocated(fun)) {
-        return fun->free_vals_allocated;
+static char *object_data_get_string(object_data_t *data) {
+    APE_ASSERT(data->type == OBJECT_STRING);
+    if (data->string.is_view) {
+        return data->string.view_value;
+    } else if (data->string.is_allocated) {
+        return data->string.value_allocated;
     } else {
-        return fun->free_vals_buf;
+        return data->string.value_buf;
     }
 }
 
-const char* object_get_error_message(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ERROR);
-    object_data_t *data = object_get_allocated_data(object);
-    return data->error.message;
-}
+static bool object_data_string_reserve_capacity(object_data_t *data, int capacity) {
+    APE_ASSERT(capacity >= 0);
+    
+    object_string_t *string = &data->string;
 
-void object_set_error_traceback(object_t object, traceback_t *traceback) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ERROR);
-    if (object_get_type(object) != OBJECT_ERROR) {
-        return;
+    string->length = 0;
+    string->hash = 0;
+
+    if (capacity <= string->capacity) {
+        return true;
     }
-    object_data_t *data = object_get_allocated_data(object);
-    APE_ASSERT(data->error.traceback == NULL);
-    data->error.traceback = traceback;
-}
 
-traceback_t* object_get_error_traceback(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ERROR);
-    object_data_t *data = object_get_allocated_data(object);
-    return data->error.traceback;
-}
+    if (capacity <= (OBJECT_STRING_BUF_SIZE - 1)) {
+        if (string->is_allocated) {
+            APE_ASSERT(false); // should never happen
+            allocator_free(data->page->mem->alloc, string->value_allocated); // just in case
+        }
+        string->capacity = OBJECT_STRING_BUF_SIZE - 1;
+        string->is_allocated = false;
+        return true;
+    }
 
-bool object_set_external_data(object_t object, void *ext_data) {
-    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
-    external_data_t* data = object_get_external_data(object);
-    if (!data) {
+    char *new_value = allocator_malloc(data->page->mem->alloc, capacity + 1);
+    if (!new_value) {
         return false;
     }
-    data->data = ext_data;
-    return true;
-}
 
-bool object_set_external_copy_function(object_t object, external_data_copy_fn copy_fn) {
-    APE_ASSERT(object_get_type(object) == OBJECT_EXTERNAL);
-    external_data_t* data = object_get_external_data(object);
-    if (!data) {
-        return false;
+    if (string->is_allocated) {
+        allocator_free(data->page->mem->alloc, string->value_allocated);
     }
-    data->data_copy_fn = copy_fn;
+
+    string->value_allocated = new_value;
+    string->is_allocated = true;
+    string->capacity = capacity;
     return true;
 }
+//FILE_END
+//FILE_START:gc.c
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
 
-object_t object_get_array_value_at(object_t object, int ix) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
-    array(object_t)* array = object_get_allocated_array(object);
-    if (ix < 0 || ix >= array_count(array)) {
-        return object_make_null();
+#ifndef APE_AMALGAMATED
+#include "gc.h"
+#include "object.h"
+#include "frame.h"
+#endif
+
+static object_data_pool_t* get_pool_for_type(gcmem_t *mem, object_type_t type);
+static bool can_data_be_put_in_pool(gcmem_t *mem, object_data_t *data);
+static int get_not_gced_index(gcmem_t *mem, object_t obj);
+static int get_object_data_size(object_type_t type);
+static object_data_t* alloc_slot(gcmem_t *mem, int size);
+static void free_slot(gcmem_t *mem, object_data_t *data);
+static void free_empty_pages(gcmem_t *mem, int size_class_ix);
+static gcmem_page_t* page_make(gcmem_t *mem, int slot_size, int slots_count);
+static object_data_t* page_get_slot(gcmem_page_t *page, int ix);
+static void page_sweep(gcmem_t *mem, gcmem_page_t *page);
+static void page_deinit_objects(gcmem_page_t *page);
+static void page_clear_arena_references(gcmem_page_t *page);
+static void heap_destroy_pages(gcmem_t *mem, gcmem_heap_t *heap);
+static void heap_unmark(gcmem_heap_t *heap);
+static bool data_is_marked(object_data_t *data);
+static void data_mark(object_data_t *data);
+
+static const int g_size_classes_slot_sizes[GCMEM_SIZE_CLASSES_NUM] = {
+    24, 32, 48, 64, 96, 128, 192, 256,
+};
+
+gcmem_t *gcmem_make(allocator_t *alloc) {
+    gcmem_t *mem = allocator_malloc(alloc, sizeof(gcmem_t));
+    if (!mem) {
+        return NULL;
     }
-    object_t *res = array_get(array, ix);
-    if (!res) {
-        return object_make_null();
+    memset(mem, 0, sizeof(gcmem_t));
+    mem->alloc = alloc;
+    mem->objects_not_gced = array_make(alloc, object_t);
+    if (!mem->objects_not_gced) {
+        goto error;
     }
-    return *res;
-}
+    mem->allocations_since_sweep = 0;
 
-bool object_set_array_value_at(object_t object, int ix, object_t val) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
-    array(object_t)* array = object_get_allocated_array(object);
-    if (ix < 0 || ix >= array_count(array)) {
-        return false;
+    for (int i = 0; i < GCMEM_SIZE_CLASSES_NUM; i++) {
+        gcmem_size_class_t *size_class = &mem->size_classes[i];
+        size_class->slot_size = g_size_classes_slot_sizes[i];
+        size_class->free_slots = NULL;
+        // as many slots as fit in a page together with their bitmaps
+        int slots_count = (GCMEM_PAGE_SIZE - (int)sizeof(gcmem_page_t)) / size_class->slot_size;
+        while ((int)sizeof(gcmem_page_t) + (slots_count + 63) / 64 * 2 * (int)sizeof(uint64_t) + slots_count * size_class->slot_size > GCMEM_PAGE_SIZE) {
+            slots_count--;
+        }
+        size_class->slots_per_page = slots_count;
     }
-    return array_set(array, ix, &val);
+    mem->arena_enabled = false;
+
+    for (int i = 0; i < GCMEM_POOLS_NUM; i++) {
+        object_data_pool_t *pool = &mem->pools[i];
+        mem->pools[i].count = 0;
+        memset(pool, 0, sizeof(object_data_pool_t));
+    }
+
+    return mem;
+error:
+    gcmem_destroy(mem);
+    return NULL;
 }
 
-bool object_add_array_value(object_t object, object_t val) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
-    array(object_t)* array = object_get_allocated_array(object);
-    return array_add(array, &val);
+void gcmem_destroy(gcmem_t *mem) {
+    if (!mem) {
+        return;
+    }
+
+    array_destroy(mem->objects_not_gced);
+
+    // pooled objects are still live in their pages so they get deinitialised with the rest
+    heap_destroy_pages(mem, &mem->heap);
+    heap_destroy_pages(mem, &mem->arena);
+
+    allocator_free(mem->alloc, mem);
 }
 
-int object_get_array_length(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
-    array(object_t)* array = object_get_allocated_array(object);
-    return array_count(array);
+object_data_t* gcmem_alloc_object_data(gcmem_t *mem, object_type_t type) {
+    return gcmem_alloc_object_data_with_tail(mem, type, 0);
 }
 
-APE_INTERNAL bool object_remove_array_value_at(object_t object, int ix) {
-    array(object_t)* array = object_get_allocated_array(object);
-    return array_remove_at(array, ix);
-}
+object_data_t* gcmem_alloc_object_data_with_tail(gcmem_t *mem, object_type_t type, int tail_size) {
+    mem->allocations_since_sweep++;
+    int size = get_object_data_size(type) + tail_size;
+    object_data_t *data = alloc_slot(mem, size);
+    if (!data) {
+        return NULL;
+    }
 
-int object_get_map_length(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    object_data_t *data = object_get_allocated_data(object);
-    return valdict_count(data->map);
+    gcmem_page_t *page = data->page;
+    uint16_t page_slot = data->page_slot;
+    memset(data, 0, size);
+    data->page = page;
+    data->page_slot = page_slot;
+    data->type = type;
+    return data;
 }
 
-object_t object_get_map_key_at(object_t object, int ix) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    object_data_t *data = object_get_allocated_data(object);
-    object_t *res = valdict_get_key_at(data->map, ix);
-    if (!res) {
-        return object_make_null();
+object_data_t* gcmem_get_object_data_from_pool(gcmem_t *mem, object_type_t type) {
+    if (mem->arena_enabled) {
+        return NULL; // pooled objects live outside of the arena
     }
-    return *res;
+    object_data_pool_t *pool = get_pool_for_type(mem, type);
+    if (!pool || pool->count <= 0) {
+        return NULL;
+    }
+    object_data_t *data = pool->data[pool->count - 1];
+    pool->count--;
+    return data;
 }
 
-object_t object_get_map_value_at(object_t object, int ix) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    object_data_t *data = object_get_allocated_data(object);
-    object_t *res = valdict_get_value_at(data->map, ix);
-    if (!res) {
-        return object_make_null();
-    }
-    return *res;
+void gcmem_set_arena_enabled(gcmem_t *mem, bool enabled) {
+    mem->arena_enabled = enabled;
 }
 
-bool object_set_map_value_at(object_t object, int ix, object_t val) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    if (ix >= object_get_map_length(object)) {
-        return false;
-    }
-    object_data_t *data = object_get_allocated_data(object);
-    return valdict_set_value_at(data->map, ix, &val);
+bool gcmem_is_arena_enabled(gcmem_t *mem) {
+    return mem->arena_enabled;
 }
 
-object_t object_get_kv_pair_at(gcmem_t *mem, object_t object, int ix) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    object_data_t *data = object_get_allocated_data(object);
-    if (ix >= valdict_count(data->map)) {
-        return object_make_null();
-    }
-    object_t key = object_get_map_key_at(object, ix);
-    object_t val = object_get_map_value_at(object, ix);
-    object_t res = object_make_map(mem);
-    if (object_is_null(res)) {
-        return object_make_null();
+void gcmem_arena_reset(gcmem_t *mem) {
+    // objects allocated before the arena could've been modified to point into it
+    for (int i = 0; i < GCMEM_SIZE_CLASSES_NUM; i++) {
+        for (gcmem_page_t *page = mem->heap.pages[i]; page; page = page->next) {
+            page_clear_arena_references(page);
+        }
     }
-
-    object_t key_obj = object_make_string(mem, "key");
-    if (object_is_null(key_obj)) {
-        return object_make_null();
+    for (gcmem_page_t *page = mem->heap.large_pages; page; page = page->next) {
+        page_clear_arena_references(page);
     }
-    object_set_map_value(res, key_obj, key);
 
-    object_t val_obj = object_make_string(mem, "value");
-    if (object_is_null(val_obj)) {
-        return object_make_null();
+    for (int i = array_count(mem->objects_not_gced) - 1; i >= 0; i--) {
+        object_t *obj = array_get(mem->objects_not_gced, i);
+        if (gc_object_is_in_arena(*obj)) {
+            array_remove_at(mem->objects_not_gced, i);
+        }
     }
-    object_set_map_value(res, val_obj, val);
 
-    return res;
+    heap_destroy_pages(mem, &mem->arena);
+    mem->arena_enabled = false;
 }
 
-bool object_set_map_value(object_t object, object_t key, object_t val) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    object_data_t *data = object_get_allocated_data(object);
-    return valdict_set(data->map, &key, &val);
+bool gc_object_is_in_arena(object_t obj) {
+    if (!object_is_allocated(obj)) {
+        return false;
+    }
+    object_data_t *data = object_get_allocated_data(obj);
+    return data->page->arena;
 }
 
-object_t object_get_map_value(object_t object, object_t key) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    object_data_t *data = object_get_allocated_data(object);
-    object_t *res = valdict_get(data->map, &key);
-    if (!res) {
-        return object_make_null();
+void gc_clear_arena_references(object_t *objects, int count) {
+    for (int i = 0; i < count; i++) {
+        if (gc_object_is_in_arena(objects[i])) {
+            objects[i] = object_make_null();
+        }
     }
-    return *res;
 }
 
-bool object_map_has_key(object_t object, object_t key) {
-    APE_ASSERT(object_get_type(object) == OBJECT_MAP);
-    object_data_t *data = object_get_allocated_data(object);
-    object_t *res = valdict_get(data->map, &key);
-    return res != NULL;
+void gc_unmark_all(gcmem_t *mem) {
+    heap_unmark(&mem->heap);
+    heap_unmark(&mem->arena);
 }
 
-// INTERNAL
-static object_t object_deep_copy_internal(gcmem_t *mem, object_t obj, valdict(object_t, object_t) *copies) {
-    object_t *copy_ptr = valdict_get(copies, &obj);
-    if (copy_ptr) {
-        return *copy_ptr;
+void gc_mark_objects(object_t *objects, int count) {
+    for (int i = 0; i < count; i++) {
+        object_t obj = objects[i];
+        gc_mark_object(obj);
     }
+}
 
-    object_t copy = object_make_null()  ;
+void gc_mark_object(object_t obj) {
+    if (!object_is_allocated(obj)) {
+        return;
+    }
 
-    object_type_t type = object_get_type(obj);
-    switch (type) {
-        case OBJECT_FREED:
-        case OBJECT_ANY:
-        case OBJECT_NONE: {
-            APE_ASSERT(false);
-            copy = object_make_null();
+    object_data_t *data = object_get_allocated_data(obj);
+    if (data_is_marked(data)) {
+        return;
+    }
+
+    data_mark(data);
+    switch (data->type) {
+        case OBJECT_MAP: {
+            int len = object_get_map_length(obj);
+            for (int i = 0; i < len; i++) {
+                object_t key = object_get_map_key_at(obj, i);
+                if (object_is_allocated(key)) {
+                    object_data_t *key_data = object_get_allocated_data(key);
+                    if (!data_is_marked(key_data)) {
+                        gc_mark_object(key);
+                    }
+                }
+                object_t val = object_get_map_value_at(obj, i);
+                if (object_is_allocated(val)) {
+                    object_data_t *val_data = object_get_allocated_data(val);
+                    if (!data_is_marked(val_data)) {
+                        gc_mark_object(val);
+                    }
+                }
+            }
             break;
         }
-        case OBJECT_NUMBER:
-        case OBJECT_BOOL:
-        case OBJECT_NULL:
-        case OBJECT_NATIVE_FUNCTION: {
-            copy = obj;
+        case OBJECT_ARRAY: {
+            int len = object_get_array_length(obj);
+            for (int i = 0; i < len; i++) {
+                object_t val = object_get_array_value_at(obj, i);
+                if (object_is_allocated(val)) {
+                    object_data_t *val_data = object_get_allocated_data(val);
+                    if (!data_is_marked(val_data)) {
+                        gc_mark_object(val);
+                    }
+                }
+            }
+            break;
+        }
+        case OBJECT_FUNCTION: {
+            function_t *function = object_get_function(obj);
+            gc_mark_object(function->constants);
+            for (int i = 0; i < function->free_vals_count; i++) {
+                object_t free_val = object_get_function_free_val(obj, i);
+                gc_mark_object(free_val);
+                if (object_is_allocated(free_val)) {
+                    object_data_t *free_val_data = object_get_allocated_data(free_val);
+                    if (!data_is_marked(free_val_data)) {
+                        gc_mark_object(free_val);
+                    }
+                }
+            }
             break;
         }
         case OBJECT_STRING: {
-            const char *str = object_get_string(obj);
-            copy = object_make_string(mem, str);
+            if (data->string.is_view) {
+                gc_mark_object(data->string.view_parent);
+            }
             break;
         }
-        case OBJECT_FUNCTION: {
-            function_t *function = object_get_function(obj);
-            uint8_t *bytecode_copy = NULL;
-            src_pos_t *src_positions_copy = NULL;
-            compilation_result_t *comp_res_copy = NULL;
-
-            bytecode_copy = allocator_malloc(mem->alloc, sizeof(uint8_t) * function->comp_result->count);
-            if (!bytecode_copy) {
-                return object_make_null();
+        case OBJECT_COROUTINE: {
+            coroutine_t *coroutine = object_get_coroutine(obj);
+            gc_mark_object(coroutine->function);
+            for (int i = 0; i < coroutine->frames_count; i++) {
+                gc_mark_object(coroutine->frames[i].function);
             }
-            memcpy(bytecode_copy, function->comp_result->bytecode, sizeof(uint8_t) * function->comp_result->count);
+            gc_mark_objects(coroutine->stack, coroutine->stack_count);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
 
-            src_positions_copy = allocator_malloc(mem->alloc, sizeof(src_pos_t) * function->comp_result->count);
-            if (!src_positions_copy) {
-                allocator_free(mem->alloc, bytecode_copy);
-                return object_make_null();
-            }
-            memcpy(src_positions_copy, function->comp_result->src_positions, sizeof(src_pos_t) * function->comp_result->count);
+void gc_sweep(gcmem_t *mem) {
+    gc_mark_objects(array_data(mem->objects_not_gced), array_count(mem->objects_not_gced));
 
-            comp_res_copy = compilation_result_make(mem->alloc, bytecode_copy, src_positions_copy, function->comp_result->count); // todo: add compilation result copy function
-            if (!comp_res_copy) {
-                allocator_free(mem->alloc, src_positions_copy);
-                allocator_free(mem->alloc, bytecode_copy);
-                return object_make_null();
-            }
+    // objects waiting in pools are unreachable, but they're kept alive to be reused
+    for (int i = 0; i < GCMEM_POOLS_NUM; i++) {
+        object_data_pool_t *pool = &mem->pools[i];
+        for (int j = 0; j < pool->count; j++) {
+            data_mark(pool->data[j]);
+        }
+    }
 
-            copy = object_make_function(mem, object_get_function_name(obj), comp_res_copy, true,
-                                        function->num_locals, function->num_args, 0);
-            if (object_is_null(copy)) {
-                compilation_result_destroy(comp_res_copy);
-                return object_make_null();
+    // arena pages are never swept
+    for (int i = 0; i < GCMEM_SIZE_CLASSES_NUM; i++) {
+        int empty_pages_count = 0;
+        for (gcmem_page_t *page = mem->heap.pages[i]; page; page = page->next) {
+            page_sweep(mem, page);
+            if (page->live_count == 0) {
+                empty_pages_count++;
             }
+        }
+        if (empty_pages_count > GCMEM_EMPTY_PAGES_RESERVE) {
+            free_empty_pages(mem, i);
+        }
+    }
 
-            bool ok = valdict_set(copies, &obj, &copy);
-            if (!ok) {
-                return object_make_null();
-            }
+    gcmem_page_t *page = mem->heap.large_pages;
+    while (page) {
+        gcmem_page_t *next = page->next;
+        object_data_t *data = page_get_slot(page, 0);
+        if (!data_is_marked(data)) {
+            object_data_deinit(data);
+            free_slot(mem, data);
+        }
+        page = next;
+    }
 
-            function_t *function_copy = object_get_function(copy);
-            if (freevals_are_allocated(function)) {
-                function_copy->free_vals_allocated = allocator_malloc(mem->alloc, sizeof(object_t) * function->free_vals_count);
-                if (!function_copy->free_vals_allocated) {
-                    return object_make_null();
-                }
-            }
+    mem->allocations_since_sweep = 0;
+}
 
-            function_copy->free_vals_count = function->free_vals_count;
-            for (int i = 0; i < function->free_vals_count; i++) {
-                object_t free_val = object_get_function_free_val(obj, i);
-                object_t free_val_copy = object_deep_copy_internal(mem, free_val, copies);
-                if (!object_is_null(free_val) && object_is_null(free_val_copy)) {
-                    return object_make_null();
-                }
-                object_set_function_free_val(copy, i, free_val_copy);
-            }
-            break;
+bool gc_disable_on_object(object_t obj) {
+    if (!object_is_allocated(obj)) {
+        return false;
+    }
+    object_data_t *data = object_get_allocated_data(obj);
+    if (get_not_gced_index(data->page->mem, obj) >= 0) {
+        return false;
+    }
+    bool ok = array_add(data->page->mem->objects_not_gced, &obj);
+    return ok;
+}
+
+void gc_enable_on_object(object_t obj) {
+    if (!object_is_allocated(obj)) {
+        return;
+    }
+    object_data_t *data = object_get_allocated_data(obj);
+    int ix = get_not_gced_index(data->page->mem, obj);
+    if (ix >= 0) {
+        array_remove_at(data->page->mem->objects_not_gced, ix);
+    }
+}
+
+int gc_should_sweep(gcmem_t *mem) {
+    return mem->allocations_since_sweep > GCMEM_SWEEP_INTERVAL;
+}
+
+// INTERNAL
+static object_data_pool_t* get_pool_for_type(gcmem_t *mem, object_type_t type) {
+    switch (type) {
+        case OBJECT_ARRAY:  return &mem->pools[0];
+        case OBJECT_MAP:    return &mem->pools[1];
+        case OBJECT_STRING: return &mem->pools[2];
+        default:            return NULL;
+    }
+}
+
+// array_contains compares item addresses, objects have to be compared by value
+static int get_not_gced_index(gcmem_t *mem, object_t obj) {
+    for (int i = 0; i < array_count(mem->objects_not_gced); i++) {
+        object_t *not_gced = array_get(mem->objects_not_gced, i);
+        if (not_gced->handle == obj.handle) {
+            return i;
         }
+    }
+    return -1;
+}
+
+static bool can_data_be_put_in_pool(gcmem_t *mem, object_data_t *data) {
+    object_t obj = object_make_from_data(data->type, data);
+
+    // this is to ensure that large objects won't be kept in pool indefinitely
+    switch (data->type) {
         case OBJECT_ARRAY: {
-            int len = object_get_array_length(obj);
-            copy = object_make_array_with_capacity(mem, len);
-            if (object_is_null(copy)) {
-                return object_make_null();
-            }
-            bool ok = valdict_set(copies, &obj, &copy);
-            if (!ok) {
-                return object_make_null();
-            }
-            for (int i = 0; i < len; i++) {
-                object_t item = object_get_array_value_at(obj, i);
-                object_t item_copy = object_deep_copy_internal(mem, item, copies);
-                if (!object_is_null(item) && object_is_null(item_copy)) {
-                    return object_make_null();
-                }
-                bool ok = object_add_array_value(copy, item_copy);
-                if (!ok) {
-                    return object_make_null();
-                }
+            if (object_get_array_length(obj) > 1024) {
+                return false;
             }
             break;
         }
         case OBJECT_MAP: {
-            copy = object_make_map(mem);
-            if (object_is_null(copy)) {
-                return object_make_null();
-            }
-            bool ok = valdict_set(copies, &obj, &copy);
-            if (!ok) {
-                return object_make_null();
-            }
-            for (int i = 0; i < object_get_map_length(obj); i++) {
-                object_t key = object_get_map_key_at(obj, i);
-                object_t val = object_get_map_value_at(obj, i);
-
-                object_t key_copy = object_deep_copy_internal(mem, key, copies);
-                if (!object_is_null(key) && object_is_null(key_copy)) {
-                    return object_make_null();
-                }
-
-                object_t val_copy = object_deep_copy_internal(mem, val, copies);
-                if (!object_is_null(val) && object_is_null(val_copy)) {
-                    return object_make_null();
-                }
-
-                bool ok = object_set_map_value(copy, key_copy, val_copy);
-                if (!ok) {
-                    return object_make_null();
-                }
+            if (object_get_map_length(obj) > 1024) {
+                return false;
             }
             break;
         }
-        case OBJECT_EXTERNAL: {
-            copy = object_copy(mem, obj);
+        case OBJECT_STRING: {
+            if (!data->string.is_allocated || data->string.capacity > 4096) {
+                return false;
+            }
             break;
         }
-        case OBJECT_ERROR: {
-            copy = obj;
+        default:
             break;
-        }
     }
-    return copy;
-}
 
+    object_data_pool_t *pool = get_pool_for_type(mem, data->type);
+    if (!pool || pool->count >= GCMEM_POOL_SIZE) {
+        return false;
+    }
 
-static bool object_equals_wrapped(const object_t *a_ptr, const object_t *b_ptr) {
-    object_t a = *a_ptr;
-    object_t b = *b_ptr;
-    return object_equals(a, b);
+    return true;
 }
 
-static unsigned long object_hash(object_t *obj_ptr) {
-    object_t obj = *obj_ptr;
-    object_type_t type = object_get_type(obj);
-
+static int get_object_data_size(object_type_t type) {
+    int header_size = offsetof(object_data_t, string);
     switch (type) {
-        case OBJECT_NUMBER: {
-            double val = object_get_number(obj);
-            return object_hash_double(val);
-        }
-        case OBJECT_BOOL: {
-            bool val = object_get_bool(obj);
-            return val;
+        case OBJECT_STRING:          return header_size + sizeof(object_string_t);
+        case OBJECT_ERROR:           return header_size + sizeof(object_error_t);
+        case OBJECT_ARRAY:           return header_size + sizeof(array(object_t)*);
+        case OBJECT_MAP:             return header_size + sizeof(valdict(object_t, object_t)*);
+        case OBJECT_FUNCTION:        return header_size + sizeof(function_t);
+        case OBJECT_NATIVE_FUNCTION: return header_size + sizeof(native_function_t);
+        case OBJECT_EXTERNAL:        return header_size + sizeof(external_data_t);
+        case OBJECT_COROUTINE:       return header_size + sizeof(coroutine_t);
+        default:                     return sizeof(object_data_t);
+    }
+}
+
+static object_data_t* alloc_slot(gcmem_t *mem, int size) {
+    gcmem_size_class_t *size_class = NULL;
+    int size_class_ix = 0;
+    for (size_class_ix = 0; size_class_ix < GCMEM_SIZE_CLASSES_NUM; size_class_ix++) {
+        if (size <= mem->size_classes[size_class_ix].slot_size) {
+            size_class = &mem->size_classes[size_class_ix];
+            break;
         }
-        case OBJECT_STRING: {
-            return object_get_string_hash(obj);
+    }
+
+    gcmem_heap_t *heap = mem->arena_enabled ? &mem->arena : &mem->heap;
+
+    if (!size_class) {
+        gcmem_page_t *page = page_make(mem, size, 1);
+        if (!page) {
+            return NULL;
         }
-        default: {
-            return 0;
+        page->size_class = GCMEM_LARGE_OBJECT_SIZE_CLASS;
+        page->slots_used = 1;
+        page->live_count = 1;
+        page->live[0] = 1;
+        page->next = heap->large_pages;
+        if (heap->large_pages) {
+            heap->large_pages->prev = page;
         }
+        heap->large_pages = page;
+        object_data_t *data = page_get_slot(page, 0);
+        data->page = page;
+        data->page_slot = 0;
+        return data;
     }
-}
 
-static unsigned long object_hash_string(const char *str) { /* djb2 */
-    unsigned long hash = 5381;
-    int c;
-    while ((c = *str++)) {
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
+    object_data_t *data = NULL;
+    if (size_class->free_slots && !mem->arena_enabled) {
+        data = size_class->free_slots;
+        size_class->free_slots = data->next_free;
+    } else {
+        gcmem_page_t *page = heap->pages[size_class_ix];
+        if (!page || page->slots_used >= page->slots_count) {
+            page = page_make(mem, size_class->slot_size, size_class->slots_per_page);
+            if (!page) {
+                return NULL;
+            }
+            page->next = heap->pages[size_class_ix];
+            page->size_class = size_class_ix;
+            if (heap->pages[size_class_ix]) {
+                heap->pages[size_class_ix]->prev = page;
+            }
+            heap->pages[size_class_ix] = page;
+        }
+        data = page_get_slot(page, page->slots_used);
+        data->page = page;
+        data->page_slot = page->slots_used;
+        page->slots_used++;
     }
-    return hash;
+
+    gcmem_page_t *page = data->page;
+    page->live[data->page_slot / 64] |= (uint64_t)1 << (data->page_slot % 64);
+    page->live_count++;
+    return data;
 }
 
-static unsigned long object_hash_double(double val) { /* djb2 */
-    uint32_t *val_ptr = (uint32_t*)&val;
-    unsigned long hash = 5381;
-    hash = ((hash << 5) + hash) + val_ptr[0];
-    hash = ((hash << 5) + hash) + val_ptr[1];
-    return hash;
+static void free_slot(gcmem_t *mem, object_data_t *data) {
+    gcmem_page_t *page = data->page;
+    APE_ASSERT(!page->arena);
+    if (page->size_class == GCMEM_LARGE_OBJECT_SIZE_CLASS) {
+        if (page->prev) {
+            page->prev->next = page->next;
+        } else {
+            mem->heap.large_pages = page->next;
+        }
+        if (page->next) {
+            page->next->prev = page->prev;
+        }
+        allocator_free(mem->alloc, page);
+        return;
+    }
+    page->live[data->page_slot / 64] &= ~((uint64_t)1 << (data->page_slot % 64));
+    page->live_count--;
+    gcmem_size_class_t *size_class = &mem->size_classes[page->size_class];
+    data->type = OBJECT_FREED;
+    data->next_free = size_class->free_slots;
+    size_class->free_slots = data;
+}
+
+// free slots of empty pages are spread over the size class' free list, so it's rebuilt from pages that stay
+static void free_empty_pages(gcmem_t *mem, int size_class_ix) {
+    gcmem_size_class_t *size_class = &mem->size_classes[size_class_ix];
+    size_class->free_slots = NULL;
+    int empty_pages_count = 0;
+    gcmem_page_t *page = mem->heap.pages[size_class_ix];
+    while (page) {
+        gcmem_page_t *next = page->next;
+        if (page->live_count == 0) {
+            empty_pages_count++;
+        }
+        if (page->live_count == 0 && empty_pages_count > GCMEM_EMPTY_PAGES_RESERVE) {
+            if (page->prev) {
+                page->prev->next = page->next;
+            } else {
+                mem->heap.pages[size_class_ix] = page->next;
+            }
+            if (page->next) {
+                page->next->prev = page->prev;
+            }
+            allocator_free(mem->alloc, page);
+        } else {
+            for (int i = page->slots_used - 1; i >= 0; i--) {
+                if (page->live[i / 64] & ((uint64_t)1 << (i % 64))) {
+                    continue;
+                }
+                object_data_t *data = page_get_slot(page, i);
+                data->next_free = size_class->free_slots;
+                size_class->free_slots = data;
+            }
+        }
+        page = next;
+    }
 }
 
-array(object_t)* object_get_allocated_array(object_t object) {
-    APE_ASSERT(object_get_type(object) == OBJECT_ARRAY);
-    object_data_t *data = object_get_allocated_data(object);
-    return data->array;
+static gcmem_page_t* page_make(gcmem_t *mem, int slot_size, int slots_count) {
+    int bitmap_words = (slots_count + 63) / 64;
+    int bitmaps_size = bitmap_words * 2 * sizeof(uint64_t);
+    gcmem_page_t *page = allocator_malloc(mem->alloc, sizeof(gcmem_page_t) + bitmaps_size + slot_size * slots_count);
+    if (!page) {
+        return NULL;
+    }
+    memset(page, 0, sizeof(gcmem_page_t) + bitmaps_size);
+    page->mem = mem;
+    page->slot_size = slot_size;
+    page->slots_count = slots_count;
+    page->bitmap_words = bitmap_words;
+    page->arena = mem->arena_enabled;
+    page->live = (uint64_t*)(page + 1);
+    page->marks = page->live + bitmap_words;
+    page->slots = (uint8_t*)(page->marks + bitmap_words);
+    return page;
 }
 
-static bool object_is_number(object_t o) {
-    return (o.handle & OBJECT_PATTERN) != OBJECT_PATTERN;
+static object_data_t* page_get_slot(gcmem_page_t *page, int ix) {
+    return (object_data_t*)(page->slots + page->slot_size * ix);
 }
 
-static uint64_t get_type_tag(object_type_t type) {
-    switch (type) {
-        case OBJECT_NONE: return 0;
-        case OBJECT_BOOL: return 1;
-        case OBJECT_NULL: return 2;
-        default:          return 4;
+static void page_sweep(gcmem_t *mem, gcmem_page_t *page) {
+    APE_ASSERT(page->size_class != GCMEM_LARGE_OBJECT_SIZE_CLASS);
+    for (int i = 0; i < page->bitmap_words; i++) {
+        uint64_t dead = page->live[i] & ~page->marks[i];
+        for (int bit = 0; dead; bit++, dead >>= 1) {
+            if (!(dead & 1)) {
+                continue;
+            }
+            object_data_t *data = page_get_slot(page, i * 64 + bit);
+            if (can_data_be_put_in_pool(mem, data)) {
+                object_data_pool_t *pool = get_pool_for_type(mem, data->type);
+                pool->data[pool->count] = data;
+                pool->count++;
+            } else {
+                object_data_deinit(data);
+                free_slot(mem, data);
+            }
+        }
     }
 }
 
-static bool freevals_are_allocated(function_t *fun) {
-    return fun->free_vals_count >= APE_ARRAY_LEN(fun->free_vals_buf);
+static void page_deinit_objects(gcmem_page_t *page) {
+    for (int i = 0; i < page->bitmap_words; i++) {
+        uint64_t live = page->live[i];
+        for (int bit = 0; live; bit++, live >>= 1) {
+            if (live & 1) {
+                object_data_deinit(page_get_slot(page, i * 64 + bit));
+            }
+        }
+    }
 }
 
-static char *object_data_get_string(object_data_t *data) {
-    APE_ASSERT(data->type == OBJECT_STRING);
-    if (data->string.is_allocated) {
-        return data->string.value_allocated;
-    } else {
-        return data->string.value_buf;
+static void page_clear_arena_references(gcmem_page_t *page) {
+    for (int i = 0; i < page->bitmap_words; i++) {
+        uint64_t live = page->live[i];
+        for (int bit = 0; live; bit++, live >>= 1) {
+            if (!(live & 1)) {
+                continue;
+            }
+            object_data_t *data = page_get_slot(page, i * 64 + bit);
+            object_t obj = object_make_from_data(data->type, data);
+            switch (data->type) {
+                case OBJECT_ARRAY: {
+                    if (data->array) {
+                        gc_clear_arena_references(array_data(data->array), array_count(data->array));
+                    }
+                    break;
+                }
+                case OBJECT_MAP: {
+                    for (int j = object_get_map_length(obj) - 1; j >= 0; j--) {
+                        object_t key = object_get_map_key_at(obj, j);
+                        object_t val = object_get_map_value_at(obj, j);
+                        if (gc_object_is_in_arena(key) || gc_object_is_in_arena(val)) {
+                            valdict_remove(data->map, &key);
+                        }
+                    }
+                    break;
+                }
+                case OBJECT_FUNCTION: {
+                    gc_clear_arena_references(object_get_function_free_vals(obj), data->function.free_vals_count);
+                    break;
+                }
+                case OBJECT_COROUTINE: {
+                    coroutine_t *coroutine = &data->coroutine;
+                    bool runs_arena_code = gc_object_is_in_arena(coroutine->function);
+                    for (int j = 0; j < coroutine->frames_count; j++) {
+                        runs_arena_code = runs_arena_code || gc_object_is_in_arena(coroutine->frames[j].function);
+                    }
+                    if (runs_arena_code) {
+                        coroutine->function = object_make_null();
+                        coroutine->frames_count = 0;
+                        coroutine->stack_count = 0;
+                        coroutine->state = COROUTINE_DONE;
+                    } else {
+                        gc_clear_arena_references(coroutine->stack, coroutine->stack_count);
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
     }
 }
 
-static bool object_data_string_reserve_capacity(object_data_t *data, int capacity) {
-    APE_ASSERT(capacity >= 0);
-    
-    object_string_t *string = &data->string;
-
-    string->length = 0;
-    string->hash = 0;
+static void heap_destroy_pages(gcmem_t *mem, gcmem_heap_t *heap) {
+    for (int i = 0; i < GCMEM_SIZE_CLASSES_NUM; i++) {
+        gcmem_page_t *page = heap->pages[i];
+        while (page) {
+            gcmem_page_t *next = page->next;
+            page_deinit_objects(page);
+            allocator_free(mem->alloc, page);
+            page = next;
+        }
+        heap->pages[i] = NULL;
+    }
 
-    if (capacity <= string->capacity) {
-        return true;
+    gcmem_page_t *page = heap->large_pages;
+    while (page) {
+        gcmem_page_t *next = page->next;
+        page_deinit_objects(page);
+        allocator_free(mem->alloc, page);
+        page = next;
     }
+    heap->large_pages = NULL;
+}
 
-    if (capacity <= (OBJECT_STRING_BUF_SIZE - 1)) {
-        if (string->is_allocated) {
-            APE_ASSERT(false); // should never happen
-            allocator_free(data->mem->alloc, string->value_allocated); // just in case
+static void heap_unmark(gcmem_heap_t *heap) {
+    for (int i = 0; i < GCMEM_SIZE_CLASSES_NUM; i++) {
+        for (gcmem_page_t *page = heap->pages[i]; page; page = page->next) {
+            memset(page->marks, 0, page->bitmap_words * sizeof(uint64_t));
         }
-        string->capacity = OBJECT_STRING_BUF_SIZE - 1;
-        string->is_allocated = false;
-        return true;
     }
-
-    char *new_value = allocator_malloc(data->mem->alloc, capacity + 1);
-    if (!new_value) {
-        return false;
+    for (gcmem_page_t *page = heap->large_pages; page; page = page->next) {
+        memset(page->marks, 0, page->bitmap_words * sizeof(uint64_t));
     }
+}
 
-    if (string->is_allocated) {
-        allocator_free(data->mem->alloc, string->value_allocated);
-    }
+static bool data_is_marked(object_data_t *data) {
+    return data->page->marks[data->page_slot / 64] & ((uint64_t)1 << (data->page_slot % 64));
+}
 
-    string->value_allocated = new_value;
-    string->is_allocated = true;
-    string->capacity = capacity;
-    return true;
+static void data_mark(object_data_t *data) {
+    data->page->marks[data->page_slot / 64] |= (uint64_t)1 << (data->page_slot % 64);
 }
 //FILE_END
-//FILE_START:gc.c
-#include <stdlib.h>
-#include <string.h>
-#include <stdio.h>
-
+//FILE_START:channel.c
 #ifndef APE_AMALGAMATED
+#include "channel.h"
+
 #include "gc.h"
-#include "object.h"
 #endif
 
-static object_data_pool_t* get_pool_for_type(gcmem_t *mem, object_type_t type);
-static bool can_data_be_put_in_pool(gcmem_t *mem, object_data_t *data);
+typedef enum message_tag {
+    MESSAGE_NULL = 0,
+    MESSAGE_FALSE,
+    MESSAGE_TRUE,
+    MESSAGE_NUMBER,
+    MESSAGE_STRING,
+    MESSAGE_ERROR,
+    MESSAGE_ARRAY,
+    MESSAGE_MAP,
+    MESSAGE_REF, // array or map that was already written, used for shared and cyclic references
+} message_tag_t;
+
+typedef struct message_reader {
+    const uint8_t *data;
+    int len;
+    int pos;
+} message_reader_t;
+
+typedef struct channel {
+    allocator_t alloc; // copied so channel doesn't depend on lifetime of instances using it
+    ape_mutex_t mutex;
+    ape_cond_t not_empty;
+    ape_cond_t not_full;
+    array(uint8_t) **messages; // ring buffer
+    int capacity;
+    int head;
+    int count;
+    int ref_count;
+    bool closed;
+} channel_t;
 
-gcmem_t *gcmem_make(allocator_t *alloc) {
-    gcmem_t *mem = allocator_malloc(alloc, sizeof(gcmem_t));
-    if (!mem) {
+static array(uint8_t)* message_make(channel_t *channel, object_t obj, errors_t *errors);
+static bool message_write_object(array(uint8_t) *buf, object_t obj, valdict(object_t, uint32_t) *refs, errors_t *errors);
+static bool message_write(array(uint8_t) *buf, const void *data, int len);
+static object_t message_read_object(message_reader_t *reader, gcmem_t *mem, array(object_t) *refs);
+static bool message_read(message_reader_t *reader, void *out_data, int len);
+
+static void* channel_external_copy(void *data);
+static void channel_external_destroy(void *data);
+
+channel_t* channel_make(allocator_t *alloc, int capacity) {
+    if (capacity < 1) {
+        capacity = 1;
+    }
+    channel_t *channel = allocator_malloc(alloc, sizeof(channel_t));
+    if (!channel) {
         return NULL;
     }
-    memset(mem, 0, sizeof(gcmem_t));
-    mem->alloc = alloc;
-    mem->objects = ptrarray_make(alloc);
-    if (!mem->objects) {
-        goto error;
+    memset(channel, 0, sizeof(channel_t));
+    channel->alloc = *alloc;
+    channel->capacity = capacity;
+    channel->ref_count = 1;
+    channel->messages = allocator_malloc(alloc, sizeof(array(uint8_t)*) * capacity);
+    if (!channel->messages) {
+        goto err;
     }
-    mem->objects_back = ptrarray_make(alloc);
-    if (!mem->objects_back) {
-        goto error;
+    bool ok = ape_mutex_init(&channel->mutex);
+    if (!ok) {
+        goto err;
     }
-    mem->objects_not_gced = array_make(alloc, object_t);
-    if (!mem->objects_not_gced) {
-        goto error;
+    ok = ape_cond_init(&channel->not_empty);
+    if (!ok) {
+        ape_mutex_deinit(&channel->mutex);
+        goto err;
     }
-    mem->allocations_since_sweep = 0;
-    mem->data_only_pool.count = 0;
-
-    for (int i = 0; i < GCMEM_POOLS_NUM; i++) {
-        object_data_pool_t *pool = &mem->pools[i];
-        mem->pools[i].count = 0;
-        memset(pool, 0, sizeof(object_data_pool_t));
+    ok = ape_cond_init(&channel->not_full);
+    if (!ok) {
+        ape_cond_deinit(&channel->not_empty);
+        ape_mutex_deinit(&channel->mutex);
+        goto err;
     }
-
-    return mem;
-error:
-    gcmem_destroy(mem);
+    return channel;
+err:
+    allocator_free(alloc, channel->messages);
+    allocator_free(alloc, channel);
     return NULL;
 }
 
-void gcmem_destroy(gcmem_t *mem) {
-    if (!mem) {
+channel_t* channel_retain(channel_t *channel) {
+    ape_mutex_lock(&channel->mutex);
+    channel->ref_count++;
+    ape_mutex_unlock(&channel->mutex);
+    return channel;
+}
+
+void channel_release(channel_t *channel) {
+    if (!channel) {
+        return;
+    }
+    ape_mutex_lock(&channel->mutex);
+    channel->ref_count--;
+    bool referenced = channel->ref_count > 0;
+    ape_mutex_unlock(&channel->mutex);
+    if (referenced) {
         return;
     }
+    for (int i = 0; i < channel->count; i++) {
+        array_destroy(channel->messages[(channel->head + i) % channel->capacity]);
+    }
+    ape_cond_deinit(&channel->not_full);
+    ape_cond_deinit(&channel->not_empty);
+    ape_mutex_deinit(&channel->mutex);
+    allocator_t alloc = channel->alloc;
+    allocator_free(&alloc, channel->messages);
+    allocator_free(&alloc, channel);
+}
 
-    array_destroy(mem->objects_not_gced);
-    ptrarray_destroy(mem->objects_back);
+void channel_close(channel_t *channel) {
+    ape_mutex_lock(&channel->mutex);
+    channel->closed = true;
+    ape_cond_broadcast(&channel->not_empty);
+    ape_cond_broadcast(&channel->not_full);
+    ape_mutex_unlock(&channel->mutex);
+}
 
-    for (int i = 0; i < ptrarray_count(mem->objects); i++) {
-        object_data_t *obj = ptrarray_get(mem->objects, i);
-        object_data_deinit(obj);
-        allocator_free(mem->alloc, obj);
+bool channel_send(channel_t *channel, object_t obj, errors_t *errors) {
+    // copying is done before locking so senders don't block each other
+    array(uint8_t) *message = message_make(channel, obj, errors);
+    if (!message) {
+        return false;
     }
-    ptrarray_destroy(mem->objects);
 
-    for (int i = 0; i < GCMEM_POOLS_NUM; i++) {
-        object_data_pool_t *pool = &mem->pools[i];
-        for (int j = 0; j < pool->count; j++) {
-            object_data_t *data = pool->data[j];
-            object_data_deinit(data);
-            allocator_free(mem->alloc, data);
+    ape_mutex_lock(&channel->mutex);
+    while (channel->count == channel->capacity && !channel->closed) {
+        if (!ape_threads_platform_supported()) {
+            ape_mutex_unlock(&channel->mutex);
+            array_destroy(message);
+            errors_add_error(errors, ERROR_RUNTIME, src_pos_invalid, "Channel is full");
+            return false;
         }
-        memset(pool, 0, sizeof(object_data_pool_t));
+        ape_cond_wait(&channel->not_full, &channel->mutex);
     }
-
-    for (int i = 0; i < mem->data_only_pool.count; i++) {
-        allocator_free(mem->alloc, mem->data_only_pool.data[i]);
+    if (channel->closed) {
+        ape_mutex_unlock(&channel->mutex);
+        array_destroy(message);
+        errors_add_error(errors, ERROR_RUNTIME, src_pos_invalid, "Channel is closed");
+        return false;
     }
-
-    allocator_free(mem->alloc, mem);
+    channel->messages[(channel->head + channel->count) % channel->capacity] = message;
+    channel->count++;
+    ape_cond_broadcast(&channel->not_empty);
+    ape_mutex_unlock(&channel->mutex);
+    return true;
 }
 
-object_data_t* gcmem_alloc_object_data(gcmem_t *mem, object_type_t type) {
-    object_data_t *data = NULL;
-    mem->allocations_since_sweep++;
-    if (mem->data_only_pool.count > 0) {
-        data = mem->data_only_pool.data[mem->data_only_pool.count - 1];
-        mem->data_only_pool.count--;
-    } else {
-        data = allocator_malloc(mem->alloc, sizeof(object_data_t));
-        if (!data) {
-            return NULL;
+object_t channel_recv(channel_t *channel, gcmem_t *mem, errors_t *errors) {
+    ape_mutex_lock(&channel->mutex);
+    while (channel->count == 0 && !channel->closed) {
+        if (!ape_threads_platform_supported()) {
+            ape_mutex_unlock(&channel->mutex);
+            errors_add_error(errors, ERROR_RUNTIME, src_pos_invalid, "Channel is empty");
+            return object_make_null();
         }
+        ape_cond_wait(&channel->not_empty, &channel->mutex);
+    }
+    if (channel->count == 0) {
+        ape_mutex_unlock(&channel->mutex);
+        return object_make_null();
     }
+    array(uint8_t) *message = channel->messages[channel->head];
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+    ape_cond_broadcast(&channel->not_full);
+    ape_mutex_unlock(&channel->mutex);
+
+    object_t res = object_make_null();
+    array(object_t) *refs = array_make(mem->alloc, object_t);
+    if (refs) {
+        message_reader_t reader;
+        reader.data = array_data(message);
+        reader.len = array_count(message);
+        reader.pos = 0;
+        res = message_read_object(&reader, mem, refs);
+        array_destroy(refs);
+    }
+    array_destroy(message);
+    return res;
+}
 
-    memset(data, 0, sizeof(object_data_t));
+object_t object_make_channel(gcmem_t *mem, channel_t *channel) {
+    object_t res = object_make_external(mem, channel);
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+    channel_retain(channel);
+    object_set_external_destroy_function(res, channel_external_destroy);
+    object_set_external_copy_function(res, channel_external_copy);
+    return res;
+}
 
-    APE_ASSERT(ptrarray_count(mem->objects_back) >= ptrarray_count(mem->objects));
-    // we want to make sure that appending to objects_back never fails in sweep
-    // so this only reserves space there.
-    bool ok = ptrarray_add(mem->objects_back, data);
-    if (!ok) {
-        allocator_free(mem->alloc, data);
+channel_t* object_get_channel(object_t obj) {
+    if (object_get_type(obj) != OBJECT_EXTERNAL) {
         return NULL;
     }
-    ok = ptrarray_add(mem->objects, data);
-    if (!ok) {
-        allocator_free(mem->alloc, data);
+    external_data_t *external = object_get_external_data(obj);
+    if (external->data_destroy_fn != channel_external_destroy) {
         return NULL;
     }
-    data->mem = mem;
-    data->type = type;
-    return data;
+    return external->data;
 }
 
-object_data_t* gcmem_get_object_data_from_pool(gcmem_t *mem, object_type_t type) {
-    object_data_pool_t *pool = get_pool_for_type(mem, type);
-    if (!pool || pool->count <= 0) {
+// INTERNAL
+static array(uint8_t)* message_make(channel_t *channel, object_t obj, errors_t *errors) {
+    array(uint8_t) *buf = array_make(&channel->alloc, uint8_t);
+    if (!buf) {
+        errors_add_error(errors, ERROR_ALLOCATION, src_pos_invalid, "Allocation failed");
         return NULL;
     }
-    object_data_t *data = pool->data[pool->count - 1];
-
-    APE_ASSERT(ptrarray_count(mem->objects_back) >= ptrarray_count(mem->objects));
-
-    // we want to make sure that appending to objects_back never fails in sweep
-    // so this only reserves space there.
-    bool ok = ptrarray_add(mem->objects_back, data);
-    if (!ok) {
+    valdict(object_t, uint32_t) *refs = valdict_make(&channel->alloc, object_t, uint32_t);
+    if (!refs) {
+        array_destroy(buf);
+        errors_add_error(errors, ERROR_ALLOCATION, src_pos_invalid, "Allocation failed");
         return NULL;
     }
-    ok = ptrarray_add(mem->objects, data);
+    int errors_count = errors_get_count(errors);
+    bool ok = message_write_object(buf, obj, refs, errors);
+    valdict_destroy(refs);
     if (!ok) {
+        if (errors_get_count(errors) == errors_count) {
+            errors_add_error(errors, ERROR_ALLOCATION, src_pos_invalid, "Allocation failed");
+        }
+        array_destroy(buf);
         return NULL;
     }
-
-    pool->count--;
-
-    return data;
-}
-
-void gc_unmark_all(gcmem_t *mem) {
-    for (int i = 0; i < ptrarray_count(mem->objects); i++) {
-        object_data_t *data = ptrarray_get(mem->objects, i);
-        data->gcmark = false;
-    }
-}
-
-void gc_mark_objects(object_t *objects, int count) {
-    for (int i = 0; i < count; i++) {
-        object_t obj = objects[i];
-        gc_mark_object(obj);
-    }
+    return buf;
 }
 
-void gc_mark_object(object_t obj) {
-    if (!object_is_allocated(obj)) {
-        return;
-    }
-
-    object_data_t *data = object_get_allocated_data(obj);
-    if (data->gcmark) {
-        return;
-    }
-
-    data->gcmark = true;
-    switch (data->type) {
+static bool message_write_object(array(uint8_t) *buf, object_t obj, valdict(object_t, uint32_t) *refs, errors_t *errors) {
+    uint8_t tag = MESSAGE_NULL;
+    object_type_t type = object_get_type(obj);
+    switch (type) {
+        case OBJECT_NULL: {
+            tag = MESSAGE_NULL;
+            return message_write(buf, &tag, sizeof(tag));
+        }
+        case OBJECT_BOOL: {
+            tag = object_get_bool(obj) ? MESSAGE_TRUE : MESSAGE_FALSE;
+            return message_write(buf, &tag, sizeof(tag));
+        }
+        case OBJECT_NUMBER: {
+            tag = MESSAGE_NUMBER;
+            double val = object_get_number(obj);
+            return message_write(buf, &tag, sizeof(tag))
+                && message_write(buf, &val, sizeof(val));
+        }
+        case OBJECT_STRING:
+        case OBJECT_ERROR: {
+            tag = type == OBJECT_STRING ? MESSAGE_STRING : MESSAGE_ERROR;
+            const char *str = type == OBJECT_STRING ? object_get_string(obj) : object_get_error_message(obj);
+            int len = type == OBJECT_STRING ? object_get_string_length(obj) : (int)strlen(str);
+            return message_write(buf, &tag, sizeof(tag))
+                && message_write(buf, &len, sizeof(len))
+                && message_write(buf, str, len + 1);
+        }
+        case OBJECT_ARRAY:
         case OBJECT_MAP: {
-            int len = object_get_map_length(obj);
-            for (int i = 0; i < len; i++) {
-                object_t key = object_get_map_key_at(obj, i);
-                if (object_is_allocated(key)) {
-                    object_data_t *key_data = object_get_allocated_data(key);
-                    if (!key_data->gcmark) {
-                        gc_mark_object(key);
-                    }
-                }
-                object_t val = object_get_map_value_at(obj, i);
-                if (object_is_allocated(val)) {
-                    object_data_t *val_data = object_get_allocated_data(val);
-                    if (!val_data->gcmark) {
-                        gc_mark_object(val);
-                    }
-                }
+            uint32_t *ref = valdict_get(refs, &obj);
+            if (ref) {
+                tag = MESSAGE_REF;
+                return message_write(buf, &tag, sizeof(tag))
+                    && message_write(buf, ref, sizeof(*ref));
+            }
+            uint32_t ref_ix = valdict_count(refs);
+            bool ok = valdict_set(refs, &obj, &ref_ix);
+            if (!ok) {
+                return false;
+            }
+            tag = type == OBJECT_ARRAY ? MESSAGE_ARRAY : MESSAGE_MAP;
+            int len = type == OBJECT_ARRAY ? object_get_array_length(obj) : object_get_map_length(obj);
+            ok = message_write(buf, &tag, sizeof(tag))
+              && message_write(buf, &len, sizeof(len));
+            if (!ok) {
+                return false;
             }
-            break;
-        }
-        case OBJECT_ARRAY: {
-            int len = object_get_array_length(obj);
             for (int i = 0; i < len; i++) {
-                object_t val = object_get_array_value_at(obj, i);
-                if (object_is_allocated(val)) {
-                    object_data_t *val_data = object_get_allocated_data(val);
-                    if (!val_data->gcmark) {
-                        gc_mark_object(val);
-                    }
+                if (type == OBJECT_ARRAY) {
+                    ok = message_write_object(buf, object_get_array_value_at(obj, i), refs, errors);
+                } else {
+                    ok = message_write_object(buf, object_get_map_key_at(obj, i), refs, errors)
+                      && message_write_object(buf, object_get_map_value_at(obj, i), refs, errors);
                 }
-            }
-            break;
-        }
-        case OBJECT_FUNCTION: {
-            function_t *function = object_get_function(obj);
-            for (int i = 0; i < function->free_vals_count; i++) {
-                object_t free_val = object_get_function_free_val(obj, i);
-                gc_mark_object(free_val);
-                if (object_is_allocated(free_val)) {
-                    object_data_t *free_val_data = object_get_allocated_data(free_val);
-                    if (!free_val_data->gcmark) {
-                        gc_mark_object(free_val);
-                    }
+                if (!ok) {
+                    return false;
                 }
             }
-            break;
+            return true;
         }
         default: {
-            break;
+            errors_add_errorf(errors, ERROR_RUNTIME, src_pos_invalid, "Object of type %s can't be sent through a channel", object_get_type_name(type));
+            return false;
         }
     }
 }
 
-void gc_sweep(gcmem_t *mem) {
-    gc_mark_objects(array_data(mem->objects_not_gced), array_count(mem->objects_not_gced));
-
-    APE_ASSERT(ptrarray_count(mem->objects_back) >= ptrarray_count(mem->objects));
+static bool message_write(array(uint8_t) *buf, const void *data, int len) {
+    return array_addn(buf, data, len);
+}
 
-    ptrarray_clear(mem->objects_back);
-    for (int i = 0; i < ptrarray_count(mem->objects); i++) {
-        object_data_t *data = ptrarray_get(mem->objects, i);
-        if (data->gcmark) {
-            // this should never fail because objects_back's size should be equal to objects
-            bool ok = ptrarray_add(mem->objects_back, data);
-            (void)ok;
-            APE_ASSERT(ok);
-        } else {
-            if (can_data_be_put_in_pool(mem, data)) {
-                object_data_pool_t *pool = get_pool_for_type(mem, data->type);
-                pool->data[pool->count] = data;
-                pool->count++;
-            } else {
-                object_data_deinit(data);
-                if (mem->data_only_pool.count < GCMEM_POOL_SIZE) {
-                    mem->data_only_pool.data[mem->data_only_pool.count] = data;
-                    mem->data_only_pool.count++;
+static object_t message_read_object(message_reader_t *reader, gcmem_t *mem, array(object_t) *refs) {
+    uint8_t tag = MESSAGE_NULL;
+    bool ok = message_read(reader, &tag, sizeof(tag));
+    if (!ok) {
+        return object_make_null();
+    }
+    switch (tag) {
+        case MESSAGE_NULL: {
+            return object_make_null();
+        }
+        case MESSAGE_FALSE:
+        case MESSAGE_TRUE: {
+            return object_make_bool(tag == MESSAGE_TRUE);
+        }
+        case MESSAGE_NUMBER: {
+            double val = 0;
+            ok = message_read(reader, &val, sizeof(val));
+            return ok ? object_make_number(val) : object_make_null();
+        }
+        case MESSAGE_STRING:
+        case MESSAGE_ERROR: {
+            int len = 0;
+            ok = message_read(reader, &len, sizeof(len));
+            if (!ok || reader->pos + len + 1 > reader->len) {
+                return object_make_null();
+            }
+            const char *str = (const char*)reader->data + reader->pos;
+            reader->pos += len + 1;
+            if (tag == MESSAGE_ERROR) {
+                return object_make_error(mem, str);
+            }
+            object_t res = object_make_string_with_capacity(mem, len);
+            if (object_is_null(res)) {
+                return object_make_null();
+            }
+            ok = object_string_append(res, str, len);
+            return ok ? res : object_make_null();
+        }
+        case MESSAGE_ARRAY:
+        case MESSAGE_MAP: {
+            int len = 0;
+            ok = message_read(reader, &len, sizeof(len));
+            if (!ok) {
+                return object_make_null();
+            }
+            object_t res = tag == MESSAGE_ARRAY ? object_make_array_with_capacity(mem, len) : object_make_map_with_capacity(mem, len);
+            if (object_is_null(res)) {
+                return object_make_null();
+            }
+            ok = array_add(refs, &res);
+            if (!ok) {
+                return object_make_null();
+            }
+            for (int i = 0; i < len; i++) {
+                if (tag == MESSAGE_ARRAY) {
+                    object_t item = message_read_object(reader, mem, refs);
+                    ok = object_add_array_value(res, item);
                 } else {
-                    allocator_free(mem->alloc, data);
+                    object_t key = message_read_object(reader, mem, refs);
+                    object_t val = message_read_object(reader, mem, refs);
+                    ok = object_set_map_value(res, key, val);
+                }
+                if (!ok) {
+                    return object_make_null();
                 }
             }
+            return res;
+        }
+        case MESSAGE_REF: {
+            uint32_t ref_ix = 0;
+            ok = message_read(reader, &ref_ix, sizeof(ref_ix));
+            object_t *ref = ok ? array_get(refs, ref_ix) : NULL;
+            return ref ? *ref : object_make_null();
+        }
+        default: {
+            APE_ASSERT(false);
+            return object_make_null();
         }
     }
-    ptrarray(object_t) *objs_temp = mem->objects;
-    mem->objects = mem->objects_back;
-    mem->objects_back = objs_temp;
-    mem->allocations_since_sweep = 0;
 }
 
-bool gc_disable_on_object(object_t obj) {
-    if (!object_is_allocated(obj)) {
-        return false;
-    }
-    object_data_t *data = object_get_allocated_data(obj);
-    if (array_contains(data->mem->objects_not_gced, &obj)) {
+static bool message_read(message_reader_t *reader, void *out_data, int len) {
+    if (reader->pos + len > reader->len) {
+        APE_ASSERT(false);
         return false;
     }
-    bool ok = array_add(data->mem->objects_not_gced, &obj);
-    return ok;
-}
-
-void gc_enable_on_object(object_t obj) {
-    if (!object_is_allocated(obj)) {
-        return;
-    }
-    object_data_t *data = object_get_allocated_data(obj);
-    array_remove_item(data->mem->objects_not_gced, &obj);
-}
-
-int gc_should_sweep(gcmem_t *mem) {
-    return mem->allocations_since_sweep > GCMEM_SWEEP_INTERVAL;
+    memcpy(out_data, reader->data + reader->pos, len);
+    reader->pos += len;
+    return true;
 }
 
-// INTERNAL
-static object_data_pool_t* get_pool_for_type(gcmem_t *mem, object_type_t type) {
-    switch (type) {
-        case OBJECT_ARRAY:  return &mem->pools[0];
-        case OBJECT_MAP:    return &mem->pools[1];
-        case OBJECT_STRING: return &mem->pools[2];
-        default:            return NULL;
-    }
+static void* channel_external_copy(void *data) {
+    return channel_retain(data);
 }
 
-static bool can_data_be_put_in_pool(gcmem_t *mem, object_data_t *data) {
-    object_t obj = object_make_from_data(data->type, data);
-
-    // this is to ensure that large objects won't be kept in pool indefinitely
-    switch (data->type) {
-        case OBJECT_ARRAY: {
-            if (object_get_array_length(obj) > 1024) {
-                return false;
-            }
-            break;
-        }
-        case OBJECT_MAP: {
-            if (object_get_map_length(obj) > 1024) {
-                return false;
-            }
-            break;
-        }
-        case OBJECT_STRING: {
-            if (!data->string.is_allocated || data->string.capacity > 4096) {
-                return false;
-            }
-            break;
-        }
-        default:
-            break;
-    }
-
-    object_data_pool_t *pool = get_pool_for_type(mem, data->type);
-    if (!pool || pool->count >= GCMEM_POOL_SIZE) {
-        return false;
-    }
-
-    return true;
+static void channel_external_destroy(void *data) {
+    channel_release(data);
 }
 //FILE_END
 //FILE_START:builtins.c
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 
 #ifndef APE_AMALGAMATED
 #include "builtins.h"
@@ -11747,6 +14785,7 @@ static bool can_data_be_put_in_pool(gcmem_t *mem, object_data_t *data) {
 #include "common.h"
 #include "object.h"
 #include "vm.h"
+#include "channel.h"
 #endif
 
 static object_t len_fn(vm_t *vm, void *data, int argc, object_t *args);
@@ -11760,6 +14799,7 @@ static object_t remove_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t remove_at_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t println_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t print_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t flush_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t read_file_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t write_file_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t to_str_fn(vm_t *vm, void *data, int argc, object_t *args);
@@ -11776,8 +14816,31 @@ static object_t crash_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t assert_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t random_seed_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t random_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t random_array_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t shuffle_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t slice_fn(vm_t *vm, void *data, int argc, object_t *args);
 
+// Strings
+static object_t split_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t join_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t find_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t replace_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t trim_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t starts_with_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t ends_with_fn(vm_t *vm, void *data, int argc, object_t *args);
+
+static int find_substring(const char *str, int str_len, const char *substr, int substr_len);
+static object_t make_string_tail(vm_t *vm, object_t string, int index);
+
+// Channels
+static object_t send_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t recv_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t close_channel_fn(vm_t *vm, void *data, int argc, object_t *args);
+
+// Coroutines
+static object_t coroutine_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t coroutine_status_fn(vm_t *vm, void *data, int argc, object_t *args);
+
 // Type checks
 static object_t is_string_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t is_array_fn(vm_t *vm, void *data, int argc, object_t *args);
@@ -11789,6 +14852,7 @@ static object_t is_function_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t is_external_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t is_error_fn(vm_t *vm, void *data, int argc, object_t *args);
 static object_t is_native_function_fn(vm_t *vm, void *data, int argc, object_t *args);
+static object_t is_coroutine_fn(vm_t *vm, void *data, int argc, object_t *args);
 
 // Math
 static object_t sqrt_fn(vm_t *vm, void *data, int argc, object_t *args);
@@ -11811,61 +14875,85 @@ static bool check_args(vm_t *vm, bool generate_error, int argc, object_t *args,
         sizeof((object_type_t[]){__VA_ARGS__}) / sizeof(object_type_t),\
         (object_type_t[]){__VA_ARGS__})
 
+// builtins added after a name was free to use can be shadowed by script definitions, so existing scripts keep compiling
 static struct {
     const char *name;
     native_fn fn;
+    bool shadowable;
 } g_native_functions[] = {
-    {"len",         len_fn},
-    {"println",     println_fn},
-    {"print",       print_fn},
-    {"read_file",   read_file_fn},
-    {"write_file",  write_file_fn},
-    {"first",       first_fn},
-    {"last",        last_fn},
-    {"rest",        rest_fn},
-    {"append",      append_fn},
-    {"remove",      remove_fn},
-    {"remove_at",   remove_at_fn},
-    {"to_str",      to_str_fn},
-    {"to_num",      to_num_fn},
-    {"range",       range_fn},
-    {"keys",        keys_fn},
-    {"values",      values_fn},
-    {"copy",        copy_fn},
-    {"deep_copy",   deep_copy_fn},
-    {"concat",      concat_fn},
-    {"char_to_str", char_to_str_fn},
-    {"reverse",     reverse_fn},
-    {"array",       array_fn},
-    {"error",       error_fn},
-    {"crash",       crash_fn},
-    {"assert",      assert_fn},
-    {"random_seed", random_seed_fn},
-    {"random",      random_fn},
-    {"slice",       slice_fn},
+    {"len",         len_fn, false},
+    {"println",     println_fn, false},
+    {"print",       print_fn, false},
+    {"flush",       flush_fn, true},
+    {"read_file",   read_file_fn, false},
+    {"write_file",  write_file_fn, false},
+    {"first",       first_fn, false},
+    {"last",        last_fn, false},
+    {"rest",        rest_fn, false},
+    {"append",      append_fn, false},
+    {"remove",      remove_fn, false},
+    {"remove_at",   remove_at_fn, false},
+    {"to_str",      to_str_fn, false},
+    {"to_num",      to_num_fn, false},
+    {"range",       range_fn, false},
+    {"keys",        keys_fn, false},
+    {"values",      values_fn, false},
+    {"copy",        copy_fn, false},
+    {"deep_copy",   deep_copy_fn, false},
+    {"concat",      concat_fn, false},
+    {"char_to_str", char_to_str_fn, false},
+    {"reverse",     reverse_fn, false},
+    {"array",       array_fn, false},
+    {"error",       error_fn, false},
+    {"crash",       crash_fn, false},
+    {"assert",      assert_fn, false},
+    {"random_seed", random_seed_fn, false},
+    {"random",      random_fn, false},
+    {"random_array", random_array_fn, true},
+    {"shuffle",     shuffle_fn, true},
+    {"slice",       slice_fn, false},
+
+    // Strings
+    {"split",       split_fn, true},
+    {"join",        join_fn, true},
+    {"find",        find_fn, true},
+    {"replace",     replace_fn, true},
+    {"trim",        trim_fn, true},
+    {"starts_with", starts_with_fn, true},
+    {"ends_with",   ends_with_fn, true},
+
+    // Channels
+    {"send",          send_fn, true},
+    {"recv",          recv_fn, true},
+    {"close_channel", close_channel_fn, true},
+
+    // Coroutines
+    {"coroutine",        coroutine_fn, true},
+    {"coroutine_status", coroutine_status_fn, true},
 
     // Type checks
-    {"is_string",   is_string_fn},
-    {"is_array",    is_array_fn},
-    {"is_map",      is_map_fn},
-    {"is_number",   is_number_fn},
-    {"is_bool",     is_bool_fn},
-    {"is_null",     is_null_fn},
-    {"is_function", is_function_fn},
-    {"is_external", is_external_fn},
-    {"is_error",    is_error_fn},
-    {"is_native_function", is_native_function_fn},
+    {"is_string",   is_string_fn, false},
+    {"is_array",    is_array_fn, false},
+    {"is_map",      is_map_fn, false},
+    {"is_number",   is_number_fn, false},
+    {"is_bool",     is_bool_fn, false},
+    {"is_null",     is_null_fn, false},
+    {"is_function", is_function_fn, false},
+    {"is_external", is_external_fn, false},
+    {"is_error",    is_error_fn, false},
+    {"is_native_function", is_native_function_fn, false},
+    {"is_coroutine", is_coroutine_fn, true},
 
     // Math
-    {"sqrt",  sqrt_fn},
-    {"pow",   pow_fn},
-    {"sin",   sin_fn},
-    {"cos",   cos_fn},
-    {"tan",   tan_fn},
-    {"log",   log_fn},
-    {"ceil",  ceil_fn},
-    {"floor", floor_fn},
-    {"abs",   abs_fn},
+    {"sqrt",  sqrt_fn, false},
+    {"pow",   pow_fn, false},
+    {"sin",   sin_fn, false},
+    {"cos",   cos_fn, false},
+    {"tan",   tan_fn, false},
+    {"log",   log_fn, false},
+    {"ceil",  ceil_fn, false},
+    {"floor", floor_fn, false},
+    {"abs",   abs_fn, false},
 };
 
 int builtins_count() {
@@ -11880,6 +14968,17 @@ const char* builtins_get_name(int ix) {
     return g_native_functions[ix].name;
 }
 
+bool builtins_is_shadowable(int ix) {
+    return g_native_functions[ix].shadowable;
+}
+
+bool builtins_is_range(object_t obj) {
+    if (object_get_type(obj) != OBJECT_NATIVE_FUNCTION) {
+        return false;
+    }
+    return object_get_native_function(obj)->fn == range_fn;
+}
+
 // INTERNAL
 static object_t len_fn(vm_t *vm, void *data, int argc, object_t *args) {
     (void)data;
@@ -12048,7 +15147,7 @@ static object_t println_fn(vm_t *vm, void *data, int argc, object_t *args) {
         return object_make_null(); // todo: runtime error?
     }
 
-    strbuf_t *buf = strbuf_make(vm->alloc);
+    strbuf_t *buf = vm_get_stdout_buf(vm);
     if (!buf) {
         return object_make_null();
     }
@@ -12057,12 +15156,7 @@ static object_t println_fn(vm_t *vm, void *data, int argc, object_t *args) {
         object_to_string(arg, buf, false);
     }
     strbuf_append(buf, "\n");
-    if (strbuf_failed(buf)) {
-        strbuf_destroy(buf);
-        return object_make_null();
-    }
-    config->stdio.write.write(config->stdio.write.context, strbuf_get_string(buf), strbuf_get_length(buf));
-    strbuf_destroy(buf);
+    vm_flush_stdout(vm, false);
     return object_make_null();
 }
 
@@ -12074,7 +15168,7 @@ static object_t print_fn(vm_t *vm, void *data, int argc, object_t *args) {
         return object_make_null(); // todo: runtime error?
     }
 
-    strbuf_t *buf = strbuf_make(vm->alloc);
+    strbuf_t *buf = vm_get_stdout_buf(vm);
     if (!buf) {
         return object_make_null();
     }
@@ -12082,12 +15176,15 @@ static object_t print_fn(vm_t *vm, void *data, int argc, object_t *args) {
         object_t arg = args[i];
         object_to_string(arg, buf, false);
     }
-    if (strbuf_failed(buf)) {
-        strbuf_destroy(buf);
-        return object_make_null();
-    }
-    config->stdio.write.write(config->stdio.write.context, strbuf_get_string(buf), strbuf_get_length(buf));
-    strbuf_destroy(buf);
+    vm_flush_stdout(vm, false);
+    return object_make_null();
+}
+
+static object_t flush_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    (void)argc;
+    (void)args;
+    vm_flush_stdout(vm, true);
     return object_make_null();
 }
 
@@ -12200,8 +15297,7 @@ static object_t char_to_str_fn(vm_t *vm, void *data, int argc, object_t *args) {
     double val = object_get_number(args[0]);
 
     char c = (char)val;
-    char str[2] = {c, '\0'};
-    return object_make_string(vm->mem, str);
+    return vm_get_char_string(vm, c);
 }
 
 static object_t range_fn(vm_t *vm, void *data, int argc, object_t *args) {
@@ -12245,7 +15341,7 @@ static object_t range_fn(vm_t *vm, void *data, int argc, object_t *args) {
     if (object_is_null(res)) {
         return object_make_null();
     }
-    for (int i = start; i < end; i += step) {
+    for (int i = start; step > 0 ? i < end : i > end; i += step) {
         object_t item = object_make_number(i);
         bool ok = object_add_array_value(res, item);
         if (!ok) {
@@ -12450,13 +15546,13 @@ static object_t random_seed_fn(vm_t *vm, void *data, int argc, object_t *args) {
         return object_make_null();
     }
     int seed = (int)object_get_number(args[0]);
-    srand(seed);
+    ape_random_seed(&vm->random, (uint64_t)seed);
     return object_make_bool(true);
 }
 
 static object_t random_fn(vm_t *vm, void *data, int argc, object_t *args) {
     (void)data;
-    double res = (double)rand() / RAND_MAX;
+    double res = ape_random_next_double(&vm->random);
     if (argc == 0) {
         return object_make_number(res);
     } else if (argc == 2) {
@@ -12466,7 +15562,7 @@ static object_t random_fn(vm_t *vm, void *data, int argc, object_t *args) {
         double min = object_get_number(args[0]);
         double max = object_get_number(args[1]);
         if (min >= max) {
-            errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "max is bigger than min");
+            errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "min is bigger than max");
             return object_make_null();
         }
         double range = max - min;
@@ -12478,6 +15574,66 @@ static object_t random_fn(vm_t *vm, void *data, int argc, object_t *args) {
     }
 }
 
+static object_t random_array_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    double min = 0;
+    double range = 1;
+    if (argc == 1) {
+        if (!CHECK_ARGS(vm, true, argc, args, OBJECT_NUMBER)) {
+            return object_make_null();
+        }
+    } else if (argc == 3) {
+        if (!CHECK_ARGS(vm, true, argc, args, OBJECT_NUMBER, OBJECT_NUMBER, OBJECT_NUMBER)) {
+            return object_make_null();
+        }
+        min = object_get_number(args[1]);
+        double max = object_get_number(args[2]);
+        if (min >= max) {
+            errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "min is bigger than max");
+            return object_make_null();
+        }
+        range = max - min;
+    } else {
+        errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "Invalid number or arguments");
+        return object_make_null();
+    }
+
+    double count_val = object_get_number(args[0]);
+    if (!(count_val >= 0 && count_val <= INT_MAX)) { // also catches nan
+        errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "Invalid number of random numbers");
+        return object_make_null();
+    }
+    int count = (int)count_val;
+    object_t res = object_make_array_with_capacity(vm->mem, count);
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+    for (int i = 0; i < count; i++) {
+        double val = min + (ape_random_next_double(&vm->random) * range);
+        bool ok = object_add_array_value(res, object_make_number(val));
+        if (!ok) {
+            return object_make_null();
+        }
+    }
+    return res;
+}
+
+static object_t shuffle_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_ARRAY)) {
+        return object_make_null();
+    }
+    object_t arr = args[0];
+    int len = object_get_array_length(arr);
+    for (int i = len - 1; i > 0; i--) {
+        int j = (int)(ape_random_next_double(&vm->random) * (i + 1));
+        object_t tmp = object_get_array_value_at(arr, i);
+        object_set_array_value_at(arr, i, object_get_array_value_at(arr, j));
+        object_set_array_value_at(arr, j, tmp);
+    }
+    return arr;
+}
+
 static object_t slice_fn(vm_t *vm, void *data, int argc, object_t *args) {
     (void)data;
     if (!CHECK_ARGS(vm, true, argc, args, OBJECT_STRING | OBJECT_ARRAY, OBJECT_NUMBER)) {
@@ -12506,7 +15662,6 @@ static object_t slice_fn(vm_t *vm, void *data, int argc, object_t *args) {
         }
         return res;
     } else if (arg_type == OBJECT_STRING) {
-        const char *str = object_get_string(args[0]);
         int len = (int)object_get_string_length(args[0]);
         if (index < 0) {
             index = len + index;
@@ -12517,26 +15672,363 @@ static object_t slice_fn(vm_t *vm, void *data, int argc, object_t *args) {
         if (index >= len) {
             return object_make_string(vm->mem, "");
         }
-        int res_len = len - index;
-        object_t res = object_make_string_with_capacity(vm->mem, res_len);
+        return make_string_tail(vm, args[0], index);
+    } else {
+        const char *type_str = object_get_type_name(arg_type);
+        errors_add_errorf(vm->errors, ERROR_RUNTIME, src_pos_invalid,
+                          "Invalid argument 0 passed to slice, got %s instead", type_str);
+        return object_make_null();
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Strings
+//-----------------------------------------------------------------------------
+
+static object_t split_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_STRING, OBJECT_STRING)) {
+        return object_make_null();
+    }
+    const char *str = object_get_string(args[0]);
+    int len = object_get_string_length(args[0]);
+    const char *sep = object_get_string(args[1]);
+    int sep_len = object_get_string_length(args[1]);
+
+    if (sep_len == 0) {
+        object_t res = object_make_array_with_capacity(vm->mem, len);
         if (object_is_null(res)) {
             return object_make_null();
         }
-
-        char *res_buf = object_get_mutable_string(res);
-        memset(res_buf, 0, res_len + 1);
-        for (int i = index; i < len; i++) {
-            char c = str[i];
-            res_buf[i - index] = c;
+        for (int i = 0; i < len; i++) {
+            bool ok = object_add_array_value(res, vm_get_char_string(vm, str[i]));
+            if (!ok) {
+                return object_make_null();
+            }
         }
-        object_set_string_length(res, res_len);
         return res;
-    } else {
-        const char *type_str = object_get_type_name(arg_type);
-        errors_add_errorf(vm->errors, ERROR_RUNTIME, src_pos_invalid,
-                          "Invalid argument 0 passed to slice, got %s instead", type_str);
+    }
+
+    int parts_count = 1;
+    int pos = 0;
+    while (true) {
+        int found = find_substring(str + pos, len - pos, sep, sep_len);
+        if (found < 0) {
+            break;
+        }
+        parts_count++;
+        pos += found + sep_len;
+    }
+
+    object_t res = object_make_array_with_capacity(vm->mem, parts_count);
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+    pos = 0;
+    for (int i = 0; i < parts_count; i++) {
+        int part_len = 0;
+        object_t part = object_make_null();
+        if (i == (parts_count - 1)) {
+            part = make_string_tail(vm, args[0], pos);
+            part_len = len - pos;
+        } else {
+            part_len = find_substring(str + pos, len - pos, sep, sep_len);
+            part = object_make_string_with_capacity(vm->mem, part_len);
+            if (object_is_null(part)) {
+                return object_make_null();
+            }
+            bool ok = object_string_append(part, str + pos, part_len);
+            if (!ok) {
+                return object_make_null();
+            }
+        }
+        if (object_is_null(part)) {
+            return object_make_null();
+        }
+        bool ok = object_add_array_value(res, part);
+        if (!ok) {
+            return object_make_null();
+        }
+        pos += part_len + sep_len;
+    }
+    return res;
+}
+
+static object_t join_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_ARRAY, OBJECT_STRING)) {
+        return object_make_null();
+    }
+    int count = object_get_array_length(args[0]);
+    const char *sep = object_get_string(args[1]);
+    int sep_len = object_get_string_length(args[1]);
+
+    int res_len = 0;
+    for (int i = 0; i < count; i++) {
+        object_t item = object_get_array_value_at(args[0], i);
+        object_type_t item_type = object_get_type(item);
+        if (item_type != OBJECT_STRING) {
+            errors_add_errorf(vm->errors, ERROR_RUNTIME, src_pos_invalid,
+                              "Invalid item %d passed to join, got %s instead of %s",
+                              i, object_get_type_name(item_type), object_get_type_name(OBJECT_STRING));
+            return object_make_null();
+        }
+        res_len += object_get_string_length(item) + (i > 0 ? sep_len : 0);
+    }
+
+    object_t res = object_make_string_with_capacity(vm->mem, res_len);
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+    for (int i = 0; i < count; i++) {
+        object_t item = object_get_array_value_at(args[0], i);
+        if (i > 0) {
+            bool ok = object_string_append(res, sep, sep_len);
+            if (!ok) {
+                return object_make_null();
+            }
+        }
+        bool ok = object_string_append(res, object_get_string(item), object_get_string_length(item));
+        if (!ok) {
+            return object_make_null();
+        }
+    }
+    return res;
+}
+
+static object_t find_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_STRING, OBJECT_STRING)) {
+        return object_make_null();
+    }
+    int ix = find_substring(object_get_string(args[0]), object_get_string_length(args[0]),
+                            object_get_string(args[1]), object_get_string_length(args[1]));
+    return object_make_number(ix);
+}
+
+static object_t replace_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_STRING, OBJECT_STRING, OBJECT_STRING)) {
         return object_make_null();
     }
+    const char *str = object_get_string(args[0]);
+    int len = object_get_string_length(args[0]);
+    const char *old_str = object_get_string(args[1]);
+    int old_len = object_get_string_length(args[1]);
+    const char *new_str = object_get_string(args[2]);
+    int new_len = object_get_string_length(args[2]);
+
+    if (old_len == 0) {
+        errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "String to replace cannot be empty");
+        return object_make_null();
+    }
+
+    int count = 0;
+    int pos = 0;
+    while (true) {
+        int found = find_substring(str + pos, len - pos, old_str, old_len);
+        if (found < 0) {
+            break;
+        }
+        count++;
+        pos += found + old_len;
+    }
+    if (count == 0) {
+        return args[0];
+    }
+
+    object_t res = object_make_string_with_capacity(vm->mem, len + count * (new_len - old_len));
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+    pos = 0;
+    for (int i = 0; i <= count; i++) {
+        int found = i < count ? find_substring(str + pos, len - pos, old_str, old_len) : len - pos;
+        bool ok = object_string_append(res, str + pos, found);
+        if (!ok) {
+            return object_make_null();
+        }
+        if (i < count) {
+            ok = object_string_append(res, new_str, new_len);
+            if (!ok) {
+                return object_make_null();
+            }
+        }
+        pos += found + old_len;
+    }
+    return res;
+}
+
+static object_t trim_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_STRING)) {
+        return object_make_null();
+    }
+    const char *str = object_get_string(args[0]);
+    int len = object_get_string_length(args[0]);
+    int start = 0;
+    while (start < len && isspace((unsigned char)str[start])) {
+        start++;
+    }
+    int end = len;
+    while (end > start && isspace((unsigned char)str[end - 1])) {
+        end--;
+    }
+    if (end == len) {
+        return make_string_tail(vm, args[0], start);
+    }
+    object_t res = object_make_string_with_capacity(vm->mem, end - start);
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+    bool ok = object_string_append(res, str + start, end - start);
+    return ok ? res : object_make_null();
+}
+
+static object_t starts_with_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_STRING, OBJECT_STRING)) {
+        return object_make_null();
+    }
+    int len = object_get_string_length(args[0]);
+    int prefix_len = object_get_string_length(args[1]);
+    if (prefix_len > len) {
+        return object_make_bool(false);
+    }
+    return object_make_bool(memcmp(object_get_string(args[0]), object_get_string(args[1]), prefix_len) == 0);
+}
+
+static object_t ends_with_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_STRING, OBJECT_STRING)) {
+        return object_make_null();
+    }
+    int len = object_get_string_length(args[0]);
+    int suffix_len = object_get_string_length(args[1]);
+    if (suffix_len > len) {
+        return object_make_bool(false);
+    }
+    return object_make_bool(memcmp(object_get_string(args[0]) + len - suffix_len, object_get_string(args[1]), suffix_len) == 0);
+}
+
+static int find_substring(const char *str, int str_len, const char *substr, int substr_len) {
+    if (substr_len == 0) {
+        return 0;
+    }
+    if (substr_len > str_len) {
+        return -1;
+    }
+    const char *pos = str;
+    const char *last = str + str_len - substr_len;
+    while (pos <= last) {
+        // memchr skips to candidates for the first character, memcmp checks the rest
+        pos = memchr(pos, substr[0], last - pos + 1);
+        if (!pos) {
+            return -1;
+        }
+        if (memcmp(pos + 1, substr + 1, substr_len - 1) == 0) {
+            return (int)(pos - str);
+        }
+        pos++;
+    }
+    return -1;
+}
+
+static object_t make_string_tail(vm_t *vm, object_t string, int index) {
+    const char *str = object_get_string(string);
+    int len = object_get_string_length(string);
+    int res_len = len - index;
+    if (index == 0) {
+        return string; // strings are immutable
+    } else if (res_len == 1) {
+        return vm_get_char_string(vm, str[index]);
+    } else if (res_len < OBJECT_STRING_BUF_SIZE) {
+        // fits in object's inline buffer, copying is cheaper than keeping whole string alive
+        object_t res = object_make_string_with_capacity(vm->mem, res_len);
+        if (object_is_null(res)) {
+            return object_make_null();
+        }
+        bool ok = object_string_append(res, str + index, res_len);
+        return ok ? res : object_make_null();
+    }
+    return object_make_string_view(vm->mem, string, index);
+}
+
+//-----------------------------------------------------------------------------
+// Channels
+//-----------------------------------------------------------------------------
+
+static channel_t* get_channel_arg(vm_t *vm, object_t arg) {
+    channel_t *channel = object_get_channel(arg);
+    if (!channel) {
+        errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "Argument is not a channel");
+    }
+    return channel;
+}
+
+static object_t send_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_EXTERNAL, OBJECT_ANY)) {
+        return object_make_null();
+    }
+    channel_t *channel = get_channel_arg(vm, args[0]);
+    if (!channel) {
+        return object_make_null();
+    }
+    bool ok = channel_send(channel, args[1], vm->errors);
+    return object_make_bool(ok);
+}
+
+static object_t recv_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_EXTERNAL)) {
+        return object_make_null();
+    }
+    channel_t *channel = get_channel_arg(vm, args[0]);
+    if (!channel) {
+        return object_make_null();
+    }
+    return channel_recv(channel, vm->mem, vm->errors);
+}
+
+static object_t close_channel_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_EXTERNAL)) {
+        return object_make_null();
+    }
+    channel_t *channel = get_channel_arg(vm, args[0]);
+    if (!channel) {
+        return object_make_null();
+    }
+    channel_close(channel);
+    return object_make_null();
+}
+
+//-----------------------------------------------------------------------------
+// Coroutines
+//-----------------------------------------------------------------------------
+
+static object_t coroutine_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_FUNCTION)) {
+        return object_make_null();
+    }
+    return object_make_coroutine(vm->mem, args[0]);
+}
+
+static object_t coroutine_status_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_COROUTINE)) {
+        return object_make_null();
+    }
+    coroutine_t *coroutine = object_get_coroutine(args[0]);
+    switch (coroutine->state) {
+        case COROUTINE_CREATED:   return object_make_string(vm->mem, "suspended");
+        case COROUTINE_SUSPENDED: return object_make_string(vm->mem, "suspended");
+        case COROUTINE_RUNNING:   return object_make_string(vm->mem, "running");
+        case COROUTINE_DONE:      return object_make_string(vm->mem, "done");
+    }
+    return object_make_null();
 }
 
 //-----------------------------------------------------------------------------
@@ -12623,6 +16115,14 @@ static object_t is_native_function_fn(vm_t *vm, void *data, int argc, object_t *
     return object_make_bool(object_get_type(args[0]) == OBJECT_NATIVE_FUNCTION);
 }
 
+static object_t is_coroutine_fn(vm_t *vm, void *data, int argc, object_t *args) {
+    (void)data;
+    if (!CHECK_ARGS(vm, true, argc, args, OBJECT_ANY)) {
+        return object_make_null();
+    }
+    return object_make_bool(object_get_type(args[0]) == OBJECT_COROUTINE);
+}
+
 //-----------------------------------------------------------------------------
 // Math
 //-----------------------------------------------------------------------------
@@ -12800,10 +16300,38 @@ bool traceback_append(traceback_t *traceback, const char *function_name, src_pos
     return true;
 }
 
+// frames of running coroutine at given nesting level, 0 is the main stack
+static bool traceback_append_from_frames(traceback_t *traceback, vm_t *vm, int level) {
+    frame_t *frames = vm->frames;
+    int frames_count = vm->frames_count;
+    if (level < vm->resumed_coroutines_count) {
+        frames = vm->resumed_coroutines[level].caller_frames;
+        frames_count = vm->resumed_coroutines[level].caller_frames_count;
+    }
+    for (int i = frames_count - 1; i >= 0; i--) {
+        frame_t *frame = &frames[i];
+        src_pos_t pos = frame_src_position(frame);
+        if (frame->src_positions) {
+            inline_frame_t inline_frame = code_find_inline_frame(frame->src_positions, frame->src_positions_size, frame->src_ip);
+            if (inline_frame.function_name) {
+                bool ok = traceback_append(traceback, inline_frame.function_name, pos);
+                if (!ok) {
+                    return false;
+                }
+                pos = inline_frame.call_pos;
+            }
+        }
+        bool ok = traceback_append(traceback, object_get_function_name(frame->function), pos);
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool traceback_append_from_vm(traceback_t *traceback, vm_t *vm) {
-    for (int i = vm->frames_count - 1; i >= 0; i--) {
-        frame_t *frame = &vm->frames[i];
-        bool ok = traceback_append(traceback, object_get_function_name(frame->function), frame_src_position(frame));
+    for (int level = vm->resumed_coroutines_count; level >= 0; level--) {
+        bool ok = traceback_append_from_frames(traceback, vm, level);
         if (!ok) {
             return false;
         }
@@ -12858,11 +16386,14 @@ bool frame_init(frame_t* frame, object_t function_obj, int base_pointer) {
     }
     function_t* function = object_get_function(function_obj);
     frame->function = function_obj;
+    frame->constants = function->constants;
     frame->ip = 0;
     frame->base_pointer = base_pointer;
     frame->src_ip = 0;
     frame->bytecode = function->comp_result->bytecode;
+    frame->dequickened = function->comp_result->dequickened;
     frame->src_positions = function->comp_result->src_positions;
+    frame->src_positions_size = function->comp_result->src_positions_size;
     frame->bytecode_size = function->comp_result->count;
     frame->recover_ip = -1;
     frame->is_recovering = false;
@@ -12871,7 +16402,26 @@ bool frame_init(frame_t* frame, object_t function_obj, int base_pointer) {
 
 opcode_val_t frame_read_opcode(frame_t* frame){
     frame->src_ip = frame->ip;
-    return frame_read_uint8(frame);
+    // opcodes are rewritten by vm and bytecode can be shared by instances on other threads
+    opcode_val_t op = APE_RELAXED_LOAD_U8(frame->bytecode + frame->ip);
+    frame->ip++;
+    return op;
+}
+
+void frame_quicken_opcode(frame_t* frame, opcode_t op) {
+    // polymorphic instructions would keep switching between forms, they stay generic after failing a guard once
+    uint8_t bits = APE_RELAXED_LOAD_U8(frame->dequickened + frame->src_ip / 8);
+    if (bits & (1 << (frame->src_ip % 8))) {
+        return;
+    }
+    APE_RELAXED_STORE_U8(frame->bytecode + frame->src_ip, op);
+}
+
+void frame_dequicken_opcode(frame_t* frame, opcode_t op) {
+    // bits set concurrently by other threads might get lost, which only lets their instructions be quickened again
+    uint8_t *bits = frame->dequickened + frame->src_ip / 8;
+    APE_RELAXED_STORE_U8(bits, APE_RELAXED_LOAD_U8(bits) | (1 << (frame->src_ip % 8)));
+    APE_RELAXED_STORE_U8(frame->bytecode + frame->src_ip, op);
 }
 
 uint64_t frame_read_uint64(frame_t* frame) {
@@ -12903,11 +16453,625 @@ uint8_t frame_read_uint8(frame_t* frame) {
 
 src_pos_t frame_src_position(const frame_t *frame) {
     if (frame->src_positions) {
-        return frame->src_positions[frame->src_ip];
+        return code_find_src_pos(frame->src_positions, frame->src_positions_size, frame->src_ip);
     }
     return src_pos_invalid;
 }
 //FILE_END
+//FILE_START:jit.c
+#include <stdlib.h>
+#include <stddef.h>
+
+#ifndef APE_AMALGAMATED
+#include "jit.h"
+#include "code.h"
+#include "compiler.h"
+#include "vm.h"
+#endif
+
+#ifdef APE_JIT
+
+#include <sys/mman.h>
+
+// Registers used by generated code:
+// rbx - jit_state_t*, r12 - base pointer, r13 - stack pointer (next free slot),
+// r14 - last popped object, r15 - globals, rax, rcx, rdx, xmm0, xmm1 - scratch.
+// Every instruction either finishes or returns to the interpreter before changing the stack.
+
+#define JIT_STATE_OFFSET(field) ((uint8_t)offsetof(jit_state_t, field))
+
+#define JIT_EMIT(jc, ...) jit_emit((jc), (const uint8_t[]){ __VA_ARGS__ }, sizeof((const uint8_t[]){ __VA_ARGS__ }))
+
+#define JIT_JE  0x84
+#define JIT_JNE 0x85
+#define JIT_JAE 0x83
+#define JIT_JLE 0x8e
+
+typedef void (*jit_entry_fn)(jit_state_t *state);
+
+struct jit_code {
+    void *mem;
+    size_t mem_size;
+    jit_entry_fn entry;
+};
+
+typedef enum jit_fixup_type {
+    JIT_FIXUP_INSTRUCTION, // code of instruction at ip
+    JIT_FIXUP_EXIT,        // stub returning to the interpreter at ip
+    JIT_FIXUP_EPILOGUE,
+    JIT_FIXUP_TABLE,
+} jit_fixup_type_t;
+
+typedef struct jit_fixup {
+    jit_fixup_type_t type;
+    int offset; // of rel32 operand
+    int ip;
+} jit_fixup_t;
+
+typedef struct jit_compiler {
+    allocator_t *alloc;
+    array(uint8_t) *code;
+    array(jit_fixup_t) *fixups;
+    int *instr_offsets; // -1 if ip isn't at the start of an instruction
+    int *exit_offsets;  // -1 if there's no exit stub for ip
+    bool failed;
+} jit_compiler_t;
+
+static bool jit_compile_instruction(jit_compiler_t *jc, object_t function_obj, int ip, opcode_t op, const uint64_t *operands);
+static jit_code_t* jit_code_make(allocator_t *alloc, const uint8_t *code, int code_size);
+static void jit_emit(jit_compiler_t *jc, const uint8_t *bytes, int n);
+static void jit_emit_u32(jit_compiler_t *jc, uint32_t val);
+static void jit_emit_u64(jit_compiler_t *jc, uint64_t val);
+static void jit_emit_rel32(jit_compiler_t *jc, jit_fixup_type_t type, int ip);
+static int  jit_emit_short_jump(jit_compiler_t *jc, uint8_t op);
+static void jit_patch_short_jump(jit_compiler_t *jc, int pos);
+static void jit_emit_exit_if(jit_compiler_t *jc, uint8_t cc, int ip);
+static void jit_emit_exit(jit_compiler_t *jc, int ip);
+static void jit_emit_prologue(jit_compiler_t *jc);
+static void jit_emit_epilogue(jit_compiler_t *jc);
+static void jit_emit_load_imm(jit_compiler_t *jc, uint64_t val);
+static void jit_emit_push_rax(jit_compiler_t *jc);
+static void jit_emit_number_guard(jit_compiler_t *jc, bool rcx, int ip);
+static void jit_emit_assign_guard(jit_compiler_t *jc, int ip);
+static void jit_emit_canonicalise_nan(jit_compiler_t *jc);
+static void jit_emit_backward_jump_check(jit_compiler_t *jc, int ip, int target_ip);
+
+jit_code_t* jit_compile(allocator_t *alloc, object_t function_obj) {
+    function_t *function = object_get_function(function_obj);
+    uint8_t *bytecode = function->comp_result->bytecode;
+    int size = function->comp_result->count;
+
+    jit_code_t *res = NULL;
+
+    jit_compiler_t jc;
+    memset(&jc, 0, sizeof(jit_compiler_t));
+    jc.alloc = alloc;
+    jc.code = array_make(alloc, uint8_t);
+    jc.fixups = array_make(alloc, jit_fixup_t);
+    jc.instr_offsets = allocator_malloc(alloc, sizeof(int) * (size + 1));
+    jc.exit_offsets = allocator_malloc(alloc, sizeof(int) * (size + 1));
+    if (!jc.code || !jc.fixups || !jc.instr_offsets || !jc.exit_offsets) {
+        goto end;
+    }
+    for (int i = 0; i <= size; i++) {
+        jc.instr_offsets[i] = -1;
+        jc.exit_offsets[i] = -1;
+    }
+
+    jit_emit_prologue(&jc);
+
+    int ip = 0;
+    while (ip < size) {
+        // opcodes might be quickened by vms on other threads, quickened versions have the same semantics
+        opcode_t op = opcode_get_generic(APE_RELAXED_LOAD_U8(bytecode + ip));
+        opcode_definition_t *def = opcode_lookup(op);
+        if (!def) {
+            goto end;
+        }
+        int len = 1;
+        for (int i = 0; i < def->num_operands; i++) {
+            len += def->operand_widths[i];
+        }
+        if ((ip + len) > size) {
+            goto end;
+        }
+        uint64_t operands[2] = { 0, 0 };
+        code_read_operands(def, bytecode + ip + 1, operands);
+        jc.instr_offsets[ip] = array_count(jc.code);
+        if (!jit_compile_instruction(&jc, function_obj, ip, op, operands)) {
+            jit_emit_exit(&jc, ip);
+        }
+        ip += len;
+    }
+    jc.instr_offsets[size] = array_count(jc.code);
+    jit_emit_exit(&jc, size);
+
+    int fixups_count = array_count(jc.fixups);
+    for (int i = 0; i < fixups_count; i++) {
+        jit_fixup_t fixup = *(jit_fixup_t*)array_get(jc.fixups, i);
+        if (fixup.type == JIT_FIXUP_EXIT && jc.exit_offsets[fixup.ip] < 0) {
+            jc.exit_offsets[fixup.ip] = array_count(jc.code);
+            jit_emit_exit(&jc, fixup.ip);
+        }
+    }
+
+    int epilogue_offset = array_count(jc.code);
+    jit_emit_epilogue(&jc);
+
+    while (array_count(jc.code) % 4) {
+        JIT_EMIT(&jc, 0xcc); // int3
+    }
+
+    // entry points of instructions, entering at any other ip returns right away
+    int table_offset = array_count(jc.code);
+    for (int i = 0; i <= size; i++) {
+        int target = jc.instr_offsets[i] >= 0 ? jc.instr_offsets[i] : epilogue_offset;
+        jit_emit_u32(&jc, (uint32_t)(target - table_offset));
+    }
+
+    if (jc.failed) {
+        goto end;
+    }
+
+    uint8_t *code = array_data(jc.code);
+    for (int i = 0; i < array_count(jc.fixups); i++) {
+        jit_fixup_t *fixup = array_get(jc.fixups, i);
+        int target = -1;
+        switch (fixup->type) {
+            case JIT_FIXUP_INSTRUCTION: target = jc.instr_offsets[fixup->ip]; break;
+            case JIT_FIXUP_EXIT:        target = jc.exit_offsets[fixup->ip]; break;
+            case JIT_FIXUP_EPILOGUE:    target = epilogue_offset; break;
+            case JIT_FIXUP_TABLE:       target = table_offset; break;
+        }
+        if (target < 0) {
+            goto end;
+        }
+        uint32_t rel = (uint32_t)(target - (fixup->offset + 4));
+        for (int j = 0; j < 4; j++) {
+            code[fixup->offset + j] = (uint8_t)(rel >> (j * 8));
+        }
+    }
+
+    res = jit_code_make(alloc, code, array_count(jc.code));
+end:
+    array_destroy(jc.code);
+    array_destroy(jc.fixups);
+    allocator_free(alloc, jc.instr_offsets);
+    allocator_free(alloc, jc.exit_offsets);
+    return res;
+}
+
+void jit_code_destroy(allocator_t *alloc, jit_code_t *code) {
+    if (!code) {
+        return;
+    }
+    munmap(code->mem, code->mem_size);
+    allocator_free(alloc, code);
+}
+
+void jit_run(const jit_code_t *code, jit_state_t *state) {
+    code->entry(state);
+}
+
+// INTERNAL
+static bool jit_compile_instruction(jit_compiler_t *jc, object_t function_obj, int ip, opcode_t op, const uint64_t *operands) {
+    function_t *function = object_get_function(function_obj);
+    switch (op) {
+        case OPCODE_CONSTANT: {
+            // allocated constants would have to be kept alive by generated code
+            object_t constant = object_get_array_value_at(function->constants, (int)operands[0]);
+            if (object_is_null(constant) || object_is_allocated(constant)) {
+                return false;
+            }
+            jit_emit_load_imm(jc, constant.handle);
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_NUMBER: {
+            jit_emit_load_imm(jc, object_make_number(ape_uint64_to_double(operands[0])).handle);
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_TRUE:
+        case OPCODE_FALSE:
+        case OPCODE_NULL: {
+            object_t obj = op == OPCODE_NULL ? object_make_null() : object_make_bool(op == OPCODE_TRUE);
+            jit_emit_load_imm(jc, obj.handle);
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_CURRENT_FUNCTION: {
+            jit_emit_load_imm(jc, function_obj.handle);
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_POP: {
+            JIT_EMIT(jc, 0x4d, 0x8b, 0x75, 0xf8); // mov r14, [r13 - 8]
+            JIT_EMIT(jc, 0x49, 0x83, 0xed, 0x08); // sub r13, 8
+            return true;
+        }
+        case OPCODE_DUP: {
+            JIT_EMIT(jc, 0x49, 0x8b, 0x45, 0xf8); // mov rax, [r13 - 8]
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_GET_LOCAL: {
+            JIT_EMIT(jc, 0x49, 0x8b, 0x84, 0x24); // mov rax, [r12 + disp32]
+            jit_emit_u32(jc, (uint32_t)(operands[0] * sizeof(object_t)));
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_DEFINE_LOCAL:
+        case OPCODE_SET_LOCAL: {
+            uint32_t disp = (uint32_t)(operands[0] * sizeof(object_t));
+            JIT_EMIT(jc, 0x49, 0x8b, 0x45, 0xf8); // mov rax, [r13 - 8]
+            if (op == OPCODE_SET_LOCAL) {
+                JIT_EMIT(jc, 0x49, 0x8b, 0x8c, 0x24); // mov rcx, [r12 + disp32]
+                jit_emit_u32(jc, disp);
+                jit_emit_assign_guard(jc, ip);
+            }
+            JIT_EMIT(jc, 0x49, 0x83, 0xed, 0x08); // sub r13, 8
+            JIT_EMIT(jc, 0x49, 0x89, 0xc6);       // mov r14, rax
+            JIT_EMIT(jc, 0x49, 0x89, 0x84, 0x24); // mov [r12 + disp32], rax
+            jit_emit_u32(jc, disp);
+            return true;
+        }
+        case OPCODE_GET_MODULE_GLOBAL: {
+            // globals aren't bound checked by generated code
+            if (operands[0] >= VM_MAX_GLOBALS) {
+                return false;
+            }
+            JIT_EMIT(jc, 0x49, 0x8b, 0x87); // mov rax, [r15 + disp32]
+            jit_emit_u32(jc, (uint32_t)(operands[0] * sizeof(object_t)));
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_SET_MODULE_GLOBAL: {
+            if (operands[0] >= VM_MAX_GLOBALS) {
+                return false;
+            }
+            // guard passes only if old value isn't null, so the global is already defined
+            uint32_t disp = (uint32_t)(operands[0] * sizeof(object_t));
+            JIT_EMIT(jc, 0x49, 0x8b, 0x45, 0xf8); // mov rax, [r13 - 8]
+            JIT_EMIT(jc, 0x49, 0x8b, 0x8f);       // mov rcx, [r15 + disp32]
+            jit_emit_u32(jc, disp);
+            jit_emit_assign_guard(jc, ip);
+            JIT_EMIT(jc, 0x49, 0x83, 0xed, 0x08); // sub r13, 8
+            JIT_EMIT(jc, 0x49, 0x89, 0xc6);       // mov r14, rax
+            JIT_EMIT(jc, 0x49, 0x89, 0x87);       // mov [r15 + disp32], rax
+            jit_emit_u32(jc, disp);
+            return true;
+        }
+        case OPCODE_GET_FREE: {
+            object_t *free_vals = object_get_function_free_vals(function_obj);
+            if (!free_vals || (int)operands[0] >= function->free_vals_count) {
+                return false;
+            }
+            jit_emit_load_imm(jc, (uint64_t)(uintptr_t)(free_vals + operands[0]));
+            JIT_EMIT(jc, 0x48, 0x8b, 0x00); // mov rax, [rax]
+            jit_emit_push_rax(jc);
+            return true;
+        }
+        case OPCODE_ADD:
+        case OPCODE_SUB:
+        case OPCODE_MUL:
+        case OPCODE_DIV:
+        case OPCODE_COMPARE:
+        case OPCODE_COMPARE_EQ: {
+            JIT_EMIT(jc, 0x49, 0x8b, 0x45, 0xf8); // mov rax, [r13 - 8] (right)
+            JIT_EMIT(jc, 0x49, 0x8b, 0x4d, 0xf0); // mov rcx, [r13 - 16] (left)
+            jit_emit_number_guard(jc, true, ip);
+            jit_emit_number_guard(jc, false, ip);
+            int zero_jump = -1;
+            if (op == OPCODE_COMPARE || op == OPCODE_COMPARE_EQ) {
+                JIT_EMIT(jc, 0x48, 0x39, 0xc1); // cmp rcx, rax
+                zero_jump = jit_emit_short_jump(jc, 0x74); // je
+            }
+            JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc1); // movq xmm0, rcx
+            JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc8); // movq xmm1, rax
+            switch (op) {
+                case OPCODE_ADD: JIT_EMIT(jc, 0xf2, 0x0f, 0x58, 0xc1); break; // addsd xmm0, xmm1
+                case OPCODE_MUL: JIT_EMIT(jc, 0xf2, 0x0f, 0x59, 0xc1); break; // mulsd xmm0, xmm1
+                case OPCODE_DIV: JIT_EMIT(jc, 0xf2, 0x0f, 0x5e, 0xc1); break; // divsd xmm0, xmm1
+                default:         JIT_EMIT(jc, 0xf2, 0x0f, 0x5c, 0xc1); break; // subsd xmm0, xmm1
+            }
+            JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+            jit_emit_canonicalise_nan(jc);
+            if (zero_jump >= 0) {
+                // same as object_compare, equal handles compare as 0
+                int done_jump = jit_emit_short_jump(jc, 0xeb); // jmp
+                jit_patch_short_jump(jc, zero_jump);
+                JIT_EMIT(jc, 0x31, 0xc0); // xor eax, eax
+                jit_patch_short_jump(jc, done_jump);
+            }
+            JIT_EMIT(jc, 0x49, 0x83, 0xed, 0x08); // sub r13, 8
+            JIT_EMIT(jc, 0x49, 0x89, 0x45, 0xf8); // mov [r13 - 8], rax
+            JIT_EMIT(jc, 0x49, 0x89, 0xce);       // mov r14, rcx
+            return true;
+        }
+        case OPCODE_MOD: {
+            // stack is aligned to 16 bytes after prologue and registers holding state are callee saved
+            JIT_EMIT(jc, 0x49, 0x8b, 0x45, 0xf8); // mov rax, [r13 - 8] (right)
+            JIT_EMIT(jc, 0x49, 0x8b, 0x4d, 0xf0); // mov rcx, [r13 - 16] (left)
+            jit_emit_number_guard(jc, true, ip);
+            jit_emit_number_guard(jc, false, ip);
+            JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc1); // movq xmm0, rcx
+            JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc8); // movq xmm1, rax
+            jit_emit_load_imm(jc, (uint64_t)(uintptr_t)fmod);
+            JIT_EMIT(jc, 0xff, 0xd0);                   // call rax
+            JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+            jit_emit_canonicalise_nan(jc);
+            JIT_EMIT(jc, 0x49, 0x83, 0xed, 0x08); // sub r13, 8
+            JIT_EMIT(jc, 0x4d, 0x8b, 0x75, 0xf8); // mov r14, [r13 - 8]
+            JIT_EMIT(jc, 0x49, 0x89, 0x45, 0xf8); // mov [r13 - 8], rax
+            return true;
+        }
+        case OPCODE_EQUAL:
+        case OPCODE_NOT_EQUAL:
+        case OPCODE_GREATER_THAN:
+        case OPCODE_GREATER_THAN_EQUAL: {
+            JIT_EMIT(jc, 0x49, 0x8b, 0x4d, 0xf8); // mov rcx, [r13 - 8]
+            jit_emit_number_guard(jc, true, ip);
+            if (op == OPCODE_EQUAL || op == OPCODE_NOT_EQUAL) {
+                // fabs(x) < DBL_EPSILON, same as APE_DBLEQ
+                JIT_EMIT(jc, 0x48, 0x89, 0xc8);             // mov rax, rcx
+                JIT_EMIT(jc, 0x48, 0xd1, 0xe0);             // shl rax, 1
+                JIT_EMIT(jc, 0x48, 0xd1, 0xe8);             // shr rax, 1
+                JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+                jit_emit_load_imm(jc, ape_double_to_uint64(DBL_EPSILON));
+                JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc8); // movq xmm1, rax
+                JIT_EMIT(jc, 0x66, 0x0f, 0x2e, 0xc8);       // ucomisd xmm1, xmm0
+                if (op == OPCODE_EQUAL) {
+                    JIT_EMIT(jc, 0x0f, 0x97, 0xc0); // seta al
+                } else {
+                    JIT_EMIT(jc, 0x0f, 0x96, 0xc0); // setbe al
+                }
+            } else {
+                // x > 0 || fabs(x) < DBL_EPSILON is the same as x > -DBL_EPSILON
+                double min = op == OPCODE_GREATER_THAN ? 0 : -DBL_EPSILON;
+                JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc1); // movq xmm0, rcx
+                jit_emit_load_imm(jc, ape_double_to_uint64(min));
+                JIT_EMIT(jc, 0x66, 0x48, 0x0f, 0x6e, 0xc8); // movq xmm1, rax
+                JIT_EMIT(jc, 0x66, 0x0f, 0x2e, 0xc1);       // ucomisd xmm0, xmm1
+                JIT_EMIT(jc, 0x0f, 0x97, 0xc0);             // seta al
+            }
+            JIT_EMIT(jc, 0x0f, 0xb6, 0xc0); // movzx eax, al
+            JIT_EMIT(jc, 0x48, 0xba);       // mov rdx, imm64
+            jit_emit_u64(jc, object_make_bool(false).handle);
+            JIT_EMIT(jc, 0x48, 0x09, 0xd0);       // or rax, rdx
+            JIT_EMIT(jc, 0x49, 0x89, 0x45, 0xf8); // mov [r13 - 8], rax
+            JIT_EMIT(jc, 0x49, 0x89, 0xce);       // mov r14, rcx
+            return true;
+        }
+        case OPCODE_MINUS: {
+            JIT_EMIT(jc, 0x49, 0x8b, 0x4d, 0xf8); // mov rcx, [r13 - 8]
+            jit_emit_number_guard(jc, true, ip);
+            JIT_EMIT(jc, 0x48, 0x89, 0xc8);             // mov rax, rcx
+            JIT_EMIT(jc, 0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+            jit_emit_canonicalise_nan(jc);
+            JIT_EMIT(jc, 0x49, 0x89, 0x45, 0xf8); // mov [r13 - 8], rax
+            JIT_EMIT(jc, 0x49, 0x89, 0xce);       // mov r14, rcx
+            return true;
+        }
+        case OPCODE_BANG: {
+            JIT_EMIT(jc, 0x49, 0x8b, 0x4d, 0xf8);             // mov rcx, [r13 - 8]
+            JIT_EMIT(jc, 0x48, 0x89, 0xca);                   // mov rdx, rcx
+            JIT_EMIT(jc, 0x48, 0xc1, 0xea, 0x30);             // shr rdx, 48
+            JIT_EMIT(jc, 0x81, 0xfa, 0xf9, 0xff, 0x00, 0x00); // cmp edx, bool header
+            int not_bool_jump = jit_emit_short_jump(jc, 0x75); // jne
+            JIT_EMIT(jc, 0x48, 0x89, 0xc8);                   // mov rax, rcx
+            JIT_EMIT(jc, 0x48, 0x83, 0xf0, 0x01);             // xor rax, 1
+            int done_jump = jit_emit_short_jump(jc, 0xeb);    // jmp
+            jit_patch_short_jump(jc, not_bool_jump);
+            JIT_EMIT(jc, 0x81, 0xfa, 0xfa, 0xff, 0x00, 0x00); // cmp edx, null header
+            jit_emit_exit_if(jc, JIT_JNE, ip);
+            jit_emit_load_imm(jc, object_make_bool(true).handle);
+            jit_patch_short_jump(jc, done_jump);
+            JIT_EMIT(jc, 0x49, 0x89, 0x45, 0xf8); // mov [r13 - 8], rax
+            JIT_EMIT(jc, 0x49, 0x89, 0xce);       // mov r14, rcx
+            return true;
+        }
+        case OPCODE_JUMP: {
+            jit_emit_backward_jump_check(jc, ip, (int)operands[0]);
+            JIT_EMIT(jc, 0xe9); // jmp rel32
+            jit_emit_rel32(jc, JIT_FIXUP_INSTRUCTION, (int)operands[0]);
+            return true;
+        }
+        case OPCODE_JUMP_IF_FALSE:
+        case OPCODE_JUMP_IF_TRUE: {
+            // same as object_get_bool, numbers are true if any bit is set
+            jit_emit_backward_jump_check(jc, ip, (int)operands[0]);
+            JIT_EMIT(jc, 0x49, 0x8b, 0x45, 0xf8);             // mov rax, [r13 - 8]
+            JIT_EMIT(jc, 0x49, 0x83, 0xed, 0x08);             // sub r13, 8
+            JIT_EMIT(jc, 0x49, 0x89, 0xc6);                   // mov r14, rax
+            JIT_EMIT(jc, 0x48, 0x89, 0xc2);                   // mov rdx, rax
+            JIT_EMIT(jc, 0x48, 0xc1, 0xea, 0x33);             // shr rdx, 51
+            JIT_EMIT(jc, 0x81, 0xfa, 0xff, 0x1f, 0x00, 0x00); // cmp edx, 0x1fff
+            int number_jump = jit_emit_short_jump(jc, 0x75);  // jne
+            JIT_EMIT(jc, 0x48, 0xc1, 0xe0, 0x10);             // shl rax, 16
+            jit_patch_short_jump(jc, number_jump);
+            JIT_EMIT(jc, 0x48, 0x85, 0xc0);                   // test rax, rax
+            JIT_EMIT(jc, 0x0f, op == OPCODE_JUMP_IF_FALSE ? JIT_JE : JIT_JNE);
+            jit_emit_rel32(jc, JIT_FIXUP_INSTRUCTION, (int)operands[0]);
+            return true;
+        }
+        default: {
+            return false;
+        }
+    }
+}
+
+static jit_code_t* jit_code_make(allocator_t *alloc, const uint8_t *code, int code_size) {
+    jit_code_t *res = allocator_malloc(alloc, sizeof(jit_code_t));
+    if (!res) {
+        return NULL;
+    }
+    size_t mem_size = (size_t)code_size;
+    void *mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        allocator_free(alloc, res);
+        return NULL;
+    }
+    memcpy(mem, code, mem_size);
+    if (mprotect(mem, mem_size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, mem_size);
+        allocator_free(alloc, res);
+        return NULL;
+    }
+    res->mem = mem;
+    res->mem_size = mem_size;
+    memcpy(&res->entry, &mem, sizeof(res->entry)); // ISO C doesn't allow casting void* to a function pointer
+    return res;
+}
+
+static void jit_emit(jit_compiler_t *jc, const uint8_t *bytes, int n) {
+    bool ok = array_addn(jc->code, bytes, n);
+    if (!ok) {
+        jc->failed = true;
+    }
+}
+
+static void jit_emit_u32(jit_compiler_t *jc, uint32_t val) {
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++) {
+        bytes[i] = (uint8_t)(val >> (i * 8));
+    }
+    jit_emit(jc, bytes, 4);
+}
+
+static void jit_emit_u64(jit_compiler_t *jc, uint64_t val) {
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (uint8_t)(val >> (i * 8));
+    }
+    jit_emit(jc, bytes, 8);
+}
+
+static void jit_emit_rel32(jit_compiler_t *jc, jit_fixup_type_t type, int ip) {
+    jit_fixup_t fixup;
+    fixup.type = type;
+    fixup.offset = array_count(jc->code);
+    fixup.ip = ip;
+    bool ok = array_add(jc->fixups, &fixup);
+    if (!ok) {
+        jc->failed = true;
+    }
+    jit_emit_u32(jc, 0);
+}
+
+static int jit_emit_short_jump(jit_compiler_t *jc, uint8_t op) {
+    JIT_EMIT(jc, op, 0x00);
+    return array_count(jc->code) - 1;
+}
+
+static void jit_patch_short_jump(jit_compiler_t *jc, int pos) {
+    uint8_t *rel = array_get(jc->code, pos);
+    if (rel) {
+        *rel = (uint8_t)(array_count(jc->code) - (pos + 1));
+    }
+}
+
+static void jit_emit_exit_if(jit_compiler_t *jc, uint8_t cc, int ip) {
+    JIT_EMIT(jc, 0x0f, cc);
+    jit_emit_rel32(jc, JIT_FIXUP_EXIT, ip);
+}
+
+static void jit_emit_exit(jit_compiler_t *jc, int ip) {
+    JIT_EMIT(jc, 0xc7, 0x43, JIT_STATE_OFFSET(ip)); // mov dword [rbx + ip], imm32
+    jit_emit_u32(jc, (uint32_t)ip);
+    JIT_EMIT(jc, 0xe9); // jmp rel32
+    jit_emit_rel32(jc, JIT_FIXUP_EPILOGUE, 0);
+}
+
+static void jit_emit_prologue(jit_compiler_t *jc) {
+    JIT_EMIT(jc, 0x53);                               // push rbx
+    JIT_EMIT(jc, 0x41, 0x54);                         // push r12
+    JIT_EMIT(jc, 0x41, 0x55);                         // push r13
+    JIT_EMIT(jc, 0x41, 0x56);                         // push r14
+    JIT_EMIT(jc, 0x41, 0x57);                         // push r15
+    JIT_EMIT(jc, 0x48, 0x89, 0xfb);                   // mov rbx, rdi
+    JIT_EMIT(jc, 0x4c, 0x8b, 0x63, JIT_STATE_OFFSET(bp));          // mov r12, [rbx + bp]
+    JIT_EMIT(jc, 0x4c, 0x8b, 0x6b, JIT_STATE_OFFSET(sp));          // mov r13, [rbx + sp]
+    JIT_EMIT(jc, 0x4c, 0x8b, 0x73, JIT_STATE_OFFSET(last_popped)); // mov r14, [rbx + last_popped]
+    JIT_EMIT(jc, 0x4c, 0x8b, 0x7b, JIT_STATE_OFFSET(globals));     // mov r15, [rbx + globals]
+    JIT_EMIT(jc, 0x8b, 0x43, JIT_STATE_OFFSET(ip));                // mov eax, [rbx + ip]
+    JIT_EMIT(jc, 0x48, 0x8d, 0x0d);                   // lea rcx, [rip + table]
+    jit_emit_rel32(jc, JIT_FIXUP_TABLE, 0);
+    JIT_EMIT(jc, 0x48, 0x63, 0x04, 0x81);             // movsxd rax, [rcx + rax * 4]
+    JIT_EMIT(jc, 0x48, 0x01, 0xc8);                   // add rax, rcx
+    JIT_EMIT(jc, 0xff, 0xe0);                         // jmp rax
+}
+
+static void jit_emit_epilogue(jit_compiler_t *jc) {
+    JIT_EMIT(jc, 0x4c, 0x89, 0x6b, JIT_STATE_OFFSET(sp));          // mov [rbx + sp], r13
+    JIT_EMIT(jc, 0x4c, 0x89, 0x73, JIT_STATE_OFFSET(last_popped)); // mov [rbx + last_popped], r14
+    JIT_EMIT(jc, 0x41, 0x5f); // pop r15
+    JIT_EMIT(jc, 0x41, 0x5e); // pop r14
+    JIT_EMIT(jc, 0x41, 0x5d); // pop r13
+    JIT_EMIT(jc, 0x41, 0x5c); // pop r12
+    JIT_EMIT(jc, 0x5b);       // pop rbx
+    JIT_EMIT(jc, 0xc3);       // ret
+}
+
+static void jit_emit_load_imm(jit_compiler_t *jc, uint64_t val) {
+    JIT_EMIT(jc, 0x48, 0xb8); // mov rax, imm64
+    jit_emit_u64(jc, val);
+}
+
+static void jit_emit_push_rax(jit_compiler_t *jc) {
+    JIT_EMIT(jc, 0x49, 0x89, 0x45, 0x00); // mov [r13], rax
+    JIT_EMIT(jc, 0x49, 0x83, 0xc5, 0x08); // add r13, 8
+}
+
+static void jit_emit_number_guard(jit_compiler_t *jc, bool rcx, int ip) {
+    JIT_EMIT(jc, 0x48, 0x89, rcx ? 0xca : 0xc2);      // mov rdx, rcx/rax
+    JIT_EMIT(jc, 0x48, 0xc1, 0xea, 0x33);             // shr rdx, 51
+    JIT_EMIT(jc, 0x81, 0xfa, 0xff, 0x1f, 0x00, 0x00); // cmp edx, 0x1fff
+    jit_emit_exit_if(jc, JIT_JE, ip);
+}
+
+static void jit_emit_assign_guard(jit_compiler_t *jc, int ip) {
+    // new value in rax and old in rcx have to be both numbers or have the same non allocated type,
+    // everything else is checked by the interpreter
+    JIT_EMIT(jc, 0x48, 0x89, 0xc2);                   // mov rdx, rax
+    JIT_EMIT(jc, 0x48, 0xc1, 0xea, 0x33);             // shr rdx, 51
+    JIT_EMIT(jc, 0x81, 0xfa, 0xff, 0x1f, 0x00, 0x00); // cmp edx, 0x1fff
+    int number_jump = jit_emit_short_jump(jc, 0x75);  // jne
+    JIT_EMIT(jc, 0x48, 0x89, 0xc2);                   // mov rdx, rax
+    JIT_EMIT(jc, 0x48, 0x31, 0xca);                   // xor rdx, rcx
+    JIT_EMIT(jc, 0x48, 0xc1, 0xea, 0x30);             // shr rdx, 48
+    jit_emit_exit_if(jc, JIT_JNE, ip);
+    JIT_EMIT(jc, 0x48, 0x89, 0xc2);                   // mov rdx, rax
+    JIT_EMIT(jc, 0x48, 0xc1, 0xea, 0x30);             // shr rdx, 48
+    JIT_EMIT(jc, 0x81, 0xfa, 0xfc, 0xff, 0x00, 0x00); // cmp edx, allocated header
+    jit_emit_exit_if(jc, JIT_JAE, ip);
+    int done_jump = jit_emit_short_jump(jc, 0xeb);    // jmp
+    jit_patch_short_jump(jc, number_jump);
+    jit_emit_number_guard(jc, true, ip);
+    jit_patch_short_jump(jc, done_jump);
+}
+
+static void jit_emit_canonicalise_nan(jit_compiler_t *jc) {
+    // same as object_make_number, NaNs produced by the cpu would be taken for tagged objects
+    JIT_EMIT(jc, 0x48, 0x89, 0xc2);                   // mov rdx, rax
+    JIT_EMIT(jc, 0x48, 0xc1, 0xea, 0x33);             // shr rdx, 51
+    JIT_EMIT(jc, 0x81, 0xfa, 0xff, 0x1f, 0x00, 0x00); // cmp edx, 0x1fff
+    int skip_jump = jit_emit_short_jump(jc, 0x75);    // jne
+    jit_emit_load_imm(jc, 0x7ff8000000000000);
+    jit_patch_short_jump(jc, skip_jump);
+}
+
+static void jit_emit_backward_jump_check(jit_compiler_t *jc, int ip, int target_ip) {
+    // loops return to the interpreter once in a while so it can check execution time
+    if (target_ip > ip) {
+        return;
+    }
+    JIT_EMIT(jc, 0x83, 0x6b, JIT_STATE_OFFSET(budget), 0x01); // sub dword [rbx + budget], 1
+    jit_emit_exit_if(jc, JIT_JLE, ip);
+}
+
+#endif /* APE_JIT */
+//FILE_END
 //FILE_START:vm.c
 #include <stdlib.h>
 #include <stdio.h>
@@ -12922,8 +17086,12 @@ src_pos_t frame_src_position(const frame_t *frame) {
 #include "traceback.h"
 #include "builtins.h"
 #include "gc.h"
+#include "jit.h"
 #endif
 
+// lazy range steps are nonzero integers, so a fractional step marks a loop over the result of replaced range
+#define FOREACH_REPLACED_RANGE_STEP 0.5
+
 static void set_sp(vm_t *vm, int new_sp);
 static void stack_push(vm_t *vm, object_t obj);
 static object_t stack_pop(vm_t *vm);
@@ -12935,12 +17103,25 @@ static object_t this_stack_get(vm_t *vm, int nth_item);
 
 static bool push_frame(vm_t *vm, frame_t frame);
 static bool pop_frame(vm_t *vm);
-static void run_gc(vm_t *vm, array(object_t) *constants);
+static void run_gc(vm_t *vm);
+static bool execute_frames(vm_t *vm);
 static bool call_object(vm_t *vm, object_t callee, int num_args);
+static bool foreach_push_next(vm_t *vm, object_t source, int ix, int done_ip);
 static object_t call_native_function(vm_t *vm, object_t callee, src_pos_t src_pos, int argc, object_t *args);
 static bool check_assign(vm_t *vm, object_t old_value, object_t new_value);
 static bool try_overload_operator(vm_t *vm, object_t left, object_t right, opcode_t op, bool *out_overload_found);
 
+static bool resume_coroutine(vm_t *vm, object_t coroutine_obj, int num_args, int done_ip);
+static bool yield_coroutine(vm_t *vm, object_t value);
+static bool pop_finished_coroutine(vm_t *vm, int *out_done_ip);
+static void abandon_coroutines(vm_t *vm, int resumed_coroutines_count);
+static void restore_caller_stacks(vm_t *vm);
+static void finish_coroutine(vm_t *vm, coroutine_t *coroutine);
+static bool grow_coroutine_stacks(vm_t *vm, int stack_count, int frames_count);
+#ifdef APE_JIT
+static bool run_jit(vm_t *vm);
+#endif
+
 vm_t *vm_make(allocator_t *alloc, const ape_config_t *config, gcmem_t *mem, errors_t *errors, global_store_t *global_store) {
     vm_t *vm = allocator_malloc(alloc, sizeof(vm_t));
     if (!vm) {
@@ -12953,15 +17134,23 @@ vm_t *vm_make(allocator_t *alloc, const ape_config_t *config, gcmem_t *mem, erro
     vm->errors = errors;
     vm->global_store = global_store;
     vm->globals_count = 0;
+    vm->stack = vm->main_stack;
+    vm->stack_capacity = VM_STACK_SIZE;
     vm->sp = 0;
     vm->this_sp = 0;
+    vm->frames = vm->main_frames;
+    vm->frames_capacity = VM_MAX_FRAMES;
     vm->frames_count = 0;
     vm->last_popped = object_make_null();
     vm->running = false;
+    ape_random_seed(&vm->random, 0);
 
     for (int i = 0; i < OPCODE_MAX; i++) {
         vm->operator_oveload_keys[i] = object_make_null();
     }
+    for (int i = 0; i < APE_ARRAY_LEN(vm->char_strings); i++) {
+        vm->char_strings[i] = object_make_null();
+    }
 #define SET_OPERATOR_OVERLOAD_KEY(op, key) do {\
     object_t key_obj = object_make_string(vm->mem, key);\
     if (object_is_null(key_obj)) {\
@@ -12994,10 +17183,14 @@ void vm_destroy(vm_t *vm) {
     if (!vm) {
         return;
     }
+    strbuf_destroy(vm->stdout_buf);
     allocator_free(vm->alloc, vm);
 }
 
 void vm_reset(vm_t *vm) {
+    abandon_coroutines(vm, 0);
+    vm->suspend_requested = false;
+    vm->suspended = false;
     vm->sp = 0;
     vm->this_sp = 0;
     while (vm->frames_count > 0) {
@@ -13005,18 +17198,23 @@ void vm_reset(vm_t *vm) {
     }
 }
 
-bool vm_run(vm_t *vm, compilation_result_t *comp_res, array(object_t) *constants) {
+bool vm_run(vm_t *vm, compilation_result_t *comp_res, object_t constants) {
 #ifdef APE_DEBUG
     int old_sp = vm->sp;
 #endif
     int old_this_sp = vm->this_sp;
     int old_frames_count = vm->frames_count;
-    object_t main_fn = object_make_function(vm->mem, "main", comp_res, false, 0, 0, 0);
+    object_t main_fn = object_make_function(vm->mem, "main", comp_res, constants, false, 0, 0, 0);
     if (object_is_null(main_fn)) {
         return false;
     }
     stack_push(vm, main_fn);
-    bool res = vm_execute_function(vm, main_fn, constants);
+    bool res = vm_execute_function(vm, main_fn);
+    if (vm->suspended) {
+        vm->suspended_frames_count = old_frames_count;
+        vm->suspended_this_sp = old_this_sp;
+        return res;
+    }
     while (vm->frames_count > old_frames_count) {
         pop_frame(vm);
     }
@@ -13025,7 +17223,7 @@ bool vm_run(vm_t *vm, compilation_result_t *comp_res, array(object_t) *constants
     return res;
 }
 
-object_t vm_call(vm_t *vm, array(object_t) *constants, object_t callee, int argc, object_t *args) {
+object_t vm_call(vm_t *vm, object_t callee, int argc, object_t *args) {
     object_type_t type = object_get_type(callee);
     if (type == OBJECT_FUNCTION) {
 #ifdef APE_DEBUG
@@ -13037,10 +17235,15 @@ object_t vm_call(vm_t *vm, array(object_t) *constants, object_t callee, int argc
         for (int i = 0; i < argc; i++) {
             stack_push(vm, args[i]);
         }
-        bool ok = vm_execute_function(vm, callee, constants);
+        bool ok = vm_execute_function(vm, callee);
         if (!ok) {
             return object_make_null();
         }
+        if (vm->suspended) {
+            vm->suspended_frames_count = old_frames_count;
+            vm->suspended_this_sp = old_this_sp;
+            return object_make_null();
+        }
         while (vm->frames_count > old_frames_count) {
             pop_frame(vm);
         }
@@ -13048,18 +17251,31 @@ object_t vm_call(vm_t *vm, array(object_t) *constants, object_t callee, int argc
         vm->this_sp = old_this_sp;
         return vm_get_last_popped(vm);
     } else if (type == OBJECT_NATIVE_FUNCTION) {
-        return call_native_function(vm, callee, src_pos_invalid, argc, args);
+        object_t res = call_native_function(vm, callee, src_pos_invalid, argc, args);
+        if (vm->config) {
+            vm_flush_stdout(vm, true);
+        }
+        if (vm->suspend_requested) {
+            vm->suspend_requested = false;
+            errors_add_error(vm->errors, ERROR_USER, src_pos_invalid, "Native function called directly cannot suspend execution");
+            return object_make_null();
+        }
+        return res;
     } else {
         errors_add_error(vm->errors, ERROR_USER, src_pos_invalid, "Object is not callable");
         return object_make_null();
     }
 }
 
-bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants) {
+bool vm_execute_function(vm_t *vm, object_t function) {
     if (vm->running) {
         errors_add_error(vm->errors, ERROR_USER, src_pos_invalid, "VM is already executing code");
         return false;
     }
+    if (vm->suspended) {
+        errors_add_error(vm->errors, ERROR_USER, src_pos_invalid, "VM is suspended");
+        return false;
+    }
 
     function_t *function_function = object_get_function(function); // naming is hard
     frame_t new_frame;
@@ -13074,8 +17290,58 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
         return false;
     }
 
-    vm->running = true;
     vm->last_popped = object_make_null();
+    return execute_frames(vm);
+}
+
+bool vm_resume(vm_t *vm, object_t result) {
+    if (vm->running) {
+        errors_add_error(vm->errors, ERROR_USER, src_pos_invalid, "VM is already executing code");
+        return false;
+    }
+    if (!vm->suspended) {
+        errors_add_error(vm->errors, ERROR_USER, src_pos_invalid, "VM is not suspended");
+        return false;
+    }
+    vm->suspended = false;
+    stack_push(vm, result); // result of the call that suspended execution
+    bool res = execute_frames(vm);
+    if (vm->suspended) {
+        return res;
+    }
+    while (vm->frames_count > vm->suspended_frames_count) {
+        pop_frame(vm);
+    }
+    vm->this_sp = vm->suspended_this_sp;
+    return res;
+}
+
+bool vm_is_suspended(vm_t *vm) {
+    return vm->suspended;
+}
+
+bool vm_is_running_code_of(vm_t *vm, const compilation_result_t *comp_res) {
+    for (int level = vm->resumed_coroutines_count; level >= 0; level--) {
+        frame_t *frames = vm->frames;
+        int frames_count = vm->frames_count;
+        if (level < vm->resumed_coroutines_count) {
+            frames = vm->resumed_coroutines[level].caller_frames;
+            frames_count = vm->resumed_coroutines[level].caller_frames_count;
+        }
+        for (int i = 0; i < frames_count; i++) {
+            function_t *function = object_get_function(frames[i].function);
+            if (function->comp_result == comp_res) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// INTERNAL
+static bool execute_frames(vm_t *vm) {
+    bool ok = false;
+    vm->running = true;
 
     bool check_time = false;
     double max_exec_time_ms = 0;
@@ -13090,19 +17356,22 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
     if (check_time) {
         timer = ape_timer_start();
     }
+#ifdef APE_JIT
+    bool enter_jit = false; // set after calls, returns and backward jumps
+#endif
 
     while (vm->current_frame->ip < vm->current_frame->bytecode_size) {
         opcode_val_t opcode = frame_read_opcode(vm->current_frame);
         switch (opcode) {
             case OPCODE_CONSTANT: {
                 uint16_t constant_ix = frame_read_uint16(vm->current_frame);
-                object_t *constant = array_get(constants, constant_ix);
-                if (!constant) {
+                object_t constant = object_get_array_value_at(vm->current_frame->constants, constant_ix);
+                if (object_is_null(constant)) {
                     errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame),
                                       "Constant at %d not found", constant_ix);
                     goto err;
                 }
-                stack_push(vm, *constant);
+                stack_push(vm, constant);
                 break;
             }
             case OPCODE_ADD:
@@ -13142,6 +17411,10 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                         default: APE_ASSERT(false); break;
                     }
                     stack_push(vm, object_make_number(res));
+                    opcode_t quickened = opcode_get_quickened(opcode);
+                    if (quickened != OPCODE_NONE && left_type == OBJECT_NUMBER && right_type == OBJECT_NUMBER) {
+                        frame_quicken_opcode(vm->current_frame, quickened);
+                    }
                 } else if (left_type == OBJECT_STRING  && right_type == OBJECT_STRING && opcode == OPCODE_ADD) {
                     int left_len = (int)object_get_string_length(left);
                     int right_len = (int)object_get_string_length(right);
@@ -13188,6 +17461,43 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                 }
                 break;
             }
+            case OPCODE_ADD_NUMBER:
+            case OPCODE_SUB_NUMBER:
+            case OPCODE_MUL_NUMBER:
+            case OPCODE_DIV_NUMBER:
+            case OPCODE_MOD_NUMBER:
+            case OPCODE_COMPARE_NUMBER:
+            case OPCODE_COMPARE_EQ_NUMBER:
+            {
+                object_t right = stack_get(vm, 0);
+                object_t left = stack_get(vm, 1);
+                if (object_get_type(left) != OBJECT_NUMBER || object_get_type(right) != OBJECT_NUMBER) {
+                    // guard failed, instruction is executed again in generic form
+                    frame_dequicken_opcode(vm->current_frame, opcode_get_generic(opcode));
+                    vm->current_frame->ip = vm->current_frame->src_ip;
+                    break;
+                }
+                stack_pop(vm);
+                stack_pop(vm);
+                double right_val = object_get_number(right);
+                double left_val = object_get_number(left);
+                double res = 0;
+                switch (opcode) {
+                    case OPCODE_ADD_NUMBER: res = left_val + right_val; break;
+                    case OPCODE_SUB_NUMBER: res = left_val - right_val; break;
+                    case OPCODE_MUL_NUMBER: res = left_val * right_val; break;
+                    case OPCODE_DIV_NUMBER: res = left_val / right_val; break;
+                    case OPCODE_MOD_NUMBER: res = fmod(left_val, right_val); break;
+                    case OPCODE_COMPARE_NUMBER:
+                    case OPCODE_COMPARE_EQ_NUMBER: {
+                        res = left.handle == right.handle ? 0 : left_val - right_val; // same as object_compare
+                        break;
+                    }
+                    default: APE_ASSERT(false); break;
+                }
+                stack_push(vm, object_make_number(res));
+                break;
+            }
             case OPCODE_POP: {
                 stack_pop(vm);
                 break;
@@ -13215,6 +17525,9 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                     if (ok || opcode == OPCODE_COMPARE_EQ) {
                         object_t res = object_make_number(comparison_res);
                         stack_push(vm, res);
+                        if (object_get_type(left) == OBJECT_NUMBER && object_get_type(right) == OBJECT_NUMBER) {
+                            frame_quicken_opcode(vm->current_frame, opcode_get_quickened(opcode));
+                        }
                     } else {
                         const char *right_type_string = object_get_type_name(object_get_type(right));
                         const char *left_type_string = object_get_type_name(object_get_type(left));
@@ -13296,6 +17609,9 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
             }
             case OPCODE_JUMP: {
                 uint16_t pos = frame_read_uint16(vm->current_frame);
+#ifdef APE_JIT
+                enter_jit = pos < vm->current_frame->src_ip;
+#endif
                 vm->current_frame->ip = pos;
                 break;
             }
@@ -13303,6 +17619,9 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                 uint16_t pos = frame_read_uint16(vm->current_frame);
                 object_t test = stack_pop(vm);
                 if (!object_get_bool(test)) {
+#ifdef APE_JIT
+                    enter_jit = pos < vm->current_frame->src_ip;
+#endif
                     vm->current_frame->ip = pos;
                 }
                 break;
@@ -13311,6 +17630,9 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                 uint16_t pos = frame_read_uint16(vm->current_frame);
                 object_t test = stack_pop(vm);
                 if (object_get_bool(test)) {
+#ifdef APE_JIT
+                    enter_jit = pos < vm->current_frame->src_ip;
+#endif
                     vm->current_frame->ip = pos;
                 }
                 break;
@@ -13433,8 +17755,7 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                     int left_len = object_get_string_length(left);
                     int ix = (int)object_get_number(index);
                     if (ix >= 0 && ix < left_len) {
-                        char res_str[2] = {str[ix], '\0'};
-                        res = object_make_string(vm->mem, res_str);
+                        res = vm_get_char_string(vm, str[ix]);
                     }
                 }
                 stack_push(vm, res);
@@ -13471,8 +17792,7 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                     int left_len = object_get_string_length(left);
                     int ix = (int)object_get_number(index);
                     if (ix >= 0 && ix < left_len) {
-                        char res_str[2] = {str[ix], '\0'};
-                        res = object_make_string(vm->mem, res_str);
+                        res = vm_get_char_string(vm, str[ix]);
                     }
                 }
                 stack_push(vm, res);
@@ -13485,6 +17805,9 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                 if (!ok) {
                     goto err;
                 }
+#ifdef APE_JIT
+                enter_jit = true;
+#endif
                 break;
             }
             case OPCODE_RETURN_VALUE: {
@@ -13493,16 +17816,32 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                 if (!ok) {
                     goto end;
                 }
+                int done_ip = -1;
+                if (pop_finished_coroutine(vm, &done_ip) && done_ip >= 0) {
+                    vm->current_frame->ip = done_ip;
+                    break;
+                }
                 stack_push(vm, res);
+#ifdef APE_JIT
+                enter_jit = true;
+#endif
                 break;
             }
             case OPCODE_RETURN: {
                 bool ok = pop_frame(vm);
-                stack_push(vm, object_make_null());
+                int done_ip = -1;
+                if (ok && pop_finished_coroutine(vm, &done_ip) && done_ip >= 0) {
+                    vm->current_frame->ip = done_ip;
+                } else {
+                    stack_push(vm, object_make_null());
+                }
                 if (!ok) {
                     stack_pop(vm);
                     goto end;
                 }
+#ifdef APE_JIT
+                enter_jit = true;
+#endif
                 break;
             }
             case OPCODE_DEFINE_LOCAL: {
@@ -13540,29 +17879,29 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
             case OPCODE_FUNCTION: {
                 uint16_t constant_ix = frame_read_uint16(vm->current_frame);
                 uint8_t num_free = frame_read_uint8(vm->current_frame);
-                object_t *constant = array_get(constants, constant_ix);
-                if (!constant) {
+                object_t constant = object_get_array_value_at(vm->current_frame->constants, constant_ix);
+                if (object_is_null(constant)) {
                     errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Constant %d not found", constant_ix);
                     goto err;
                 }
-                object_type_t constant_type = object_get_type(*constant);
+                object_type_t constant_type = object_get_type(constant);
                 if (constant_type != OBJECT_FUNCTION) {
                     const char *type_name = object_get_type_name(constant_type);
                     errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "%s is not a function", type_name);
                     goto err;
                 }
 
-                const function_t *constant_function = object_get_function(*constant);
-                object_t function_obj = object_make_function(vm->mem, object_get_function_name(*constant),
-                                                            constant_function->comp_result, false,
+                const function_t *constant_function = object_get_function(constant);
+                object_t function_obj = object_make_function(vm->mem, object_get_function_name(constant),
+                                                            constant_function->comp_result, constant_function->constants, false,
                                                             constant_function->num_locals, constant_function->num_args,
                                                             num_free);
                 if (object_is_null(function_obj)) {
                     goto err;
                 }
-                for (int i = 0; i < num_free; i++) {
-                    object_t free_val = vm->stack[vm->sp - num_free + i];
-                    object_set_function_free_val(function_obj, i, free_val);
+                if (num_free > 0) {
+                    object_t *free_vals = object_get_function_free_vals(function_obj);
+                    memcpy(free_vals, &vm->stack[vm->sp - num_free], sizeof(object_t) * num_free);
                 }
                 set_sp(vm, vm->sp - num_free);
                 stack_push(vm, function_obj);
@@ -13644,19 +17983,111 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                     errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Cannot get length of %s", type_name);
                     goto err;
                 }
-                stack_push(vm, object_make_number(len));
+                stack_push(vm, object_make_number(len));
+                break;
+            }
+            case OPCODE_NUMBER: {
+                uint64_t val = frame_read_uint64(vm->current_frame);
+                double val_double = ape_uint64_to_double(val);
+                object_t obj = object_make_number(val_double);
+                stack_push(vm, obj);
+                break;
+            }
+            case OPCODE_SET_RECOVER: {
+                uint16_t recover_ip = frame_read_uint16(vm->current_frame);
+                vm->current_frame->recover_ip = recover_ip;
+                break;
+            }
+            case OPCODE_YIELD: {
+                object_t value = stack_pop(vm);
+                ok = yield_coroutine(vm, value);
+                if (!ok) {
+                    goto err;
+                }
+                break;
+            }
+            case OPCODE_FOREACH_RANGE_INIT: {
+                uint8_t argc = frame_read_uint8(vm->current_frame);
+                object_t callee = stack_get(vm, argc);
+                if (!builtins_is_range(callee)) {
+                    // range was replaced after compiling, its result is iterated by FOREACH_RANGE_NEXT instead.
+                    // step and index are pushed below the call so the result ends up where end would be,
+                    // index is advanced by the marker step so it's divided by it in FOREACH_RANGE_NEXT
+                    object_t call[4];
+                    for (int i = 0; i <= argc; i++) {
+                        call[i] = stack_get(vm, argc - i);
+                    }
+                    set_sp(vm, vm->sp - argc - 1);
+                    stack_push(vm, object_make_number(FOREACH_REPLACED_RANGE_STEP));
+                    stack_push(vm, object_make_number(0));
+                    for (int i = 0; i <= argc; i++) {
+                        stack_push(vm, call[i]);
+                    }
+                    ok = call_object(vm, callee, argc);
+                    if (!ok) {
+                        goto err;
+                    }
+#ifdef APE_JIT
+                    enter_jit = true;
+#endif
+                    break;
+                }
+                double args[3] = {0};
+                for (int i = 0; i < argc; i++) {
+                    object_t arg = stack_get(vm, argc - i - 1);
+                    object_type_t arg_type = object_get_type(arg);
+                    if (arg_type != OBJECT_NUMBER) {
+                        errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame),
+                                          "Invalid argument %d passed to range, got %s instead of %s",
+                                          i, object_get_type_name(arg_type), object_get_type_name(OBJECT_NUMBER));
+                        goto err;
+                    }
+                    args[i] = (int)object_get_number(arg);
+                }
+                set_sp(vm, vm->sp - argc - 1);
+                double start = argc > 1 ? args[0] : 0;
+                double end = argc > 1 ? args[1] : args[0];
+                double step = argc > 2 ? args[2] : 1;
+                if (step == 0) {
+                    errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "range step cannot be 0");
+                    goto err;
+                }
+                stack_push(vm, object_make_number(step));
+                stack_push(vm, object_make_number(start));
+                stack_push(vm, object_make_number(end));
                 break;
             }
-            case OPCODE_NUMBER: {
-                uint64_t val = frame_read_uint64(vm->current_frame);
-                double val_double = ape_uint64_to_double(val);
-                object_t obj = object_make_number(val_double);
-                stack_push(vm, obj);
+            case OPCODE_FOREACH_RANGE_NEXT: {
+                uint16_t done_ip = frame_read_uint16(vm->current_frame);
+                double step = object_get_number(stack_pop(vm));
+                object_t end_obj = stack_pop(vm);
+                object_t current = stack_pop(vm);
+                if (step == FOREACH_REPLACED_RANGE_STEP) {
+                    // end holds the result of a replaced range, it's iterated like any other value
+                    int ix = (int)(object_get_number(current) / FOREACH_REPLACED_RANGE_STEP);
+                    ok = foreach_push_next(vm, end_obj, ix, done_ip);
+                    if (!ok) {
+                        goto err;
+                    }
+                    break;
+                }
+                double end = object_get_number(end_obj);
+                double current_val = object_get_number(current);
+                if (step > 0 ? current_val < end : current_val > end) {
+                    stack_push(vm, current);
+                } else {
+                    vm->current_frame->ip = done_ip;
+                }
                 break;
             }
-            case OPCODE_SET_RECOVER: {
-                uint16_t recover_ip = frame_read_uint16(vm->current_frame);
-                vm->current_frame->recover_ip = recover_ip;
+            case OPCODE_FOREACH_NEXT: {
+                uint16_t done_ip = frame_read_uint16(vm->current_frame);
+                object_t index = stack_pop(vm);
+                object_t source = stack_pop(vm);
+                ok = foreach_push_next(vm, source, (int)object_get_number(index), done_ip);
+                if (!ok) {
+                    goto err;
+                }
                 break;
             }
             default: {
@@ -13666,6 +18097,31 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
             }
         }
 
+        if (vm->suspend_requested) {
+            vm->suspend_requested = false;
+            if (opcode != OPCODE_CALL) {
+                errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Execution can only be suspended by a function call");
+                goto err;
+            }
+            // frames and stacks are kept as they are until vm_resume
+            vm->suspended = true;
+            vm->running = false;
+            if (vm->config) {
+                vm_flush_stdout(vm, true);
+            }
+            return true;
+        }
+
+#ifdef APE_JIT
+        if (enter_jit) {
+            enter_jit = false;
+            bool budget_used = run_jit(vm);
+            if (budget_used) {
+                time_check_counter = time_check_interval; // jitted loops are checked every time they return
+            }
+        }
+#endif
+
         if (check_time) {
             time_check_counter++;
             if (time_check_counter > time_check_interval) {
@@ -13682,11 +18138,21 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
             error_t *err = errors_get_last_error(vm->errors);
             if (err->type == ERROR_RUNTIME && errors_get_count(vm->errors) == 1) {
                 int recover_frame_ix = -1;
-                for (int i = vm->frames_count - 1; i >= 0; i--) {
-                    frame_t *frame = &vm->frames[i];
-                    if (frame->recover_ip >= 0 && !frame->is_recovering) {
-                        recover_frame_ix = i;
-                        break;
+                int recover_level = -1; // resumed coroutines running below the recovering frame
+                for (int level = vm->resumed_coroutines_count; level >= 0 && recover_frame_ix < 0; level--) {
+                    frame_t *frames = vm->frames;
+                    int frames_count = vm->frames_count;
+                    if (level < vm->resumed_coroutines_count) {
+                        frames = vm->resumed_coroutines[level].caller_frames;
+                        frames_count = vm->resumed_coroutines[level].caller_frames_count;
+                    }
+                    for (int i = frames_count - 1; i >= 0; i--) {
+                        frame_t *frame = &frames[i];
+                        if (frame->recover_ip >= 0 && !frame->is_recovering) {
+                            recover_frame_ix = i;
+                            recover_level = level;
+                            break;
+                        }
                     }
                 }
                 if (recover_frame_ix < 0) {
@@ -13698,6 +18164,7 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
                     if (err->traceback) {
                         traceback_append_from_vm(err->traceback, vm);
                     }
+                    abandon_coroutines(vm, recover_level);
                     while (vm->frames_count > (recover_frame_ix + 1)) {
                         pop_frame(vm);
                     }
@@ -13716,7 +18183,7 @@ bool vm_execute_function(vm_t *vm, object_t function, array(object_t) *constants
             }
         }
         if (gc_should_sweep(vm->mem)) {
-            run_gc(vm, constants);
+            run_gc(vm);
         }
     }
 
@@ -13730,8 +18197,13 @@ end:
             traceback_append_from_vm(err->traceback, vm);
         }
     }
+    abandon_coroutines(vm, 0);
+
+    if (vm->config) {
+        vm_flush_stdout(vm, true);
+    }
 
-    run_gc(vm, constants);
+    run_gc(vm);
 
     vm->running = false;
     return errors_get_count(vm->errors) == 0;
@@ -13767,6 +18239,52 @@ object_t vm_get_global(vm_t *vm, int ix) {
     return vm->globals[ix];
 }
 
+strbuf_t* vm_get_stdout_buf(vm_t *vm) {
+    if (!vm->stdout_buf) {
+        vm->stdout_buf = strbuf_make(vm->alloc);
+    }
+    return vm->stdout_buf;
+}
+
+void vm_flush_stdout(vm_t *vm, bool force) {
+    strbuf_t *buf = vm->stdout_buf;
+    if (!buf) {
+        return;
+    }
+    if (strbuf_failed(buf)) { // output is lost, buffer is recreated on next print
+        strbuf_destroy(buf);
+        vm->stdout_buf = NULL;
+        return;
+    }
+    int len = strbuf_get_length(buf);
+    if (len == 0 || (!force && len < vm->config->stdio.buffer_size)) {
+        return;
+    }
+    if (vm->config->stdio.write.write) {
+        vm->config->stdio.write.write(vm->config->stdio.write.context, strbuf_get_string(buf), len);
+    }
+    if (len > vm->config->stdio.buffer_size + VM_STDOUT_BUF_MAX_SLACK) {
+        // keeping memory of one big print for the rest of execution isn't worth it
+        strbuf_destroy(buf);
+        vm->stdout_buf = NULL;
+        return;
+    }
+    strbuf_clear(buf);
+}
+
+object_t vm_get_char_string(vm_t *vm, char c) {
+    object_t *cached = &vm->char_strings[(unsigned char)c];
+    if (!object_is_null(*cached)) {
+        return *cached;
+    }
+    char str[2] = {c, '\0'};
+    object_t res = object_make_string(vm->mem, str);
+    if (!gcmem_is_arena_enabled(vm->mem)) { // arena strings are released on arena reset
+        *cached = res;
+    }
+    return res;
+}
+
 // INTERNAL
 static void set_sp(vm_t *vm, int new_sp) {
     if (new_sp > vm->sp) { // to avoid gcing freed objects
@@ -13779,7 +18297,7 @@ static void set_sp(vm_t *vm, int new_sp) {
 
 static void stack_push(vm_t *vm, object_t obj) {
 #ifdef APE_DEBUG
-    if (vm->sp >= VM_STACK_SIZE) {
+    if (vm->sp >= vm->stack_capacity) {
         APE_ASSERT(false);
         errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Stack overflow");
         return;
@@ -13818,7 +18336,7 @@ static object_t stack_pop(vm_t *vm) {
 static object_t stack_get(vm_t *vm, int nth_item) {
     int ix = vm->sp - 1 - nth_item;
 #ifdef APE_DEBUG
-    if (ix < 0 || ix >= VM_STACK_SIZE) {
+    if (ix < 0 || ix >= vm->stack_capacity) {
         errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame),
                                   "Invalid stack index: %d", nth_item);
         APE_ASSERT(false);
@@ -13866,14 +18384,17 @@ static object_t this_stack_get(vm_t *vm, int nth_item) {
 }
 
 static bool push_frame(vm_t *vm, frame_t frame) {
-    if (vm->frames_count >= VM_MAX_FRAMES) {
-        APE_ASSERT(false);
-        return false;
+    function_t *frame_function = object_get_function(frame.function);
+    int stack_count = frame.base_pointer + frame_function->num_locals + frame.bytecode_size; // instructions push at most one slot each
+    if (vm->frames_count >= vm->frames_capacity || stack_count > vm->stack_capacity) {
+        bool ok = grow_coroutine_stacks(vm, stack_count, vm->frames_count + 1);
+        if (!ok) {
+            return false;
+        }
     }
     vm->frames[vm->frames_count] = frame;
     vm->current_frame = &vm->frames[vm->frames_count];
     vm->frames_count++;
-    function_t *frame_function = object_get_function(frame.function);
     set_sp(vm, frame.base_pointer + frame_function->num_locals);
     return true;
 }
@@ -13888,16 +18409,18 @@ static bool pop_frame(vm_t *vm) {
     vm->frames_count--;
     if (vm->frames_count == 0) {
         vm->current_frame = NULL;
-        return false;
+        return vm->resumed_coroutines_count > 0; // coroutine returned, pop_finished_coroutine switches to its caller
     }
     vm->current_frame = &vm->frames[vm->frames_count - 1];
     return true;
 }
 
-static void run_gc(vm_t *vm, array(object_t) *constants) {
+static void run_gc(vm_t *vm) {
+    if (gcmem_is_arena_enabled(vm->mem)) {
+        return; // arena is released all at once in ape_arena_reset
+    }
     gc_unmark_all(vm->mem);
     gc_mark_objects(global_store_get_object_data(vm->global_store), global_store_get_object_count(vm->global_store));
-    gc_mark_objects(array_data(constants), array_count(constants));
     gc_mark_objects(vm->globals, vm->globals_count);
     for (int i = 0; i < vm->frames_count; i++) {
         frame_t *frame = &vm->frames[i];
@@ -13905,8 +18428,17 @@ static void run_gc(vm_t *vm, array(object_t) *constants) {
     }
     gc_mark_objects(vm->stack, vm->sp);
     gc_mark_objects(vm->this_stack, vm->this_sp);
+    for (int i = 0; i < vm->resumed_coroutines_count; i++) {
+        resumed_coroutine_t *resumed = &vm->resumed_coroutines[i];
+        gc_mark_object(resumed->coroutine);
+        for (int j = 0; j < resumed->caller_frames_count; j++) {
+            gc_mark_object(resumed->caller_frames[j].function);
+        }
+        gc_mark_objects(resumed->caller_stack, resumed->caller_sp);
+    }
     gc_mark_object(vm->last_popped);
     gc_mark_objects(vm->operator_oveload_keys, OPCODE_MAX);
+    gc_mark_objects(vm->char_strings, APE_ARRAY_LEN(vm->char_strings));
     gc_sweep(vm->mem);
 }
 
@@ -13931,6 +18463,8 @@ static bool call_object(vm_t *vm, object_t callee, int num_args) {
             errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "Pushing frame failed in call_object");
             return false;
         }
+    } else if (callee_type == OBJECT_COROUTINE) {
+        return resume_coroutine(vm, callee, num_args, -1);
     } else if (callee_type == OBJECT_NATIVE_FUNCTION) {
         object_t *stack_pos = vm->stack + vm->sp - num_args;
         object_t res = call_native_function(vm, callee, frame_src_position(vm->current_frame), num_args, stack_pos);
@@ -13938,6 +18472,9 @@ static bool call_object(vm_t *vm, object_t callee, int num_args) {
             return false;
         }
         set_sp(vm, vm->sp - num_args - 1);
+        if (vm->suspend_requested) {
+            return true; // result is pushed by vm_resume
+        }
         stack_push(vm, res);
     } else {
         const char *callee_type_name = object_get_type_name(callee_type);
@@ -13948,9 +18485,59 @@ static bool call_object(vm_t *vm, object_t callee, int num_args) {
     return true;
 }
 
+// pushes item ix of source or jumps to done_ip when source is exhausted
+static bool foreach_push_next(vm_t *vm, object_t source, int ix, int done_ip) {
+    object_type_t source_type = object_get_type(source);
+    if (source_type == OBJECT_ARRAY) {
+        if (ix < object_get_array_length(source)) {
+            stack_push(vm, object_get_array_value_at(source, ix));
+        } else {
+            vm->current_frame->ip = done_ip;
+        }
+    } else if (source_type == OBJECT_MAP) {
+        if (ix < object_get_map_length(source)) {
+            object_t kv_pair = object_get_kv_pair_at(vm->mem, source, ix);
+            if (object_is_null(kv_pair)) {
+                return false;
+            }
+            stack_push(vm, kv_pair);
+        } else {
+            vm->current_frame->ip = done_ip;
+        }
+    } else if (source_type == OBJECT_STRING) {
+        if (ix < object_get_string_length(source)) {
+            object_t res = vm_get_char_string(vm, object_get_string(source)[ix]);
+            if (object_is_null(res)) {
+                return false;
+            }
+            stack_push(vm, res);
+        } else {
+            vm->current_frame->ip = done_ip;
+        }
+    } else if (source_type == OBJECT_COROUTINE) {
+        if (object_get_coroutine(source)->state == COROUTINE_DONE) {
+            vm->current_frame->ip = done_ip;
+        } else {
+            stack_push(vm, source);
+            bool ok = resume_coroutine(vm, source, 0, done_ip);
+            if (!ok) {
+                return false;
+            }
+        }
+    } else {
+        const char *type_name = object_get_type_name(source_type);
+        errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Cannot iterate over %s", type_name);
+        return false;
+    }
+    return true;
+}
+
 static object_t call_native_function(vm_t *vm, object_t callee, src_pos_t src_pos, int argc, object_t *args) {
     native_function_t *native_fun = object_get_native_function(callee);
     object_t res = native_fun->fn(vm, native_fun->data, argc, args);
+    if (errors_has_errors(vm->errors)) {
+        vm->suspend_requested = false;
+    }
     if (errors_has_errors(vm->errors) && !APE_STREQ(native_fun->name, "crash")) {
         error_t *err = errors_get_last_error(vm->errors);
         err->pos = src_pos;
@@ -13992,6 +18579,255 @@ static bool check_assign(vm_t *vm, object_t old_value, object_t new_value) {
     return true;
 }
 
+#ifdef APE_JIT
+static bool run_jit(vm_t *vm) {
+    // returns true if jitted code returned because it used its backward jumps budget
+    frame_t *frame = vm->current_frame;
+    function_t *function = object_get_function(frame->function);
+    if (!function->jit_code) {
+        if (function->jit_failed) {
+            return false;
+        }
+        function->jit_counter++;
+        if (function->jit_counter < APE_JIT_THRESHOLD) {
+            return false;
+        }
+        function->jit_code = jit_compile(vm->mem->alloc, frame->function);
+        if (!function->jit_code) {
+            function->jit_failed = true;
+            return false;
+        }
+    }
+    jit_state_t state;
+    state.bp = vm->stack + frame->base_pointer;
+    state.sp = vm->stack + vm->sp;
+    state.globals = vm->globals;
+    state.last_popped = vm->last_popped;
+    state.ip = frame->ip;
+    state.budget = JIT_BACKWARD_JUMPS_BUDGET;
+    jit_run(function->jit_code, &state);
+    vm->sp = (int)(state.sp - vm->stack);
+    vm->last_popped = state.last_popped;
+    frame->ip = state.ip;
+    return state.budget <= 0;
+}
+#endif
+
+static bool resume_coroutine(vm_t *vm, object_t coroutine_obj, int num_args, int done_ip) {
+    coroutine_t *coroutine = object_get_coroutine(coroutine_obj);
+    if (coroutine->state == COROUTINE_DONE) {
+        errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Coroutine is finished");
+        return false;
+    }
+    if (coroutine->state == COROUTINE_RUNNING) {
+        errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Coroutine is already running");
+        return false;
+    }
+    if (vm->resumed_coroutines_count >= VM_MAX_RESUMED_COROUTINES) {
+        errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Too many nested coroutines");
+        return false;
+    }
+
+    bool first_resume = coroutine->state == COROUTINE_CREATED;
+    if (first_resume) {
+        function_t *function = object_get_function(coroutine->function);
+        if (num_args != function->num_args) {
+            errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame),
+                              "Invalid number of arguments to \"%s\", expected %d, got %d",
+                              object_get_function_name(coroutine->function), function->num_args, num_args);
+            return false;
+        }
+        if (!coroutine->stack) {
+            allocator_t *alloc = vm->mem->alloc;
+            coroutine->stack_capacity = num_args + 1;
+            coroutine->stack = allocator_malloc(alloc, sizeof(object_t) * coroutine->stack_capacity);
+            coroutine->frames_capacity = 1;
+            coroutine->frames = allocator_malloc(alloc, sizeof(frame_t) * coroutine->frames_capacity);
+            if (!coroutine->stack || !coroutine->frames) {
+                errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "Allocating coroutine stack failed");
+                return false;
+            }
+        }
+    } else if (num_args > 1) {
+        errors_add_errorf(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame),
+                          "Invalid number of arguments to resumed coroutine, expected 0 or 1, got %d", num_args);
+        return false;
+    }
+
+    object_t *args = vm->stack + vm->sp - num_args;
+    object_t value = object_make_null();
+    if (first_resume) {
+        // first resume calls the function with passed arguments
+        coroutine->stack[0] = coroutine->function;
+        if (num_args > 0) {
+            memcpy(coroutine->stack + 1, args, sizeof(object_t) * num_args);
+        }
+        coroutine->stack_count = num_args + 1;
+        coroutine->frames_count = 0;
+    } else if (num_args == 1) {
+        value = args[0];
+    }
+
+    resumed_coroutine_t resumed;
+    resumed.coroutine = coroutine_obj;
+    resumed.caller_stack = vm->stack;
+    resumed.caller_stack_capacity = vm->stack_capacity;
+    resumed.caller_sp = vm->sp - num_args - 1;
+    resumed.caller_frames = vm->frames;
+    resumed.caller_frames_capacity = vm->frames_capacity;
+    resumed.caller_frames_count = vm->frames_count;
+    resumed.this_sp = vm->this_sp;
+    resumed.done_ip = done_ip;
+    vm->resumed_coroutines[vm->resumed_coroutines_count] = resumed;
+    vm->resumed_coroutines_count++;
+
+    vm->stack = coroutine->stack;
+    vm->stack_capacity = coroutine->stack_capacity;
+    vm->sp = coroutine->stack_count;
+    vm->frames = coroutine->frames;
+    vm->frames_capacity = coroutine->frames_capacity;
+    vm->frames_count = coroutine->frames_count;
+    vm->current_frame = vm->frames_count > 0 ? &vm->frames[vm->frames_count - 1] : NULL;
+    coroutine->frames_count = 0;
+    coroutine->stack_count = 0;
+    coroutine->state = COROUTINE_RUNNING;
+
+    if (first_resume) {
+        frame_t frame;
+        bool ok = frame_init(&frame, coroutine->function, 1);
+        ok = ok && push_frame(vm, frame);
+        if (!ok) {
+            restore_caller_stacks(vm);
+            coroutine->state = COROUTINE_CREATED;
+            errors_add_error(vm->errors, ERROR_RUNTIME, src_pos_invalid, "Pushing frame failed in resume_coroutine");
+            return false;
+        }
+    } else {
+        stack_push(vm, value); // result of yield expression
+    }
+    return true;
+}
+
+static bool yield_coroutine(vm_t *vm, object_t value) {
+    if (vm->resumed_coroutines_count == 0) {
+        errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Cannot yield outside of a coroutine");
+        return false;
+    }
+    resumed_coroutine_t *resumed = &vm->resumed_coroutines[vm->resumed_coroutines_count - 1];
+    if (vm->this_sp != resumed->this_sp) {
+        errors_add_error(vm->errors, ERROR_RUNTIME, frame_src_position(vm->current_frame), "Cannot yield inside of a map literal");
+        return false;
+    }
+    coroutine_t *coroutine = object_get_coroutine(resumed->coroutine);
+    coroutine->frames_count = vm->frames_count;
+    coroutine->stack_count = vm->sp;
+    coroutine->state = COROUTINE_SUSPENDED;
+    restore_caller_stacks(vm);
+    stack_push(vm, value); // result of resuming call
+    return true;
+}
+
+// called after popping a frame, checks if it was the first frame of running coroutine
+static bool pop_finished_coroutine(vm_t *vm, int *out_done_ip) {
+    if (vm->resumed_coroutines_count == 0 || vm->frames_count > 0) {
+        return false;
+    }
+    resumed_coroutine_t *resumed = &vm->resumed_coroutines[vm->resumed_coroutines_count - 1];
+    coroutine_t *coroutine = object_get_coroutine(resumed->coroutine);
+    *out_done_ip = resumed->done_ip;
+    restore_caller_stacks(vm);
+    finish_coroutine(vm, coroutine);
+    return true;
+}
+
+// marks coroutines whose frames are being unwound (by an error) as finished
+static void abandon_coroutines(vm_t *vm, int resumed_coroutines_count) {
+    while (vm->resumed_coroutines_count > resumed_coroutines_count) {
+        resumed_coroutine_t *resumed = &vm->resumed_coroutines[vm->resumed_coroutines_count - 1];
+        coroutine_t *coroutine = object_get_coroutine(resumed->coroutine);
+        restore_caller_stacks(vm);
+        finish_coroutine(vm, coroutine);
+    }
+}
+
+// switches back to stacks of the code that resumed the last coroutine
+static void restore_caller_stacks(vm_t *vm) {
+    resumed_coroutine_t *resumed = &vm->resumed_coroutines[vm->resumed_coroutines_count - 1];
+    vm->stack = resumed->caller_stack;
+    vm->stack_capacity = resumed->caller_stack_capacity;
+    vm->sp = resumed->caller_sp;
+    vm->frames = resumed->caller_frames;
+    vm->frames_capacity = resumed->caller_frames_capacity;
+    vm->frames_count = resumed->caller_frames_count;
+    vm->current_frame = &vm->frames[vm->frames_count - 1];
+    vm->resumed_coroutines_count--;
+}
+
+static void finish_coroutine(vm_t *vm, coroutine_t *coroutine) {
+    allocator_t *alloc = vm->mem->alloc;
+    allocator_free(alloc, coroutine->frames);
+    allocator_free(alloc, coroutine->stack);
+    memset(coroutine, 0, sizeof(coroutine_t));
+    coroutine->function = object_make_null();
+    coroutine->state = COROUTINE_DONE;
+}
+
+// stacks of running coroutine start small and grow up to the size of the main stacks, which never grow
+static bool grow_coroutine_stacks(vm_t *vm, int stack_count, int frames_count) {
+    if (frames_count > VM_MAX_FRAMES) {
+        APE_ASSERT(false);
+        return false;
+    }
+    if (vm->resumed_coroutines_count == 0) {
+        return frames_count <= vm->frames_capacity;
+    }
+    resumed_coroutine_t *resumed = &vm->resumed_coroutines[vm->resumed_coroutines_count - 1];
+    coroutine_t *coroutine = object_get_coroutine(resumed->coroutine);
+    allocator_t *alloc = vm->mem->alloc;
+
+    if (stack_count > vm->stack_capacity && vm->stack_capacity < VM_STACK_SIZE) {
+        int new_capacity = vm->stack_capacity * 2;
+        if (new_capacity < stack_count) {
+            new_capacity = stack_count;
+        }
+        if (new_capacity > VM_STACK_SIZE) {
+            new_capacity = VM_STACK_SIZE;
+        }
+        object_t *new_stack = allocator_malloc(alloc, sizeof(object_t) * new_capacity);
+        if (!new_stack) {
+            return false;
+        }
+        memcpy(new_stack, vm->stack, sizeof(object_t) * vm->sp);
+        allocator_free(alloc, vm->stack);
+        vm->stack = new_stack;
+        vm->stack_capacity = new_capacity;
+        coroutine->stack = new_stack;
+        coroutine->stack_capacity = new_capacity;
+    }
+
+    if (frames_count > vm->frames_capacity) {
+        int new_capacity = vm->frames_capacity * 2;
+        if (new_capacity < frames_count) {
+            new_capacity = frames_count;
+        }
+        if (new_capacity > VM_MAX_FRAMES) {
+            new_capacity = VM_MAX_FRAMES;
+        }
+        frame_t *new_frames = allocator_malloc(alloc, sizeof(frame_t) * new_capacity);
+        if (!new_frames) {
+            return false;
+        }
+        memcpy(new_frames, vm->frames, sizeof(frame_t) * vm->frames_count);
+        allocator_free(alloc, vm->frames);
+        vm->frames = new_frames;
+        vm->frames_capacity = new_capacity;
+        vm->current_frame = vm->frames_count > 0 ? &vm->frames[vm->frames_count - 1] : NULL;
+        coroutine->frames = new_frames;
+        coroutine->frames_capacity = new_capacity;
+    }
+    return true;
+}
+
 static bool try_overload_operator(vm_t *vm, object_t left, object_t right, opcode_t op, bool *out_overload_found) {
     *out_overload_found = false;
     object_type_t left_type = object_get_type(left);
@@ -14062,6 +18898,7 @@ static bool try_overload_operator(vm_t *vm, object_t left, object_t right, opcod
 #include "symbol_table.h"
 #include "traceback.h"
 #include "global_store.h"
+#include "channel.h"
 #endif
 
 typedef struct native_fn_wrapper {
@@ -14070,11 +18907,41 @@ typedef struct native_fn_wrapper {
     void *data;
 } native_fn_wrapper_t;
 
+typedef struct parallel_map_worker {
+    ape_t *ape; // clone reused by every map
+    const ape_program_t *program;
+    const char *function_name;
+    object_t args_arrays; // worker's share of the arguments, copied to its heap before it starts
+    int first_ix;
+    int step;
+    object_t results;
+    ape_thread_t thread;
+    bool thread_started;
+} parallel_map_worker_t;
+
+typedef struct ape_workers {
+    ape_t *ape;
+    parallel_map_worker_t *workers;
+    int count;
+} ape_workers_t;
+
 typedef struct ape_program {
     ape_t *ape;
     compilation_result_t *comp_res;
+    int number; // programs compiled by ape so far, including this one
 } ape_program_t;
 
+typedef struct program_constants {
+    const ape_t *ape; // instance that compiled the program
+    int number;
+    object_t constants; // not collected while entry exists
+} program_constants_t;
+
+typedef struct shared_constants {
+    object_t constants; // not collected while entry exists
+    int clones_count; // live clones sharing bytecode of functions using the constants
+} shared_constants_t;
+
 typedef struct ape {
     allocator_t alloc;
     gcmem_t *mem;
@@ -14087,6 +18954,15 @@ typedef struct ape {
 
     allocator_t custom_allocator;
 
+    int programs_count;
+    struct ape *cloned_from;
+    int cloned_programs_count;
+    int clones_count; // clones made so far, used to seed their random generators
+    array(program_constants_t) *programs_constants; // of live programs that can run on this instance
+    array(shared_constants_t) *shared_constants; // owned by functions whose code is shared with clones
+    array(object_t) *borrowed_constants; // shared constants of cloned_from released when clone is destroyed
+
+    compilation_result_t *suspended_comp_res; // kept alive until suspended ape_execute finishes
 } ape_t;
 
 static void ape_deinit(ape_t *ape);
@@ -14096,6 +18972,15 @@ static ape_object_t object_to_ape_object(object_t obj);
 static ape_object_t ape_object_make_native_function_with_name(ape_t *ape, const char *name, ape_native_fn fn, void *data);
 
 static void reset_state(ape_t *ape);
+static void rebind_native_functions(ape_t *ape, valdict(object_t, object_t) *copies);
+static object_t parallel_map_copy_args(ape_t *ape, object_t args_arrays, int first_ix, int step, errors_t *errors);
+static void parallel_map_worker_run(void *arg);
+static bool program_can_run_on(const ape_program_t *program, const ape_t *ape);
+static ape_program_t* program_make(ape_t *ape, compilation_result_t *comp_res);
+static program_constants_t* find_program_constants(ape_t *ape, const ape_program_t *program);
+static bool share_constants(ape_t *ape, object_t constants);
+static void unshare_constants(ape_t *ape, object_t constants);
+static shared_constants_t* find_shared_constants(ape_t *ape, object_t constants);
 static void set_default_config(ape_t *ape);
 static char* read_file_default(void *ctx, const char *filename);
 static size_t write_file_default(void* context, const char *path, const char *string, size_t string_size);
@@ -14137,6 +19022,16 @@ ape_t* ape_make_ex(ape_malloc_fn malloc_fn, ape_free_fn free_fn, void *ctx) {
         goto err;
     }
 
+    ape->programs_constants = array_make(&ape->alloc, program_constants_t);
+    if (!ape->programs_constants) {
+        goto err;
+    }
+
+    ape->shared_constants = array_make(&ape->alloc, shared_constants_t);
+    if (!ape->shared_constants) {
+        goto err;
+    }
+
     ape->global_store = global_store_make(&ape->alloc, ape->mem);
     if (!ape->global_store) {
         goto err;
@@ -14163,9 +19058,145 @@ void ape_destroy(ape_t *ape) {
     if (!ape) {
         return;
     }
-    ape_deinit(ape);
-    allocator_t alloc = ape->alloc;
-    allocator_free(&alloc, ape);
+    ape_deinit(ape);
+    allocator_t alloc = ape->alloc;
+    allocator_free(&alloc, ape);
+}
+
+ape_t* ape_clone(ape_t *ape) {
+    ape_t *clone = allocator_malloc(&ape->custom_allocator, sizeof(ape_t));
+    if (!clone) {
+        return NULL;
+    }
+
+    memset(clone, 0, sizeof(ape_t));
+    clone->alloc = allocator_make(ape_malloc, ape_free, clone);
+    clone->custom_allocator = ape->custom_allocator;
+    clone->config = ape->config;
+    clone->cloned_from = ape;
+    clone->cloned_programs_count = ape->programs_count;
+
+    errors_init(&clone->errors);
+
+    valdict(object_t, object_t) *copies = NULL;
+
+    clone->mem = gcmem_make(&clone->alloc);
+    if (!clone->mem) {
+        goto err;
+    }
+
+    clone->files = ptrarray_make(&clone->alloc);
+    if (!clone->files) {
+        goto err;
+    }
+
+    clone->programs_constants = array_make(&clone->alloc, program_constants_t);
+    if (!clone->programs_constants) {
+        goto err;
+    }
+
+    clone->shared_constants = array_make(&clone->alloc, shared_constants_t);
+    if (!clone->shared_constants) {
+        goto err;
+    }
+
+    clone->borrowed_constants = array_make(&clone->alloc, object_t);
+    if (!clone->borrowed_constants) {
+        goto err;
+    }
+
+    clone->global_store = global_store_copy(ape->global_store, &clone->alloc);
+    if (!clone->global_store) {
+        goto err;
+    }
+
+    clone->compiler = compiler_make_copy(ape->compiler, &clone->alloc, &clone->config, clone->mem, &clone->errors, clone->files, clone->global_store);
+    if (!clone->compiler) {
+        goto err;
+    }
+
+    clone->vm = vm_make(&clone->alloc, &clone->config, clone->mem, &clone->errors, clone->global_store);
+    if (!clone->vm) {
+        goto err;
+    }
+    // seeded from a copy of ape's generator, so that cloning doesn't change numbers generated by ape,
+    // and from the number of clones made, so that clones don't repeat each other's numbers
+    ape_random_t random = ape->vm->random;
+    ape->clones_count++;
+    ape_random_seed(&clone->vm->random, ape_random_next(&random) ^ ((uint64_t)ape->clones_count * 0x9e3779b97f4a7c15));
+
+    // copies are shared between all roots so that objects referenced from multiple places stay the same object
+    copies = valdict_make(&clone->alloc, object_t, object_t);
+    if (!copies) {
+        goto err;
+    }
+
+    for (int i = 0; i < global_store_get_object_count(clone->global_store); i++) {
+        object_t obj = global_store_get_object_data(clone->global_store)[i];
+        object_t copy = object_copy_to_heap(clone->mem, obj, copies, true, &ape->errors);
+        if (object_is_null(copy) && !object_is_null(obj)) {
+            goto err;
+        }
+        global_store_set_object_at(clone->global_store, i, copy);
+    }
+
+    for (int i = 0; i < array_count(ape->programs_constants); i++) {
+        program_constants_t program_constants = *(program_constants_t*)array_get(ape->programs_constants, i);
+        program_constants.constants = object_copy_to_heap(clone->mem, program_constants.constants, copies, true, &ape->errors);
+        if (object_is_null(program_constants.constants)) {
+            goto err;
+        }
+        bool ok = gc_disable_on_object(program_constants.constants);
+        if (!ok) {
+            goto err;
+        }
+        ok = array_add(clone->programs_constants, &program_constants);
+        if (!ok) {
+            gc_enable_on_object(program_constants.constants);
+            goto err;
+        }
+    }
+
+    for (int i = 0; i < ape->vm->globals_count; i++) {
+        object_t obj = ape->vm->globals[i];
+        object_t copy = object_copy_to_heap(clone->mem, obj, copies, true, &ape->errors);
+        if (object_is_null(copy) && !object_is_null(obj)) {
+            goto err;
+        }
+        vm_set_global(clone->vm, i, copy);
+    }
+
+    rebind_native_functions(clone, copies);
+
+    // bytecode is shared with clone so functions owning it can't be collected until clone is destroyed,
+    // constants are borrowed once per function and released the same number of times
+    for (int i = 0; i < valdict_count(copies); i++) {
+        object_t *obj = valdict_get_key_at(copies, i);
+        if (object_get_type(*obj) != OBJECT_FUNCTION) {
+            continue;
+        }
+        object_t constants = object_get_function(*obj)->constants;
+        if (object_is_null(constants)) {
+            continue;
+        }
+        bool ok = share_constants(ape, constants);
+        if (!ok) {
+            goto err;
+        }
+        ok = array_add(clone->borrowed_constants, &constants);
+        if (!ok) {
+            unshare_constants(ape, constants);
+            goto err;
+        }
+    }
+
+    valdict_destroy(copies);
+    return clone;
+err:
+    valdict_destroy(copies);
+    ape_deinit(clone);
+    allocator_free(&ape->custom_allocator, clone);
+    return NULL;
 }
 
 void ape_free_allocated(ape_t *ape, void *ptr) {
@@ -14194,10 +19225,18 @@ bool ape_set_timeout(ape_t *ape, double max_execution_time_ms) {
 }
 
 void ape_set_stdout_write_function(ape_t *ape, ape_stdout_write_fn stdout_write, void *context) {
+    if (ape->vm) {
+        vm_flush_stdout(ape->vm, true); // pending output goes to the previous function
+    }
     ape->config.stdio.write.write = stdout_write;
     ape->config.stdio.write.context = context;
 }
 
+void ape_set_stdout_buffer_size(ape_t *ape, int size) {
+    ape->config.stdio.buffer_size = size;
+    vm_flush_stdout(ape->vm, false);
+}
+
 void ape_set_file_write_function(ape_t *ape, ape_write_file_fn file_write, void *context) {
     ape->config.fileio.write_file.write_file = file_write;
     ape->config.fileio.write_file.context = context;
@@ -14218,12 +19257,10 @@ ape_program_t* ape_compile(ape_t *ape, const char *code) {
         goto err;
     }
 
-    ape_program_t *program = allocator_malloc(&ape->alloc, sizeof(ape_program_t));
+    ape_program_t *program = program_make(ape, comp_res);
     if (!program) {
         goto err;
     }
-    program->ape = ape;
-    program->comp_res = comp_res;
     return program;
 
 err:
@@ -14241,13 +19278,10 @@ ape_program_t* ape_compile_file(ape_t *ape, const char *path) {
         goto err;
     }
 
-    ape_program_t *program = allocator_malloc(&ape->alloc, sizeof(ape_program_t));
+    ape_program_t *program = program_make(ape, comp_res);
     if (!program) {
         goto err;
     }
-
-    program->ape = ape;
-    program->comp_res = comp_res;
     return program;
 
 err:
@@ -14258,13 +19292,17 @@ err:
 ape_object_t ape_execute_program(ape_t *ape, const ape_program_t *program) {
     reset_state(ape);
  
-    if (ape != program->ape) {
+    program_constants_t *program_constants = NULL;
+    if (program_can_run_on(program, ape)) {
+        program_constants = find_program_constants(ape, program);
+    }
+    if (!program_constants) {
         errors_add_error(&ape->errors, ERROR_USER, src_pos_invalid, "ape program was compiled with a different ape instance");
         return ape_object_make_null();
     }
 
-    bool ok = vm_run(ape->vm, program->comp_res, compiler_get_constants(ape->compiler));
-    if (!ok || errors_get_count(&ape->errors) > 0) {
+    bool ok = vm_run(ape->vm, program->comp_res, program_constants->constants);
+    if (!ok || errors_get_count(&ape->errors) > 0 || vm_is_suspended(ape->vm)) {
         return ape_object_make_null();
     }
 
@@ -14282,6 +19320,17 @@ void ape_program_destroy(ape_program_t *program) {
     if (!program) {
         return;
     }
+    ape_t *ape = program->ape;
+    if (vm_is_suspended(ape->vm) && vm_is_running_code_of(ape->vm, program->comp_res)) {
+        vm_reset(ape->vm); // suspended execution can't continue without program's code
+    }
+    program_constants_t *program_constants = find_program_constants(program->ape, program);
+    if (program_constants) {
+        if (!find_shared_constants(program->ape, program_constants->constants)) {
+            gc_enable_on_object(program_constants->constants);
+        }
+        array_remove_item(program->ape->programs_constants, program_constants);
+    }
     compilation_result_destroy(program->comp_res);
     allocator_free(&program->ape->alloc, program);
 }
@@ -14301,6 +19350,11 @@ ape_object_t ape_execute(ape_t *ape, const char *code) {
         goto err;
     }
 
+    if (vm_is_suspended(ape->vm)) {
+        ape->suspended_comp_res = comp_res;
+        return ape_object_make_null();
+    }
+
     APE_ASSERT(ape->vm->sp == 0);
 
     object_t res = vm_get_last_popped(ape->vm);
@@ -14332,6 +19386,11 @@ ape_object_t ape_execute_file(ape_t *ape, const char *path) {
         goto err;
     }
 
+    if (vm_is_suspended(ape->vm)) {
+        ape->suspended_comp_res = comp_res;
+        return ape_object_make_null();
+    }
+
     APE_ASSERT(ape->vm->sp == 0);
 
     object_t res = vm_get_last_popped(ape->vm);
@@ -14348,6 +19407,21 @@ err:
     return ape_object_make_null();
 }
 
+void ape_arena_begin(ape_t *ape) {
+    gcmem_set_arena_enabled(ape->mem, true);
+}
+
+void ape_arena_reset(ape_t *ape) {
+    if (!gcmem_is_arena_enabled(ape->mem)) {
+        return;
+    }
+    vm_t *vm = ape->vm;
+    gc_clear_arena_references(vm->globals, vm->globals_count);
+    gc_clear_arena_references(&vm->last_popped, 1);
+    gc_clear_arena_references(global_store_get_object_data(ape->global_store), global_store_get_object_count(ape->global_store));
+    gcmem_arena_reset(ape->mem);
+}
+
 ape_object_t ape_call(ape_t *ape, const char *function_name, int argc, ape_object_t *args) {
     reset_state(ape);
 
@@ -14355,13 +19429,216 @@ ape_object_t ape_call(ape_t *ape, const char *function_name, int argc, ape_objec
     if (object_get_type(callee) == OBJECT_NULL) {
         return ape_object_make_null();
     }
-    object_t res = vm_call(ape->vm, compiler_get_constants(ape->compiler), callee, argc, (object_t*)args);
+    object_t res = vm_call(ape->vm, callee, argc, (object_t*)args);
     if (errors_get_count(&ape->errors) > 0) {
         return ape_object_make_null();
     }
     return object_to_ape_object(res);
 }
 
+ape_object_t ape_suspend(ape_t *ape) {
+    ape->vm->suspend_requested = true;
+    return ape_object_make_null();
+}
+
+ape_object_t ape_resume(ape_t *ape, ape_object_t result) {
+    ape_clear_errors(ape);
+
+    bool ok = vm_resume(ape->vm, ape_object_to_object(result));
+    if (!vm_is_suspended(ape->vm)) {
+        compilation_result_destroy(ape->suspended_comp_res);
+        ape->suspended_comp_res = NULL;
+    }
+    if (!ok || errors_get_count(&ape->errors) > 0 || vm_is_suspended(ape->vm)) {
+        return ape_object_make_null();
+    }
+
+    APE_ASSERT(ape->vm->sp == 0);
+
+    object_t res = vm_get_last_popped(ape->vm);
+    if (object_get_type(res) == OBJECT_NONE) {
+        return ape_object_make_null();
+    }
+    return object_to_ape_object(res);
+}
+
+bool ape_is_suspended(const ape_t *ape) {
+    return vm_is_suspended(ape->vm);
+}
+
+ape_workers_t* ape_workers_make(ape_t *ape, int threads_count) {
+    if (!ape_threads_platform_supported() || threads_count < 1) {
+        threads_count = 1;
+    }
+
+    ape_workers_t *workers = allocator_malloc(&ape->alloc, sizeof(ape_workers_t));
+    if (!workers) {
+        return NULL;
+    }
+    memset(workers, 0, sizeof(ape_workers_t));
+    workers->ape = ape;
+
+    workers->workers = allocator_malloc(&ape->alloc, sizeof(parallel_map_worker_t) * threads_count);
+    if (!workers->workers) {
+        goto err;
+    }
+    memset(workers->workers, 0, sizeof(parallel_map_worker_t) * threads_count);
+
+    for (int i = 0; i < threads_count; i++) {
+        workers->workers[i].ape = ape_clone(ape);
+        if (!workers->workers[i].ape) {
+            goto err;
+        }
+        workers->count++;
+    }
+    return workers;
+err:
+    ape_workers_destroy(workers);
+    return NULL;
+}
+
+ape_object_t ape_workers_map(ape_workers_t *ape_workers, const ape_program_t *program, const char *function_name, ape_object_t ape_args_arrays) {
+    ape_t *ape = ape_workers->ape;
+    reset_state(ape);
+
+    object_t args_arrays = ape_object_to_object(ape_args_arrays);
+    bool args_valid = object_get_type(args_arrays) == OBJECT_ARRAY;
+    int count = args_valid ? object_get_array_length(args_arrays) : 0;
+    for (int i = 0; i < count; i++) {
+        if (object_get_type(object_get_array_value_at(args_arrays, i)) != OBJECT_ARRAY) {
+            args_valid = false;
+            break;
+        }
+    }
+    if (!args_valid) {
+        errors_add_error(&ape->errors, ERROR_USER, src_pos_invalid, "Arguments have to be an array of arrays");
+        return ape_object_make_null();
+    }
+
+    int threads_count = ape_workers->count;
+    if (threads_count > count) {
+        threads_count = count > 0 ? count : 1;
+    }
+
+    object_t res = object_make_null();
+
+    parallel_map_worker_t *workers = ape_workers->workers;
+    for (int i = 0; i < threads_count; i++) {
+        parallel_map_worker_t *worker = &workers[i];
+        worker->program = program;
+        worker->function_name = function_name;
+        worker->first_ix = i;
+        worker->step = threads_count;
+        worker->results = object_make_null();
+        worker->thread_started = false;
+        // copying reads lazily computed state of the caller's objects (e.g. string hashes),
+        // so it's done here and not concurrently by workers
+        worker->args_arrays = parallel_map_copy_args(worker->ape, args_arrays, worker->first_ix, worker->step, &ape->errors);
+        if (object_is_null(worker->args_arrays)) {
+            goto end;
+        }
+    }
+
+    if (threads_count == 1) {
+        parallel_map_worker_run(&workers[0]);
+    } else {
+        for (int i = 0; i < threads_count; i++) {
+            parallel_map_worker_t *worker = &workers[i];
+            worker->thread_started = ape_thread_start(&worker->thread, parallel_map_worker_run, worker);
+            if (!worker->thread_started) {
+                parallel_map_worker_run(worker);
+            }
+        }
+        for (int i = 0; i < threads_count; i++) {
+            if (workers[i].thread_started) {
+                ape_thread_join(&workers[i].thread);
+            }
+        }
+    }
+
+    for (int i = 0; i < threads_count; i++) {
+        ape_t *worker_ape = workers[i].ape;
+        if (errors_get_count(&worker_ape->errors) > 0) {
+            const error_t *err = errors_getc(&worker_ape->errors, 0);
+            errors_add_error(&ape->errors, err->type, src_pos_invalid, err->message);
+            goto end;
+        }
+    }
+
+    res = object_make_array_with_capacity(ape->mem, count);
+    if (object_is_null(res)) {
+        goto end;
+    }
+    for (int i = 0; i < count; i++) {
+        bool ok = object_add_array_value(res, object_make_null());
+        if (!ok) {
+            res = object_make_null();
+            goto end;
+        }
+    }
+
+    // results live in workers' heaps, so they're copied together with bytecode before workers reuse them
+    for (int i = 0; i < threads_count; i++) {
+        parallel_map_worker_t *worker = &workers[i];
+        valdict(object_t, object_t) *copies = valdict_make(&ape->alloc, object_t, object_t);
+        if (!copies) {
+            res = object_make_null();
+            goto end;
+        }
+        int results_count = object_get_array_length(worker->results);
+        for (int j = 0; j < results_count; j++) {
+            object_t worker_res = object_get_array_value_at(worker->results, j);
+            object_t worker_res_copy = object_copy_to_heap(ape->mem, worker_res, copies, false, &ape->errors);
+            if (object_is_null(worker_res_copy) && !object_is_null(worker_res)) {
+                valdict_destroy(copies);
+                res = object_make_null();
+                goto end;
+            }
+            object_set_array_value_at(res, worker->first_ix + j * worker->step, worker_res_copy);
+        }
+        rebind_native_functions(ape, copies);
+        valdict_destroy(copies);
+    }
+
+end:
+    // arguments and results can be collected by workers' next runs
+    for (int i = 0; i < threads_count; i++) {
+        gc_enable_on_object(workers[i].args_arrays);
+        gc_enable_on_object(workers[i].results);
+        workers[i].args_arrays = object_make_null();
+        workers[i].results = object_make_null();
+    }
+    return object_to_ape_object(res);
+}
+
+void ape_workers_destroy(ape_workers_t *workers) {
+    if (!workers) {
+        return;
+    }
+    for (int i = 0; i < workers->count; i++) {
+        ape_destroy(workers->workers[i].ape);
+    }
+    allocator_free(&workers->ape->alloc, workers->workers);
+    allocator_free(&workers->ape->alloc, workers);
+}
+
+ape_object_t ape_parallel_map(ape_t *ape, const ape_program_t *program, const char *function_name, ape_object_t args_arrays, int threads_count) {
+    // no more clones than calls
+    object_t args_arrays_obj = ape_object_to_object(args_arrays);
+    if (object_get_type(args_arrays_obj) == OBJECT_ARRAY && threads_count > object_get_array_length(args_arrays_obj)) {
+        threads_count = object_get_array_length(args_arrays_obj);
+    }
+    ape_workers_t *workers = ape_workers_make(ape, threads_count);
+    if (!workers) {
+        reset_state(ape);
+        errors_add_error(&ape->errors, ERROR_ALLOCATION, src_pos_invalid, "Creating workers failed");
+        return ape_object_make_null();
+    }
+    ape_object_t res = ape_workers_map(workers, program, function_name, args_arrays);
+    ape_workers_destroy(workers);
+    return res;
+}
+
 bool ape_has_errors(const ape_t *ape) {
     return ape_errors_count(ape) > 0;
 }
@@ -14379,7 +19656,11 @@ const ape_error_t* ape_get_error(const ape_t *ape, int index) {
 }
 
 bool ape_set_native_function(ape_t *ape, const char *name, ape_native_fn fn, void *data) {
+    // native functions are registered for good, so they're kept out of the arena
+    bool arena_enabled = gcmem_is_arena_enabled(ape->mem);
+    gcmem_set_arena_enabled(ape->mem, false);
     ape_object_t obj = ape_object_make_native_function_with_name(ape, name, fn, data);
+    gcmem_set_arena_enabled(ape->mem, arena_enabled);
     if (ape_object_is_null(obj)) {
         return false;
     }
@@ -14586,6 +19867,7 @@ ape_object_type_t ape_object_get_type(ape_object_t ape_obj) {
         case OBJECT_MAP:             return APE_OBJECT_MAP;
         case OBJECT_FUNCTION:        return APE_OBJECT_FUNCTION;
         case OBJECT_EXTERNAL:        return APE_OBJECT_EXTERNAL;
+        case OBJECT_COROUTINE:       return APE_OBJECT_COROUTINE;
         case OBJECT_FREED:           return APE_OBJECT_FREED;
         case OBJECT_ANY:             return APE_OBJECT_ANY;
         default:                     return APE_OBJECT_NONE;
@@ -14609,6 +19891,7 @@ const char* ape_object_get_type_name(ape_object_type_t type) {
         case APE_OBJECT_MAP:             return "MAP";
         case APE_OBJECT_FUNCTION:        return "FUNCTION";
         case APE_OBJECT_EXTERNAL:        return "EXTERNAL";
+        case APE_OBJECT_COROUTINE:       return "COROUTINE";
         case APE_OBJECT_FREED:           return "FREED";
         case APE_OBJECT_ANY:             return "ANY";
         default:                         return "NONE";
@@ -14839,6 +20122,41 @@ bool ape_object_map_has_key(ape_object_t ape_object, const char *key) {
     return object_map_has_key(object, key_object);
 }
 
+//-----------------------------------------------------------------------------
+// Ape channel
+//-----------------------------------------------------------------------------
+
+ape_channel_t* ape_channel_make(int capacity) {
+    return ape_channel_make_ex(capacity, NULL, NULL, NULL);
+}
+
+ape_channel_t* ape_channel_make_ex(int capacity, ape_malloc_fn malloc_fn, ape_free_fn free_fn, void *ctx) {
+    allocator_t alloc = allocator_make((allocator_malloc_fn)malloc_fn, (allocator_free_fn)free_fn, ctx);
+    return (ape_channel_t*)channel_make(&alloc, capacity);
+}
+
+void ape_channel_destroy(ape_channel_t *ape_channel) {
+    channel_release((channel_t*)ape_channel);
+}
+
+void ape_channel_close(ape_channel_t *ape_channel) {
+    channel_close((channel_t*)ape_channel);
+}
+
+bool ape_channel_send(ape_t *ape, ape_channel_t *ape_channel, ape_object_t obj) {
+    return channel_send((channel_t*)ape_channel, ape_object_to_object(obj), &ape->errors);
+}
+
+ape_object_t ape_channel_recv(ape_t *ape, ape_channel_t *ape_channel) {
+    object_t res = channel_recv((channel_t*)ape_channel, ape->mem, &ape->errors);
+    return object_to_ape_object(res);
+}
+
+ape_object_t ape_object_make_channel(ape_t *ape, ape_channel_t *ape_channel) {
+    object_t res = object_make_channel(ape->mem, (channel_t*)ape_channel);
+    return object_to_ape_object(res);
+}
+
 //-----------------------------------------------------------------------------
 // Ape error
 //-----------------------------------------------------------------------------
@@ -15011,7 +20329,212 @@ const char* ape_traceback_get_function_name(const ape_traceback_t *ape_traceback
 //-----------------------------------------------------------------------------
 // Ape internal
 //-----------------------------------------------------------------------------
+static void parallel_map_worker_run(void *arg) {
+    parallel_map_worker_t *worker = arg;
+    ape_t *ape = worker->ape;
+
+    if (worker->program) {
+        ape_execute_program(ape, worker->program);
+        if (ape_has_errors(ape)) {
+            return;
+        }
+    }
+
+    reset_state(ape);
+
+    object_t callee = ape_object_to_object(ape_get_object(ape, worker->function_name));
+    if (ape_has_errors(ape)) {
+        return;
+    }
+
+    worker->results = object_make_array(ape->mem);
+    if (object_is_null(worker->results)) {
+        return;
+    }
+    bool ok = gc_disable_on_object(worker->results);
+    if (!ok) {
+        return;
+    }
+
+    int count = object_get_array_length(worker->args_arrays);
+    for (int i = 0; i < count; i++) {
+        object_t args = object_get_array_value_at(worker->args_arrays, i);
+        int argc = object_get_array_length(args);
+        object_t *argv = array_data(object_get_allocated_data(args)->array);
+        object_t res = vm_call(ape->vm, callee, argc, argv);
+        if (vm_is_suspended(ape->vm)) {
+            errors_add_error(&ape->errors, ERROR_USER, src_pos_invalid, "Execution cannot be suspended in parallel map");
+        }
+        if (ape_has_errors(ape)) {
+            break;
+        }
+        ok = object_add_array_value(worker->results, res);
+        if (!ok) {
+            break;
+        }
+    }
+}
+
+// every call gets its own copies of arguments
+static object_t parallel_map_copy_args(ape_t *ape, object_t args_arrays, int first_ix, int step, errors_t *errors) {
+    object_t res = object_make_array(ape->mem);
+    if (object_is_null(res)) {
+        return object_make_null();
+    }
+    bool ok = gc_disable_on_object(res);
+    if (!ok) {
+        return object_make_null();
+    }
+
+    valdict(object_t, object_t) *copies = valdict_make(&ape->alloc, object_t, object_t);
+    if (!copies) {
+        return object_make_null();
+    }
+
+    int count = object_get_array_length(args_arrays);
+    for (int i = first_ix; i < count; i += step) {
+        valdict_clear(copies);
+        object_t args = object_get_array_value_at(args_arrays, i);
+        object_t args_copy = object_copy_to_heap(ape->mem, args, copies, true, errors);
+        if (object_is_null(args_copy)) {
+            res = object_make_null();
+            break;
+        }
+        rebind_native_functions(ape, copies);
+        ok = object_add_array_value(res, args_copy);
+        if (!ok) {
+            res = object_make_null();
+            break;
+        }
+    }
+
+    valdict_destroy(copies);
+    return res;
+}
+
+// native functions copied from other instances have to call back into ape
+static void rebind_native_functions(ape_t *ape, valdict(object_t, object_t) *copies) {
+    for (int i = 0; i < valdict_count(copies); i++) {
+        object_t *copy = valdict_get_value_at(copies, i);
+        if (object_get_type(*copy) != OBJECT_NATIVE_FUNCTION) {
+            continue;
+        }
+        native_function_t *native_function = object_get_native_function(*copy);
+        if (native_function->fn == ape_native_fn_wrapper) {
+            native_fn_wrapper_t *wrapper = (native_fn_wrapper_t*)native_function->data;
+            wrapper->ape = ape;
+        }
+    }
+}
+
+static ape_program_t* program_make(ape_t *ape, compilation_result_t *comp_res) {
+    program_constants_t program_constants;
+    program_constants.ape = ape;
+    program_constants.number = ape->programs_count + 1;
+    program_constants.constants = compiler_get_constants(ape->compiler);
+
+    ape_program_t *program = allocator_malloc(&ape->alloc, sizeof(ape_program_t));
+    if (!program) {
+        return NULL;
+    }
+    bool ok = gc_disable_on_object(program_constants.constants);
+    if (!ok) {
+        allocator_free(&ape->alloc, program);
+        return NULL;
+    }
+    ok = array_add(ape->programs_constants, &program_constants);
+    if (!ok) {
+        gc_enable_on_object(program_constants.constants);
+        allocator_free(&ape->alloc, program);
+        return NULL;
+    }
+    program->ape = ape;
+    program->comp_res = comp_res;
+    program->number = ++ape->programs_count;
+    return program;
+}
+
+static program_constants_t* find_program_constants(ape_t *ape, const ape_program_t *program) {
+    for (int i = 0; i < array_count(ape->programs_constants); i++) {
+        program_constants_t *program_constants = array_get(ape->programs_constants, i);
+        if (program_constants->ape == program->ape && program_constants->number == program->number) {
+            return program_constants;
+        }
+    }
+    return NULL;
+}
+
+static bool share_constants(ape_t *ape, object_t constants) {
+    shared_constants_t *shared = find_shared_constants(ape, constants);
+    if (shared) {
+        shared->clones_count++;
+        return true;
+    }
+    shared_constants_t new_shared;
+    new_shared.constants = constants;
+    new_shared.clones_count = 1;
+    bool ok = array_add(ape->shared_constants, &new_shared);
+    if (!ok) {
+        return false;
+    }
+    gc_disable_on_object(constants); // fails if a program already keeps constants alive
+    return true;
+}
+
+static void unshare_constants(ape_t *ape, object_t constants) {
+    shared_constants_t *shared = find_shared_constants(ape, constants);
+    if (!shared) {
+        return;
+    }
+    shared->clones_count--;
+    if (shared->clones_count > 0) {
+        return;
+    }
+    array_remove_item(ape->shared_constants, shared);
+    for (int i = 0; i < array_count(ape->programs_constants); i++) {
+        program_constants_t *program_constants = array_get(ape->programs_constants, i);
+        if (program_constants->constants.handle == constants.handle) {
+            return;
+        }
+    }
+    gc_enable_on_object(constants);
+}
+
+static shared_constants_t* find_shared_constants(ape_t *ape, object_t constants) {
+    for (int i = 0; i < array_count(ape->shared_constants); i++) {
+        shared_constants_t *shared = array_get(ape->shared_constants, i);
+        if (shared->constants.handle == constants.handle) {
+            return shared;
+        }
+    }
+    return NULL;
+}
+
+// clones share compiler state (symbols, constants of programs) of their originals as it was at the time of cloning
+static bool program_can_run_on(const ape_program_t *program, const ape_t *ape) {
+    while (ape) {
+        if (ape == program->ape) {
+            return true;
+        }
+        if (ape->cloned_from == program->ape) {
+            return ape->cloned_programs_count >= program->number;
+        }
+        ape = ape->cloned_from;
+    }
+    return false;
+}
+
 static void ape_deinit(ape_t *ape) {
+    if (ape->cloned_from) {
+        for (int i = 0; i < array_count(ape->borrowed_constants); i++) {
+            object_t *constants = array_get(ape->borrowed_constants, i);
+            unshare_constants(ape->cloned_from, *constants);
+        }
+    }
+    array_destroy(ape->borrowed_constants);
+    array_destroy(ape->programs_constants);
+    array_destroy(ape->shared_constants);
+    compilation_result_destroy(ape->suspended_comp_res);
     vm_destroy(ape->vm);
     compiler_destroy(ape->compiler);
     global_store_destroy(ape->global_store);
@@ -15055,6 +20578,8 @@ static ape_object_t ape_object_make_native_function_with_name(ape_t *ape, const
 static void reset_state(ape_t *ape) {
     ape_clear_errors(ape);
     vm_reset(ape->vm);
+    compilation_result_destroy(ape->suspended_comp_res);
+    ape->suspended_comp_res = NULL;
 }
 
 static void set_default_config(ape_t *ape) {
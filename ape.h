@@ -54,6 +54,8 @@ typedef struct ape_object { uint64_t _internal; } ape_object_t;
 typedef struct ape_error ape_error_t;
 typedef struct ape_program ape_program_t;
 typedef struct ape_traceback ape_traceback_t;
+typedef struct ape_channel ape_channel_t;
+typedef struct ape_workers ape_workers_t;
 
 typedef enum ape_error_type {
     APE_ERROR_NONE = 0,
@@ -78,6 +80,7 @@ typedef enum ape_object_type {
     APE_OBJECT_FUNCTION        = 1 << 8,
     APE_OBJECT_EXTERNAL        = 1 << 9,
     APE_OBJECT_FREED           = 1 << 10,
+    APE_OBJECT_COROUTINE       = 1 << 11,
     APE_OBJECT_ANY             = 0xffff, // for checking types with &
 } ape_object_type_t;
 
@@ -98,6 +101,13 @@ ape_t* ape_make(void);
 ape_t* ape_make_ex(ape_malloc_fn malloc_fn, ape_free_fn free_fn, void *ctx);
 void   ape_destroy(ape_t *ape);
 
+// Creates a new instance with copies of ape's globals, compiler state and heap.
+// Bytecode, symbol tables, compilation results and names of files and functions are borrowed
+// from ape, so it has to outlive its clones. Clones' random generators are seeded from ape's
+// without changing the numbers ape generates.
+// Coroutines can't be copied, cloning fails with an error added to ape if one is reachable from its globals.
+ape_t* ape_clone(ape_t *ape);
+
 void   ape_free_allocated(ape_t *ape, void *ptr);
 
 void ape_set_repl_mode(ape_t *ape, bool enabled);
@@ -109,11 +119,17 @@ void ape_set_repl_mode(ape_t *ape, bool enabled);
 bool ape_set_timeout(ape_t *ape, double max_execution_time_ms);
 
 void ape_set_stdout_write_function(ape_t *ape, ape_stdout_write_fn stdout_write, void *context);
+// Output of print functions is passed to stdout write function once at least size bytes are buffered,
+// when flush() is called and when execution finishes or is suspended. 0 (default) writes on every print.
+void ape_set_stdout_buffer_size(ape_t *ape, int size);
 void ape_set_file_write_function(ape_t *ape, ape_write_file_fn file_write, void *context);
 void ape_set_file_read_function(ape_t *ape, ape_read_file_fn file_read, void *context);
 
 ape_program_t* ape_compile(ape_t *ape, const char *code);
 ape_program_t* ape_compile_file(ape_t *ape, const char *path);
+// Programs can be executed by the instance that compiled them and by its clones created after compiling.
+// Executing doesn't modify the program, so clones can run it on different threads at the same time
+// (as long as every instance is used by one thread at a time).
 ape_object_t   ape_execute_program(ape_t *ape, const ape_program_t *program);
 void           ape_program_destroy(ape_program_t *program);
 
@@ -128,6 +144,42 @@ ape_object_t  ape_call(ape_t *ape, const char *function_name, int argc, ape_obje
         sizeof((ape_object_t[]){__VA_ARGS__}) / sizeof(ape_object_t),\
         (ape_object_t[]){__VA_ARGS__})
 
+// Calls function_name once for every array of arguments in args_arrays, spreading the calls over threads_count
+// clones of ape running on separate threads (or on the calling thread if threads aren't supported).
+// If program isn't NULL every clone executes it before calling the function.
+// Arguments and results are deep copied between heaps. Returns an array of results in input order,
+// or null if any call fails. Allocator passed to ape_make_ex has to be thread safe.
+// Clones ape for every call, use ape_workers for repeated maps.
+ape_object_t ape_parallel_map(ape_t *ape, const ape_program_t *program, const char *function_name, ape_object_t args_arrays, int threads_count);
+
+// Workers are threads_count clones of ape that are made once and reused by every ape_workers_map,
+// which works like ape_parallel_map. Workers see ape's state as it was when they were made and keep
+// their own state between maps, so only programs compiled before ape_workers_make can run on them.
+// Maps have to be called from the thread using ape, workers have to be destroyed before ape.
+ape_workers_t* ape_workers_make(ape_t *ape, int threads_count);
+ape_object_t   ape_workers_map(ape_workers_t *workers, const ape_program_t *program, const char *function_name, ape_object_t args_arrays);
+void           ape_workers_destroy(ape_workers_t *workers);
+
+// Native function can return ape_suspend(ape) to suspend execution after it returns.
+// ape_execute*/ape_call then return null with ape_is_suspended() set and the script's
+// frames and stack are kept until ape_resume() continues it, using result as the return value
+// of the suspended call. ape_resume returns what the suspended ape_execute*/ape_call would have.
+// Starting any other execution on a suspended instance abandons the suspended one.
+// So does destroying the program it's executing, ape_resume then fails. Programs executed
+// by clones mustn't be destroyed while the clones are suspended.
+ape_object_t ape_suspend(ape_t *ape);
+ape_object_t ape_resume(ape_t *ape, ape_object_t result);
+bool         ape_is_suspended(const ape_t *ape);
+
+// Objects created after ape_arena_begin() (except compiled constants) are allocated from an arena
+// that isn't garbage collected and gets released all at once by ape_arena_reset().
+// On reset references to arena objects are set to null in globals and arrays created before
+// the arena, and map entries referencing them are removed. Native functions set by
+// ape_set_native_function() during the arena aren't allocated from it and stay defined,
+// other global constants referencing arena objects are set to null.
+void ape_arena_begin(ape_t *ape);
+void ape_arena_reset(ape_t *ape);
+
 void ape_set_runtime_error(ape_t *ape, const char *message);
 void ape_set_runtime_errorf(ape_t *ape, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
 bool ape_has_errors(const ape_t *ape);
@@ -235,6 +287,23 @@ bool          ape_object_get_map_bool(ape_object_t object, const char *key);
 
 bool ape_object_map_has_key(ape_object_t object, const char *key);
 
+//-----------------------------------------------------------------------------
+// Ape channel
+//-----------------------------------------------------------------------------
+// Bounded queue for passing objects between instances, which can run on different threads.
+// Sent objects are copied out of the sender's heap and into the receiver's heap, so only nulls,
+// bools, numbers, strings, errors, arrays and maps can be sent (shared and cyclic references are kept).
+// Send blocks while channel is full and recv blocks while it's empty, unless threads aren't supported,
+// in which case they fail with an error instead. Recv returns null once channel is closed and drained.
+// Allocator passed to ape_channel_make_ex has to be thread safe if channel is used by multiple threads.
+ape_channel_t* ape_channel_make(int capacity);
+ape_channel_t* ape_channel_make_ex(int capacity, ape_malloc_fn malloc_fn, ape_free_fn free_fn, void *ctx);
+void           ape_channel_destroy(ape_channel_t *channel); // channel is freed when it's not referenced by any object
+void           ape_channel_close(ape_channel_t *channel);
+bool           ape_channel_send(ape_t *ape, ape_channel_t *channel, ape_object_t obj);
+ape_object_t   ape_channel_recv(ape_t *ape, ape_channel_t *channel);
+ape_object_t   ape_object_make_channel(ape_t *ape, ape_channel_t *channel); // external usable with send/recv/close_channel builtins
+
 //-----------------------------------------------------------------------------
 // Ape error
 //-----------------------------------------------------------------------------
@@ -18,7 +18,7 @@ function compile_and_run {
     extra_flags=$1
     echo "Compiling tests (${extra_flags})"
     flags="-Wall -Wextra -pedantic-errors -Werror"
-    gcc ${flags} ${extra_flags} -DAPE_TESTS_MAIN *.c -o tests -lm
+    gcc ${flags} ${extra_flags} -DAPE_TESTS_MAIN *.c -o tests -lm -lpthread
     echo "    OK"
 
     echo "Running tests (${extra_flags})"
@@ -29,3 +29,6 @@ function compile_and_run {
 compile_and_run ""
 
 compile_and_run "-g -DAPE_DEBUG -DCOLLECTIONS_DEBUG"
+
+# every function is jitted right away (jit is only built on x86-64 linux)
+compile_and_run "-DAPE_JIT -DAPE_JIT_THRESHOLD=0"
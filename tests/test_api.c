@@ -25,13 +25,22 @@ typedef struct failing_alloc {
 } failing_alloc_t;
 
 static void test_repl(void);
+static void test_repeated_execute(void);
 static void test_program(void);
 static void test_compiling(void);
 static void test_fails(void);
+static void test_compile_rollback(void);
+static void test_compile_fails_midway(void);
 static void test_calling_functions(void);
 static void test_traceback(void);
 static void test_various(void);
 static void test_time_limit(void);
+static void test_arena(void);
+static void test_clone(void);
+static void test_parallel_map(void);
+static void test_channels(void);
+static void test_suspend(void);
+static void test_buffered_stdout(void);
 static void test_allocation_fails(void);
 
 static void *failing_malloc(void *ctx, size_t size);
@@ -41,8 +50,10 @@ static void *counted_malloc(void *ctx, size_t size);
 static void counted_free(void *ctx, void *ptr);
 
 static char* read_file(const char * filename);
+static char* broken_file_read(void *context, const char *filename);
 static void print_ape_errors(ape_t *ape);
 static size_t stdout_write(void* context, const void *data, size_t size);
+static size_t counting_stdout_write(void* context, const void *data, size_t size);
 
 static ape_object_t external_fn_test(ape_t *ape, void *data, int argc, ape_object_t *args);
 static ape_object_t square_array_fun(ape_t *ape, void *data, int argc, ape_object_t *args);
@@ -53,6 +64,9 @@ static ape_object_t add_fun(ape_t *ape, void *data, int argc, ape_object_t *args
 static ape_object_t fourtytwo_fun(ape_t *ape, void *data, int argc, ape_object_t *args);
 static ape_object_t vec2_add_fun(ape_t *ape, void *data, int argc, ape_object_t *args);
 static ape_object_t vec2_sub_fun(ape_t *ape, void *data, int argc, ape_object_t *args);
+static ape_object_t suspending_fetch_fun(ape_t *ape, void *data, int argc, ape_object_t *args);
+
+static void channel_producer_thread(void *arg);
 
 static int g_external_fn_test;
     
@@ -61,13 +75,22 @@ static char g_stdout_buf[1024];
 void api_test() {
     puts("### API test");
     test_repl();
+    test_repeated_execute();
     test_program();
     test_compiling();
     test_fails();
+    test_compile_rollback();
+    test_compile_fails_midway();
     test_calling_functions();
     test_traceback();
     test_various();
     test_time_limit();
+    test_arena();
+    test_clone();
+    test_parallel_map();
+    test_channels();
+    test_suspend();
+    test_buffered_stdout();
     test_allocation_fails();
     puts("\tOK");
 }
@@ -102,6 +125,42 @@ static void test_repl() {
     free(inputs);
 }
 
+static void test_repeated_execute() {
+    int malloc_count = 0;
+    ape_t *ape = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+    ape_execute(ape, "var f = null\nvar s = null");
+
+    const char *long_str = "a string that is too long to be stored inline";
+    int count_at_start = 0;
+    char code[512];
+    for (int i = 0; i < 2000; i++) {
+        if (i == 500) {
+            count_at_start = malloc_count;
+        }
+        snprintf(code, sizeof(code), "f = fn() { return \"%s %d\" }; s = f() + \"%s %d\" + \"%s %d\"",
+                 long_str, i, long_str, i + 1, long_str, i + 2);
+        ape_execute(ape, code);
+        if (ape_has_errors(ape)) {
+            print_ape_errors(ape);
+            assert(false);
+        }
+        assert(ape_object_get_type(ape_get_object(ape, "s")) == APE_OBJECT_STRING);
+    }
+    // only source lines are kept, constants of replaced code are collected
+    assert(malloc_count - count_at_start < 1500 * 2);
+
+    // pages emptied by a sweep are freed
+    count_at_start = malloc_count;
+    ape_execute(ape, "var big = []\nfor (i in range(100000)) { append(big, to_str(i)) }");
+    int big_count = malloc_count - count_at_start;
+    ape_execute(ape, "big = null\nfor (i in range(10000)) { const x = to_str(i) }");
+    assert(!ape_has_errors(ape));
+    assert(malloc_count - count_at_start < big_count / 2);
+
+    ape_destroy(ape);
+    assert(malloc_count == 0);
+}
+
 static void test_program() {
     g_external_fn_test = 0;
     int malloc_count = 0;
@@ -174,6 +233,18 @@ static void test_compiling() {
     free(code);
     assert(malloc_count == 0);
     assert(g_external_fn_test == 42);
+
+    // compiler stays usable after compiling a file fails
+    ape = ape_make();
+    ape_set_file_read_function(ape, broken_file_read, NULL);
+    program = ape_compile_file(ape, "broken.ape");
+    assert(!program);
+    assert(ape_has_errors(ape));
+    program = ape_compile(ape, "var x = 1");
+    assert(program);
+    assert(!ape_has_errors(ape));
+    ape_program_destroy(program);
+    ape_destroy(ape);
 }
 
 static void test_fails() {
@@ -201,6 +272,119 @@ static void test_fails() {
     }
     ptrarray_destroy_with_items(lines, free);
     free(fails);
+
+    // globals have a fixed size array, functions using the last ones are jitted like any other
+    char *code = malloc(2100 * 32);
+    assert(code);
+    int globals_counts[] = { 2040, 2049 }; // loop adds a few globals
+    for (int j = 0; j < APE_ARRAY_LEN(globals_counts); j++) {
+        int globals_count = globals_counts[j];
+        int len = 0;
+        for (int i = 0; i < globals_count; i++) {
+            len += sprintf(code + len, "var g%d = %d\n", i, i);
+        }
+        sprintf(code + len, "fn inc() { g%d = g%d + 1; return g%d }\nfor (i in range(100)) { inc() }\ninc()",
+                globals_count - 1, globals_count - 1, globals_count - 1);
+
+        int malloc_count = 0;
+        ape_t *ape = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+        ape_object_t res = ape_execute(ape, code);
+        if (globals_count < 2048) {
+            assert(!ape_has_errors(ape));
+            assert(APE_DBLEQ(ape_object_get_number(res), globals_count - 1 + 101));
+        } else {
+            assert(ape_has_errors(ape));
+            assert(ape_error_get_type(ape_get_error(ape, 0)) == APE_ERROR_COMPILATION);
+        }
+        ape_destroy(ape);
+        assert(malloc_count == 0);
+    }
+    free(code);
+}
+
+static void test_compile_rollback() {
+    int malloc_count = 0;
+    ape_t *ape = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+    ape_set_repl_mode(ape, true);
+
+    ape_execute(ape, "var a = 1");
+    assert(!ape_has_errors(ape));
+
+    // symbols, constants and imports of failed compilations are forgotten
+    const char *failing[] = {
+        "var a = \"x\"; var b = 2; fn f() { if (true) { var c = 3; return undefined_symbol } }",
+        "var b = \"str\"; import \"missing_module\"",
+        "var b = 2; fn() { fn() { b + undefined_symbol } }",
+    };
+    for (int i = 0; i < APE_ARRAY_LEN(failing); i++) {
+        ape_execute(ape, failing[i]);
+        assert(ape_has_errors(ape));
+        assert(APE_DBLEQ(ape_object_get_number(ape_get_object(ape, "a")), 1));
+        ape_execute(ape, "b");
+        assert(ape_has_errors(ape));
+    }
+
+    ape_object_t res = ape_execute(ape, "var b = \"str\"; var a = a + len(b); a");
+    assert(!ape_has_errors(ape));
+    assert(APE_DBLEQ(ape_object_get_number(res), 4));
+
+    ape_destroy(ape);
+    assert(malloc_count == 0);
+}
+
+static void test_compile_fails_midway() {
+    // ast is released at once when parsing fails after many statements, in the main file or in a nested import
+    char *code = malloc(2000 * 64);
+    assert(code);
+    for (int i = 0; i < 2; i++) {
+        bool with_import = i == 1;
+        int len = sprintf(code, "%s", with_import ? "import \"module_broken\"\n" : "");
+        for (int j = 0; j < 2000; j++) {
+            len += sprintf(code + len, "var v%d = [%d, %d * 2, {\"k\": \"s%d\"}]\n", j, j, j, j);
+        }
+        sprintf(code + len, "%s", with_import ? "" : "var broken = (1 + \n");
+
+        int malloc_count = 0;
+        ape_t *ape = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+        ape_execute(ape, code);
+        assert(ape_has_errors(ape));
+        assert(ape_error_get_type(ape_get_error(ape, 0)) == APE_ERROR_PARSING);
+        int count_after_fail = malloc_count;
+        ape_execute(ape, code);
+        assert(ape_has_errors(ape));
+        assert(malloc_count - count_after_fail < 20); // only compiled files are kept for tracebacks
+        ape_destroy(ape);
+        assert(malloc_count == 0);
+    }
+
+    // every failing allocation while compiling (including arena chunks) is cleaned up
+    int len = sprintf(code, "import \"module_broken\"\n");
+    for (int j = 0; j < 20; j++) {
+        len += sprintf(code + len, "var v%d = [%d, {\"k\": \"s%d\"}]\n", j, j, j);
+    }
+    int n = 0;
+    while (true) {
+        failing_alloc_t failing_alloc = {
+            .allocation_to_fail = n,
+            .alloc_count = 0,
+            .total_count = 0,
+            .has_failed = false,
+            .should_fail = true,
+        };
+        n++;
+        ape_t *ape = ape_make_ex(failing_malloc, failing_free, &failing_alloc);
+        if (!ape) {
+            continue;
+        }
+        ape_execute(ape, code);
+        assert(ape_has_errors(ape));
+        ape_destroy(ape);
+        assert(failing_alloc.alloc_count == 0);
+        if (!failing_alloc.has_failed) {
+            break;
+        }
+    }
+    free(code);
 }
 
 static void test_calling_functions() {
@@ -291,6 +475,38 @@ static void test_calling_functions() {
     
     assert(ape_object_get_number(res) == strlen("lorem"));
 
+    // range replaced after compiling is called instead of being iterated lazily
+    ape_program_t *program = ape_compile(ape, "fn sum_range() { var r = 0; for (i in range(2, 5)) { r = r + i } return r }");
+    assert(program);
+    ape_execute_program(ape, program);
+    res = ape_call(ape, "sum_range", 0, NULL);
+    assert(!ape_has_errors(ape));
+    assert(APE_DBLEQ(ape_object_get_number(res), 9));
+
+    ape_set_native_function(ape, "range", square_array_fun, NULL);
+    res = ape_call(ape, "sum_range", 0, NULL);
+    if (ape_has_errors(ape)) {
+        print_ape_errors(ape);
+        assert(false);
+    }
+    assert(APE_DBLEQ(ape_object_get_number(res), 29));
+
+    res = ape_execute(ape, "fn squares_and_one(a, b) { return [a * a, b * b, 1] }");
+    ape_set_global_constant(ape, "range", ape_get_object(ape, "squares_and_one"));
+    res = ape_call(ape, "sum_range", 0, NULL);
+    if (ape_has_errors(ape)) {
+        print_ape_errors(ape);
+        assert(false);
+    }
+    assert(APE_DBLEQ(ape_object_get_number(res), 30));
+
+    res = ape_execute(ape, "fn range_count(a, b) { return b - a }");
+    ape_set_global_constant(ape, "range", ape_get_object(ape, "range_count"));
+    res = ape_call(ape, "sum_range", 0, NULL);
+    assert(ape_has_errors(ape));
+    assert(strstr(ape_error_get_message(ape_get_error(ape, 0)), "Cannot iterate over NUMBER"));
+    ape_program_destroy(program);
+
     ape_destroy(ape);
     assert(malloc_count == 0);
 }
@@ -415,6 +631,38 @@ static void test_traceback() {
         }
     }
 
+    {
+        // sq is inlined, its frame is rebuilt from the call site
+        ape_call(ape, "traceback_inlined", 0, NULL);
+        if (!ape_has_errors(ape)) {
+            assert(false);
+        }
+
+        const ape_error_t *err = ape_get_error(ape, 0);
+        const ape_traceback_t *traceback = ape_error_get_traceback(err);
+
+        struct {
+            const char *name;
+            int line;
+            int column;
+        } tests[] = {
+            {"sq", 50, 13},
+            {"traceback_inlined", 54, 13},
+        };
+
+        assert(ape_traceback_get_depth(traceback) == APE_ARRAY_LEN(tests));
+
+        for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
+            typeof(tests[0]) test = tests[i];
+            int line = ape_traceback_get_line_number(traceback, i);
+            int col = ape_traceback_get_column_number(traceback, i);
+            const char *name = ape_traceback_get_function_name(traceback, i);
+            assert(line == test.line);
+            assert(col == test.column);
+            assert(APE_STREQ(name, test.name));
+        }
+    }
+
     ape_destroy(ape);
     assert(malloc_count == 0);
 
@@ -441,7 +689,8 @@ static void test_various() {
 static void test_time_limit() {
     const char *tests[] = {
         "while (true) {}",
-        "fn(){ while (true) {}}()"
+        "fn(){ while (true) {}}()",
+        "var i = 0; while (true) { i = i + 1 }",
     };
 
     for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
@@ -468,6 +717,472 @@ static void test_time_limit() {
     }
 }
 
+static void test_arena() {
+    int malloc_count = 0;
+    ape_t *ape = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+
+    ape_execute(ape, "var cache = []");
+    if (ape_has_errors(ape)) {
+        print_ape_errors(ape);
+        assert(false);
+    }
+
+    const char *code = "\
+        const parts = []\n\
+        for (i in range(1000)) { append(parts, to_str(i)) }\n\
+        append(cache, parts)\n\
+        len(parts)\n\
+    ";
+
+    ape_program_t *program = ape_compile(ape, code);
+    if (!program || ape_has_errors(ape)) {
+        print_ape_errors(ape);
+        assert(false);
+    }
+
+    for (int i = 0; i < 10; i++) {
+        ape_arena_begin(ape);
+        ape_object_t res = ape_execute_program(ape, program);
+        if (ape_has_errors(ape)) {
+            print_ape_errors(ape);
+            assert(false);
+        }
+        assert(APE_DBLEQ(ape_object_get_number(res), 1000));
+        ape_arena_reset(ape);
+    }
+
+    ape_program_destroy(program);
+
+    ape_object_t res = ape_execute(ape, "len(cache)");
+    assert(APE_DBLEQ(ape_object_get_number(res), 10));
+
+    res = ape_execute(ape, "cache[0]");
+    assert(ape_object_get_type(res) == APE_OBJECT_NULL);
+
+    // native functions registered during the arena outlive it
+    ape_arena_begin(ape);
+    ape_set_native_function(ape, "late_add", add_fun, NULL);
+    ape_set_global_constant(ape, "late_str", ape_object_make_string(ape, "arena"));
+    ape_arena_reset(ape);
+    res = ape_execute(ape, "late_add(2, 3)");
+    assert(APE_DBLEQ(ape_object_get_number(res), 5));
+    res = ape_execute(ape, "is_null(late_str)");
+    assert(!ape_has_errors(ape));
+    assert(ape_object_get_bool(res));
+
+    ape_destroy(ape);
+    assert(malloc_count == 0);
+}
+
+static void test_clone() {
+    int malloc_count = 0;
+    ape_t *ape = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+    ape_set_native_function(ape, "add", add_fun, NULL);
+
+    ape_execute(ape, "\
+        var counter = 0\n\
+        fn inc() { counter = add(counter, 1); return counter }\n\
+        const shared = { items: [1, 2, 3] }\n\
+        const alias = shared\n\
+    ");
+    if (ape_has_errors(ape)) {
+        print_ape_errors(ape);
+        assert(false);
+    }
+
+    for (int i = 0; i < 3; i++) {
+        ape_t *clone = ape_clone(ape);
+        assert(clone);
+
+        ape_object_t res = ape_call(clone, "inc", 0, NULL);
+        assert(APE_DBLEQ(ape_object_get_number(res), 1));
+        res = ape_call(clone, "inc", 0, NULL);
+        assert(APE_DBLEQ(ape_object_get_number(res), 2));
+
+        res = ape_execute(clone, "append(shared.items, 4)\nlen(alias.items)");
+        if (ape_has_errors(clone)) {
+            print_ape_errors(clone);
+            assert(false);
+        }
+        assert(APE_DBLEQ(ape_object_get_number(res), 4));
+
+        ape_destroy(clone);
+    }
+
+    ape_object_t res = ape_call(ape, "inc", 0, NULL);
+    assert(APE_DBLEQ(ape_object_get_number(res), 1));
+    res = ape_execute(ape, "len(alias.items)");
+    assert(APE_DBLEQ(ape_object_get_number(res), 3));
+
+    // cloning doesn't advance ape's random generator and clones get different numbers
+    ape_execute(ape, "random_seed(7)");
+    double expected_random = ape_object_get_number(ape_execute(ape, "random()"));
+    ape_execute(ape, "random_seed(7)");
+    ape_t *clones[2] = {ape_clone(ape), ape_clone(ape)};
+    assert(clones[0] && clones[1]);
+    assert(APE_DBLEQ(ape_object_get_number(ape_execute(ape, "random()")), expected_random));
+    double clone_random = ape_object_get_number(ape_execute(clones[0], "random()"));
+    assert(!APE_DBLEQ(clone_random, ape_object_get_number(ape_execute(clones[1], "random()"))));
+    assert(!APE_DBLEQ(clone_random, expected_random));
+    ape_destroy(clones[0]);
+    ape_destroy(clones[1]);
+
+    ape_t *early_clone = ape_clone(ape);
+    assert(early_clone);
+
+    ape_program_t *program = ape_compile(ape, "fn total() { return inc() + len(shared.items) }\ntotal()");
+    assert(program);
+
+    ape_t *clone = ape_clone(ape);
+    assert(clone);
+    ape_t *clone_of_clone = ape_clone(clone);
+    assert(clone_of_clone);
+
+    for (int i = 0; i < 2; i++) {
+        res = ape_execute_program(clone, program);
+        assert(!ape_has_errors(clone));
+        assert(APE_DBLEQ(ape_object_get_number(res), 5 + i));
+
+        res = ape_execute_program(clone_of_clone, program);
+        assert(!ape_has_errors(clone_of_clone));
+        assert(APE_DBLEQ(ape_object_get_number(res), 5 + i));
+    }
+
+    ape_execute_program(early_clone, program);
+    assert(ape_has_errors(early_clone));
+
+    ape_destroy(clone_of_clone);
+    ape_destroy(clone);
+    ape_destroy(early_clone);
+    ape_program_destroy(program);
+
+    // constants pinned for a clone are released when it's destroyed, so replaced functions can be collected
+    ape_execute(ape, "var replaced = null");
+    int growth_without_clones = 0;
+    int growth_with_clones = 0;
+    for (int i = 0; i < 2; i++) {
+        int start_malloc_count = malloc_count;
+        for (int j = 0; j < 1000; j++) {
+            ape_execute(ape, "replaced = fn() { return \"constant\" }");
+            assert(!ape_has_errors(ape));
+            if (i == 1) {
+                clone = ape_clone(ape);
+                assert(clone);
+                ape_destroy(clone);
+            }
+        }
+        *(i == 0 ? &growth_without_clones : &growth_with_clones) = malloc_count - start_malloc_count;
+    }
+    assert(growth_with_clones - growth_without_clones < 50);
+
+    // execution state of coroutines can't be copied
+    ape_execute(ape, "fn gen() { yield 1 }\nconst co = coroutine(gen)\nco()");
+    assert(!ape_has_errors(ape));
+    clone = ape_clone(ape);
+    assert(!clone);
+    assert(ape_has_errors(ape));
+    assert(strstr(ape_error_get_message(ape_get_error(ape, 0)), "Coroutines can't be copied"));
+
+    ape_destroy(ape);
+    assert(malloc_count == 0);
+}
+
+static void test_parallel_map() {
+    ape_t *ape = ape_make();
+    ape_set_native_function(ape, "add", add_fun, NULL);
+
+    ape_program_t *program = ape_compile(ape, "\
+        fn score(a, b) {\n\
+            return { sum: add(a, b), name: to_str(a) }\n\
+        }\n\
+        fn name_len(a, name) {\n\
+            return a + len(name)\n\
+        }\n\
+    ");
+    if (!program || ape_has_errors(ape)) {
+        print_ape_errors(ape);
+        assert(false);
+    }
+
+    ape_object_t args_arrays = ape_object_make_array(ape);
+    for (int i = 0; i < 1000; i++) {
+        ape_object_t args = ape_object_make_array(ape);
+        ape_object_add_array_number(args, i);
+        ape_object_add_array_number(args, 1);
+        ape_object_add_array_value(args_arrays, args);
+    }
+
+    int threads_counts[] = { 1, 3, 8 };
+    for (int i = 0; i < APE_ARRAY_LEN(threads_counts); i++) {
+        ape_object_t res = ape_parallel_map(ape, program, "score", args_arrays, threads_counts[i]);
+        if (ape_has_errors(ape)) {
+            print_ape_errors(ape);
+            assert(false);
+        }
+        assert(ape_object_get_array_length(res) == 1000);
+        for (int j = 0; j < 1000; j++) {
+            ape_object_t item = ape_object_get_array_value(res, j);
+            assert(APE_DBLEQ(ape_object_get_map_number(item, "sum"), j + 1));
+        }
+    }
+
+    // same string object is passed to every worker
+    ape_object_t shared_args_arrays = ape_object_make_array(ape);
+    ape_object_t shared_name = ape_object_make_string(ape, "a name too long to be stored inline");
+    for (int i = 0; i < 1000; i++) {
+        ape_object_t args = ape_object_make_array(ape);
+        ape_object_add_array_number(args, i);
+        ape_object_add_array_value(args, shared_name);
+        ape_object_add_array_value(shared_args_arrays, args);
+    }
+    ape_object_t shared_res = ape_parallel_map(ape, program, "name_len", shared_args_arrays, 4);
+    if (ape_has_errors(ape)) {
+        print_ape_errors(ape);
+        assert(false);
+    }
+    for (int j = 0; j < 1000; j++) {
+        assert(APE_DBLEQ(ape_object_get_number(ape_object_get_array_value(shared_res, j)), j + 35));
+    }
+
+    ape_object_t res = ape_parallel_map(ape, program, "not_defined", args_arrays, 4);
+    assert(ape_has_errors(ape));
+    assert(ape_object_is_null(res));
+
+    // workers are cloned once and reused, also after a failed map
+    ape_workers_t *workers = ape_workers_make(ape, 4);
+    assert(workers);
+    ape_object_t few_args_arrays = ape_object_make_array(ape);
+    ape_object_add_array_value(few_args_arrays, ape_object_get_array_value(args_arrays, 7));
+    for (int i = 0; i < 3; i++) {
+        res = ape_workers_map(workers, program, "not_defined", args_arrays);
+        assert(ape_has_errors(ape));
+        assert(ape_object_is_null(res));
+
+        res = ape_workers_map(workers, program, "score", args_arrays);
+        if (ape_has_errors(ape)) {
+            print_ape_errors(ape);
+            assert(false);
+        }
+        assert(ape_object_get_array_length(res) == 1000);
+        for (int j = 0; j < 1000; j++) {
+            ape_object_t item = ape_object_get_array_value(res, j);
+            assert(APE_DBLEQ(ape_object_get_map_number(item, "sum"), j + 1));
+        }
+
+        res = ape_workers_map(workers, NULL, "score", few_args_arrays);
+        assert(!ape_has_errors(ape));
+        assert(ape_object_get_array_length(res) == 1);
+        assert(APE_DBLEQ(ape_object_get_map_number(ape_object_get_array_value(res, 0), "sum"), 8));
+    }
+    ape_workers_destroy(workers);
+
+    ape_program_destroy(program);
+    ape_destroy(ape);
+}
+
+static void test_channels() {
+    int malloc_count = 0;
+    ape_channel_t *channel = ape_channel_make_ex(2, counted_malloc, counted_free, &malloc_count);
+    assert(channel);
+
+    ape_t *sender = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+    ape_t *receiver = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+    ape_set_global_constant(sender, "ch", ape_object_make_channel(sender, channel));
+    ape_set_global_constant(receiver, "ch", ape_object_make_channel(receiver, channel));
+
+    ape_execute(sender, "\
+        const shared = { name: \"shared\", items: [1, 2] }\n\
+        append(shared.items, shared)\n\
+        send(ch, [shared, shared, error(\"oops\"), null, true, 1.5])\n\
+        send(ch, \"second\")\n\
+    ");
+    if (ape_has_errors(sender)) {
+        print_ape_errors(sender);
+        assert(false);
+    }
+
+    ape_execute(sender, "send(ch, fn() {})");
+    assert(ape_has_errors(sender));
+    ape_clear_errors(sender);
+
+    ape_execute(receiver, "\
+        const msg = recv(ch)\n\
+        assert(msg[0] == msg[1])\n\
+        assert(msg[0].items[2] == msg[0])\n\
+        assert(msg[0].name == \"shared\")\n\
+        assert(is_error(msg[2]))\n\
+        assert(msg[3] == null && msg[4] == true && msg[5] == 1.5)\n\
+        assert(recv(ch) == \"second\")\n\
+        close_channel(ch)\n\
+        assert(recv(ch) == null)\n\
+    ");
+    if (ape_has_errors(receiver)) {
+        print_ape_errors(receiver);
+        assert(false);
+    }
+
+    ape_destroy(sender);
+    ape_destroy(receiver);
+    ape_channel_destroy(channel);
+    assert(malloc_count == 0);
+
+    if (!ape_threads_platform_supported()) {
+        return;
+    }
+
+    channel = ape_channel_make(1);
+    ape_t *producer = ape_make();
+    ape_set_global_constant(producer, "ch", ape_object_make_channel(producer, channel));
+    ape_thread_t thread;
+    bool ok = ape_thread_start(&thread, channel_producer_thread, producer);
+    assert(ok);
+
+    receiver = ape_make();
+    ape_set_global_constant(receiver, "ch", ape_object_make_channel(receiver, channel));
+    ape_object_t res = ape_execute(receiver, "\
+        fn sum_received() {\n\
+            var sum = 0\n\
+            while (true) {\n\
+                const msg = recv(ch)\n\
+                if (msg == null) { break }\n\
+                sum += msg.value\n\
+            }\n\
+            return sum\n\
+        }\n\
+        sum_received()\n\
+    ");
+    if (ape_has_errors(receiver)) {
+        print_ape_errors(receiver);
+        assert(false);
+    }
+    ape_thread_join(&thread);
+    assert(!ape_has_errors(producer));
+    assert(APE_DBLEQ(ape_object_get_number(res), 4950));
+
+    ape_destroy(producer);
+    ape_destroy(receiver);
+    ape_channel_destroy(channel);
+}
+
+static void test_suspend() {
+    int malloc_count = 0;
+    ape_t *apes[2];
+    char requested[2][64];
+    for (int i = 0; i < 2; i++) {
+        apes[i] = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+        ape_set_native_function(apes[i], "fetch", suspending_fetch_fun, requested[i]);
+    }
+
+    // both instances are in flight at the same time
+    ape_object_t res[2];
+    res[0] = ape_execute(apes[0], "\
+        fn fetch_all() {\n\
+            var total = 0\n\
+            for (key in [\"a\", \"bb\", \"ccc\"]) {\n\
+                total += fetch(key)\n\
+            }\n\
+            return total\n\
+        }\n\
+        fetch_all()\n\
+    ");
+    res[1] = ape_execute(apes[1], "\
+        fn gen() { yield fetch(\"dddd\") }\n\
+        fn get() {\n\
+            const co = coroutine(gen)\n\
+            const res = { value: co() }\n\
+            return res.value\n\
+        }\n\
+        get()\n\
+    ");
+    int resumes_count = 0;
+    while (ape_is_suspended(apes[0]) || ape_is_suspended(apes[1])) {
+        for (int i = 0; i < 2; i++) {
+            if (ape_is_suspended(apes[i])) {
+                res[i] = ape_resume(apes[i], ape_object_make_number(strlen(requested[i])));
+                resumes_count++;
+            }
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (ape_has_errors(apes[i])) {
+            print_ape_errors(apes[i]);
+            assert(false);
+        }
+    }
+    assert(resumes_count == 4);
+    assert(APE_DBLEQ(ape_object_get_number(res[0]), 6));
+    assert(APE_DBLEQ(ape_object_get_number(res[1]), 4));
+
+    ape_execute(apes[0], "fn lookup(key) { return fetch(key) + 1 }");
+    ape_object_t call_res = APE_CALL(apes[0], "lookup", ape_object_make_string(apes[0], "eeeee"));
+    assert(ape_is_suspended(apes[0]));
+    assert(ape_object_is_null(call_res));
+    call_res = ape_resume(apes[0], ape_object_make_number(5));
+    assert(!ape_is_suspended(apes[0]));
+    assert(APE_DBLEQ(ape_object_get_number(call_res), 6));
+
+    // starting another execution abandons suspended one
+    ape_execute(apes[1], "fetch(\"f\")");
+    assert(ape_is_suspended(apes[1]));
+    res[1] = ape_execute(apes[1], "len(\"ab\")");
+    assert(!ape_is_suspended(apes[1]));
+    assert(APE_DBLEQ(ape_object_get_number(res[1]), 2));
+    ape_resume(apes[1], ape_object_make_null());
+    assert(ape_has_errors(apes[1]));
+
+    // destroying suspended program abandons its execution
+    ape_program_t *program = ape_compile(apes[0], "fetch(\"h\")");
+    assert(program);
+    ape_execute_program(apes[0], program);
+    assert(ape_is_suspended(apes[0]));
+    ape_program_destroy(program);
+    assert(!ape_is_suspended(apes[0]));
+    ape_resume(apes[0], ape_object_make_number(1));
+    assert(ape_has_errors(apes[0]));
+    res[0] = ape_execute(apes[0], "len(\"abc\")");
+    assert(APE_DBLEQ(ape_object_get_number(res[0]), 3));
+
+    ape_execute(apes[1], "fetch(\"g\")");
+    for (int i = 0; i < 2; i++) {
+        ape_destroy(apes[i]);
+    }
+    assert(malloc_count == 0);
+}
+
+static void test_buffered_stdout() {
+    int writes_count = 0;
+    ape_t *ape = ape_make();
+    ape_set_stdout_write_function(ape, counting_stdout_write, &writes_count);
+
+    ape_execute(ape, "for (i in range(100)) { print(\"a\") }");
+    assert(writes_count == 100);
+
+    writes_count = 0;
+    ape_set_stdout_buffer_size(ape, 64);
+    ape_execute(ape, "for (i in range(100)) { print(\"a\") }");
+    assert(writes_count == 2); // once buffer is full and at the end
+    assert(strlen(g_stdout_buf) == 36);
+
+    writes_count = 0;
+    ape_execute(ape, "println(\"hello\"); flush(); println(\"world\")");
+    assert(writes_count == 2);
+    assert(APE_STREQ(g_stdout_buf, "world\n"));
+
+    ape_destroy(ape);
+
+    // buffer grown by a big print is freed after it's written and recreated by the next print
+    int malloc_count = 0;
+    ape = ape_make_ex(counted_malloc, counted_free, &malloc_count);
+    ape_set_stdout_write_function(ape, counting_stdout_write, &writes_count);
+    writes_count = 0;
+    ape_execute(ape, "var s = \"a\"; for (i in range(17)) { s = s + s } print(s); print(\"b\")");
+    assert(!ape_has_errors(ape));
+    assert(writes_count == 2);
+    assert(APE_STREQ(g_stdout_buf, "b"));
+    ape_destroy(ape);
+    assert(malloc_count == 0);
+}
+
 static void test_allocation_fails() {
     int n = 0;
     while (true) {
@@ -561,6 +1276,14 @@ static void counted_free(void *ctx, void *ptr) {
     free(ptr);
 }
 
+static char* broken_file_read(void *context, const char *filename) {
+    const char *code = "var x = undefined_symbol";
+    char *res = malloc(strlen(code) + 1);
+    assert(res);
+    strcpy(res, code);
+    return res;
+}
+
 static char * read_file(const char * filename) {
     FILE *fp = fopen(filename, "r");
     size_t size_to_read = 0;
@@ -604,11 +1327,18 @@ static void print_ape_errors(ape_t *ape) {
 }
 
 static size_t stdout_write(void* context, const void *data, size_t size) {
-    memcpy(g_stdout_buf, data, size);
-    g_stdout_buf[size] = '\0';
+    size_t copied = size < sizeof(g_stdout_buf) ? size : sizeof(g_stdout_buf) - 1; // last write is kept
+    memcpy(g_stdout_buf, data, copied);
+    g_stdout_buf[copied] = '\0';
     return size;
 }
 
+static size_t counting_stdout_write(void* context, const void *data, size_t size) {
+    int *writes_count = (int*)context;
+    (*writes_count)++;
+    return stdout_write(NULL, data, size);
+}
+
 static ape_object_t external_fn_test(ape_t *ape, void *data, int argc, ape_object_t *args) {
     int *test = (int*)data;
     *test = 42;
@@ -734,5 +1464,24 @@ static ape_object_t vec2_sub_fun(ape_t *ape, void *data, int argc, ape_object_t
     return res;
 }
 
+static ape_object_t suspending_fetch_fun(ape_t *ape, void *data, int argc, ape_object_t *args) {
+    if (!APE_CHECK_ARGS(ape, true, argc, args, APE_OBJECT_STRING)) {
+        return ape_object_make_null();
+    }
+    char *requested = data;
+    strcpy(requested, ape_object_get_string(args[0]));
+    return ape_suspend(ape);
+}
+
+static void channel_producer_thread(void *arg) {
+    ape_t *producer = arg;
+    ape_execute(producer, "\
+        for (i in range(100)) {\n\
+            send(ch, { value: i })\n\
+        }\n\
+        close_channel(ch)\n\
+    ");
+}
+
 
 #pragma GCC diagnostic pop
@@ -11,16 +11,22 @@
 
 #include "code.h"
 #include "common.h"
+#include "compilation_scope.h"
+#include "optimisation.h"
 
 static void test_code_make(void);
 static void test_instr_strings(void);
 static void test_read_operands(void);
+static void test_src_positions(void);
+static void test_peephole(void);
 
 void code_test() {
     puts("### Code test");
     test_code_make();
     test_read_operands();
     test_instr_strings();
+    test_src_positions();
+    test_peephole();
     puts("\tOK");
 }
 
@@ -76,7 +82,7 @@ static void test_instr_strings() {
 ";
 
     strbuf_t *buf = strbuf_make(NULL);
-    code_to_string(array_data(code), NULL, array_count(code), buf);
+    code_to_string(array_data(code), NULL, 0, array_count(code), buf);
     const char *serialized = strbuf_get_string(buf);
     assert(APE_STREQ(serialized, expected));
     strbuf_destroy(buf);
@@ -115,4 +121,122 @@ static void test_read_operands() {
     }
 }
 
+static void test_src_positions() {
+    const compiled_file_t *file_a = (const compiled_file_t*)&file_a;
+    const compiled_file_t *file_b = (const compiled_file_t*)&file_b;
+    struct {
+        int ip;
+        src_pos_t pos;
+        inline_frame_t inline_frame;
+    } entries[] = {
+        {0, {file_a, 0, 0}, {NULL, {NULL, -1, -1}}},
+        {3, {file_a, 0, 4}, {NULL, {NULL, -1, -1}}},
+        {4, {file_a, 12, 2}, {"sq", {file_a, 20, 7}}},
+        {6, {file_a, 12, 4}, {"sq", {file_a, 20, 7}}},
+        {13, {file_b, 1, 1}, {"sq", {file_a, 21, 3}}},
+        {300, {file_a, 0, 100000}, {NULL, {NULL, -1, -1}}},
+    };
+
+    array(uint8_t) *src_positions = array_make(NULL, uint8_t);
+    src_pos_t prev_pos = src_pos_invalid;
+    const inline_frame_t *prev_inline_frame = NULL;
+    int prev_ip = 0;
+    for (int i = 0; i < APE_ARRAY_LEN(entries); i++) {
+        bool ok = code_add_src_pos(src_positions, entries[i].ip - prev_ip, entries[i].pos, prev_pos,
+                                   &entries[i].inline_frame, prev_inline_frame);
+        assert(ok);
+        prev_ip = entries[i].ip;
+        prev_pos = entries[i].pos;
+        prev_inline_frame = &entries[i].inline_frame;
+    }
+
+    for (int i = 0; i < APE_ARRAY_LEN(entries); i++) {
+        int end_ip = i < (APE_ARRAY_LEN(entries) - 1) ? entries[i + 1].ip : entries[i].ip + 10;
+        for (int ip = entries[i].ip; ip < end_ip; ip++) {
+            src_pos_t pos = code_find_src_pos(array_data(src_positions), array_count(src_positions), ip);
+            assert(pos.file == entries[i].pos.file);
+            assert(pos.line == entries[i].pos.line);
+            assert(pos.column == entries[i].pos.column);
+            inline_frame_t inline_frame = code_find_inline_frame(array_data(src_positions), array_count(src_positions), ip);
+            assert(inline_frame_equals(&inline_frame, &entries[i].inline_frame));
+        }
+    }
+
+    src_pos_t pos = code_find_src_pos(NULL, 0, 0);
+    assert(pos.line == src_pos_invalid.line);
+
+    array_destroy(src_positions);
+}
+
+static void test_peephole() {
+    struct {
+        opcode_t op;
+        int operands_count;
+        uint64_t operand;
+    } instrs[] = {
+        {OPCODE_GET_LOCAL, 1, 0},
+        {OPCODE_DUP, 0, 0},
+        {OPCODE_SET_LOCAL, 1, 1},
+        {OPCODE_POP, 0, 0},
+        {OPCODE_GET_LOCAL, 1, 1},
+        {OPCODE_JUMP_IF_FALSE, 1, 11},
+        {OPCODE_JUMP, 1, 17},
+        {OPCODE_NULL, 0, 0},
+        {OPCODE_POP, 0, 0},
+        {OPCODE_RETURN, 0, 0},
+        {OPCODE_RETURN_VALUE, 0, 0},
+    };
+
+    // every instruction is at line equal to its original ip
+    array(uint8_t) *code = array_make(NULL, uint8_t);
+    array(uint8_t) *src_positions = array_make(NULL, uint8_t);
+    src_pos_t prev_pos = src_pos_invalid;
+    int prev_ip = 0;
+    for (int i = 0; i < APE_ARRAY_LEN(instrs); i++) {
+        int ip = array_count(code);
+        src_pos_t pos = {NULL, ip, 0};
+        bool ok = code_add_src_pos(src_positions, ip - prev_ip, pos, prev_pos, NULL, NULL);
+        assert(ok);
+        prev_ip = ip;
+        prev_pos = pos;
+        code_make(instrs[i].op, instrs[i].operands_count, (uint64_t[]){instrs[i].operand}, code);
+    }
+
+    compilation_result_t *res = compilation_result_make(NULL, array_data(code), array_data(src_positions),
+                                                        array_count(src_positions), array_count(code));
+    array_orphan_data(code);
+    array_orphan_data(src_positions);
+    bool ok = optimise_bytecode(res, false);
+    assert(ok);
+
+    const char *expected = "\
+0000 GET_LOCAL 0\n\
+0002 DUP\n\
+0003 SET_LOCAL 1\n\
+0005 JUMP_IF_FALSE 12\n\
+0008 JUMP 12\n\
+0011 RETURN\n\
+0012 RETURN_VALUE\n\
+";
+    strbuf_t *buf = strbuf_make(NULL);
+    code_to_string(res->bytecode, NULL, 0, res->count, buf);
+    assert(APE_STREQ(strbuf_get_string(buf), expected));
+    strbuf_destroy(buf);
+
+    struct {
+        int ip;
+        int line;
+    } positions[] = {
+        {0, 0}, {2, 3}, {3, 3}, {5, 8}, {8, 11}, {11, 16}, {12, 17},
+    };
+    for (int i = 0; i < APE_ARRAY_LEN(positions); i++) {
+        src_pos_t pos = code_find_src_pos(res->src_positions, res->src_positions_size, positions[i].ip);
+        assert(pos.line == positions[i].line);
+    }
+
+    compilation_result_destroy(res);
+    array_destroy(code);
+    array_destroy(src_positions);
+}
+
 #pragma GCC diagnostic pop
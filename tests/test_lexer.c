@@ -11,15 +11,18 @@
 #include <stdio.h>
 
 #include "lexer.h"
+#include "compiled_file.h"
 #include "common.h"
 
 static void test_lexing(void);
 static void test_token_positions(void);
+static void test_file_lines(void);
 
 void lexer_test() {
     puts("### Lexer test");
     test_lexing();
     test_token_positions();
+    test_file_lines();
     puts("\tOK");
 }
 
@@ -268,4 +271,54 @@ var five = 5;\n\
     }
 }
 
+static void test_file_lines() {
+    const char *input = "var a = 1 // comment\n\t\tb::c = 0x1F;\r\n// only comment\n  a.b\n// end";
+
+    token_t expected_tokens[] = {
+        {TOKEN_VAR, "var", 0, NULL, 0, 0},
+        {TOKEN_IDENT, "a", 0, NULL, 0, 4},
+        {TOKEN_ASSIGN, "=", 0, NULL, 0, 6},
+        {TOKEN_NUMBER, "1", 0, NULL, 0, 8},
+        {TOKEN_IDENT, "b::c", 0, NULL, 1, 2},
+        {TOKEN_ASSIGN, "=", 0, NULL, 1, 7},
+        {TOKEN_NUMBER, "0x1F", 0, NULL, 1, 9},
+        {TOKEN_SEMICOLON, ";", 0, NULL, 1, 13},
+        {TOKEN_IDENT, "a", 0, NULL, 3, 2},
+        {TOKEN_DOT, ".", 0, NULL, 3, 3},
+        {TOKEN_IDENT, "b", 0, NULL, 3, 4},
+        {TOKEN_EOF, "EOF", 0, NULL, 4, 6},
+    };
+
+    compiled_file_t *file = compiled_file_make(NULL, "test.ape");
+
+    lexer_t lexer;
+    lexer_init(&lexer, NULL, NULL, input, file);
+
+    for (int i = 0; i < APE_ARRAY_LEN(expected_tokens); i++) {
+        token_t test_tok = expected_tokens[i];
+        token_t tok = lexer_next_token_internal(&lexer);
+        assert(tok.type == test_tok.type);
+        assert(tok.len == (int)strlen(test_tok.literal));
+        assert(APE_STRNEQ(tok.literal, test_tok.literal, tok.len));
+        assert(tok.pos.line == test_tok.pos.line);
+        assert(tok.pos.column == test_tok.pos.column);
+    }
+
+    assert(ptrarray_count(file->lines) == 5);
+    assert(APE_STREQ(ptrarray_get(file->lines, 1), "\t\tb::c = 0x1F;\r"));
+    assert(APE_STREQ(ptrarray_get(file->lines, 4), "// end"));
+
+    // lines of code compiled later in the same file are appended
+    lexer_init(&lexer, NULL, NULL, "x\n", file);
+    token_t tok = lexer_next_token_internal(&lexer);
+    assert(tok.type == TOKEN_IDENT);
+    assert(tok.pos.line == 5);
+    assert(ptrarray_count(file->lines) == 7);
+    assert(APE_STREQ(ptrarray_get(file->lines, 5), "x"));
+    assert(APE_STREQ(ptrarray_get(file->lines, 6), ""));
+    assert(APE_STREQ(ptrarray_get(file->lines, 0), "var a = 1 // comment"));
+
+    compiled_file_destroy(file);
+}
+
 #pragma GCC diagnostic pop
@@ -21,9 +21,12 @@
 #include "compiler.h"
 #include "vm.h"
 #include "gc.h"
+#include "jit.h"
 #include "tests.h"
 
 static object_t execute(const char *input, bool must_succeed);
+static int compiled_size(const char *input);
+static int executed_code_count_opcode(const char *input, opcode_t op);
 static void test_number(object_t obj, double expected);
 static void test_number_arithmentic(void);
 static void test_boolean_expressions(void);
@@ -40,8 +43,14 @@ static void test_functions(void);
 static void test_recursive_functions(void);
 static void test_assign(void);
 static void test_block_scopes(void);
+static void test_constant_propagation(void);
+static void test_dead_code(void);
+static void test_inlining(void);
+static void test_quickening(void);
+static void test_jit(void);
 static void test_while_loops(void);
 static void test_foreach(void);
+static void test_coroutines(void);
 static void test_for_loops(void);
 static void test_code_blocks(void);
 static void test_errors(void);
@@ -63,8 +72,14 @@ void vm_test() {
     test_recursive_functions();
     test_assign();
     test_block_scopes();
+    test_constant_propagation();
+    test_dead_code();
+    test_inlining();
+    test_quickening();
+    test_jit();
     test_while_loops();
     test_foreach();
+    test_coroutines();
     test_for_loops();
     test_code_blocks();
     test_errors();
@@ -120,6 +135,64 @@ static object_t execute(const char *input, bool must_succeed) {
     return top;
 }
 
+static int compiled_size(const char *input) {
+    ape_config_t config;
+    memset(&config, 0, sizeof(ape_config_t));
+
+    gcmem_t *mem = gcmem_make(NULL);
+
+    errors_t errors;
+    errors_init(&errors);
+    ptrarray(compiled_file_t) *files = ptrarray_make(NULL);
+    global_store_t *gs = global_store_make(NULL, mem);
+    compiler_t *comp = compiler_make(NULL, &config, mem, &errors, files, gs);
+
+    compilation_result_t *comp_res = compiler_compile(comp, input);
+    if (!comp_res || errors_has_errors(&errors)) {
+        print_errors(&errors);
+        assert(false);
+    }
+    return comp_res->count;
+}
+
+static int executed_code_count_opcode(const char *input, opcode_t op) {
+    ape_config_t config;
+    memset(&config, 0, sizeof(ape_config_t));
+
+    gcmem_t *mem = gcmem_make(NULL);
+
+    errors_t errors;
+    errors_init(&errors);
+    ptrarray(compiled_file_t) *files = ptrarray_make(NULL);
+    global_store_t *gs = global_store_make(NULL, mem);
+    compiler_t *comp = compiler_make(NULL, &config, mem, &errors, files, gs);
+
+    compilation_result_t *comp_res = compiler_compile(comp, input);
+    if (!comp_res || errors_has_errors(&errors)) {
+        print_errors(&errors);
+        assert(false);
+    }
+
+    vm_t *vm = vm_make(NULL, NULL, mem, &errors, gs);
+    bool ok = vm_run(vm, comp_res, compiler_get_constants(comp));
+    assert(ok);
+
+    int count = 0;
+    int ip = 0;
+    while (ip < comp_res->count) {
+        opcode_definition_t *def = opcode_lookup(comp_res->bytecode[ip]);
+        assert(def);
+        if (comp_res->bytecode[ip] == op) {
+            count++;
+        }
+        ip++;
+        for (int i = 0; i < def->num_operands; i++) {
+            ip += def->operand_widths[i];
+        }
+    }
+    return count;
+}
+
 static void test_number(object_t obj, double expected) {
     assert(object_get_type(obj) == OBJECT_NUMBER);
     double num = object_get_number(obj);
@@ -292,6 +365,9 @@ static void test_string_expressions() {
         {"\"lorem\\tipsum\"", "lorem\tipsum"},
         {"\"mon\" + \"key\"", "monkey"},
         {"\"mon\" + \"key\" + \"banana\"", "monkeybanana"},
+        {"slice(\"a string too long to be stored inline\", 2)", "string too long to be stored inline"},
+        {"slice(slice(\"a string too long to be stored inline\", 2), 7) + \"!\"", "too long to be stored inline!"},
+        {"\"abc\"[1] + \"abc\"[1] + slice(\"abc\", 2)", "bbc"},
     };
 
     for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
@@ -557,6 +633,18 @@ static void test_native_functions() {
         {"rest([])", true, 0},
         {"var arr = []; append(arr, 1); arr[0]", false, 1},
         {"values({\"a\":1, \"b\": 2})[0]", false, 1},
+        {"find(\"abc\", \"c\")", false, 2},
+        // negative steps count down to end
+        {"len(range(10, 0, -3))", false, 4},
+        {"range(10, 0, -3)[3]", false, 1},
+        {"len(range(0, 10, -1))", false, 0},
+        {"len(range(5, 5, -1))", false, 0},
+        // newer builtins can be shadowed
+        {"fn split(s, sep) { return len(s) } split(\"abc\", \",\")", false, 3},
+        {"fn f() { var join = 1; return join } f()", false, 1},
+        {"var send = 2; var recv = 3; send + recv", false, 5},
+        {"fn flush(x) { return x + 1 } fn f() { return flush(1) } f()", false, 2},
+        {"fn sp(s) { return split(s, \",\") } fn f() { var split = 0; return len(sp(\"a,b\")) } f()", false, 2},
     };
 
     for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
@@ -626,6 +714,19 @@ static void test_functions() {
             ",
             99,
         },
+        {
+            "\
+            const newClosure = fn(a, b, c, d, e) {\
+                return fn() { return a + b + c + d + e; };\
+            };\
+            var closures = [];\
+            for (var i = 0; i < 300; i++) {\
+                closures = [newClosure(i, 1, 2, 3, 4)];\
+            };\
+            closures[0]();\
+            ",
+            309,
+        },
     };
 
     for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
@@ -803,6 +904,145 @@ static void test_block_scopes() {
     }
 }
 
+static void test_constant_propagation() {
+    struct {
+        const char *input;
+        int val;
+    } tests[] = {
+        {"const a = 2; const b = a * 3; b + a", 8},
+        {"fn f() { const a = 5; return a } fn g() { var a = 1; a = 3; return a } f() + g()", 8},
+        {"var r = 0; if (r == 0) { const a = 5; r = a } if (r == 5) { var a = 1; a = 2; r = r + a } r", 7},
+        {"const a = 2; fn f() { return a * 10 } f()", 20},
+        {"const s = \"ab\"; const t = s + \"c\"; len(t)", 3},
+        {"const a = [1, 2]; append(a, 3); len(a)", 3},
+    };
+
+    for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
+        typeof(tests[0]) test = tests[i];
+        object_t obj = execute(test.input, true);
+        test_number(obj, test.val);
+    }
+}
+
+static void test_dead_code() {
+    struct {
+        const char *input;
+        int val;
+    } tests[] = {
+        {"const DEBUG = false; var x = 0; if (DEBUG) { x = 1 } else { x = 2 } x", 2},
+        {"const DEBUG = false; var x = 0; if (x == 1) { x = 1 } else if (!DEBUG) { x = 2 } else { x = 3 } x", 2},
+        {"const DEBUG = false; var x = 0; if (x == 1) { x = 1 } else if (DEBUG) { x = 2 } else { x = 3 } x", 3},
+        {"var x = 5; if (x == 1) {} else if (true) {} else if (x == 5) {} else {} x", 5},
+        {"var x = 5; var r = 0; if (x == 1) { r = 1 } else if (true) { r = 2 } else if (x == 5) { r = 3 } else { r = 4 } r", 2},
+        {"var x = 1; var r = 0; if (x == 1) { r = 1 } else if (true) { r = 2 } else if (x == 5) { r = 3 } else { r = 4 } r", 1},
+        {"const DEBUG = false; var x = 0; while (DEBUG) { x = 1 } x", 0},
+        {"const DEBUG = true; DEBUG ? 1 : 2", 1},
+        {"const DEBUG = false; DEBUG ? 1 : 2", 2},
+        {"const DEBUG = true; var x = DEBUG && 3; x", 3},
+        {"const DEBUG = false; var x = DEBUG || 4; x", 4},
+        {"fn f() { return 1; crash() } f()", 1},
+        {"var x = 0; while (true) { x++; if (x == 3) { break; x = 10 } } x", 3},
+    };
+
+    for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
+        typeof(tests[0]) test = tests[i];
+        object_t obj = execute(test.input, true);
+        test_number(obj, test.val);
+    }
+
+    // disabled branches don't emit any code
+    int size_with_branches = compiled_size("const DEBUG = false; var x = 0; if (DEBUG) { x = 1 } else if (!DEBUG) { x = 2 }");
+    int size_without_branches = compiled_size("const DEBUG = false; var x = 0; x = 2");
+    assert(size_with_branches == size_without_branches);
+}
+
+static void test_inlining() {
+    struct {
+        const char *input;
+        int val;
+    } tests[] = {
+        {"fn sq(x) { return x * x } sq(3)", 9},
+        {"fn clamp(x, lo, hi) { return x < lo ? lo : x > hi ? hi : x } clamp(-1, 0, 5) + clamp(9, 0, 5) + clamp(3, 0, 5)", 8},
+        {"fn sub(a, b) { return a - b } fn f() { var a = 1; var b = 10; return sub(b, a) } f()", 9},
+        {"fn sub(a, b) { return a - b } var x = 0; for (i in range(4)) { x = x + sub(i, 1) } x", 2},
+        {"fn len2(a) { return len(a) * 2 } len2([1, 2, 3])", 6},
+        {"var n = 0; fn inc() { n++; return n } fn sub(a, b) { return a - b } sub(inc(), inc())", -1},
+        {"fn sq(x) { return x * x } fn f(x) { return sq(x) + sq(x + 1) } f(2)", 13},
+        {"const k = 3; fn mul(x) { return x * k } mul(2)", 6},
+        {"fn add(a, b) { return a + b } add(1)", 0}, // not inlined, fails at runtime
+    };
+
+    for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
+        typeof(tests[0]) test = tests[i];
+        bool must_succeed = i < APE_ARRAY_LEN(tests) - 1;
+        object_t obj = execute(test.input, must_succeed);
+        if (must_succeed) {
+            test_number(obj, test.val);
+        }
+    }
+
+    // inlined call is compiled as if parameters were variables
+    int size_inlined = compiled_size("fn sq(x) { return x * x } var y = sq(3)");
+    int size_expanded = compiled_size("fn sq(x) { return x * x } var x = 3; var y = x * x");
+    assert(size_inlined == size_expanded);
+}
+
+static void test_quickening() {
+    struct {
+        const char *input;
+        int val;
+    } tests[] = {
+        {"var r = []; for (x in [1, \"a\", 2, \"b\"]) { append(r, x + x) } r[0] + r[2] + len(r[1] + r[3])", 10},
+        {"var r = 0; for (x in [1, true, 2, 3]) { r = r + (x * 2) } r", 14},
+        {"var r = 0; for (x in [1, 2, \"a\", 3]) { if (x == \"a\") { r = r + 10 } else if (x < 3) { r = r + x } } r", 13},
+        {"var v = { x: 1, __operator_add__: fn(a, b) { return a.x + b } }; var r = 0; for (x in [1, v, 2]) { r = r + (x + 1) } r", 7},
+        {"var r = 0; for (i in range(10)) { r = r + i % 3 } r", 9},
+    };
+
+    for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
+        typeof(tests[0]) test = tests[i];
+        object_t obj = execute(test.input, true);
+        test_number(obj, test.val);
+    }
+
+#if defined(APE_JIT) && APE_JIT_THRESHOLD == 0
+    return; // everything is jitted right away and jitted code doesn't quicken instructions
+#endif
+
+    // sites that only saw numbers stay quickened, sites that got other types go back to generic opcodes
+    // (foreach increments its index with ADD too)
+    assert(executed_code_count_opcode("var r = 0; for (x in [1, 2]) { r = r + x }", OPCODE_ADD_NUMBER) == 2);
+    assert(executed_code_count_opcode("var r = 0; for (x in [1, 2]) { r = r + x }", OPCODE_ADD) == 0);
+    assert(executed_code_count_opcode("var r = \"\"; for (x in [1, \"a\"]) { r = to_str(x + x) }", OPCODE_ADD) == 1);
+    assert(executed_code_count_opcode("var r = \"\"; for (x in [1, \"a\"]) { r = to_str(x + x) }", OPCODE_ADD_NUMBER) == 1);
+    assert(executed_code_count_opcode("var r = 0; for (i in range(3)) { if (i < 2) { r = r + 1 } }", OPCODE_COMPARE_NUMBER) == 1);
+    // sites that failed a guard aren't quickened again
+    assert(executed_code_count_opcode("var r = \"\"; for (x in [1, \"a\", 2]) { r = to_str(x + x) }", OPCODE_ADD) == 1);
+}
+
+static void test_jit() {
+    // loops are hot enough to be jitted (if it's enabled), types change or guards fail at some point
+    struct {
+        const char *input;
+        double val;
+    } tests[] = {
+        {"var r = 0; for (i in range(3000)) { r = r + i % 7 } r", 8994},
+        {"var r = 0; var s = \"\"; for (i in range(3000)) { if (i > 2500) { s = s + \"a\" } r = r + i * 2 - 1 } r + len(s)", 8994499},
+        {"var f = false; var n = 0; for (i in range(3000)) { f = !f; if (f) { n++ } } n", 1500},
+        {"fn sq(x) { return x * x } var r = 0; for (i in range(3000)) { r = r + sq(i) } r", 8995500500},
+        {"var x = 0; for (i in range(3000)) { x = -(0 / 0) } is_number(x) ? 1 : 0", 1},
+        {"var r = 0; var i = 0; while (i < 3000) { if (i >= 1500 && i != 2000) { r += 1 } i++ } r", 1499},
+        {"fn f(x) { var y = x; y = null; return y == null } var r = 0; for (i in range(3000)) { if (f(i)) { r++ } } r", 3000},
+        {"var r = 0; for (i in range(3000)) { r = r + (i > 1000 ? 1 : i) } r", 502499},
+    };
+
+    for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
+        typeof(tests[0]) test = tests[i];
+        object_t obj = execute(test.input, true);
+        test_number(obj, test.val);
+    }
+}
+
 static void test_while_loops() {
     struct {
         const char *input;
@@ -943,6 +1183,147 @@ static void test_foreach() {
             ",
             2,
         },
+        {
+            "\
+            var res = 0;\
+            for (item in range(10, 0, -3)) {\
+                res += item;\
+            }\
+            for (item in range(4)) {\
+                if (item == 1) {\
+                    continue;\
+                }\
+                res += item;\
+            }\
+            res;\
+            ",
+            27,
+        },
+        {"var n = 0; for (i in range(0, 10, -1)) { n++ } for (i in range(5, 5, -1)) { n++ } n", 0},
+    };
+
+    for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
+        typeof(tests[0]) test = tests[i];
+        object_t obj = execute(test.input, true);
+        test_number(obj, test.val);
+    }
+}
+
+static void test_coroutines() {
+    struct {
+        const char *input;
+        int val;
+    } tests[] = {
+        {
+            "\
+            fn gen() { yield 1; yield 2; yield 3; }\
+            var res = 0;\
+            for (item in coroutine(gen)) {\
+                res += item;\
+            }\
+            res;\
+            ",
+            6,
+        },
+        {
+            "\
+            fn gen() { for (i in range(0, 5)) { yield i; } }\
+            const co = coroutine(gen);\
+            co();\
+            var res = 0;\
+            for (item in co) {\
+                res += item;\
+            }\
+            res;\
+            ",
+            10,
+        },
+        {
+            "\
+            fn acc() { var sum = 0; while (true) { sum += yield sum; } }\
+            const co = coroutine(acc);\
+            co();\
+            co(1);\
+            co(2);\
+            co(3);\
+            ",
+            6,
+        },
+        {
+            "\
+            fn inner(x) { yield x; yield x * 2; return 0; }\
+            fn outer() { inner(1); yield 3; inner(5); }\
+            var res = 0;\
+            for (item in coroutine(outer)) {\
+                res += item;\
+            }\
+            res;\
+            ",
+            21,
+        },
+        {
+            "\
+            fn gen() { var i = 0; while (true) { yield i; i++; } }\
+            var res = 0;\
+            for (item in coroutine(gen)) {\
+                if (item > 5) {\
+                    break;\
+                }\
+                res += item;\
+            }\
+            res;\
+            ",
+            15,
+        },
+        {
+            "\
+            fn gen() { yield 1; crash(); }\
+            fn run() {\
+                recover (e) { return 42; }\
+                for (item in coroutine(gen)) { }\
+                return 0;\
+            }\
+            run();\
+            ",
+            42,
+        },
+        {
+            "\
+            fn gen() { yield 1; }\
+            const co = coroutine(gen);\
+            co();\
+            co();\
+            fn run() {\
+                recover (e) { return 7; }\
+                co();\
+                return 0;\
+            }\
+            run();\
+            ",
+            7,
+        },
+        {
+            "\
+            fn sum(n) { if (n == 0) { return yield 0; } return n + sum(n - 1); }\
+            fn deep() { return sum(300); }\
+            const co = coroutine(deep);\
+            co();\
+            co(5);\
+            ",
+            45155,
+        },
+        {
+            "\
+            fn inner() { yield 1; yield 2; }\
+            fn outer() { const co = coroutine(inner); yield co() + 10; yield co() + 20; }\
+            var res = 0;\
+            for (item in coroutine(outer)) {\
+                res += item;\
+            }\
+            res;\
+            ",
+            33,
+        },
     };
 
     for (int i = 0; i < APE_ARRAY_LEN(tests); i++) {
@@ -1035,6 +1416,7 @@ static void test_errors() {
         {"var x = 0; for (i in range(0, 10)) { if (i == 9) { x = i[\"a\"];}}", 0, 56},
         {"var arr = [1, 2, 3];\narr[4] = 5", 1, 3},
         {"var arr = [1, 2, 3];\narr[\"a\"] = 5", 1, 3},
+        {"var x = 0;\nfor (i in range(0, 2000)) { x = x + i; if (i == 1999) { x = x - \"a\" } }", 1, 62},
     };
 
     ape_config_t config;